@@ -0,0 +1,115 @@
+#include "src/email.h"
+#include "src/fty_email_server.h"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+
+static zhash_t* s_headers(int64_t count)
+{
+    zhash_t* headers = zhash_new();
+    zhash_autofree(headers);
+    for (int64_t i = 0; i != count; i++) {
+        std::string name  = "X-Header-" + std::to_string(i);
+        std::string value = "value of header " + std::to_string(i);
+        zhash_update(headers, name.c_str(), const_cast<char*>(value.c_str()));
+    }
+    return headers;
+}
+
+/// attachment of given size, removed by destructor
+class BenchFile
+{
+public:
+    explicit BenchFile(int64_t size)
+        : _path("fty-email-bench-" + std::to_string(size) + ".log")
+    {
+        std::ofstream file{_path, std::ios::binary};
+        std::string   line = "2020-01-01T00:00:00 ups-1 output.voltage 230.0 input.voltage 229.5\n";
+        for (int64_t i = 0; i < size; i += int64_t(line.size()))
+            file.write(line.data(), std::streamsize(std::min<int64_t>(int64_t(line.size()), size - i)));
+    }
+
+    ~BenchFile()
+    {
+        std::remove(_path.c_str());
+    }
+
+    const char* path() const
+    {
+        return _path.c_str();
+    }
+
+private:
+    std::string _path;
+};
+
+static zmsg_t* s_encode(zhash_t* headers, const BenchFile* file)
+{
+    return fty_email_encode("uuid", "joe@example.com", "Alert on ups-1", headers, "body of the email",
+        file ? file->path() : nullptr, nullptr);
+}
+
+/// args: number of headers
+static void BM_fty_email_encode(benchmark::State& state)
+{
+    zhash_t* headers = s_headers(state.range(0));
+    for (auto _ : state) {
+        zmsg_t* msg = s_encode(headers, nullptr);
+        benchmark::DoNotOptimize(msg);
+        zmsg_destroy(&msg);
+    }
+    zhash_destroy(&headers);
+}
+BENCHMARK(BM_fty_email_encode)->Arg(0)->Arg(8)->Arg(64);
+
+/// args: number of headers, size of attachment (0 is none)
+static void BM_msg2email(benchmark::State& state)
+{
+    Smtp                       smtp;
+    zhash_t*                   headers = s_headers(state.range(0));
+    std::unique_ptr<BenchFile> file;
+    if (state.range(1) != 0)
+        file.reset(new BenchFile(state.range(1)));
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        zmsg_t* msg  = s_encode(headers, file.get());
+        char*   uuid = zmsg_popstr(msg);
+        zstr_free(&uuid);
+        state.ResumeTiming();
+
+        std::string email = smtp.msg2email(&msg);
+        bytes += email.size();
+        benchmark::DoNotOptimize(email);
+    }
+    state.SetBytesProcessed(int64_t(bytes));
+    zhash_destroy(&headers);
+}
+BENCHMARK(BM_msg2email)->ArgsProduct({{0, 8, 64}, {0, 64 * 1024, 1024 * 1024}})->Unit(benchmark::kMicrosecond);
+
+static void BM_sms_email_address(benchmark::State& state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(sms_email_address("0#####@hyper.mobile", "+79 (0) 123456"));
+}
+BENCHMARK(BM_sms_email_address);
+
+/// args: index of msmtp output
+static void BM_msmtp_stderr2code(benchmark::State& state)
+{
+    static const std::string failed = "/usr/bin/msmtp failed with exit code '69'\nstderr: ";
+    static const std::string inputs[] = {
+        "msmtp: cannot locate host mail.example.com: Name or service not known",
+        failed + "msmtp: TLS certificate verification failed: the certificate is not trusted\n",
+        failed + "msmtp: envelope from address a@b not accepted by the server\n" + std::string(1024, 'x'),
+    };
+    const std::string& inp = inputs[state.range(0)];
+    for (auto _ : state)
+        benchmark::DoNotOptimize(msmtp_stderr2code(inp));
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(inp.size()));
+}
+BENCHMARK(BM_msmtp_stderr2code)->DenseRange(0, 2);
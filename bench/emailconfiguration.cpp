@@ -0,0 +1,56 @@
+#include "src/emailconfiguration.h"
+#include "src/fty_email.h"
+#include <benchmark/benchmark.h>
+#include <fty_common_translation.h>
+
+/// alert rendered by the benchmarks, translations are loaded from test configuration
+class BenchAlert
+{
+public:
+    BenchAlert()
+    {
+        translation_initialize(FTY_EMAIL_ADDRESS, FTY_EMAIL_BENCH_CONF, "test_");
+        zlist_t* actions = zlist_new();
+        zlist_append(actions, const_cast<char*>("EMAIL"));
+        zmsg_t* msg = fty_proto_encode_alert(nullptr, uint64_t(time(nullptr)), 600, "upsonbattery@ups-1", "ups-1",
+            "ACTIVE", "CRITICAL", "UPS is running on battery", actions);
+        _alert = fty_proto_decode(&msg);
+        zlist_destroy(&actions);
+    }
+
+    ~BenchAlert()
+    {
+        fty_proto_destroy(&_alert);
+    }
+
+    fty_proto_t* get() const
+    {
+        return _alert;
+    }
+
+private:
+    fty_proto_t* _alert;
+};
+
+static void BM_generate_subject(benchmark::State& state)
+{
+    BenchAlert alert;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(generate_subject(alert.get(), "1", "UPS 1"));
+}
+BENCHMARK(BM_generate_subject);
+
+static void BM_generate_body(benchmark::State& state)
+{
+    BenchAlert alert;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(generate_body(alert.get(), "1", "UPS 1"));
+}
+BENCHMARK(BM_generate_body);
+
+static void BM_getIpAddr(benchmark::State& state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(getIpAddr());
+}
+BENCHMARK(BM_getIpAddr);
@@ -0,0 +1,24 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <vector>
+
+// results are printed as JSON unless --benchmark_format is given, so that releases can be compared by tools
+int main(int argc, char** argv)
+{
+    std::vector<char*> args(argv, argv + argc);
+    bool               format = false;
+    for (int i = 1; i < argc; i++)
+        format |= strncmp(argv[i], "--benchmark_format", 18) == 0;
+    char json[] = "--benchmark_format=json";
+    if (!format)
+        args.insert(args.begin() + 1, json);
+    args.push_back(nullptr);
+
+    int count = int(args.size()) - 1;
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
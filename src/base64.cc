@@ -0,0 +1,272 @@
+/*  =========================================================================
+    base64 - Vectorized base64 encoder
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    base64 - Vectorized base64 encoder
+@discuss
+    Support bundles attached by fty-sendmail have megabytes, encoding them on appliance CPU is measurable.
+    SIMD kernels follow W. Mula, D. Lemire: Faster Base64 Encoding and Decoding Using AVX2 Instructions (2018).
+@end
+*/
+
+#include "base64.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FTY_BASE64_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FTY_BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+static const char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// input bytes of one line of 76 characters
+static const size_t LINE_BYTES = 57;
+static const size_t LINE_CHARS = 76;
+
+// ----------------------------------------------------------------------------
+// scalar
+
+static size_t s_encode_scalar(const unsigned char* data, size_t size, char* out)
+{
+    char* start = out;
+    for (size_t i = 0; i + 3 <= size; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8 | uint32_t(data[i + 2]);
+        *out++     = s_alphabet[v >> 18];
+        *out++     = s_alphabet[(v >> 12) & 63];
+        *out++     = s_alphabet[(v >> 6) & 63];
+        *out++     = s_alphabet[v & 63];
+    }
+    return size_t(out - start);
+}
+
+/// encode less than a line with padding
+static size_t s_encode_tail(const unsigned char* data, size_t size, char* out)
+{
+    size_t full = size - size % 3;
+    size_t len  = s_encode_scalar(data, full, out);
+    if (full != size) {
+        uint32_t v = uint32_t(data[full]) << 16;
+        if (size - full == 2)
+            v |= uint32_t(data[full + 1]) << 8;
+        out[len++] = s_alphabet[v >> 18];
+        out[len++] = s_alphabet[(v >> 12) & 63];
+        out[len++] = size - full == 2 ? s_alphabet[(v >> 6) & 63] : '=';
+        out[len++] = '=';
+    }
+    return len;
+}
+
+// ----------------------------------------------------------------------------
+// x86
+
+#ifdef FTY_BASE64_X86
+
+/// spread 12 bytes of each lane to 16 6-bit indices
+__attribute__((target("ssse3"))) static inline __m128i s_reshuffle_ssse3(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+/// map 6-bit indices to the alphabet by adding the offset of their range
+__attribute__((target("ssse3"))) static inline __m128i s_lookup_ssse3(__m128i indices)
+{
+    // 0..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12, then 0..25 -> 13
+    __m128i       result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less   = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result               = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i shift  = _mm_setr_epi8(char('a' - 26), char('0' - 52), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('+' - 62), char('/' - 63), 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, result), indices);
+}
+
+__attribute__((target("ssse3"))) static size_t s_encode_ssse3(const unsigned char* data, size_t size, char* out)
+{
+    size_t i = 0;
+    char*  o = out;
+    // 16 bytes are loaded, 12 are encoded
+    for (; size - i >= 16; i += 12, o += 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), s_lookup_ssse3(s_reshuffle_ssse3(in)));
+    }
+    return size_t(o - out) + s_encode_scalar(data + i, size - i, o);
+}
+
+__attribute__((target("avx2"))) static inline __m256i s_reshuffle_avx2(__m256i in)
+{
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7,
+                                     8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2"))) static inline __m256i s_lookup_avx2(__m256i indices)
+{
+    __m256i       result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    const __m256i less   = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result               = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    const __m256i shift  = _mm256_setr_epi8(char('a' - 26), char('0' - 52), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('+' - 62), char('/' - 63), 'A', 0, 0, char('a' - 26), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52), char('0' - 52),
+        char('0' - 52), char('0' - 52), char('+' - 62), char('/' - 63), 'A', 0, 0);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(shift, result), indices);
+}
+
+__attribute__((target("avx2"))) static size_t s_encode_avx2(const unsigned char* data, size_t size, char* out)
+{
+    size_t i = 0;
+    char*  o = out;
+    // each lane gets 12 bytes, 28 bytes are loaded, 24 are encoded
+    for (; size - i >= 28; i += 24, o += 32) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 12));
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), s_lookup_avx2(s_reshuffle_avx2(in)));
+    }
+    return size_t(o - out) + s_encode_ssse3(data + i, size - i, o);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// aarch64
+
+#ifdef FTY_BASE64_NEON
+
+static size_t s_encode_neon(const unsigned char* data, size_t size, char* out)
+{
+    const unsigned char* alphabet = reinterpret_cast<const unsigned char*>(s_alphabet);
+    uint8x16x4_t         table;
+    table.val[0]       = vld1q_u8(alphabet);
+    table.val[1]       = vld1q_u8(alphabet + 16);
+    table.val[2]       = vld1q_u8(alphabet + 32);
+    table.val[3]       = vld1q_u8(alphabet + 48);
+    const uint8x16_t mask = vdupq_n_u8(63);
+
+    size_t i = 0;
+    char*  o = out;
+    // 48 bytes are deinterleaved to 3 registers, 64 characters are interleaved back
+    for (; size - i >= 48; i += 48, o += 64) {
+        uint8x16x3_t in = vld3q_u8(data + i);
+        uint8x16x4_t idx;
+        idx.val[0] = vshrq_n_u8(in.val[0], 2);
+        idx.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+        idx.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+        idx.val[3] = vandq_u8(in.val[2], mask);
+        uint8x16x4_t chars;
+        chars.val[0] = vqtbl4q_u8(table, idx.val[0]);
+        chars.val[1] = vqtbl4q_u8(table, idx.val[1]);
+        chars.val[2] = vqtbl4q_u8(table, idx.val[2]);
+        chars.val[3] = vqtbl4q_u8(table, idx.val[3]);
+        vst4q_u8(reinterpret_cast<unsigned char*>(o), chars);
+    }
+    return size_t(o - out) + s_encode_scalar(data + i, size - i, o);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// dispatch
+
+using Encoder = size_t (*)(const unsigned char* data, size_t size, char* out);
+
+static Encoder s_encoder(SimdIsa isa)
+{
+    switch (isa) {
+#ifdef FTY_BASE64_X86
+        case SimdIsa::SSSE3:
+            return s_encode_ssse3;
+        case SimdIsa::AVX2:
+            return s_encode_avx2;
+#endif
+#ifdef FTY_BASE64_NEON
+        case SimdIsa::NEON:
+            return s_encode_neon;
+#endif
+        default:
+            return s_encode_scalar;
+    }
+}
+
+size_t base64_encode_blocks(const unsigned char* data, size_t size, char* out)
+{
+    static const Encoder encode = s_encoder(simd_isa());
+    return encode(data, size, out);
+}
+
+size_t base64_encode_blocks(const unsigned char* data, size_t size, char* out, SimdIsa isa)
+{
+    return s_encoder(isa)(data, size, out);
+}
+
+size_t base64_lines_size(size_t size, size_t eol_size)
+{
+    size_t rest = size % LINE_BYTES;
+    return size / LINE_BYTES * (LINE_CHARS + eol_size) + (rest == 0 ? 0 : 4 * ((rest + 2) / 3) + eol_size);
+}
+
+size_t base64_encode_lines(const unsigned char* data, size_t size, char* out, const char* eol)
+{
+    size_t eol_size = strlen(eol);
+    size_t lines    = size / LINE_BYTES;
+    size_t full     = lines * LINE_BYTES;
+
+    // full lines are encoded in one run behind their final place, then spread to it; line i is moved before its
+    // eol overwrites the start of line i + 1
+    char* encoded = out + lines * eol_size;
+    base64_encode_blocks(data, full, encoded);
+    for (size_t i = 0; i != lines; i++) {
+        char* line = out + i * (LINE_CHARS + eol_size);
+        memmove(line, encoded + i * LINE_CHARS, LINE_CHARS);
+        memcpy(line + LINE_CHARS, eol, eol_size);
+    }
+
+    char* pos = out + lines * (LINE_CHARS + eol_size);
+    if (full != size) {
+        pos += s_encode_tail(data + full, size - full, pos);
+        memcpy(pos, eol, eol_size);
+        pos += eol_size;
+    }
+    return size_t(pos - out);
+}
+
+std::string base64_encode(const unsigned char* data, size_t size)
+{
+    std::string ret(4 * ((size + 2) / 3), '\0');
+    size_t      full = size - size % 3;
+    size_t      len  = base64_encode_blocks(data, full, &ret[0]);
+    s_encode_tail(data + full, size - full, &ret[len]);
+    return ret;
+}
@@ -0,0 +1,56 @@
+/*  =========================================================================
+    base64 - Vectorized base64 encoder
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   base64.h
+/// @brief  Base64 encoder (RFC 4648) of MIME attachments
+///
+/// Implementation is selected at runtime by the CPU (see simd.h): AVX2 or SSSE3 on x86, NEON on aarch64, scalar
+/// otherwise. All of them produce the same output.
+///
+/// Example:
+///
+///    std::vector<char> out(base64_lines_size(data.size(), 2));
+///    out.resize(base64_encode_lines(data.data(), data.size(), out.data(), "\r\n"));
+
+#pragma once
+
+#include "simd.h"
+#include <cstddef>
+#include <string>
+
+/// encode whole groups of 3 bytes, without padding and line breaks
+/// @param size  multiple of 3
+/// @return number of characters written to out (size / 3 * 4)
+size_t base64_encode_blocks(const unsigned char* data, size_t size, char* out);
+
+/// the same using given instruction set, which must be supported (tests and benchmarks)
+size_t base64_encode_blocks(const unsigned char* data, size_t size, char* out, SimdIsa isa);
+
+/// @return size of base64_encode_lines output
+size_t base64_lines_size(size_t size, size_t eol_size);
+
+/// encode data as MIME body: lines of 76 characters, each (including the last, padded one) terminated by eol
+/// @param out  buffer of base64_lines_size(size, strlen(eol)) characters
+/// @return number of characters written to out
+size_t base64_encode_lines(const unsigned char* data, size_t size, char* out, const char* eol = "\r\n");
+
+/// encode data with padding, without line breaks
+std::string base64_encode(const unsigned char* data, size_t size);
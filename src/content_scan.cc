@@ -0,0 +1,299 @@
+/*  =========================================================================
+    content_scan - Vectorized scan of MIME part content
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    content_scan - Vectorized scan of MIME part content
+@discuss
+    Text part which is not 7bit clean was always encoded quoted-printable, binary-like text grew three times. The
+    scan finds which encoding is needed at all: mostly ASCII logs are sent as they are (7bit or 8bit).
+@end
+*/
+
+#include "content_scan.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FTY_SCAN_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FTY_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+/// longest line of 7bit and 8bit content without CRLF (RFC 5322)
+static const uint64_t MAX_LINE = 998;
+
+/// bytes of block of at most 64 bytes, bit i stands for byte i
+struct Masks
+{
+    uint64_t high;
+    uint64_t nul;
+    uint64_t cr;
+    uint64_t lf;
+    uint64_t tab;
+    /// 0x00 - 0x1f
+    uint64_t low;
+    uint64_t del;
+    uint64_t eq;
+};
+
+static inline uint64_t s_popcount(uint64_t v)
+{
+    return uint64_t(__builtin_popcountll(v));
+}
+
+static inline void s_accumulate(ContentScanner::State& state, const Masks& m, size_t size)
+{
+    ContentStats& stats = state.stats;
+    stats.size += size;
+    stats.non_ascii += s_popcount(m.high);
+    stats.nul += s_popcount(m.nul);
+    stats.controls += s_popcount((m.low & ~(m.tab | m.cr | m.lf)) | m.del);
+    stats.equals += s_popcount(m.eq);
+
+    // CR is bare unless LF follows, the last CR of the block waits for the next block
+    uint64_t last = uint64_t(1) << (size - 1);
+    if (state.pending_cr && (m.lf & 1) == 0)
+        stats.bare_cr++;
+    stats.bare_cr += s_popcount(m.cr & ~(m.lf >> 1) & ~last);
+    state.pending_cr = (m.cr & last) != 0;
+
+    uint64_t lf    = m.lf;
+    uint64_t start = 0;
+    while (lf != 0) {
+        uint64_t pos   = uint64_t(__builtin_ctzll(lf));
+        stats.max_line = std::max(stats.max_line, state.column + pos - start);
+        state.column   = 0;
+        start          = pos + 1;
+        lf &= lf - 1;
+    }
+    state.column += size - start;
+}
+
+// ----------------------------------------------------------------------------
+// scalar
+
+static inline Masks s_masks_scalar(const unsigned char* data, size_t size)
+{
+    Masks m{};
+    for (size_t i = 0; i != size; i++) {
+        uint64_t      bit = uint64_t(1) << i;
+        unsigned char c   = data[i];
+        m.high |= c >= 0x80 ? bit : 0;
+        m.nul |= c == 0 ? bit : 0;
+        m.cr |= c == '\r' ? bit : 0;
+        m.lf |= c == '\n' ? bit : 0;
+        m.tab |= c == '\t' ? bit : 0;
+        m.low |= c < 0x20 ? bit : 0;
+        m.del |= c == 0x7f ? bit : 0;
+        m.eq |= c == '=' ? bit : 0;
+    }
+    return m;
+}
+
+static void s_scan_scalar(ContentScanner::State& state, const unsigned char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i += 64) {
+        size_t len = std::min<size_t>(64, size - i);
+        s_accumulate(state, s_masks_scalar(data + i, len), len);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// x86
+
+#ifdef FTY_SCAN_X86
+
+__attribute__((target("sse2"))) static inline uint64_t s_bits_sse2(int shift, __m128i v)
+{
+    return uint64_t(uint32_t(_mm_movemask_epi8(v))) << shift;
+}
+
+__attribute__((target("sse2"))) static void s_scan_sse2(
+    ContentScanner::State& state, const unsigned char* data, size_t size)
+{
+    size_t i = 0;
+    for (; size - i >= 64; i += 64) {
+        Masks m{};
+        for (int j = 0; j != 4; j++) {
+            const __m128i x     = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16 * size_t(j)));
+            const int     shift = 16 * j;
+            m.high |= s_bits_sse2(shift, x);
+            m.nul |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+            m.cr |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')));
+            m.lf |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+            m.tab |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')));
+            m.low |= s_bits_sse2(shift, _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x));
+            m.del |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+            m.eq |= s_bits_sse2(shift, _mm_cmpeq_epi8(x, _mm_set1_epi8('=')));
+        }
+        s_accumulate(state, m, 64);
+    }
+    s_scan_scalar(state, data + i, size - i);
+}
+
+__attribute__((target("avx2"))) static inline uint64_t s_bits_avx2(int shift, __m256i v)
+{
+    return uint64_t(uint32_t(_mm256_movemask_epi8(v))) << shift;
+}
+
+__attribute__((target("avx2,popcnt"))) static void s_scan_avx2(
+    ContentScanner::State& state, const unsigned char* data, size_t size)
+{
+    size_t i = 0;
+    for (; size - i >= 64; i += 64) {
+        Masks m{};
+        for (int j = 0; j != 2; j++) {
+            const __m256i x     = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32 * size_t(j)));
+            const int     shift = 32 * j;
+            m.high |= s_bits_avx2(shift, x);
+            m.nul |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+            m.cr |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')));
+            m.lf |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+            m.tab |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')));
+            m.low |= s_bits_avx2(shift, _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1f)), x));
+            m.del |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f)));
+            m.eq |= s_bits_avx2(shift, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('=')));
+        }
+        s_accumulate(state, m, 64);
+    }
+    s_scan_scalar(state, data + i, size - i);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// aarch64
+
+#ifdef FTY_SCAN_NEON
+
+static inline uint64_t s_bits_neon(int shift, uint8x16_t v)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t           bits        = vandq_u8(v, vld1q_u8(weights));
+    return (uint64_t(vaddv_u8(vget_low_u8(bits))) | uint64_t(vaddv_u8(vget_high_u8(bits))) << 8) << shift;
+}
+
+static void s_scan_neon(ContentScanner::State& state, const unsigned char* data, size_t size)
+{
+    size_t i = 0;
+    for (; size - i >= 64; i += 64) {
+        Masks m{};
+        for (int j = 0; j != 4; j++) {
+            const uint8x16_t x     = vld1q_u8(data + i + 16 * size_t(j));
+            const int        shift = 16 * j;
+            m.high |= s_bits_neon(shift, vcgeq_u8(x, vdupq_n_u8(0x80)));
+            m.nul |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8(0)));
+            m.cr |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8('\r')));
+            m.lf |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8('\n')));
+            m.tab |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8('\t')));
+            m.low |= s_bits_neon(shift, vcleq_u8(x, vdupq_n_u8(0x1f)));
+            m.del |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8(0x7f)));
+            m.eq |= s_bits_neon(shift, vceqq_u8(x, vdupq_n_u8('=')));
+        }
+        s_accumulate(state, m, 64);
+    }
+    s_scan_scalar(state, data + i, size - i);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// ContentScanner
+
+const char* transfer_encoding_name(TransferEncoding enc)
+{
+    switch (enc) {
+        case TransferEncoding::SEVEN_BIT:
+            return "7bit";
+        case TransferEncoding::EIGHT_BIT:
+            return "8bit";
+        case TransferEncoding::QUOTED_PRINTABLE:
+            return "quoted-printable";
+        default:
+            return "base64";
+    }
+}
+
+TransferEncoding ContentStats::encoding(bool text, bool eight_bit) const
+{
+    // canonical form of other types is binary, line breaks of 7bit or quoted-printable part would be converted
+    if (!text)
+        return TransferEncoding::BASE64;
+
+    if (nul == 0 && bare_cr == 0 && max_line <= MAX_LINE) {
+        if (non_ascii == 0)
+            return TransferEncoding::SEVEN_BIT;
+        if (eight_bit)
+            return TransferEncoding::EIGHT_BIT;
+    }
+
+    // escape has 3 characters, soft line break is added each 75 characters; base64 line is 76 characters and LF
+    uint64_t escaped = non_ascii + controls + equals + bare_cr;
+    uint64_t qp      = size + 2 * escaped;
+    qp += qp / 75 * 2;
+    uint64_t base64 = (size + 2) / 3 * 4 + (size + 56) / 57;
+    return qp <= base64 ? TransferEncoding::QUOTED_PRINTABLE : TransferEncoding::BASE64;
+}
+
+static ContentScanner::Kernel s_kernel(SimdIsa isa)
+{
+    switch (isa) {
+#ifdef FTY_SCAN_X86
+        case SimdIsa::SSE2:
+        case SimdIsa::SSSE3:
+            return s_scan_sse2;
+        case SimdIsa::AVX2:
+            return s_scan_avx2;
+#endif
+#ifdef FTY_SCAN_NEON
+        case SimdIsa::NEON:
+            return s_scan_neon;
+#endif
+        default:
+            return s_scan_scalar;
+    }
+}
+
+ContentScanner::ContentScanner()
+    : ContentScanner(simd_isa())
+{
+}
+
+ContentScanner::ContentScanner(SimdIsa isa)
+    : _kernel(s_kernel(isa))
+{
+}
+
+void ContentScanner::scan(const char* data, size_t size)
+{
+    _kernel(_state, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+ContentStats ContentScanner::stats() const
+{
+    ContentStats ret = _state.stats;
+    if (_state.pending_cr)
+        ret.bare_cr++;
+    ret.max_line = std::max(ret.max_line, _state.column);
+    return ret;
+}
@@ -0,0 +1,105 @@
+/*  =========================================================================
+    content_scan - Vectorized scan of MIME part content
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   content_scan.h
+/// @brief  Scan of MIME part content choosing the cheapest Content-Transfer-Encoding
+///
+/// Example:
+///
+///    ContentScanner scanner;
+///    scanner.scan(data, size);
+///    TransferEncoding enc = scanner.stats().encoding(true, sink.eightBit());
+
+#pragma once
+
+#include "simd.h"
+#include <cstddef>
+#include <cstdint>
+
+/// Content-Transfer-Encoding of MIME part
+enum class TransferEncoding
+{
+    SEVEN_BIT,
+    EIGHT_BIT,
+    QUOTED_PRINTABLE,
+    BASE64
+};
+
+/// @return value of Content-Transfer-Encoding header (7bit, 8bit, quoted-printable, base64)
+const char* transfer_encoding_name(TransferEncoding enc);
+
+/// what the content contains, as far as transfer encoding is concerned
+struct ContentStats
+{
+    uint64_t size{0};
+    /// bytes 0x80 - 0xff
+    uint64_t non_ascii{0};
+    uint64_t nul{0};
+    /// CR not followed by LF
+    uint64_t bare_cr{0};
+    /// control characters other than TAB, CR and LF, including NUL and DEL
+    uint64_t controls{0};
+    /// '=' characters, escaped by quoted-printable
+    uint64_t equals{0};
+    /// length of the longest line without LF (CR of CRLF is counted)
+    uint64_t max_line{0};
+
+    /// @return cheapest encoding transferring the content unchanged
+    /// @param text       content is text, line breaks may be converted to CRLF (otherwise base64 is used)
+    /// @param eight_bit  transport accepts 8bit MIME (RFC 6152)
+    TransferEncoding encoding(bool text, bool eight_bit) const;
+};
+
+///  @class ContentScanner
+///
+///  Incremental scan of content, input can be split at any byte. 64 bytes are classified at once by AVX2 or SSE2 on
+///  x86, NEON on aarch64, scalar code otherwise.
+class ContentScanner
+{
+public:
+    ContentScanner();
+
+    /// the same using given instruction set, which must be supported (tests and benchmarks)
+    explicit ContentScanner(SimdIsa isa);
+
+    /// scan next piece of the content
+    void scan(const char* data, size_t size);
+
+    /// @return statistics of the content scanned so far
+    ContentStats stats() const;
+
+    /// state carried between blocks
+    struct State
+    {
+        ContentStats stats;
+        /// length of the current line
+        uint64_t column{0};
+        /// last byte was CR, it is bare unless the next one is LF
+        bool pending_cr{false};
+    };
+
+    /// scan of data by one instruction set
+    using Kernel = void (*)(State& state, const unsigned char* data, size_t size);
+
+private:
+    Kernel _kernel;
+    State  _state;
+};
@@ -29,19 +29,187 @@
 #include "email.h"
 #include "emailconfiguration.h"
 #include "fty_email_server.h"
+#include "fty_email_trace.h"
+#include "smtp_client.h"
+#include <algorithm>
+#include <cstring>
 #include <ctime>
-#include <fstream>
+#include <fcntl.h>
 //#include <fty_common_mlm.h>
 #include <fty_log.h>
-#include <sstream>
 #include <stdio.h>
-
-// to ensure POSIX basename!!!
-// DO NOT REMOVE otherwise GNU basename can be used
-#include <cxxtools/mime.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <fty/process.h>
-#include <libgen.h>
-#include <regex>
+#include <array>
+#include <list>
+#include <mutex>
+#include <sysexits.h>
+#include <unordered_map>
+
+MsmtpConfig::MsmtpConfig(const std::string& content, bool memfd)
+    : _fd(-1)
+{
+    if (memfd)
+        _fd = memfd_create("fty-email-msmtp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (_fd != -1) {
+        // msmtp refuses configuration with password readable by others
+        fchmod(_fd, 0600);
+        _path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(_fd);
+    } else {
+        char filename[] = "/tmp/bios-msmtp-XXXXXX.cfg";
+        _fd             = mkstemps(filename, 4);
+        if (_fd == -1)
+            throw std::runtime_error("Cannot create msmtp configuration: " + std::string(strerror(errno)));
+        _file = filename;
+        _path = filename;
+    }
+
+    size_t done = 0;
+    while (done < content.size()) {
+        ssize_t r = write(_fd, content.data() + done, content.size() - done);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            std::string err = strerror(errno);
+            release();
+            throw std::runtime_error("Cannot write msmtp configuration to " + _path + ": " + err);
+        }
+        done += size_t(r);
+    }
+    // nobody can change it under running msmtp
+    if (_file.empty())
+        fcntl(_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+
+MsmtpConfig::~MsmtpConfig()
+{
+    release();
+}
+
+void MsmtpConfig::release()
+{
+    if (_fd != -1)
+        close(_fd);
+    _fd = -1;
+    if (!_file.empty())
+        unlink(_file.c_str());
+    _file.clear();
+}
+
+///  @class MimeTypeCache
+///
+///  LRU of MIME types detected by libmagic, keyed by file identity (dev, inode) and version (size, mtime), so the
+///  report attached to emails for many recipients is examined once. Shared by all Smtp instances, guarded by
+///  s_mime_mutex.
+class MimeTypeCache
+{
+public:
+    struct Key
+    {
+        dev_t    dev;
+        ino_t    ino;
+        off_t    size;
+        timespec mtime;
+
+        bool operator==(const Key& other) const
+        {
+            return dev == other.dev && ino == other.ino && size == other.size &&
+                   mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            size_t h = std::hash<uint64_t>()(uint64_t(key.ino));
+            for (uint64_t v : {uint64_t(key.dev), uint64_t(key.size), uint64_t(key.mtime.tv_sec),
+                     uint64_t(key.mtime.tv_nsec)})
+                h = h * 31 + std::hash<uint64_t>()(v);
+            return h;
+        }
+    };
+
+    /// @return cached MIME type moved to the front, nullptr if not cached
+    const std::string* find(const Key& key)
+    {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            _misses++;
+            return nullptr;
+        }
+        _hits++;
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return &it->second->second;
+    }
+
+    void insert(const Key& key, const std::string& mime_type)
+    {
+        if (_capacity == 0 || _index.count(key))
+            return;
+        _lru.emplace_front(key, mime_type);
+        _index[key] = _lru.begin();
+        shrink();
+    }
+
+    void capacity(size_t capacity)
+    {
+        _capacity = capacity;
+        shrink();
+    }
+
+    MimeTypeCacheStats stats() const
+    {
+        return {_hits, _misses, _lru.size()};
+    }
+
+private:
+    void shrink()
+    {
+        while (_lru.size() > _capacity) {
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+    }
+
+    using Entry = std::pair<Key, std::string>;
+
+    std::list<Entry>                                             _lru;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> _index;
+    size_t                                                       _capacity{256};
+    uint64_t                                                     _hits{0};
+    uint64_t                                                     _misses{0};
+};
+
+static std::mutex    s_mime_mutex;
+static MimeTypeCache s_mime_cache;
+/// type of attachments with unknown extension, empty to detect it by libmagic
+static std::string s_mime_fallback;
+
+/// MIME types of extensions trusted without looking at the content
+static const char* s_extension_type(const std::string& path)
+{
+    static const std::pair<const char*, const char*> types[] = {
+        {".txt", "text/plain; charset=utf-8"},
+        {".log", "text/plain; charset=utf-8"},
+        {".csv", "text/csv; charset=utf-8"},
+        {".json", "application/json; charset=utf-8"},
+        {".gz", "application/gzip; charset=binary"},
+        {".tgz", "application/gzip; charset=binary"},
+    };
+
+    size_t dot = path.find_last_of("./");
+    if (dot == std::string::npos || path[dot] != '.')
+        return nullptr;
+    for (const auto& it : types) {
+        if (strcasecmp(path.c_str() + dot, it.first) == 0)
+            return it.second;
+    }
+    return nullptr;
+}
 
 Smtp::Smtp()
     : _host{}
@@ -51,8 +219,15 @@ Smtp::Smtp()
     , _username{}
     , _password{}
     , _msmtp{"/usr/bin/msmtp"}
+    , _recipients_header{RecipientsHeader::BCC}
+    , _transport{Transport::NATIVE}
+    , _timeout{30}
+    , _pipelining{true}
+    , _chunking{true}
+    , _chunk_size{1024 * 1024}
     , _has_fn{false}
     , _verify_ca{false}
+    , _pool{std::make_shared<SmtpSessionPool>()}
 {
     _magic = magic_open(MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
     if (!_magic)
@@ -70,10 +245,31 @@ Smtp::~Smtp()
     magic_close(_magic);
 }
 
-std::string Smtp::createConfigFile() const
+void Smtp::configure(const Smtp& other)
+{
+    _host              = other._host;
+    _port              = other._port;
+    _from              = other._from;
+    _encryption        = other._encryption;
+    _username          = other._username;
+    _password          = other._password;
+    _msmtp             = other._msmtp;
+    _recipients_header = other._recipients_header;
+    _transport         = other._transport;
+    _timeout           = other._timeout;
+    _pipelining        = other._pipelining;
+    _chunking          = other._chunking;
+    _chunk_size        = other._chunk_size;
+    _has_fn            = other._has_fn;
+    _verify_ca         = other._verify_ca;
+    _fn                = other._fn;
+    _pool              = other._pool;
+    // configuration is materialized once and shared by all the copies
+    _msmtp_config = _transport == Transport::MSMTP ? other.msmtpConfigFile() : nullptr;
+}
+
+std::string Smtp::msmtpConfig() const
 {
-    char        filename[] = "/tmp/bios-msmtp-XXXXXX.cfg";
-    int         handle     = mkstemps(filename, 4);
     std::string line;
 
     line                        = "defaults\n";
@@ -117,19 +313,17 @@ std::string Smtp::createConfigFile() const
     line += "host " + _host + "\n";
     line += "port " + _port + "\n";
     line += "from " + _from + "\n";
-    ssize_t r = write(handle, line.c_str(), line.size());
-    if (r > 0 && static_cast<size_t>(r) != line.size())
-        log_error("write to %s was truncated, expected %zu, written %zd", filename, line.size(), r);
-    if (r == -1)
-        log_error("write to %s failed: %s", filename, strerror(errno));
-    close(handle);
-    log_debug("msmtp configuration:\n%s", line.c_str());
-    return std::string(filename);
+    return line;
 }
 
-void Smtp::deleteConfigFile(std::string& filename) const
+std::shared_ptr<MsmtpConfig> Smtp::msmtpConfigFile() const
 {
-    unlink(filename.c_str());
+    if (!_msmtp_config) {
+        std::string cfg = msmtpConfig();
+        log_debug("msmtp configuration:\n%s", cfg.c_str());
+        _msmtp_config = std::make_shared<MsmtpConfig>(cfg);
+    }
+    return _msmtp_config;
 }
 
 void Smtp::encryption(std::string enc)
@@ -142,23 +336,126 @@ void Smtp::encryption(std::string enc)
         encryption(Encryption::NONE);
 }
 
+void Smtp::recipients_header(const std::string& mode)
+{
+    if (strcasecmp("individual", mode.c_str()) == 0)
+        recipients_header(RecipientsHeader::INDIVIDUAL);
+    else if (strcasecmp("list", mode.c_str()) == 0)
+        recipients_header(RecipientsHeader::LIST);
+    else
+        recipients_header(RecipientsHeader::BCC);
+}
+
+void Smtp::transport(const std::string& transport)
+{
+    if (strcasecmp("msmtp", transport.c_str()) == 0)
+        this->transport(Transport::MSMTP);
+    else
+        this->transport(Transport::NATIVE);
+}
+
+void Smtp::pool_limits(size_t max_sessions, int idle_timeout, int health_check)
+{
+    _pool->limits(max_sessions, idle_timeout * 1000, health_check * 1000);
+}
+
+void Smtp::expire_sessions() const
+{
+    _pool->expire();
+}
+
 void Smtp::sendmail(const std::vector<std::string>& to, const std::string& subject, const std::string& body) const
 {
+    if (to.empty())
+        return;
+
+    // placeholder replaced by the recipient in INDIVIDUAL mode
+    static const std::string placeholder = "fty-email-recipient@placeholder.invalid";
+
+    // single recipient is not hidden from itself
+    RecipientsHeader mode = to.size() > 1 ? _recipients_header : RecipientsHeader::LIST;
+
+    std::string to_header;
+    zhash_t*    headers = zhash_new();
+    zhash_autofree(headers);
+    switch (mode) {
+        case RecipientsHeader::LIST:
+            for (const auto& it : to) {
+                if (!to_header.empty())
+                    to_header += ", ";
+                to_header += it;
+            }
+            break;
+        case RecipientsHeader::BCC: {
+            std::string bcc;
+            for (const auto& it : to) {
+                if (!bcc.empty())
+                    bcc += ", ";
+                bcc += it;
+            }
+            // Bcc: is used for envelope and removed from the message by the transport
+            to_header = "undisclosed-recipients:;";
+            zhash_update(headers, "Bcc", const_cast<char*>(bcc.c_str()));
+            break;
+        }
+        case RecipientsHeader::INDIVIDUAL:
+            to_header = placeholder;
+            break;
+    }
 
-    for (const auto& it : to) {
-        zuuid_t* uuid = zuuid_new();
-        zmsg_t*  msg =
-            fty_email_encode(zuuid_str_canonical(uuid), it.c_str(), subject.c_str(), nullptr, body.c_str(), nullptr);
-        zuuid_destroy(&uuid);
+    zuuid_t* uuid = zuuid_new();
+    zmsg_t*  msg =
+        fty_email_encode(zuuid_str_canonical(uuid), to_header.c_str(), subject.c_str(), headers, body.c_str(), nullptr);
+    zuuid_destroy(&uuid);
+    zhash_destroy(&headers);
+
+    // MVY: this is weird, horrible, ugly and hard to use.
+    //      Need to rething API for smtp_encode
+    //      BUT .. NEVER pass message with first uuid frame to msg2email
+    //      or BAD things will happen
+    char* cuuid = zmsg_popstr(msg);
+    zstr_free(&cuuid);
+    std::string mail = msg2email(&msg);
+
+    if (mode != RecipientsHeader::INDIVIDUAL) {
+        sendmail(mail);
+        return;
+    }
 
-        // MVY: this is weird, horrible, ugly and hard to use.
-        //      Need to rething API for smtp_encode
-        //      BUT .. NEVER pass message with first uuid frame to msg2email
-        //      or BAD things will happen
-        char* cuuid = zmsg_popstr(msg);
-        zstr_free(&cuuid);
-        sendmail(msg2email(&msg));
+    // rendered once, only To: header differs
+    size_t                   pos = mail.find(placeholder);
+    std::vector<std::string> failed;
+    SmtpError                code = SmtpError::Succeeded;
+    std::string              error;
+    bool                     permanent = true;
+    for (auto it = to.begin(); it != to.end(); ++it) {
+        std::string copy = mail;
+        if (pos != std::string::npos)
+            copy.replace(pos, placeholder.size(), *it);
+        try {
+            sendmail(copy);
+        } catch (const std::runtime_error& e) {
+            SmtpError current = smtp_exception2code(e);
+            if (failed.empty()) {
+                code  = current;
+                error = e.what();
+            }
+            failed.push_back(*it);
+            permanent = permanent && smtp_exception_permanent(e);
+            // only refusal of the message (Unknown) is specific to the recipient, the other errors (server, login)
+            // would fail the remaining copies the same way
+            if (current != SmtpError::Unknown) {
+                // untried recipients make it worth another attempt
+                permanent = permanent && it + 1 == to.end();
+                failed.insert(failed.end(), it + 1, to.end());
+                break;
+            }
+        }
     }
+    if (!failed.empty())
+        throw SmtpRecipientsException(code,
+            error + " (" + std::to_string(failed.size()) + " of " + std::to_string(to.size()) + " recipients failed)",
+            permanent, failed);
 }
 
 void Smtp::sendmail(const std::string& to, const std::string& subject, const std::string& body) const
@@ -171,47 +468,138 @@ void Smtp::sendmail(const std::string& to, const std::string& subject, const std
 
 void Smtp::sendmail(const std::string& data) const
 {
-    using namespace fmt::literals;
+    deliver(data, nullptr);
+}
+
+void Smtp::sendmail(const MimeWriter& mail) const
+{
+    deliver(mail.headers(), [&mail](MimeSink& sink) {
+        mail.writeBody(sink);
+    });
+}
 
+void Smtp::deliver(const std::string& head, const MimeSource& body) const
+{
     // for testing
     if (_has_fn) {
-        _fn(data);
+        StringSink sink;
+        sink.write(head);
+        if (body)
+            body(sink);
+        _fn(sink.str());
         return;
     }
 
-    std::string cfg = createConfigFile();
     if (_host.empty()) {
         return;
     }
-    fty::Process proc(_msmtp, {"-t", "-C", cfg});
-    auto         bret = proc.run();
+
+    if (_transport == Transport::MSMTP)
+        sendmail_msmtp(head, body);
+    else
+        sendmail_native(head, body);
+}
+
+void Smtp::sendmail_native(const std::string& head, const MimeSource& body) const
+{
+    SmtpSettings settings;
+    settings.host       = _host;
+    settings.port       = _port;
+    settings.from       = _from;
+    settings.encryption = _encryption;
+    settings.username   = _username;
+    settings.password   = _password;
+    settings.verify_ca  = _verify_ca;
+    settings.timeout_ms = _timeout * 1000;
+    settings.pipelining = _pipelining;
+    settings.chunking   = _chunking;
+    settings.chunk_size = _chunk_size;
+
+    // envelope is derived from the headers, the rest is streamed
+    SmtpEnvelope envelope = smtp_prepare_envelope(head, _from);
+
+    // sessions are kept open between messages, pool drops them when settings change
+    _pool->configure(settings);
+    _pool->sendmail(_from, envelope.recipients, [&](MimeSink& sink) {
+        sink.write(envelope.data);
+        if (body)
+            body(sink);
+    });
+}
+
+///  @class ProcessSink
+///
+///  Writes streamed email to stdin of the process, rest of the email is dropped once write fails
+class ProcessSink : public MimeSink
+{
+public:
+    using MimeSink::write;
+
+    explicit ProcessSink(fty::Process& proc)
+        : _proc(proc)
+    {
+    }
+
+    void write(const char* data, size_t size) override
+    {
+        if (_ok && size != 0)
+            _ok = _proc.write(std::string(data, size));
+        _size += size;
+    }
+
+    bool ok() const
+    {
+        return _ok;
+    }
+
+    /// @return number of bytes of the email (also those dropped after failed write)
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    fty::Process& _proc;
+    bool          _ok{true};
+    size_t        _size{0};
+};
+
+void Smtp::sendmail_msmtp(const std::string& head, const MimeSource& body) const
+{
+    using namespace fmt::literals;
+
+    // keeps the configuration alive even if settings change during the delivery
+    std::shared_ptr<MsmtpConfig> cfg = msmtpConfigFile();
+
+    fty::Process proc(_msmtp, {"-t", "-C", cfg->path()});
+    FTY_EMAIL_PROBE(spawn_start, TraceRequest::uuid(), _msmtp.c_str());
+    auto bret = proc.run();
     if (!bret) {
         throw std::runtime_error("{} failed with '{}'"_format(_msmtp, bret.error()));
     }
-
-    bool wr = proc.write(data);
-    if (!wr) {
+    FTY_EMAIL_PROBE(spawn_end, TraceRequest::uuid(), _msmtp.c_str(), int(*bret));
+
+    FTY_EMAIL_PROBE(data_start, TraceRequest::uuid());
+    ProcessSink sink{proc};
+    sink.write(head);
+    if (body)
+        body(sink);
+    if (!sink.ok()) {
         log_warning("Email truncated");
     }
 
     auto ret = proc.wait();
-    deleteConfigFile(cfg);
     if (!ret) {
         throw std::runtime_error("{} wait with '{}'"_format(_msmtp, ret.error()));
     }
+    FTY_EMAIL_PROBE(data_end, TraceRequest::uuid(), sink.size(), *ret);
 
     if (*ret != 0) {
-        throw std::runtime_error(
-            "{} failed with exit code '{}'\nstderr: {}\n"_format(_msmtp, *ret, proc.readAllStandardError()));
+        throw MsmtpException(
+            *ret, "{} failed with exit code '{}'\nstderr: {}\n"_format(_msmtp, *ret, proc.readAllStandardError()));
     }
 }
 
-static bool s_is_text(const char* mime)
-{
-    assert(mime);
-    return !strncmp(mime, "text", 4);
-}
-
 static std::string popString(zmsg_t* msg)
 {
     char*       it = zmsg_popstr(msg);
@@ -220,22 +608,22 @@ static std::string popString(zmsg_t* msg)
     return ret;
 }
 
-std::string Smtp::msg2email(zmsg_t** msg_p) const
+MimeWriter Smtp::msg2mime(zmsg_t** msg_p) const
 {
     assert(msg_p && *msg_p);
     zmsg_t* msg = *msg_p;
+    FTY_EMAIL_PROBE(mime_start, TraceRequest::uuid(), zmsg_content_size(msg));
 
-    std::stringstream       buff;
-    cxxtools::MimeMultipart mime;
+    MimeWriter mime;
 
     std::string to      = popString(msg);
     std::string subject = popString(msg);
     std::string body    = getIpAddr();
     body += popString(msg);
 
-    mime.setHeader("To", to);
-    mime.setHeader("Subject", subject);
-    mime.addObject(body);
+    mime.header("To", to);
+    mime.header("Subject", subject);
+    mime.body(body);
 
     // new protocol have more frames
     if (zmsg_size(msg) != 0) {
@@ -247,7 +635,7 @@ std::string Smtp::msg2email(zmsg_t** msg_p) const
         for (char* value = static_cast<char*>(zhash_first(headers)); value != nullptr;
              value       = static_cast<char*>(zhash_next(headers))) {
             const char* key = zhash_cursor(headers);
-            mime.setHeader(key, value);
+            mime.header(key, value);
         }
         zhash_destroy(&headers);
 
@@ -256,33 +644,81 @@ std::string Smtp::msg2email(zmsg_t** msg_p) const
         time_t     t   = ::time(nullptr);
         struct tm* tmp = ::localtime(&t);
         char       buf[256];
-        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z\n", tmp);
-        mime.setHeader("Date", buf);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", tmp);
+        mime.header("Date", buf);
 
+        // attachments are read when the email is written
         while (zmsg_size(msg) != 0) {
-            char*       path      = zmsg_popstr(msg);
-            const char* mime_type = magic_file(_magic, path);
-            if (!mime_type) {
-                log_warning("Can't guess type for %s, using application/octet-stream", path);
-                mime_type = "application/octet-stream; charset=binary";
-            }
-
-            std::ifstream ipath{path};
-
-            if (s_is_text(mime_type))
-                mime.attachTextFile(ipath, basename(path), mime_type);
-            else
-                mime.attachBinaryFile(ipath, basename(path), mime_type);
-
-            ipath.close();
+            char* path = zmsg_popstr(msg);
+            mime.attach(path, mimeType(path));
             zstr_free(&path);
         }
     }
     zmsg_destroy(&msg);
     *msg_p = nullptr;
 
-    buff << mime;
-    return buff.str();
+    FTY_EMAIL_PROBE(mime_end, TraceRequest::uuid(), mime.text().size(), mime.attachments());
+    return mime;
+}
+
+std::string Smtp::mimeType(const std::string& path) const
+{
+    const char* known = s_extension_type(path);
+    if (known)
+        return known;
+
+    struct stat        st;
+    bool               cacheable = stat(path.c_str(), &st) == 0;
+    MimeTypeCache::Key key{};
+    {
+        std::lock_guard<std::mutex> lock(s_mime_mutex);
+        if (!s_mime_fallback.empty())
+            return s_mime_fallback;
+        if (cacheable) {
+            key                    = {st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+            const std::string* hit = s_mime_cache.find(key);
+            if (hit)
+                return *hit;
+        }
+    }
+
+    // libmagic runs without the lock, each instance has own cookie
+    FTY_EMAIL_PROBE(magic_start, TraceRequest::uuid(), path.c_str());
+    const char* mime_type = magic_file(_magic, path.c_str());
+    FTY_EMAIL_PROBE(magic_end, TraceRequest::uuid(), path.c_str(), mime_type ? mime_type : "");
+    if (!mime_type) {
+        log_warning("Can't guess type for %s, using application/octet-stream", path.c_str());
+        return "application/octet-stream; charset=binary";
+    }
+    std::string ret = mime_type;
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(s_mime_mutex);
+        s_mime_cache.insert(key, ret);
+    }
+    return ret;
+}
+
+void mime_type_cache_size(size_t size)
+{
+    std::lock_guard<std::mutex> lock(s_mime_mutex);
+    s_mime_cache.capacity(size);
+}
+
+void mime_type_fallback(const std::string& mime_type)
+{
+    std::lock_guard<std::mutex> lock(s_mime_mutex);
+    s_mime_fallback = mime_type == "magic" ? "" : mime_type;
+}
+
+MimeTypeCacheStats mime_type_cache_stats()
+{
+    std::lock_guard<std::mutex> lock(s_mime_mutex);
+    return s_mime_cache.stats();
+}
+
+std::string Smtp::msg2email(zmsg_t** msg_p) const
+{
+    return msg2mime(msg_p).str();
 }
 
 std::string sms_email_address(const std::string& gw_template, const std::string& phone_number)
@@ -309,42 +745,243 @@ std::string sms_email_address(const std::string& gw_template, const std::string&
     return ret;
 }
 
+// ----------------------------------------------------------------------------
+// msmtp errors
+
+///  @class StderrMatcher
+///
+///  Aho-Corasick automaton finding all the phrases of msmtp errors in one pass over stderr, instead of running
+///  several regular expressions over it one by one. Classification keeps the semantics of the original expressions:
+///  they were ECMAScript, whose '.' matches neither CR nor LF, except DNSFailed, which was POSIX extended, whose '.'
+///  matches anything but NUL.
+class StderrMatcher
+{
+public:
+    enum Phrase
+    {
+        CONNECT_PORT,
+        LOCATE_HOST,
+        NAME_UNKNOWN,
+        NO_DNS,
+        NO_STARTTLS,
+        STARTTLS_FAILED,
+        NO_SECURE_AUTH,
+        NO_AUTH,
+        AUTH_METHOD,
+        NOT_SUPPORTED,
+        NO_USABLE_AUTH,
+        NO_CERTIFICATE,
+        FINGERPRINT,
+        FINGERPRINT_MISMATCH,
+        REVOKED,
+        UNKNOWN_ISSUER,
+        NOT_TRUSTED,
+        PHRASES
+    };
+
+    /// positions where the phrases start, npos if not found
+    struct Match
+    {
+        size_t first[PHRASES];
+        size_t last[PHRASES];
+        /// input contains CR or LF
+        bool newline{false};
+        /// input contains NUL
+        bool nul{false};
+
+        bool found(Phrase phrase) const
+        {
+            return first[phrase] != std::string::npos;
+        }
+
+        /// @return true if phrase b starts somewhere after the end of phrase a
+        bool followed(Phrase a, Phrase b) const
+        {
+            return found(a) && found(b) && last[b] >= first[a] + strlen(s_phrases[a]);
+        }
+    };
+
+    StderrMatcher()
+    {
+        // bytes which are not in any phrase share class 0
+        _class.fill(0);
+        for (const char* phrase : s_phrases) {
+            for (const char* p = phrase; *p; p++) {
+                unsigned char c = static_cast<unsigned char>(*p);
+                if (_class[c] == 0)
+                    _class[c] = uint8_t(++_classes);
+            }
+        }
+        _classes++;
+
+        // trie, 0 is "no edge" as the root is never a target
+        _delta.assign(_classes, 0);
+        _out.assign(1, 0);
+        for (int k = 0; k != PHRASES; k++) {
+            size_t state = 0;
+            for (const char* p = s_phrases[k]; *p; p++) {
+                size_t next = _delta[state * _classes + _class[static_cast<unsigned char>(*p)]];
+                if (next == 0) {
+                    next = _out.size();
+                    _delta[state * _classes + _class[static_cast<unsigned char>(*p)]] = uint16_t(next);
+                    _delta.resize(_delta.size() + _classes, 0);
+                    _out.push_back(0);
+                }
+                state = next;
+            }
+            _out[state] |= 1u << k;
+        }
+
+        // failure links resolved into complete transition table, breadth first
+        std::vector<uint16_t> fail(_out.size(), 0);
+        std::vector<size_t>   queue;
+        for (size_t c = 0; c != _classes; c++) {
+            if (_delta[c] != 0)
+                queue.push_back(_delta[c]);
+        }
+        for (size_t i = 0; i != queue.size(); i++) {
+            size_t state = queue[i];
+            _out[state] |= _out[fail[state]];
+            for (size_t c = 0; c != _classes; c++) {
+                uint16_t& next = _delta[state * _classes + c];
+                if (next != 0) {
+                    fail[next] = _delta[fail[state] * _classes + c];
+                    queue.push_back(next);
+                } else {
+                    next = _delta[fail[state] * _classes + c];
+                }
+            }
+        }
+    }
+
+    Match scan(const std::string& inp) const
+    {
+        Match ret;
+        std::fill(std::begin(ret.first), std::end(ret.first), std::string::npos);
+        std::fill(std::begin(ret.last), std::end(ret.last), std::string::npos);
+
+        size_t state = 0;
+        for (size_t i = 0; i != inp.size(); i++) {
+            unsigned char c = static_cast<unsigned char>(inp[i]);
+            ret.newline |= c == '\n' || c == '\r';
+            ret.nul |= c == '\0';
+            state        = _delta[state * _classes + _class[c]];
+            uint32_t out = _out[state];
+            while (out != 0) {
+                int    k     = __builtin_ctz(out);
+                size_t start = i + 1 - strlen(s_phrases[k]);
+                if (ret.first[k] == std::string::npos)
+                    ret.first[k] = start;
+                ret.last[k] = start;
+                out &= out - 1;
+            }
+        }
+        return ret;
+    }
+
+    static const char* const s_phrases[PHRASES];
+
+private:
+    std::array<uint8_t, 256> _class;
+    size_t                   _classes{0};
+    std::vector<uint16_t>    _delta;
+    /// phrases ending in the state
+    std::vector<uint32_t> _out;
+};
+
+const char* const StderrMatcher::s_phrases[PHRASES] = {
+    ", port ",
+    "cannot locate host",
+    ": Name or service not known",
+    "the server does not support DNS",
+    "the server does not support TLS via the STARTTLS command",
+    "command STARTTLS failed",
+    "cannot use a secure authentication method",
+    "the server does not support authentication",
+    "authentication method ",
+    " not supported",
+    "cannot find a usable authentication method",
+    "no certificate was founderror gettint ",
+    " fingerprint",
+    "the certificate fingerprint does not match",
+    "the certificate has been revoked",
+    "the certificate hasn't got a known issuer",
+    "the certificate is not trusted",
+};
+
 SmtpError msmtp_stderr2code(const std::string& inp)
 {
+    using M = StderrMatcher;
+
     if (inp.size() == 0)
         return SmtpError::Succeeded;
 
-    static std::regex ServerUnreachable{"cannot connect to .*, port .*"};
-    static std::regex DNSFailed{
-        ".*(cannot locate host.*: Name or service not known|the server does not support DNS).*", std::regex::extended};
-    static std::regex SSLNotSupported{
-        ".*(the server does not support TLS via the STARTTLS command|command STARTTLS failed|cannot use a secure "
-        "authentication method).*"};
-    static std::regex AuthMethodNotSupported{
-        ".*(the server does not support authentication|authentication method .* not supported|cannot find a usable "
-        "authentication method).*"};
-    static std::regex AuthFailed{"(authentication failed|(AUTH LOGIN|AUTH CRAM-MD5|AUTH EXTERNAL) failed)"};
-    static std::regex UnknownCA{
-        ".*(no certificate was founderror gettint .* fingerprint|the certificate fingerprint does not match|the "
-        "certificate has been revoked|the certificate hasn't got a known issuer|the certificate is not trusted).*"};
-
-    if (std::regex_match(inp, ServerUnreachable))
+    static const StderrMatcher matcher;
+    const M::Match             m = matcher.scan(inp);
+
+    // "cannot connect to .*, port .*"
+    static const std::string connect = "cannot connect to ";
+    if (!m.newline && inp.compare(0, connect.size(), connect) == 0 && m.found(M::CONNECT_PORT) &&
+        m.last[M::CONNECT_PORT] >= connect.size())
         return SmtpError::ServerUnreachable;
 
-    if (std::regex_match(inp, DNSFailed))
+    if (!m.nul && (m.followed(M::LOCATE_HOST, M::NAME_UNKNOWN) || m.found(M::NO_DNS)))
         return SmtpError::DNSFailed;
 
-    if (std::regex_match(inp, AuthMethodNotSupported))
+    if (!m.newline &&
+        (m.found(M::NO_AUTH) || m.followed(M::AUTH_METHOD, M::NOT_SUPPORTED) || m.found(M::NO_USABLE_AUTH)))
         return SmtpError::AuthMethodNotSupported;
 
-    if (std::regex_match(inp, AuthFailed))
+    // whole stderr is the message
+    if (inp == "authentication failed" || inp == "AUTH LOGIN failed" || inp == "AUTH CRAM-MD5 failed" ||
+        inp == "AUTH EXTERNAL failed")
         return SmtpError::AuthFailed;
 
-    if (std::regex_match(inp, SSLNotSupported))
+    if (!m.newline && (m.found(M::NO_STARTTLS) || m.found(M::STARTTLS_FAILED) || m.found(M::NO_SECURE_AUTH)))
         return SmtpError::SSLNotSupported;
 
-    if (std::regex_match(inp, UnknownCA))
+    if (!m.newline && (m.followed(M::NO_CERTIFICATE, M::FINGERPRINT) || m.found(M::FINGERPRINT_MISMATCH) ||
+                          m.found(M::REVOKED) || m.found(M::UNKNOWN_ISSUER) || m.found(M::NOT_TRUSTED)))
         return SmtpError::UnknownCA;
 
     return SmtpError::Unknown;
 }
+
+SmtpError msmtp_stderr2code(const std::string& inp, int exit_code)
+{
+    if (exit_code == EX_OK)
+        return SmtpError::Succeeded;
+
+    SmtpError ret = msmtp_stderr2code(inp);
+    if (ret != SmtpError::Unknown && ret != SmtpError::Succeeded)
+        return ret;
+
+    // the codes msmtp uses for one kind of failure only
+    switch (exit_code) {
+        case EX_NOHOST:
+            return SmtpError::DNSFailed;
+        case EX_NOPERM:
+            return SmtpError::AuthFailed;
+        default:
+            return SmtpError::Unknown;
+    }
+}
+
+SmtpError smtp_exception2code(const std::runtime_error& e)
+{
+    const SmtpException* se = dynamic_cast<const SmtpException*>(&e);
+    if (se)
+        return se->code();
+    const MsmtpException* me = dynamic_cast<const MsmtpException*>(&e);
+    if (me)
+        return msmtp_stderr2code(e.what(), me->exitCode());
+    return msmtp_stderr2code(e.what());
+}
+
+bool smtp_exception_permanent(const std::runtime_error& e)
+{
+    const SmtpException* se = dynamic_cast<const SmtpException*>(&e);
+    if (se)
+        return se->permanent();
+    return dynamic_cast<const MsmtpException*>(&e) && strstr(e.what(), "server message: 5");
+}
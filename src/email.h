@@ -39,9 +39,12 @@
 
 #pragma once
 
+#include "mime_writer.h"
 #include <czmq.h>
 #include <functional>
 #include <magic.h>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -53,6 +56,25 @@ enum class Encryption
     STARTTLS
 };
 
+/// How recipients of multi-recipient email are stated in the headers
+///  BCC         recipients are hidden (Bcc: semantics), one SMTP transaction (default)
+///  LIST        one To: header with all recipients, one SMTP transaction
+///  INDIVIDUAL  each recipient gets a copy with own To: header, message is rendered once
+/// Email with single recipient always gets To: header with the recipient.
+enum class RecipientsHeader
+{
+    LIST,
+    INDIVIDUAL,
+    BCC
+};
+
+/// Transport used to deliver the email
+enum class Transport
+{
+    NATIVE,
+    MSMTP
+};
+
 /// @class SmtpError
 ///
 /// Specification of error codes from Genepi project
@@ -81,12 +103,127 @@ enum class SmtpError
     Unknown                = 10
 };
 
+/// @class SmtpException
+///
+/// Error raised by the native SMTP transport, carries already classified SmtpError
+class SmtpException : public std::runtime_error
+{
+public:
+    /// @param permanent  the server refused the request by 5xx reply, it would be refused again
+    SmtpException(SmtpError code, const std::string& what, bool permanent = false)
+        : std::runtime_error(what)
+        , _code(code)
+        , _permanent(permanent)
+    {
+    }
+
+    SmtpError code() const
+    {
+        return _code;
+    }
+
+    /// @return true if the server refused the request by 5xx reply
+    bool permanent() const
+    {
+        return _permanent;
+    }
+
+private:
+    SmtpError _code;
+    bool      _permanent;
+};
+
+/// @class SmtpRecipientsException
+///
+/// Copies of email sent to each recipient (RecipientsHeader::INDIVIDUAL) were not delivered to some recipients,
+/// the other recipients got theirs. Carries code and message of the first failure, permanent if all of them were.
+class SmtpRecipientsException : public SmtpException
+{
+public:
+    SmtpRecipientsException(
+        SmtpError code, const std::string& what, bool permanent, const std::vector<std::string>& recipients)
+        : SmtpException(code, what, permanent)
+        , _recipients(recipients)
+    {
+    }
+
+    /// @return recipients which did not get the email
+    const std::vector<std::string>& recipients() const
+    {
+        return _recipients;
+    }
+
+private:
+    std::vector<std::string> _recipients;
+};
+
+/// @class MsmtpException
+///
+/// Failure of msmtp transport, carries exit code of msmtp (sysexits.h)
+class MsmtpException : public std::runtime_error
+{
+public:
+    MsmtpException(int exit_code, const std::string& what)
+        : std::runtime_error(what)
+        , _exit_code(exit_code)
+    {
+    }
+
+    int exitCode() const
+    {
+        return _exit_code;
+    }
+
+private:
+    int _exit_code;
+};
+
+class SmtpSessionPool;
+
+///  @class MsmtpConfig
+///
+///  msmtp configuration materialized in anonymous memfd, passed to msmtp as /proc/<pid>/fd/<fd>. Private temporary
+///  file is used if memfd is not available. It is immutable, replaced as a whole when settings change.
+class MsmtpConfig
+{
+public:
+    /// @param memfd  try memfd first, private temporary file is used otherwise
+    /// @throws std::runtime_error if configuration cannot be written
+    explicit MsmtpConfig(const std::string& content, bool memfd = true);
+    ~MsmtpConfig();
+
+    MsmtpConfig(const MsmtpConfig&) = delete;
+    MsmtpConfig& operator=(const MsmtpConfig&) = delete;
+
+    /// path to be passed to msmtp -C
+    const std::string& path() const
+    {
+        return _path;
+    }
+
+    /// @return temporary file to be removed, empty for memfd
+    const std::string& file() const
+    {
+        return _file;
+    }
+
+private:
+    void release();
+
+    int         _fd;
+    std::string _path;
+    std::string _file;
+};
+
 ///  @class Smtp
 ///
-/// Simple wrapper on top of msmtp
+/// Simple wrapper on top of SMTP transport
 ///
-///  This class contain some basic configuration for msmtp (host/from) + provide sendmail methods. It *DOES NOT* perform
+///  This class contain some basic configuration for SMTP (host/from) + provide sendmail methods. It *DOES NOT* perform
 ///  any additional transofmation like uuencode or mime. IOW garbage-in, garbage-out.
+///
+///  Email is delivered by the native SMTP client (see smtp_client.h) by default, msmtp binary is kept as a fallback
+///  transport.
 class Smtp
 {
 public:
@@ -95,34 +232,45 @@ public:
 
     ~Smtp();
 
+    Smtp(const Smtp&) = delete;
+    Smtp& operator=(const Smtp&) = delete;
+
+    /// copy all the settings (not the libmagic cookie) from other instance, SMTP session pool is shared
+    void configure(const Smtp& other);
+
     /// set the SMTP server address
     void host(const std::string& host)
     {
         _host = host;
+        _msmtp_config.reset();
     };
 
     /// set the SMTP server port. Default is 25.
     void port(const std::string& port)
     {
         _port = port;
+        _msmtp_config.reset();
     };
 
     /// set the "mail from" address
     void from(const std::string& from)
     {
         _from = from;
+        _msmtp_config.reset();
     };
 
     /// set username for smtp authentication
     void username(const std::string& username)
     {
         _username = username;
+        _msmtp_config.reset();
     };
 
     /// set password for smtp authentication
     void password(const std::string& password)
     {
         _password = password;
+        _msmtp_config.reset();
     };
 
     /// set the encryption for SMTP communication (NONE|TLS|STARTTLS)
@@ -130,14 +278,61 @@ public:
     void encryption(Encryption enc)
     {
         _encryption = enc;
+        _msmtp_config.reset();
     };
 
     /// turn on or of the CA verification
     void verify_ca(bool verify)
     {
         _verify_ca = verify;
+        _msmtp_config.reset();
+    }
+
+    /// set how recipients of multi-recipient email are stated in the headers (LIST|INDIVIDUAL|BCC), unknown mode is
+    /// BCC
+    void recipients_header(const std::string& mode);
+    void recipients_header(RecipientsHeader mode)
+    {
+        _recipients_header = mode;
+    }
+
+    /// set the transport used to deliver emails (NATIVE|MSMTP)
+    void transport(const std::string& transport);
+    void transport(Transport transport)
+    {
+        _transport = transport;
+    }
+
+    /// set the timeout of SMTP connection and of each read/write in seconds (native transport only)
+    void timeout(int timeout)
+    {
+        _timeout = timeout;
+    }
+
+    /// turn on or off ESMTP PIPELINING (used only if server supports it, native transport only)
+    void pipelining(bool pipelining)
+    {
+        _pipelining = pipelining;
+    }
+
+    /// turn on or off ESMTP CHUNKING (BDAT, used only if server supports it, native transport only)
+    /// @param chunking    use BDAT instead of DATA
+    /// @param chunk_size  size of one BDAT chunk in bytes
+    void chunking(bool chunking, size_t chunk_size)
+    {
+        _chunking   = chunking;
+        _chunk_size = chunk_size;
     }
 
+    /// set limits of SMTP session pool (native transport only)
+    /// @param max_sessions  maximum of sessions open to the server, 0 disables session reuse
+    /// @param idle_timeout  idle session is closed after idle_timeout seconds
+    /// @param health_check  session idle for more than health_check seconds is checked by NOOP before reuse
+    void pool_limits(size_t max_sessions, int idle_timeout, int health_check);
+
+    /// close pooled SMTP sessions idle for longer than idle timeout
+    void expire_sessions() const;
+
     /// set alternative path for msmtp
     /// @param path  path to msmtp binary to be called
     void msmtp_path(const std::string& msmtp_path)
@@ -156,12 +351,16 @@ public:
 
     /// send the email
     ///
-    /// Technically this put email to msmtp's outgoing queue
+    /// Technically this put email to msmtp's outgoing queue. Message is rendered once and delivered to all
+    /// recipients in one SMTP transaction, see recipients_header for the To: header. With INDIVIDUAL, copy refused
+    /// for one recipient does not stop the copies of the others; the call is to be repeated with recipients of
+    /// SmtpRecipientsException only, otherwise the others get the email twice.
     /// @param to        email header To: multiple recipient in vector
     /// @param subject   email header Subject:
     /// @param body      email body
     ///
-    /// @throws std::runtime_error for msmtp invocation errors
+    /// @throws std::runtime_error for msmtp invocation errors, SmtpException for native transport errors,
+    ///         SmtpRecipientsException if copies for some recipients were not delivered (INDIVIDUAL)
     void sendmail(const std::vector<std::string>& to, const std::string& subject, const std::string& body) const;
 
     /// send the email
@@ -171,7 +370,7 @@ public:
     /// @param subject   email header Subject:
     /// @param body      email body
     ///
-    /// @throws std::runtime_error for msmtp invocation errors
+    /// @throws std::runtime_error for msmtp invocation errors, SmtpException for native transport errors
     void sendmail(const std::string& to, const std::string& subject, const std::string& body) const;
 
     /// send the email
@@ -180,9 +379,25 @@ public:
     /// @param data  email DATA (To/Subject are deduced from the fields in body, so body must be properly formatted
     /// email message).
     ///
-    /// @throws std::runtime_error for msmtp invocation errors
+    /// @throws std::runtime_error for msmtp invocation errors, SmtpException for native transport errors
     void sendmail(const std::string& data) const;
 
+    /// send the multipart email, attachments are streamed to the transport
+    ///
+    /// @throws std::runtime_error for msmtp invocation errors, SmtpException for native transport errors
+    void sendmail(const MimeWriter& mail) const;
+
+    /// convert zmq message to multipart email
+    ///
+    /// Format of message is in bios_smtp_server, attachments are only referenced and read once the email is sent
+    MimeWriter msg2mime(zmsg_t** msg_p) const;
+
+    /// @return MIME type of the attachment
+    ///
+    /// Known extensions (.txt, .log, .csv, .json, .gz, .tgz) are trusted, other files are examined by libmagic unless
+    /// mime_type_fallback is set. Result of libmagic is cached by device, inode, size and mtime of the file.
+    std::string mimeType(const std::string& path) const;
+
     /// convert zmq message to email string
     ///
     /// Function creates a multipart message, which can be sent
@@ -190,10 +405,17 @@ public:
     std::string msg2email(zmsg_t** msg_p) const;
 
 protected:
-    /// create msmtp config file
-    std::string createConfigFile() const;
-    /// delete msmtp config file
-    void deleteConfigFile(std::string& filename) const;
+    /// deliver email, head is written first and then body (if any)
+    void deliver(const std::string& head, const MimeSource& body) const;
+    /// deliver email using msmtp binary
+    void sendmail_msmtp(const std::string& head, const MimeSource& body) const;
+    /// deliver email using native SMTP client
+    void sendmail_native(const std::string& head, const MimeSource& body) const;
+
+    /// render msmtp configuration
+    std::string msmtpConfig() const;
+    /// @return msmtp configuration file, it is materialized on first use and kept until a setting changes
+    std::shared_ptr<MsmtpConfig> msmtpConfigFile() const;
 
     std::string                             _host;
     std::string                             _port;
@@ -202,12 +424,37 @@ protected:
     std::string                             _username;
     std::string                             _password;
     std::string                             _msmtp;
+    RecipientsHeader                        _recipients_header;
+    Transport                               _transport;
+    int                                     _timeout;
+    bool                                    _pipelining;
+    bool                                    _chunking;
+    size_t                                  _chunk_size;
     bool                                    _has_fn;
     bool                                    _verify_ca;
     std::function<void(const std::string&)> _fn;
     magic_t                                 _magic;
+    std::shared_ptr<SmtpSessionPool>        _pool;
+    /// msmtp configuration shared by the copies made by configure, reset by setters
+    mutable std::shared_ptr<MsmtpConfig> _msmtp_config;
 };
 
+struct MimeTypeCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    size_t   size;
+};
+
+/// set capacity of the cache of MIME types detected by libmagic, 0 disables it
+void mime_type_cache_size(size_t size);
+
+/// set MIME type of attachments with unknown extension, "magic" (default) detects it by libmagic
+void mime_type_fallback(const std::string& mime_type);
+
+/// @return counters of the MIME type cache
+MimeTypeCacheStats mime_type_cache_stats();
+
 /// Ciprian's algorithm to obtain email address for given phone number
 ///
 ///  \param [in] gw_template     template for SMS gateway. The # characters are then replaced by
@@ -233,3 +480,20 @@ std::string sms_email_address(const std::string& gw_template, const std::string&
 
 /// Convert msmtp stderr to error code
 SmtpError msmtp_stderr2code(const std::string& inp);
+
+/// Convert msmtp stderr and exit code (sysexits.h) to error code
+///
+///  Exit code 0 is success. Otherwise stderr is classified as above and exit codes specific to one failure (no such
+///  host, permission denied by authentication) classify the rest.
+SmtpError msmtp_stderr2code(const std::string& inp, int exit_code);
+
+/// Convert sendmail error to error code
+///
+///  SmtpException thrown by native transport already carries the code, msmtp errors are parsed by msmtp_stderr2code
+///  (MsmtpException with the exit code of msmtp)
+SmtpError smtp_exception2code(const std::runtime_error& e);
+
+/// Check if sendmail error is permanent refusal of the server (5xx reply), the same request would be refused again
+///
+///  SmtpException carries it, msmtp prints the reply of the server to stderr ("server message: 550 ...")
+bool smtp_exception_permanent(const std::runtime_error& e);
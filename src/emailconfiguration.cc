@@ -22,8 +22,21 @@
 /// Class that is responsible for email configuration
 
 #include "emailconfiguration.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
 #include <fty_common_macros.h>
 #include <fty_common_translation.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <list>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
 
 /* This is what this code is intended to do:
  * - calling TRANSLATE_ME on template returns this kind of JSON:
@@ -65,104 +78,361 @@ Alert description: %s",
 from the rule %s was resolved",                                                                                        \
         "__assetname__", "__rulename__")
 
+#define SUBJECT_DIGEST TRANSLATE_ME("%s alert notifications on %s", "__count__", "__assetname__")
+
+#define BODY_DIGEST TRANSLATE_ME("In the system %s alert changes were detected.", "__count__")
+
 
 // ----------------------------------------------------------------------------
 // static helper functions
 
-static std::string replace_tokens(const std::string& text, const std::string& pattern, const std::string& replacement)
+// translation library is shared by all delivery workers
+static std::mutex s_translation_mutex;
+
+/// placeholders of the templates
+enum class Token
 {
-    std::string result = text;
-    size_t      pos    = 0;
-    while ((pos = result.find(pattern, pos)) != std::string::npos) {
-        result.replace(pos, pattern.length(), replacement);
-        pos += replacement.length();
-    }
-    return result;
-}
+    None,
+    RuleName,
+    AssetName,
+    Description,
+    Priority,
+    Severity,
+    State,
+    Count
+};
+
+static const std::pair<const char*, Token> s_tokens[] = {
+    {"__rulename__", Token::RuleName},
+    {"__assetname__", Token::AssetName},
+    {"__description__", Token::Description},
+    {"__priority__", Token::Priority},
+    {"__severity__", Token::Severity},
+    {"__state__", Token::State},
+    {"__count__", Token::Count},
+};
 
-static std::string s_generateEmailBodyResolved(fty_proto_t* alert, const std::string& extname)
+///  Translated template compiled to the list of segments, each one is literal text followed by a placeholder
+struct AlertTemplate
 {
-    char*       result_char = translation_get_translated_text(BODY_RESOLVED.c_str());
-    std::string result(result_char);
-    zstr_free(&result_char);
+    struct Segment
+    {
+        std::string literal;
+        Token       token;
+    };
 
-    result                       = replace_tokens(result, "__rulename__", fty_proto_rule(alert));
-    result                       = replace_tokens(result, "__assetname__", extname);
-    char*       description_char = translation_get_translated_text(fty_proto_description(alert));
-    std::string description(description_char);
-    zstr_free(&description_char);
-    result = replace_tokens(result, "__description__", description);
-    return result;
-}
+    std::vector<Segment> segments;
+    /// size of all the literals
+    size_t literal_size{0};
+    /// true if __description__ is used, it must be translated
+    bool has_description{false};
+};
 
-static std::string s_generateEmailBodyActive(
-    fty_proto_t* alert, const std::string& priority, const std::string& extname)
+enum
 {
-    char*       result_char = translation_get_translated_text(BODY_ACTIVE.c_str());
-    std::string result(result_char);
-    zstr_free(&result_char);
+    BODY_ACTIVE_TEMPLATE,
+    BODY_RESOLVED_TEMPLATE,
+    SUBJECT_ACTIVE_TEMPLATE,
+    SUBJECT_RESOLVED_TEMPLATE,
+    SUBJECT_DIGEST_TEMPLATE,
+    BODY_DIGEST_TEMPLATE,
+    TEMPLATES_COUNT
+};
 
-    result                       = replace_tokens(result, "__rulename__", fty_proto_rule(alert));
-    result                       = replace_tokens(result, "__assetname__", extname);
-    char*       description_char = translation_get_translated_text(fty_proto_description(alert));
-    std::string description(description_char);
-    zstr_free(&description_char);
-    result = replace_tokens(result, "__description__", description);
-    result = replace_tokens(result, "__priority__", priority);
-    result = replace_tokens(result, "__severity__", fty_proto_severity(alert));
-    result = replace_tokens(result, "__state__", fty_proto_state(alert));
-    return result;
+// templates compiled for the current language, guarded by s_translation_mutex
+static AlertTemplate s_templates[TEMPLATES_COUNT];
+static bool          s_templates_valid = false;
+static std::string   s_templates_language;
+
+static AlertTemplate s_compile(const std::string& text)
+{
+    AlertTemplate tmpl;
+    std::string   literal;
+    size_t        pos = 0;
+    while (pos < text.size()) {
+        size_t start = text.find("__", pos);
+        if (start == std::string::npos) {
+            literal.append(text, pos, std::string::npos);
+            break;
+        }
+        literal.append(text, pos, start - pos);
+
+        Token  token = Token::None;
+        size_t len   = 0;
+        for (const auto& it : s_tokens) {
+            if (text.compare(start, strlen(it.first), it.first) == 0) {
+                token = it.second;
+                len   = strlen(it.first);
+                break;
+            }
+        }
+        if (token == Token::None) {
+            literal.append("__");
+            pos = start + 2;
+            continue;
+        }
+
+        tmpl.literal_size += literal.size();
+        tmpl.has_description |= token == Token::Description;
+        tmpl.segments.push_back({std::move(literal), token});
+        literal.clear();
+        pos = start + len;
+    }
+    tmpl.literal_size += literal.size();
+    tmpl.segments.push_back({std::move(literal), Token::None});
+    return tmpl;
 }
 
-static std::string s_generateEmailSubjectResolved(fty_proto_t* alert, const std::string& extname)
+static std::string s_translate(const std::string& text)
 {
-    char*       result_char = translation_get_translated_text(SUBJECT_RESOLVED.c_str());
-    std::string result(result_char);
+    char*       result_char = translation_get_translated_text(text.c_str());
+    std::string result(result_char ? result_char : "");
     zstr_free(&result_char);
-    result = replace_tokens(result, "__rulename__", fty_proto_rule(alert));
-    result = replace_tokens(result, "__assetname__", extname);
     return result;
 }
 
-static std::string s_generateEmailSubjectActive(
-    fty_proto_t* alert, const std::string& priority, const std::string& extname)
+/// @return compiled template, templates are compiled on first use after change of the language
+static const AlertTemplate& s_template(int which)
 {
-    char*       result_char = translation_get_translated_text(SUBJECT_ACTIVE.c_str());
-    std::string result(result_char);
-    zstr_free(&result_char);
-    result                       = replace_tokens(result, "__rulename__", fty_proto_rule(alert));
-    result                       = replace_tokens(result, "__assetname__", extname);
-    char*       description_char = translation_get_translated_text(fty_proto_description(alert));
-    std::string description(description_char);
-    zstr_free(&description_char);
-    result = replace_tokens(result, "__description__", description);
-    result = replace_tokens(result, "__priority__", priority);
-    result = replace_tokens(result, "__severity__", fty_proto_severity(alert));
-    result = replace_tokens(result, "__state__", fty_proto_state(alert));
+    if (!s_templates_valid) {
+        s_templates[BODY_ACTIVE_TEMPLATE]      = s_compile(s_translate(BODY_ACTIVE));
+        s_templates[BODY_RESOLVED_TEMPLATE]    = s_compile(s_translate(BODY_RESOLVED));
+        s_templates[SUBJECT_ACTIVE_TEMPLATE]   = s_compile(s_translate(SUBJECT_ACTIVE));
+        s_templates[SUBJECT_RESOLVED_TEMPLATE] = s_compile(s_translate(SUBJECT_RESOLVED));
+        s_templates[SUBJECT_DIGEST_TEMPLATE]   = s_compile(s_translate(SUBJECT_DIGEST));
+        s_templates[BODY_DIGEST_TEMPLATE]      = s_compile(s_translate(BODY_DIGEST));
+        s_templates_valid                      = true;
+    }
+    return s_templates[which];
+}
+
+/// render the template in one pass, values are not searched for placeholders
+/// @param alert  alert to be rendered, nullptr for the templates of digest
+static std::string s_render(const AlertTemplate& tmpl, fty_proto_t* alert, const std::string& priority,
+    const std::string& extname, const std::string& count = "")
+{
+    std::string description;
+    if (tmpl.has_description && alert)
+        description = s_translate(fty_proto_description(alert));
+
+    const char* values[] = {
+        "",
+        alert ? fty_proto_rule(alert) : "",
+        extname.c_str(),
+        description.c_str(),
+        priority.c_str(),
+        alert ? fty_proto_severity(alert) : "",
+        alert ? fty_proto_state(alert) : "",
+        count.c_str(),
+    };
+    size_t lengths[sizeof(values) / sizeof(values[0])];
+    for (size_t i = 0; i != sizeof(values) / sizeof(values[0]); i++) {
+        if (!values[i])
+            values[i] = "";
+        lengths[i] = strlen(values[i]);
+    }
+
+    size_t size = tmpl.literal_size;
+    for (const auto& segment : tmpl.segments)
+        size += lengths[static_cast<size_t>(segment.token)];
+
+    std::string result;
+    result.reserve(size);
+    for (const auto& segment : tmpl.segments) {
+        result.append(segment.literal);
+        result.append(values[static_cast<size_t>(segment.token)], lengths[static_cast<size_t>(segment.token)]);
+    }
     return result;
 }
 
+///  LRU of rendered (subject, body) pairs, guarded by s_translation_mutex
+class RenderCache
+{
+public:
+    struct Entry
+    {
+        std::string key;
+        std::string subject;
+        std::string body;
+    };
+
+    /// @return cached entry moved to the front, nullptr if not cached
+    const Entry* find(const std::string& key)
+    {
+        auto it = _index.find(key);
+        if (it == _index.end()) {
+            _misses++;
+            return nullptr;
+        }
+        _hits++;
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return &*it->second;
+    }
+
+    void insert(const std::string& key, const std::string& subject, const std::string& body)
+    {
+        if (_capacity == 0)
+            return;
+        _lru.push_front({key, subject, body});
+        _index[_lru.front().key] = _lru.begin();
+        shrink();
+    }
+
+    void capacity(size_t capacity)
+    {
+        _capacity = capacity;
+        shrink();
+    }
+
+    void clear()
+    {
+        _index.clear();
+        _lru.clear();
+    }
+
+    RenderCacheStats stats() const
+    {
+        return {_hits, _misses, _lru.size()};
+    }
+
+private:
+    void shrink()
+    {
+        while (_lru.size() > _capacity) {
+            _index.erase(_lru.back().key);
+            _lru.pop_back();
+        }
+    }
+
+    std::list<Entry>                                         _lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+    size_t                                                   _capacity{256};
+    uint64_t                                                 _hits{0};
+    uint64_t                                                 _misses{0};
+};
+
+static RenderCache s_render_cache;
+
 // ----------------------------------------------------------------------------
 // header functions
 
 std::string generate_body(fty_proto_t* alert, const std::string& priority, const std::string& extname)
 {
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
     if (streq(fty_proto_state(alert), "RESOLVED")) {
-        return s_generateEmailBodyResolved(alert, extname);
+        return s_render(s_template(BODY_RESOLVED_TEMPLATE), alert, priority, extname);
     }
-    return s_generateEmailBodyActive(alert, priority, extname);
+    return s_render(s_template(BODY_ACTIVE_TEMPLATE), alert, priority, extname);
 }
 
 std::string generate_subject(fty_proto_t* alert, const std::string& priority, const std::string& extname)
 {
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
     if (streq(fty_proto_state(alert), "RESOLVED")) {
-        return s_generateEmailSubjectResolved(alert, extname);
+        return s_render(s_template(SUBJECT_RESOLVED_TEMPLATE), alert, priority, extname);
     }
-    return s_generateEmailSubjectActive(alert, priority, extname);
+    return s_render(s_template(SUBJECT_ACTIVE_TEMPLATE), alert, priority, extname);
 }
 
+void generate_alert(fty_proto_t* alert, const std::string& priority, const std::string& extname, std::string& subject,
+    std::string& body)
+{
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
 
-std::string getIpAddr()
+    const char* fields[] = {fty_proto_rule(alert), extname.c_str(), fty_proto_state(alert), fty_proto_severity(alert),
+        priority.c_str(), fty_proto_description(alert), s_templates_language.c_str()};
+    std::string key;
+    for (const char* field : fields) {
+        key.append(field ? field : "");
+        // fields can not contain NUL, so the key is unambiguous
+        key.push_back('\0');
+    }
+
+    const RenderCache::Entry* entry = s_render_cache.find(key);
+    if (entry) {
+        subject = entry->subject;
+        body    = entry->body;
+        return;
+    }
+
+    bool resolved = streq(fty_proto_state(alert), "RESOLVED");
+    subject = s_render(s_template(resolved ? SUBJECT_RESOLVED_TEMPLATE : SUBJECT_ACTIVE_TEMPLATE), alert, priority,
+        extname);
+    body    = s_render(s_template(resolved ? BODY_RESOLVED_TEMPLATE : BODY_ACTIVE_TEMPLATE), alert, priority, extname);
+    s_render_cache.insert(key, subject, body);
+}
+
+void generate_digest(const std::vector<DigestAlert>& alerts, std::string& subject, std::string& body)
+{
+    // active alerts are listed first
+    std::vector<const DigestAlert*> sorted;
+    for (const auto& it : alerts)
+        sorted.push_back(&it);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const DigestAlert* a, const DigestAlert* b) {
+        return !streq(fty_proto_state(a->alert), "RESOLVED") && streq(fty_proto_state(b->alert), "RESOLVED");
+    });
+
+    std::vector<std::string> bodies;
+    std::set<std::string>    seen;
+    std::string              assets;
+    for (const DigestAlert* it : sorted) {
+        std::string alert_subject, alert_body;
+        generate_alert(it->alert, it->priority, it->extname, alert_subject, alert_body);
+        bodies.push_back(std::move(alert_body));
+        if (seen.insert(it->extname).second)
+            assets += (assets.empty() ? "" : ", ") + it->extname;
+    }
+
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
+    std::string                 count = std::to_string(alerts.size());
+    subject = s_render(s_template(SUBJECT_DIGEST_TEMPLATE), nullptr, "", assets, count);
+    body    = s_render(s_template(BODY_DIGEST_TEMPLATE), nullptr, "", "", count);
+    for (const auto& it : bodies) {
+        body += "\n\n";
+        body += it;
+    }
+}
+
+void emailconfiguration_render_cache_size(size_t size)
+{
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
+    s_render_cache.capacity(size);
+}
+
+RenderCacheStats emailconfiguration_render_cache_stats()
+{
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
+    return s_render_cache.stats();
+}
+
+int emailconfiguration_change_language(const char* language)
+{
+    std::lock_guard<std::mutex> lock(s_translation_mutex);
+    // LOAD is repeated on every change of the configuration, templates are compiled again only for new language
+    if (s_templates_valid && s_templates_language == language)
+        return TE_OK;
+    int rv = translation_change_language(language);
+    if (rv == TE_OK) {
+        s_templates_valid    = false;
+        s_templates_language = language;
+        s_render_cache.clear();
+    }
+    return rv;
+}
+
+// how often is rtnetlink checked for changes (or the address refreshed if rtnetlink is not available)
+#define IP_ADDR_CHECK_MS 1000
+
+static std::mutex               s_ip_mutex;
+static std::vector<std::string> s_ip_interfaces{"eth0", "LAN1"};
+static std::string              s_ip_addr;
+static bool                     s_ip_valid = false;
+static int                      s_ip_netlink = -1;
+static bool                     s_ip_netlink_tried = false;
+static uint64_t                 s_ip_lookups = 0;
+static std::chrono::steady_clock::time_point s_ip_checked;
+
+static std::string s_ip_addr_lookup()
 {
     std::string     ipAddr       = "From: ";
     struct ifaddrs* ifAddrStruct = NULL;
@@ -180,7 +450,7 @@ std::string getIpAddr()
             tmpAddrPtr = &(reinterpret_cast<struct sockaddr_in*>(ifa->ifa_addr))->sin_addr;
             char addressBuffer[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, tmpAddrPtr, addressBuffer, INET_ADDRSTRLEN);
-            if (strcmp(ifa->ifa_name, "eth0") == 0 || strcmp(ifa->ifa_name, "LAN1") == 0) {
+            if (std::find(s_ip_interfaces.begin(), s_ip_interfaces.end(), ifa->ifa_name) != s_ip_interfaces.end()) {
                 ipAddr.append(addressBuffer);
                 break;
             }
@@ -192,3 +462,100 @@ std::string getIpAddr()
 
     return ipAddr;
 }
+
+/// subscribe to rtnetlink notifications about IPv4 addresses and links
+static int s_ip_netlink_open()
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd == -1)
+        return -1;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_LINK;
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// @return true if rtnetlink reported a change (or notifications were lost)
+static bool s_ip_netlink_changed()
+{
+    bool changed = false;
+    char buffer[8192];
+    for (;;) {
+        ssize_t r = recv(s_ip_netlink, buffer, sizeof(buffer), 0);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            // ENOBUFS means messages were dropped, anything could change
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                changed = true;
+            break;
+        }
+        for (struct nlmsghdr* nh = reinterpret_cast<struct nlmsghdr*>(buffer); NLMSG_OK(nh, size_t(r));
+             nh                  = NLMSG_NEXT(nh, r)) {
+            if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR || nh->nlmsg_type == RTM_NEWLINK ||
+                nh->nlmsg_type == RTM_DELLINK)
+                changed = true;
+        }
+    }
+    return changed;
+}
+
+std::string getIpAddr()
+{
+    std::lock_guard<std::mutex> lock(s_ip_mutex);
+
+    auto now = std::chrono::steady_clock::now();
+    if (s_ip_valid && now - s_ip_checked >= std::chrono::milliseconds(IP_ADDR_CHECK_MS)) {
+        // without rtnetlink the address is simply refreshed
+        s_ip_valid   = s_ip_netlink != -1 && !s_ip_netlink_changed();
+        s_ip_checked = now;
+    }
+
+    if (!s_ip_valid) {
+        // subscribe before the lookup, so that no change is missed
+        if (!s_ip_netlink_tried) {
+            s_ip_netlink       = s_ip_netlink_open();
+            s_ip_netlink_tried = true;
+        }
+        s_ip_addr    = s_ip_addr_lookup();
+        s_ip_valid   = true;
+        s_ip_lookups++;
+        s_ip_checked = now;
+    }
+    return s_ip_addr;
+}
+
+void emailconfiguration_ip_interfaces(const std::vector<std::string>& interfaces)
+{
+    std::lock_guard<std::mutex> lock(s_ip_mutex);
+    if (interfaces == s_ip_interfaces)
+        return;
+    s_ip_interfaces = interfaces;
+    s_ip_valid      = false;
+}
+
+void emailconfiguration_ip_interfaces(const std::string& interfaces)
+{
+    std::vector<std::string> list;
+    std::stringstream        ss(interfaces);
+    std::string              interface;
+    while (std::getline(ss, interface, ',')) {
+        interface.erase(0, interface.find_first_not_of(" \t"));
+        interface.erase(interface.find_last_not_of(" \t") + 1);
+        if (!interface.empty())
+            list.push_back(interface);
+    }
+    emailconfiguration_ip_interfaces(list);
+}
+
+IpAddrStats emailconfiguration_ip_addr_stats()
+{
+    std::lock_guard<std::mutex> lock(s_ip_mutex);
+    return IpAddrStats{s_ip_lookups, s_ip_netlink != -1};
+}
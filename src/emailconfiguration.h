@@ -23,13 +23,66 @@
 
 #include <fty_proto.h>
 #include <string>
+#include <vector>
 
 std::string generate_body(fty_proto_t* alert, const std::string& priority, const std::string& extname);
 
 std::string generate_subject(fty_proto_t* alert, const std::string& priority, const std::string& extname);
 
+/// render subject and body of the alert notification
+/// Rendered pairs are kept in LRU cache keyed by rule, asset, state, severity, priority, description and language,
+/// so the same alert sent to N contacts is rendered once.
+void generate_alert(fty_proto_t* alert, const std::string& priority, const std::string& extname, std::string& subject,
+    std::string& body);
+
+/// one alert of the digest
+struct DigestAlert
+{
+    fty_proto_t* alert;
+    std::string  priority;
+    std::string  extname;
+};
+
+/// render subject and body of the digest email listing several alert notifications, active alerts first
+void generate_digest(const std::vector<DigestAlert>& alerts, std::string& subject, std::string& body);
+
+struct RenderCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    size_t   size;
+};
+
+/// set capacity of the render cache, 0 disables it
+void emailconfiguration_render_cache_size(size_t size);
+
+/// @return counters of the render cache
+RenderCacheStats emailconfiguration_render_cache_stats();
+
+/// @return "From: <ip address>\r\n" line prepended to the emails, address of the first configured interface found
+/// The value is cached and refreshed when rtnetlink reports change of addresses or links.
 std::string getIpAddr();
 
+/// set the interfaces whose address is used by getIpAddr (default eth0 and LAN1)
+void emailconfiguration_ip_interfaces(const std::vector<std::string>& interfaces);
+
+/// set the interfaces from comma separated list ("eth0, LAN1"), blanks around the names are ignored
+void emailconfiguration_ip_interfaces(const std::string& interfaces);
+
+struct IpAddrStats
+{
+    /// lookups of the address, each miss of the cache
+    uint64_t lookups;
+    /// changes are reported by rtnetlink, otherwise the address is refreshed by timer
+    bool netlink;
+};
+
+/// @return counters of the getIpAddr cache
+IpAddrStats emailconfiguration_ip_addr_stats();
+
+/// change language of the translations, serialized with generate_body/generate_subject running in delivery workers
+int emailconfiguration_change_language(const char* language);
+
 void emailconfiguration_test(bool verbose);
 
 
@@ -0,0 +1,132 @@
+/*  =========================================================================
+    fty_email_digest - Digest of alert notifications
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_digest - Digest of alert notifications
+@discuss
+    During power events one device raises dozens of alerts within seconds, the contact gets one email listing them.
+@end
+*/
+
+#include "fty_email_digest.h"
+#include <fty_log.h>
+
+/// @return frame of the message as a string, message is not modified
+static std::string s_frame(zmsg_t* msg, size_t index)
+{
+    zframe_t* frame = zmsg_first(msg);
+    for (size_t i = 0; frame != nullptr && i != index; i++)
+        frame = zmsg_next(msg);
+    if (!frame)
+        return "";
+    return std::string(reinterpret_cast<const char*>(zframe_data(frame)), zframe_size(frame));
+}
+
+AlertDigest::AlertDigest()
+    : _window_ms(0)
+    , _max_alerts(50)
+{
+}
+
+void AlertDigest::configure(int64_t window_ms, size_t max_alerts)
+{
+    _window_ms  = window_ms;
+    _max_alerts = max_alerts < 2 ? 2 : max_alerts;
+}
+
+bool AlertDigest::add(std::unique_ptr<EmailJob>& job, int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& ready)
+{
+    if (!enabled() || job->subject != "SENDMAIL_ALERT" || !job->msg)
+        return false;
+
+    // SENDMAIL_ALERT is [priority|extname|contact|alert]
+    std::string priority = s_frame(job->msg, 0);
+    std::string extname  = s_frame(job->msg, 1);
+    std::string contact  = s_frame(job->msg, 2);
+    if (priority == "1" || priority.empty() || extname.empty() || contact.empty())
+        return false;
+
+    Bucket& bucket = _buckets[contact];
+    if (bucket.jobs.empty())
+        bucket.since = now_ms;
+    bucket.jobs.push_back(std::move(job));
+
+    if (bucket.jobs.size() >= _max_alerts) {
+        ready.push_back(release(bucket));
+        _buckets.erase(contact);
+    }
+    return true;
+}
+
+void AlertDigest::expired(int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& ready)
+{
+    for (auto it = _buckets.begin(); it != _buckets.end();) {
+        if (it->second.since + _window_ms <= now_ms) {
+            ready.push_back(release(it->second));
+            it = _buckets.erase(it);
+        } else
+            ++it;
+    }
+}
+
+void AlertDigest::flush(std::vector<std::unique_ptr<EmailJob>>& ready)
+{
+    for (auto& it : _buckets)
+        ready.push_back(release(it.second));
+    _buckets.clear();
+}
+
+int64_t AlertDigest::next_due() const
+{
+    int64_t due = -1;
+    for (const auto& it : _buckets) {
+        if (due == -1 || it.second.since + _window_ms < due)
+            due = it.second.since + _window_ms;
+    }
+    return due;
+}
+
+size_t AlertDigest::held() const
+{
+    size_t held = 0;
+    for (const auto& it : _buckets)
+        held += it.second.jobs.size();
+    return held;
+}
+
+std::unique_ptr<EmailJob> AlertDigest::release(Bucket& bucket)
+{
+    if (bucket.jobs.size() == 1)
+        return std::move(bucket.jobs.front());
+
+    // all the alerts are for one contact, so in one shard
+    std::unique_ptr<EmailJob> digest{new EmailJob};
+    digest->subject   = DIGEST_SUBJECT;
+    digest->agent     = bucket.jobs.front()->agent;
+    digest->uuid      = bucket.jobs.front()->uuid;
+    digest->shard_key = bucket.jobs.front()->shard_key;
+    digest->msg       = zmsg_new();
+    digest->parts     = std::move(bucket.jobs);
+    log_debug("%s:\tdigest of %zu alerts for %s", digest->agent.c_str(), digest->parts.size(),
+        s_frame(digest->parts.front()->msg, 2).c_str());
+    return digest;
+}
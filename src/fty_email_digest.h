@@ -0,0 +1,86 @@
+/*  =========================================================================
+    fty_email_digest - Digest of alert notifications
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "fty_email_worker.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// subject of the job delivering the digest, the original requests are its parts
+#define DIGEST_SUBJECT "SENDMAIL_DIGEST"
+
+///  @class AlertDigest
+///
+///  Coalesces SENDMAIL_ALERT requests for the same contact into one email
+///
+///  Requests are held per contact for the window (since the first one) or until max_alerts of them are held, then
+///  they are released as one DIGEST_SUBJECT job, whose parts are the original requests. Each part is replied with
+///  the result of the digest. P1 alerts and requests which can not be delivered (missing contact, asset or
+///  priority) bypass the digest, as well as a contact with single request in the window.
+class AlertDigest
+{
+public:
+    AlertDigest();
+
+    /// @param window_ms   how long are the requests held, 0 disables the digest
+    /// @param max_alerts  number of requests which releases the digest before the window ends
+    void configure(int64_t window_ms, size_t max_alerts);
+
+    /// @return true if the digest is enabled
+    bool enabled() const
+    {
+        return _window_ms > 0;
+    }
+
+    /// hold the job if it belongs to the digest
+    /// @param now_ms  monotonic time
+    /// @param ready   the digest of the contact if max_alerts was reached
+    /// @return true if the job was taken
+    bool add(std::unique_ptr<EmailJob>& job, int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& ready);
+
+    /// release the digests whose window ended
+    void expired(int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& ready);
+
+    /// release all the digests
+    void flush(std::vector<std::unique_ptr<EmailJob>>& ready);
+
+    /// @return monotonic time when the next digest is released, -1 if nothing is held
+    int64_t next_due() const;
+
+    /// @return number of held requests
+    size_t held() const;
+
+protected:
+    struct Bucket
+    {
+        int64_t                                since;
+        std::vector<std::unique_ptr<EmailJob>> jobs;
+    };
+
+    std::unique_ptr<EmailJob> release(Bucket& bucket);
+
+    int64_t                       _window_ms;
+    size_t                        _max_alerts;
+    std::map<std::string, Bucket> _buckets;
+};
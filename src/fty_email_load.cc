@@ -0,0 +1,476 @@
+/*  =========================================================================
+    fty_email_load - Load generator of the email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_load - Load generator of the email actor
+@discuss
+    Requests are sent open loop: client i sends its n-th request at start + n * clients / rate, unless it already
+    waits for window replies. Emails are delivered to the sendmail_set_test_fn hook (actor command _MSMTP_TEST),
+    which forwards them to a sink mailbox drained by a thread of the generator.
+@end
+*/
+
+#include "fty_email_load.h"
+#include "fty_email.h"
+#include "fty_email_server.h"
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <fty_common_mlm.h>
+#include <fty_common_translation.h>
+#include <fty_log.h>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+// LoadStats, LoadReport
+
+const char* load_kind_name(LoadKind kind)
+{
+    switch (kind) {
+        case LoadKind::SENDMAIL:
+            return "SENDMAIL";
+        case LoadKind::SENDMAIL_ALERT:
+            return "SENDMAIL_ALERT";
+        case LoadKind::SENDSMS_ALERT:
+            return "SENDSMS_ALERT";
+    }
+    return "";
+}
+
+void LoadStats::merge(const LoadStats& other)
+{
+    sent += other.sent;
+    ok += other.ok;
+    failed += other.failed;
+    superseded += other.superseded;
+    lost += other.lost;
+    latency.merge(other.latency);
+}
+
+LoadStats LoadReport::total() const
+{
+    LoadStats ret;
+    for (const auto& it : kinds)
+        ret.merge(it);
+    return ret;
+}
+
+double LoadReport::throughput() const
+{
+    LoadStats all = total();
+    return elapsed > 0 ? double(all.ok + all.failed + all.superseded) / elapsed : 0;
+}
+
+static void s_print_json(std::ostream& out, const LoadStats& stats)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        "{\"sent\": %" PRIu64 ", \"ok\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"superseded\": %" PRIu64
+        ", \"lost\": %" PRIu64 ", \"latency_us\": {\"min\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64
+        ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}}",
+        stats.sent, stats.ok, stats.failed, stats.superseded, stats.lost, stats.latency.min(), stats.latency.mean(),
+        stats.latency.percentile(50), stats.latency.percentile(90), stats.latency.percentile(99),
+        stats.latency.percentile(99.9), stats.latency.max());
+    out << buf;
+}
+
+static void s_print_row(std::ostream& out, const char* name, const LoadStats& stats)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+        "%-15s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10" PRIu64 " %6" PRIu64 " %9.3f %9.3f %9.3f %9.3f\n", name,
+        stats.sent, stats.ok, stats.failed, stats.superseded, stats.lost, double(stats.latency.percentile(50)) / 1000,
+        double(stats.latency.percentile(90)) / 1000, double(stats.latency.percentile(99)) / 1000,
+        double(stats.latency.max()) / 1000);
+    out << buf;
+}
+
+void LoadReport::print(std::ostream& out, bool json) const
+{
+    LoadStats all = total();
+    char      buf[256];
+    if (json) {
+        snprintf(buf, sizeof(buf),
+            "{\"elapsed\": %.3f, \"send_time\": %.3f, \"rate\": %.1f, \"throughput\": %.1f, \"delivered\": %" PRIu64
+            ", \"kinds\": {",
+            elapsed, send_time, send_time > 0 ? double(all.sent) / send_time : 0, throughput(), delivered);
+        out << buf;
+        const char* sep = "";
+        for (LoadKind kind : LOAD_KINDS) {
+            if (kinds[int(kind)].sent == 0)
+                continue;
+            out << sep << "\"" << load_kind_name(kind) << "\": ";
+            s_print_json(out, kinds[int(kind)]);
+            sep = ", ";
+        }
+        out << "}, \"total\": ";
+        s_print_json(out, all);
+        out << "}" << std::endl;
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%-15s %8s %8s %8s %10s %6s %9s %9s %9s %9s\n", "request", "sent", "ok", "failed",
+        "superseded", "lost", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    out << buf;
+    for (LoadKind kind : LOAD_KINDS) {
+        if (kinds[int(kind)].sent != 0)
+            s_print_row(out, load_kind_name(kind), kinds[int(kind)]);
+    }
+    s_print_row(out, "total", all);
+    snprintf(buf, sizeof(buf),
+        "elapsed %.3f s, sent %.1f requests/s, throughput %.1f replies/s, delivered %" PRIu64 " emails\n", elapsed,
+        send_time > 0 ? double(all.sent) / send_time : 0, throughput(), delivered);
+    out << buf;
+}
+
+// ----------------------------------------------------------------------------
+// EmailLoadGenerator
+
+static const char* LOAD_RECIPIENT = "loadgen@example.com";
+static const char* LOAD_PHONE     = "+1 555 0100";
+static const char* LOAD_SINK      = "fty-email-loadgen-sink";
+
+/// text of given size, lines of 72 characters
+static std::string s_body(size_t size)
+{
+    static const char line[] = "The quick brown fox jumps over the lazy dog, load generator of fty-email.";
+    std::string       ret;
+    ret.reserve(size);
+    while (ret.size() < size) {
+        size_t len = std::min(sizeof(line) - 2, size - ret.size());
+        ret.append(line, len);
+        if (ret.size() < size)
+            ret.push_back('\n');
+    }
+    return ret;
+}
+
+EmailLoadGenerator::EmailLoadGenerator(const LoadOptions& options)
+    : _options(options)
+{
+    static std::atomic<unsigned> instance{0};
+
+    if (_options.clients == 0)
+        _options.clients = 1;
+    if (_options.window == 0)
+        _options.window = 1;
+    if (_options.body_sizes.empty())
+        _options.body_sizes.push_back(0);
+    if (_options.attachment_sizes.empty())
+        _options.attachment_sizes.push_back(0);
+    if (_options.mix[0] + _options.mix[1] + _options.mix[2] == 0)
+        _options.mix[0] = 1;
+
+    _endpoint = "inproc://fty-email-loadgen-" + std::to_string(getpid()) + "-" + std::to_string(instance++);
+    _address  = FTY_EMAIL_ADDRESS;
+
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/fty-email-loadgen.XXXXXX";
+    if (!mkdtemp(&dir[0]))
+        throw std::runtime_error("Can't create directory " + dir + ": " + strerror(errno));
+    _dir = dir;
+
+    for (size_t size : _options.body_sizes)
+        _bodies.push_back(s_body(size));
+
+    // random content, attachments take the base64 path
+    std::mt19937 rng(_options.seed);
+    for (size_t size : _options.attachment_sizes) {
+        if (size == 0 || access(attachment(size).c_str(), F_OK) == 0)
+            continue;
+        std::string data(size, '\0');
+        for (auto& it : data)
+            it = char(rng());
+        std::ofstream file(attachment(size), std::ios::binary);
+        file.write(data.data(), std::streamsize(data.size()));
+        if (!file)
+            throw std::runtime_error("Can't write " + attachment(size));
+    }
+}
+
+EmailLoadGenerator::~EmailLoadGenerator()
+{
+    for (size_t size : _options.attachment_sizes) {
+        if (size != 0)
+            unlink(attachment(size).c_str());
+    }
+    unlink((_dir + "/fty-email.cfg").c_str());
+    rmdir(_dir.c_str());
+}
+
+std::string EmailLoadGenerator::attachment(size_t size) const
+{
+    return _dir + "/attachment-" + std::to_string(size) + ".bin";
+}
+
+/// send one request of the kind, message is destroyed
+/// @return true if the broker accepted it
+static bool s_send(mlm_client_t* client, const std::string& address, LoadKind kind, const std::string& uuid,
+    const std::string& body, const std::string& attachment)
+{
+    zmsg_t* msg = nullptr;
+    if (kind == LoadKind::SENDMAIL) {
+        msg = fty_email_encode(uuid.c_str(), LOAD_RECIPIENT, "fty-email-loadgen", nullptr, body.c_str(), nullptr);
+        if (!attachment.empty())
+            zmsg_addstr(msg, attachment.c_str());
+    } else {
+        // unique asset, so no queued alert is superseded by another
+        std::string asset   = "loadgen-" + uuid;
+        zlist_t*    actions = zlist_new();
+        zlist_append(actions, const_cast<char*>(kind == LoadKind::SENDSMS_ALERT ? "SMS" : "EMAIL"));
+        msg = fty_proto_encode_alert(nullptr, uint64_t(time(nullptr)), 600, ("load@" + asset).c_str(), asset.c_str(),
+            "ACTIVE", "CRITICAL", body.c_str(), actions);
+        zlist_destroy(&actions);
+        zmsg_pushstr(msg, kind == LoadKind::SENDSMS_ALERT ? LOAD_PHONE : LOAD_RECIPIENT);
+        zmsg_pushstr(msg, asset.c_str());
+        zmsg_pushstr(msg, "1");
+        zmsg_pushstr(msg, uuid.c_str());
+    }
+    return mlm_client_sendto(client, address.c_str(), load_kind_name(kind), nullptr, 1000, &msg) != -1;
+}
+
+void EmailLoadGenerator::client(size_t index, size_t requests, ClientResult& result)
+{
+    struct Pending
+    {
+        LoadKind          kind;
+        Clock::time_point start;
+    };
+
+    auto since_start = [this](Clock::time_point time) {
+        return std::chrono::duration<double>(time - _start).count();
+    };
+
+    mlm_client_t* client  = mlm_client_new();
+    std::string   address = "fty-email-loadgen-" + std::to_string(index);
+    if (mlm_client_connect(client, _endpoint.c_str(), 1000, address.c_str()) == -1) {
+        log_error("%s: can't connect to %s", address.c_str(), _endpoint.c_str());
+        mlm_client_destroy(&client);
+        return;
+    }
+    zpoller_t* poller = zpoller_new(mlm_client_msgpipe(client), nullptr);
+
+    std::mt19937                         rng(_options.seed + unsigned(index));
+    std::discrete_distribution<int>      kinds({double(_options.mix[0]), double(_options.mix[1]), double(_options.mix[2])});
+    std::uniform_int_distribution<size_t> bodies(0, _bodies.size() - 1);
+    std::uniform_int_distribution<size_t> attachments(0, _options.attachment_sizes.size() - 1);
+
+    std::map<std::string, Pending> pending;
+    Clock::duration                interval = Clock::duration::zero();
+    if (_options.rate > 0)
+        interval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(double(_options.clients) / _options.rate));
+    Clock::time_point next     = _start;
+    Clock::time_point progress = Clock::now();
+    size_t            sent     = 0;
+
+    while (sent < requests || !pending.empty()) {
+        Clock::time_point now      = Clock::now();
+        bool              can_send = sent < requests && pending.size() < _options.window;
+        if (can_send && now >= next) {
+            LoadKind    kind = LoadKind(kinds(rng));
+            std::string uuid = "loadgen-" + std::to_string(index) + "-" + std::to_string(sent);
+            size_t      size = _options.attachment_sizes[attachments(rng)];
+            std::string file = kind == LoadKind::SENDMAIL && size != 0 ? attachment(size) : "";
+
+            result.kinds[int(kind)].sent++;
+            Clock::time_point start = Clock::now();
+            if (s_send(client, _address, kind, uuid, _bodies[bodies(rng)], file))
+                pending[uuid] = {kind, start};
+            else
+                result.kinds[int(kind)].failed++;
+            sent++;
+            next += interval;
+            progress         = Clock::now();
+            result.last_send = since_start(progress);
+            continue;
+        }
+
+        int wait = 100;
+        if (can_send)
+            wait = int(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count()) + 1;
+        if (zpoller_wait(poller, wait)) {
+            zmsg_t*           reply   = mlm_client_recv(client);
+            Clock::time_point now2    = Clock::now();
+            std::string       subject = mlm_client_subject(client) ? mlm_client_subject(client) : "";
+            ZstrGuard         uuid(zmsg_popstr(reply));
+            ZstrGuard         status(zmsg_popstr(reply));
+            auto              it = uuid.get() ? pending.find(uuid.get()) : pending.end();
+            if (it != pending.end()) {
+                LoadStats& stats = result.kinds[int(it->second.kind)];
+                stats.latency.record(
+                    uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now2 - it->second.start).count()));
+                if (it->second.kind == LoadKind::SENDMAIL && subject == "SENDMAIL-OK")
+                    stats.ok++;
+                else if (it->second.kind == LoadKind::SENDMAIL)
+                    stats.failed++;
+                else if (status.get() && streq(status.get(), "OK"))
+                    stats.ok++;
+                else if (status.get() && streq(status.get(), "SUPERSEDED"))
+                    stats.superseded++;
+                else
+                    stats.failed++;
+                pending.erase(it);
+                progress          = now2;
+                result.last_reply = since_start(now2);
+            } else
+                log_warning("%s: unexpected %s reply %s", address.c_str(), subject.c_str(), uuid.get());
+            zmsg_destroy(&reply);
+        } else if (zpoller_terminated(poller)) {
+            break;
+        } else if (!can_send && Clock::now() - progress > std::chrono::seconds(_options.timeout)) {
+            log_error("%s: no reply for %d s, %zu requests lost", address.c_str(), _options.timeout, pending.size());
+            break;
+        }
+    }
+
+    for (const auto& it : pending)
+        result.kinds[int(it.second.kind)].lost++;
+    zpoller_destroy(&poller);
+    mlm_client_destroy(&client);
+}
+
+/// drain emails passed to the test hook
+static void s_sink(const std::string& endpoint, std::atomic<bool>& stop, std::atomic<uint64_t>& delivered)
+{
+    mlm_client_t* sink = mlm_client_new();
+    if (mlm_client_connect(sink, endpoint.c_str(), 1000, LOAD_SINK) == -1) {
+        log_error("%s: can't connect to %s", LOAD_SINK, endpoint.c_str());
+        mlm_client_destroy(&sink);
+        return;
+    }
+    zpoller_t* poller = zpoller_new(mlm_client_msgpipe(sink), nullptr);
+    while (true) {
+        if (zpoller_wait(poller, 100)) {
+            zmsg_t* msg = mlm_client_recv(sink);
+            zmsg_destroy(&msg);
+            delivered++;
+        } else if (zpoller_terminated(poller) || stop)
+            break;
+    }
+    zpoller_destroy(&poller);
+    mlm_client_destroy(&sink);
+}
+
+LoadReport EmailLoadGenerator::run()
+{
+    if (!_options.translations.empty()) {
+        size_t      slash  = _options.translations.rfind('/');
+        std::string dir    = slash == std::string::npos ? "." : _options.translations.substr(0, slash);
+        std::string prefix = slash == std::string::npos ? _options.translations : _options.translations.substr(slash + 1);
+        if (translation_initialize(FTY_EMAIL_ADDRESS, dir.c_str(), prefix.c_str()) != TE_OK)
+            log_warning("Translation not initialized from %s", _options.translations.c_str());
+    }
+
+    zactor_t* broker = zactor_new(mlm_server, const_cast<char*>("Malamute-loadgen"));
+    if (!broker)
+        throw std::runtime_error("Can't start malamute broker");
+    zstr_sendx(broker, "BIND", _endpoint.c_str(), nullptr);
+
+    // actor configuration, options override the defaults
+    std::map<std::string, std::string> values = {{"malamute/endpoint", _endpoint}, {"malamute/address", _address},
+        {"smtp/gwtemplate", "0#####@sms.example.com"}, {"smtp/from", "fty-email-loadgen@example.com"}};
+    if (!_options.smtp.empty()) {
+        size_t colon             = _options.smtp.rfind(':');
+        values["smtp/server"]    = _options.smtp.substr(0, colon);
+        values["smtp/port"]      = colon == std::string::npos ? "25" : _options.smtp.substr(colon + 1);
+        values["smtp/transport"] = "native";
+    }
+    for (const auto& it : _options.config)
+        values[it.first] = it.second;
+    zconfig_t* config = zconfig_new("root", nullptr);
+    for (const auto& it : values)
+        zconfig_put(config, it.first.c_str(), it.second.c_str());
+    std::string config_file = _dir + "/fty-email.cfg";
+    zconfig_save(config, config_file.c_str());
+    zconfig_destroy(&config);
+
+    zactor_t* actor = zactor_new(fty_email_server, nullptr);
+    if (!actor) {
+        zactor_destroy(&broker);
+        throw std::runtime_error("Can't start fty_email_server");
+    }
+    zstr_sendx(actor, "LOAD", config_file.c_str(), nullptr);
+    if (_options.smtp.empty())
+        zstr_sendx(actor, "_MSMTP_TEST", LOAD_SINK, nullptr);
+
+    std::atomic<bool>     stop{false};
+    std::atomic<uint64_t> delivered{0};
+    std::thread           sink;
+    if (_options.smtp.empty())
+        sink = std::thread(s_sink, _endpoint, std::ref(stop), std::ref(delivered));
+
+    // one request waits for the actor to be ready, it is not counted
+    bool ready = false;
+    {
+        ClientResult probe;
+        _start = Clock::now();
+        client(_options.clients, 1, probe);
+        ready = probe.kinds[0].ok + probe.kinds[1].ok + probe.kinds[2].ok == 1;
+    }
+    if (!ready) {
+        stop = true;
+        if (sink.joinable())
+            sink.join();
+        zactor_destroy(&actor);
+        zactor_destroy(&broker);
+        throw std::runtime_error("fty_email_server doesn't deliver emails");
+    }
+
+    std::vector<ClientResult> results(_options.clients);
+    std::vector<std::thread>  threads;
+    _start = Clock::now();
+    for (size_t i = 0; i != _options.clients; i++) {
+        size_t requests = _options.requests / _options.clients + (i < _options.requests % _options.clients ? 1 : 0);
+        threads.emplace_back(&EmailLoadGenerator::client, this, i, requests, std::ref(results[i]));
+    }
+    for (auto& it : threads)
+        it.join();
+
+    LoadReport report;
+    for (const auto& result : results) {
+        for (int i = 0; i != 3; i++)
+            report.kinds[i].merge(result.kinds[i]);
+        report.send_time = std::max(report.send_time, result.last_send);
+        report.elapsed   = std::max(report.elapsed, result.last_reply);
+    }
+
+    // emails are passed to the sink before the reply is sent, but by another connection
+    if (sink.joinable()) {
+        uint64_t          expected = report.total().ok + 1;
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(1);
+        while (delivered < expected && Clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        stop = true;
+        sink.join();
+        // minus the probe
+        report.delivered = delivered ? delivered - 1 : 0;
+    }
+
+    zactor_destroy(&actor);
+    zactor_destroy(&broker);
+    return report;
+}
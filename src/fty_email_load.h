@@ -0,0 +1,149 @@
+/*  =========================================================================
+    fty_email_load - Load generator of the email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "fty_email_metrics.h"
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// request sent by the load generator
+enum class LoadKind
+{
+    SENDMAIL,
+    SENDMAIL_ALERT,
+    SENDSMS_ALERT
+};
+
+static const LoadKind LOAD_KINDS[] = {LoadKind::SENDMAIL, LoadKind::SENDMAIL_ALERT, LoadKind::SENDSMS_ALERT};
+
+/// @return subject of the request
+const char* load_kind_name(LoadKind kind);
+
+struct LoadOptions
+{
+    size_t   clients  = 4;    ///< number of client mailboxes, each sends from its own thread
+    size_t   requests = 1000; ///< number of requests of all clients
+    double   rate     = 100;  ///< requests per second of all clients, 0 sends as fast as window allows
+    size_t   window   = 64;   ///< maximum of requests of one client waiting for reply
+    int      timeout  = 30;   ///< seconds to wait for replies after the last request was sent
+    unsigned seed     = 1;    ///< seed of the random choice of request kind, body and attachment
+
+    /// weights of request kinds, indexed by LoadKind
+    unsigned mix[3] = {1, 0, 0};
+    /// sizes of SENDMAIL bodies and alert descriptions, picked with equal probability
+    std::vector<size_t> body_sizes{1024};
+    /// sizes of files attached to SENDMAIL, 0 is no attachment, picked with equal probability
+    std::vector<size_t> attachment_sizes{0};
+
+    /// host:port of SMTP server the emails are delivered to (native transport), if empty emails are passed to
+    /// sendmail_set_test_fn hook and drained by a sink mailbox, so nothing leaves the process
+    std::string smtp;
+    /// translations of alert templates as directory/prefix, for example test/conf/test_
+    std::string translations;
+    /// additional configuration of the actor (server/workers, smtp/chunking, ...), see fty_email_server.h
+    std::map<std::string, std::string> config;
+};
+
+struct LoadStats
+{
+    uint64_t         sent       = 0;
+    uint64_t         ok         = 0;
+    uint64_t         failed     = 0; ///< SENDMAIL-ERR, ERROR or SUPPRESSED reply, request not accepted by broker
+    uint64_t         superseded = 0;
+    uint64_t         lost       = 0; ///< no reply until timeout
+    Histogram        latency;        ///< enqueue to reply, microseconds
+
+    void merge(const LoadStats& other);
+};
+
+struct LoadReport
+{
+    double    elapsed   = 0; ///< seconds from the first request to the last reply
+    double    send_time = 0; ///< seconds from the first to the last request
+    uint64_t  delivered = 0; ///< emails which reached the sink (test hook only)
+    LoadStats kinds[3];      ///< indexed by LoadKind
+
+    LoadStats total() const;
+
+    /// @return replies per second
+    double throughput() const;
+
+    /// print table of results, or JSON object if json is true
+    void print(std::ostream& out, bool json = false) const;
+};
+
+///  @class EmailLoadGenerator
+///
+///  Starts in-process malamute broker, fty_email_server actor and client mailboxes sending requests at given rate
+///
+///  The actor is configured to deliver the emails to test hook (or to local SMTP sink), the whole run is offline.
+///  Latency is measured from mlm_client_sendto of the request to the reception of its reply. Request waiting
+///  for free slot of the window is sent late, so the achieved rate (sent / send_time) is to be checked.
+///
+///  Example:
+///
+///     LoadOptions opts;
+///     opts.rate = 500;
+///     EmailLoadGenerator gen(opts);
+///     LoadReport report = gen.run();
+///     report.print(std::cout);
+class EmailLoadGenerator
+{
+public:
+    /// @throw std::runtime_error if temporary files can't be created
+    explicit EmailLoadGenerator(const LoadOptions& options);
+    ~EmailLoadGenerator();
+
+    EmailLoadGenerator(const EmailLoadGenerator&) = delete;
+    EmailLoadGenerator& operator=(const EmailLoadGenerator&) = delete;
+
+    /// start broker and actor, send all the requests and wait for their replies, stop broker and actor
+    /// @throw std::runtime_error if broker or actor can't be started
+    LoadReport run();
+
+    /// @return path of attachment of given size
+    std::string attachment(size_t size) const;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    /// statistics of one client, times are relative to the start of the run
+    struct ClientResult
+    {
+        LoadStats kinds[3];
+        double    last_send  = 0;
+        double    last_reply = 0;
+    };
+
+    void client(size_t index, size_t requests, ClientResult& result);
+
+    LoadOptions              _options;
+    std::string              _dir;
+    std::string              _endpoint;
+    std::string              _address;
+    std::vector<std::string> _bodies;
+    Clock::time_point        _start;
+};
@@ -0,0 +1,203 @@
+/*  =========================================================================
+    fty_email_loadgen - Load generator of fty-email
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_loadgen - Load generator of fty-email
+@discuss
+
+    Usage:
+    fty-email-loadgen -c 8 -n 10000 -r 500 -m 8:1:1 -b 512,4096 -a 0,0,0,1048576
+
+    Runs its own malamute broker and fty_email_server actor, no other agent is needed and no email leaves the
+    process unless --smtp is given. See fty_email_load.h.
+
+@end
+*/
+
+#include "fty_email.h"
+#include "fty_email_load.h"
+#include <fty/convert.h>
+#include <fty_log.h>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+
+#define TRANSLATION_PATH "/usr/share/etn-translations/locale_"
+
+void usage()
+{
+    puts(
+        "Usage: fty-email-loadgen [options]\n"
+        "  -c|--clients          number of client mailboxes [4]\n"
+        "  -n|--requests         number of requests of all clients [1000]\n"
+        "  -r|--rate             requests per second of all clients, 0 as fast as possible [100]\n"
+        "  -w|--window           maximum of requests of one client waiting for reply [64]\n"
+        "  -m|--mix              weights of SENDMAIL:SENDMAIL_ALERT:SENDSMS_ALERT requests [1:0:0]\n"
+        "  -b|--body             comma separated sizes of bodies [1024]\n"
+        "  -a|--attachment       comma separated sizes of SENDMAIL attachments, 0 is none [0]\n"
+        "  -s|--smtp             host:port of SMTP sink, emails are passed to test hook if not given\n"
+        "  -t|--translations     translations of alerts as directory/prefix [" TRANSLATION_PATH "]\n"
+        "  -o|--option           key=value of fty-email configuration, for example server/workers=8\n"
+        "  -T|--timeout          seconds to wait for replies [30]\n"
+        "  -S|--seed             seed of random choice of request, body and attachment [1]\n"
+        "  -j|--json             print results as JSON\n"
+        "  -v|--verbose          verbose output\n"
+        "  -h|--help             print this information\n"
+        "Sends requests to fty_email_server running in-process with its own malamute broker and prints\n"
+        "latency (from sending of the request to its reply) percentiles and throughput.");
+}
+
+static std::vector<std::string> s_split(const std::string& str, char sep)
+{
+    std::vector<std::string> ret;
+    std::stringstream        ss(str);
+    std::string              item;
+    while (std::getline(ss, item, sep))
+        ret.push_back(item);
+    return ret;
+}
+
+static std::vector<size_t> s_sizes(const std::string& str)
+{
+    std::vector<size_t> ret;
+    for (const auto& it : s_split(str, ','))
+        ret.push_back(fty::convert<size_t>(it));
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    int         help    = 0;
+    int         verbose = 0;
+    int         json    = 0;
+    LoadOptions opts;
+    opts.translations = TRANSLATION_PATH;
+    ManageFtyLog::setInstanceFtylog("fty-email-loadgen");
+
+// Some systems define struct option with non-"const" "char *"
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#endif
+    static const char*   short_options  = "hvjc:n:r:w:m:b:a:s:t:o:T:S:";
+    static struct option long_options[] = {{"help", no_argument, &help, 1}, {"verbose", no_argument, &verbose, 1},
+        {"json", no_argument, &json, 1}, {"clients", required_argument, 0, 'c'},
+        {"requests", required_argument, 0, 'n'}, {"rate", required_argument, 0, 'r'},
+        {"window", required_argument, 0, 'w'}, {"mix", required_argument, 0, 'm'},
+        {"body", required_argument, 0, 'b'}, {"attachment", required_argument, 0, 'a'},
+        {"smtp", required_argument, 0, 's'}, {"translations", required_argument, 0, 't'},
+        {"option", required_argument, 0, 'o'}, {"timeout", required_argument, 0, 'T'},
+        {"seed", required_argument, 0, 'S'}, {NULL, 0, 0, 0}};
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#endif
+
+    try {
+        while (true) {
+            int option_index = 0;
+            int c            = getopt_long(argc, argv, short_options, long_options, &option_index);
+            if (c == -1)
+                break;
+            switch (c) {
+                case 'v':
+                    verbose = 1;
+                    break;
+                case 'j':
+                    json = 1;
+                    break;
+                case 'c':
+                    opts.clients = fty::convert<size_t>(std::string(optarg));
+                    break;
+                case 'n':
+                    opts.requests = fty::convert<size_t>(std::string(optarg));
+                    break;
+                case 'r':
+                    opts.rate = fty::convert<double>(std::string(optarg));
+                    break;
+                case 'w':
+                    opts.window = fty::convert<size_t>(std::string(optarg));
+                    break;
+                case 'm': {
+                    std::vector<std::string> mix = s_split(optarg, ':');
+                    if (mix.size() > 3)
+                        throw std::invalid_argument("mix has more than 3 weights");
+                    for (size_t i = 0; i != 3; i++)
+                        opts.mix[i] = i < mix.size() ? fty::convert<unsigned>(mix[i]) : 0;
+                    break;
+                }
+                case 'b':
+                    opts.body_sizes = s_sizes(optarg);
+                    break;
+                case 'a':
+                    opts.attachment_sizes = s_sizes(optarg);
+                    break;
+                case 's':
+                    opts.smtp = optarg;
+                    break;
+                case 't':
+                    opts.translations = optarg;
+                    break;
+                case 'o': {
+                    std::string option(optarg);
+                    size_t      eq = option.find('=');
+                    if (eq == std::string::npos)
+                        throw std::invalid_argument("option " + option + " is not key=value");
+                    opts.config[option.substr(0, eq)] = option.substr(eq + 1);
+                    break;
+                }
+                case 'T':
+                    opts.timeout = fty::convert<int>(std::string(optarg));
+                    break;
+                case 'S':
+                    opts.seed = fty::convert<unsigned>(std::string(optarg));
+                    break;
+                case 0:
+                    // just now walking trough some long opt
+                    break;
+                case 'h':
+                default:
+                    help = 1;
+                    break;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "fty-email-loadgen: " << e.what() << std::endl;
+        help = 1;
+    }
+    if (help || optind < argc) {
+        usage();
+        exit(1);
+    }
+    if (verbose)
+        ManageFtyLog::getInstanceFtylog()->setVeboseMode();
+
+    try {
+        EmailLoadGenerator gen(opts);
+        LoadReport         report = gen.run();
+        report.print(std::cout, json);
+        LoadStats all = report.total();
+        return all.failed == 0 && all.lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const std::exception& e) {
+        log_error("fty-email-loadgen: %s", e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,303 @@
+/*  =========================================================================
+    fty_email_metrics - Counters and histograms of the email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_metrics - Counters and histograms of the email actor
+@discuss
+    Values are published by fty_email_server as fty_proto metrics on the METRICS stream, written to the stats file
+    and returned as JSON to STATS requests. See README.md for the names.
+@end
+*/
+
+#include "fty_email_metrics.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <sstream>
+
+// ----------------------------------------------------------------------------
+// Histogram
+
+Histogram::Histogram()
+    : _buckets(BUCKETS, 0)
+    , _count(0)
+    , _sum(0)
+    , _min(UINT64_MAX)
+    , _max(0)
+{
+}
+
+size_t Histogram::bucket(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return size_t(value);
+    unsigned exp = 63 - unsigned(__builtin_clzll(value));
+    // the highest 5 bits of the value: 1 and the index of sub bucket
+    return (exp - 3) * SUB_BUCKETS + size_t((value >> (exp - 4)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Histogram::upper(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    unsigned exp   = unsigned(bucket / SUB_BUCKETS) + 3;
+    uint64_t lower = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exp - 4);
+    return lower + ((uint64_t(1) << (exp - 4)) - 1);
+}
+
+void Histogram::record(uint64_t value)
+{
+    _buckets[bucket(value)]++;
+    _count++;
+    _sum += value;
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for (size_t i = 0; i != _buckets.size(); i++)
+        _buckets[i] += other._buckets[i];
+    _count += other._count;
+    _sum += other._sum;
+    _min = std::min(_min, other._min);
+    _max = std::max(_max, other._max);
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    if (_count == 0)
+        return 0;
+    uint64_t rank = uint64_t(p / 100 * double(_count) + 0.5);
+    rank          = std::max<uint64_t>(1, std::min(rank, _count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i != _buckets.size(); i++) {
+        seen += _buckets[i];
+        if (seen >= rank)
+            return std::min(upper(i), _max);
+    }
+    return _max;
+}
+
+// ----------------------------------------------------------------------------
+// AtomicHistogram
+
+AtomicHistogram::AtomicHistogram()
+{
+    reset();
+}
+
+void AtomicHistogram::record(uint64_t value)
+{
+    _buckets[Histogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t min = _min.load(std::memory_order_relaxed);
+    while (value < min && !_min.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+    }
+    uint64_t max = _max.load(std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+Histogram AtomicHistogram::snapshot() const
+{
+    Histogram ret;
+    for (size_t i = 0; i != Histogram::BUCKETS; i++) {
+        ret._buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+        ret._count += ret._buckets[i];
+    }
+    ret._sum = _sum.load(std::memory_order_relaxed);
+    ret._min = _min.load(std::memory_order_relaxed);
+    ret._max = _max.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void AtomicHistogram::reset()
+{
+    for (auto& it : _buckets)
+        it.store(0, std::memory_order_relaxed);
+    _sum.store(0, std::memory_order_relaxed);
+    _min.store(UINT64_MAX, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------------
+// EmailMetrics
+
+static const char* REQUEST_NAMES[EmailMetrics::REQUESTS] = {
+    "sendmail", "sendmail_alert", "sendsms_alert", "stats", "other"};
+
+const char* smtp_error_name(SmtpError error)
+{
+    switch (error) {
+        case SmtpError::Succeeded:
+            return "succeeded";
+        case SmtpError::NoRecipient:
+            return "no_recipient";
+        case SmtpError::ServerUnreachable:
+            return "server_unreachable";
+        case SmtpError::DNSFailed:
+            return "dns_failed";
+        case SmtpError::AuthMethodNotSupported:
+            return "auth_method_not_supported";
+        case SmtpError::AuthFailed:
+            return "auth_failed";
+        case SmtpError::SSLNotSupported:
+            return "ssl_not_supported";
+        case SmtpError::UnknownCA:
+            return "unknown_ca";
+        case SmtpError::SSLRequired:
+            return "ssl_required";
+        case SmtpError::NoSenderAddress:
+            return "no_sender_address";
+        case SmtpError::Unknown:
+            break;
+    }
+    return "unknown";
+}
+
+EmailMetrics::EmailMetrics()
+{
+    reset();
+}
+
+EmailMetrics::Request EmailMetrics::request(const std::string& subject)
+{
+    if (subject == "SENDMAIL")
+        return SENDMAIL;
+    if (subject == "SENDMAIL_ALERT")
+        return SENDMAIL_ALERT;
+    if (subject == "SENDSMS_ALERT")
+        return SENDSMS_ALERT;
+    if (subject == "STATS")
+        return STATS;
+    return OTHER;
+}
+
+void EmailMetrics::reset()
+{
+    for (auto& it : requests)
+        it.store(0, std::memory_order_relaxed);
+    for (auto& it : failures)
+        it.store(0, std::memory_order_relaxed);
+    for (auto* it : {&replies_ok, &replies_failed, &rejected, &superseded, &suppressed, &retries, &unjournaled,
+             &attachments, &attachment_bytes})
+        it->store(0, std::memory_order_relaxed);
+    queue_depth.reset();
+    delivery_ms.reset();
+    transport_us.reset();
+    render_us.reset();
+}
+
+namespace {
+struct NamedHistogram
+{
+    const char*            name;
+    const char*            unit;
+    const AtomicHistogram& histogram;
+};
+} // namespace
+
+static std::vector<NamedHistogram> s_histograms(const EmailMetrics& metrics)
+{
+    return {{"queue_depth", "", metrics.queue_depth}, {"delivery_ms", "ms", metrics.delivery_ms},
+        {"transport_us", "us", metrics.transport_us}, {"render_us", "us", metrics.render_us}};
+}
+
+std::vector<MetricValue> EmailMetrics::values(size_t queued, size_t retrying) const
+{
+    std::vector<MetricValue> ret;
+    auto counter = [&ret](const std::string& name, const std::atomic<uint64_t>& value, const char* unit = "") {
+        ret.push_back({"email." + name, value.load(std::memory_order_relaxed), unit});
+    };
+
+    for (size_t i = 0; i != REQUESTS; i++)
+        counter("requests." + std::string(REQUEST_NAMES[i]), requests[i]);
+    counter("replies.ok", replies_ok);
+    counter("replies.failed", replies_failed);
+    counter("rejected", rejected);
+    counter("superseded", superseded);
+    counter("suppressed", suppressed);
+    counter("retries", retries);
+    counter("unjournaled", unjournaled);
+    for (size_t i = 1; i != ERRORS; i++)
+        counter("failures." + std::string(smtp_error_name(SmtpError(i))), failures[i]);
+    counter("attachments", attachments);
+    counter("attachment_bytes", attachment_bytes, "B");
+    ret.push_back({"email.queued", queued, ""});
+    ret.push_back({"email.retrying", retrying, ""});
+
+    for (const NamedHistogram& it : s_histograms(*this)) {
+        Histogram   hist = it.histogram.snapshot();
+        std::string name = std::string("email.") + it.name;
+        ret.push_back({name + ".count", hist.count(), ""});
+        ret.push_back({name + ".p50", hist.percentile(50), it.unit});
+        ret.push_back({name + ".p90", hist.percentile(90), it.unit});
+        ret.push_back({name + ".p99", hist.percentile(99), it.unit});
+        ret.push_back({name + ".max", hist.max(), it.unit});
+    }
+    return ret;
+}
+
+std::string EmailMetrics::json(size_t queued, size_t retrying) const
+{
+    std::ostringstream out;
+    char               buf[512];
+    auto               load = [](const std::atomic<uint64_t>& value) {
+        return value.load(std::memory_order_relaxed);
+    };
+
+    out << "{\"requests\": {";
+    for (size_t i = 0; i != REQUESTS; i++)
+        out << (i ? ", " : "") << "\"" << REQUEST_NAMES[i] << "\": " << load(requests[i]);
+    snprintf(buf, sizeof(buf),
+        "}, \"replies\": {\"ok\": %" PRIu64 ", \"failed\": %" PRIu64 "}, \"rejected\": %" PRIu64
+        ", \"superseded\": %" PRIu64 ", \"suppressed\": %" PRIu64 ", \"retries\": %" PRIu64
+        ", \"unjournaled\": %" PRIu64 ", \"failures\": {",
+        load(replies_ok), load(replies_failed), load(rejected), load(superseded), load(suppressed), load(retries),
+        load(unjournaled));
+    out << buf;
+    for (size_t i = 1; i != ERRORS; i++)
+        out << (i != 1 ? ", " : "") << "\"" << smtp_error_name(SmtpError(i)) << "\": " << load(failures[i]);
+    snprintf(buf, sizeof(buf),
+        "}, \"attachments\": %" PRIu64 ", \"attachment_bytes\": %" PRIu64 ", \"queued\": %zu, \"retrying\": %zu",
+        load(attachments), load(attachment_bytes), queued, retrying);
+    out << buf;
+
+    for (const NamedHistogram& it : s_histograms(*this)) {
+        Histogram hist = it.histogram.snapshot();
+        snprintf(buf, sizeof(buf),
+            ", \"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %" PRIu64
+            ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+            it.name, hist.count(), hist.min(), hist.mean(), hist.percentile(50), hist.percentile(90),
+            hist.percentile(99), hist.percentile(99.9), hist.max());
+        out << buf;
+    }
+    out << "}";
+    return out.str();
+}
+
+EmailMetrics& email_metrics()
+{
+    static EmailMetrics metrics;
+    return metrics;
+}
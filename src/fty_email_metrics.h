@@ -0,0 +1,238 @@
+/*  =========================================================================
+    fty_email_metrics - Counters and histograms of the email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "email.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///  @class Histogram
+///
+///  Histogram of non-negative values (latencies, sizes) with log-linear buckets
+///
+///  Values below 16 have a bucket each, larger ones SUB_BUCKETS buckets per power of two, so a percentile is
+///  reported with error below 1/16 (6 %) using fixed memory no matter how many values were recorded.
+class Histogram
+{
+public:
+    static const unsigned SUB_BUCKETS = 16;
+    /// 16 exact buckets, then SUB_BUCKETS for each power of two 2^4 .. 2^63
+    static const size_t BUCKETS = SUB_BUCKETS * 61;
+
+    Histogram();
+
+    void record(uint64_t value);
+
+    /// add all the values recorded by other histogram
+    void merge(const Histogram& other);
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+    uint64_t min() const
+    {
+        return _count ? _min : 0;
+    }
+
+    uint64_t max() const
+    {
+        return _max;
+    }
+
+    double mean() const
+    {
+        return _count ? double(_sum) / double(_count) : 0;
+    }
+
+    /// @param p  percentile (0 - 100]
+    /// @return upper bound of bucket of the p-th percentile value (not above max), 0 if empty
+    uint64_t percentile(double p) const;
+
+    /// @return index of bucket of the value
+    static size_t bucket(uint64_t value);
+
+    /// @return the largest value of the bucket
+    static uint64_t upper(size_t bucket);
+
+protected:
+    friend class AtomicHistogram;
+
+    std::vector<uint64_t> _buckets;
+    uint64_t              _count;
+    uint64_t              _sum;
+    uint64_t              _min;
+    uint64_t              _max;
+};
+
+///  @class AtomicHistogram
+///
+///  Histogram recorded by several threads without lock
+///
+///  record is a few relaxed atomic increments, snapshot copies the buckets. Snapshot taken while other threads
+///  record may miss the values being recorded, count of the snapshot is always the sum of its buckets.
+class AtomicHistogram
+{
+public:
+    AtomicHistogram();
+
+    AtomicHistogram(const AtomicHistogram&) = delete;
+    AtomicHistogram& operator=(const AtomicHistogram&) = delete;
+
+    void record(uint64_t value);
+
+    Histogram snapshot() const;
+
+    void reset();
+
+protected:
+    std::atomic<uint64_t> _buckets[Histogram::BUCKETS];
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _min;
+    std::atomic<uint64_t> _max;
+};
+
+///  @class MetricsTimer
+///
+///  Records microseconds from construction to destruction to the histogram (also when exception is thrown)
+class MetricsTimer
+{
+public:
+    explicit MetricsTimer(AtomicHistogram& histogram)
+        : _histogram(histogram)
+        , _start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~MetricsTimer()
+    {
+        _histogram.record(uint64_t(
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count()));
+    }
+
+    MetricsTimer(const MetricsTimer&) = delete;
+    MetricsTimer& operator=(const MetricsTimer&) = delete;
+
+private:
+    AtomicHistogram&                      _histogram;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/// one value of the metrics, name is e.g. email.requests.sendmail or email.delivery_ms.p99
+struct MetricValue
+{
+    std::string name;
+    uint64_t    value;
+    std::string unit;
+};
+
+///  @class EmailMetrics
+///
+///  Counters and histograms of the email actor, updated by the actor and the delivery workers
+///
+///  All the values are cumulative since start of the process. Counters are relaxed atomics, so updating them costs
+///  about the same as an uncontended increment and they can stay on in the hot loop.
+struct EmailMetrics
+{
+    /// subjects of requests counted separately
+    enum Request
+    {
+        SENDMAIL,
+        SENDMAIL_ALERT,
+        SENDSMS_ALERT,
+        STATS,
+        OTHER,
+        REQUESTS
+    };
+
+    static const size_t ERRORS = size_t(SmtpError::Unknown) + 1;
+
+    /// requests received from the mailbox by subject
+    std::atomic<uint64_t> requests[REQUESTS];
+    /// delivered requests replied OK
+    std::atomic<uint64_t> replies_ok{0};
+    /// delivered requests replied by error (SENDMAIL-ERR, ERROR)
+    std::atomic<uint64_t> replies_failed{0};
+    /// requests refused because delivery queue was full
+    std::atomic<uint64_t> rejected{0};
+    /// alert requests superseded by newer state of the alert
+    std::atomic<uint64_t> superseded{0};
+    /// alert requests suppressed by rate limits
+    std::atomic<uint64_t> suppressed{0};
+    /// delivery attempts scheduled for retry
+    std::atomic<uint64_t> retries{0};
+    /// requests accepted while the spool is configured but cannot store them, they are lost on restart
+    std::atomic<uint64_t> unjournaled{0};
+    /// requests failed by SMTP transport (after retries), by SmtpError
+    std::atomic<uint64_t> failures[ERRORS];
+    /// number and size of attached files
+    std::atomic<uint64_t> attachments{0};
+    std::atomic<uint64_t> attachment_bytes{0};
+
+    /// requests queued for delivery when a request is queued
+    AtomicHistogram queue_depth;
+    /// ms from acceptance of the request to its reply (including retries)
+    AtomicHistogram delivery_ms;
+    /// us of one delivery attempt by native SMTP client or msmtp
+    AtomicHistogram transport_us;
+    /// us of composing the email (MIME message, alert templates)
+    AtomicHistogram render_us;
+
+    EmailMetrics();
+
+    /// @return index of counter of request subject
+    static Request request(const std::string& subject);
+
+    /// count request of the subject
+    void count(const std::string& subject)
+    {
+        requests[request(subject)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// count request failed by SMTP transport
+    void failure(SmtpError error)
+    {
+        size_t index = size_t(error) < ERRORS ? size_t(error) : size_t(SmtpError::Unknown);
+        failures[index].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// @param queued    number of queued requests now (gauge)
+    /// @param retrying  number of requests waiting for retry now (gauge)
+    /// @return all the values, histograms as count, p50, p90, p99 and max
+    std::vector<MetricValue> values(size_t queued, size_t retrying) const;
+
+    /// @return JSON object of all the values, histograms as nested objects with min, mean and percentiles
+    std::string json(size_t queued, size_t retrying) const;
+
+    /// set all the values to 0 (tests)
+    void reset();
+};
+
+/// @return metrics of the process
+EmailMetrics& email_metrics();
+
+/// @return name of SmtpError used in metrics (server_unreachable, auth_failed, ...)
+const char* smtp_error_name(SmtpError error);
@@ -0,0 +1,184 @@
+/*  =========================================================================
+    fty_email_ratelimit - Rate limiting of alert notifications
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_ratelimit - Rate limiting of alert notifications
+@discuss
+    Flapping rule must not get our sender throttled or blacklisted by the relay.
+@end
+*/
+
+#include "fty_email_ratelimit.h"
+#include <algorithm>
+
+/// FNV-1a of the strings, separated by NUL
+static uint64_t s_hash(std::initializer_list<const std::string*> parts)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const std::string* part : parts) {
+        for (unsigned char c : *part) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        hash *= 1099511628211ull;
+    }
+    // 0 marks free slot
+    return hash ? hash : 1;
+}
+
+// ----------------------------------------------------------------------------
+// TokenBuckets
+
+TokenBuckets::TokenBuckets(size_t size)
+    : _rate(0)
+    , _burst(0)
+{
+    size_t slots = PROBES;
+    while (slots < size)
+        slots *= 2;
+    _slots.resize(slots, Slot{0, 0, 0, 0});
+}
+
+void TokenBuckets::configure(double rate, double burst)
+{
+    if (rate == _rate && burst == _burst)
+        return;
+    _rate  = rate;
+    _burst = std::max(burst, 1.0);
+    std::fill(_slots.begin(), _slots.end(), Slot{0, 0, 0, 0});
+}
+
+TokenBuckets::Slot* TokenBuckets::find(uint64_t key)
+{
+    size_t mask   = _slots.size() - 1;
+    Slot*  oldest = nullptr;
+    for (size_t i = 0; i != PROBES; i++) {
+        Slot& slot = _slots[(key + i) & mask];
+        if (slot.key == key)
+            return &slot;
+        if (slot.key == 0) {
+            oldest = &slot;
+            break;
+        }
+        if (!oldest || slot.last < oldest->last)
+            oldest = &slot;
+    }
+    oldest->key    = key;
+    oldest->last   = 0;
+    oldest->tokens = _burst;
+    oldest->mark   = 0;
+    return oldest;
+}
+
+bool TokenBuckets::check(uint64_t key, int64_t now_ms)
+{
+    if (!enabled())
+        return true;
+
+    Slot* slot = find(key);
+    if (slot->last != 0 && now_ms > slot->last)
+        slot->tokens = std::min(_burst, slot->tokens + double(now_ms - slot->last) * _rate / 60000.0);
+    slot->last = now_ms;
+    return slot->tokens >= 1.0;
+}
+
+void TokenBuckets::take(uint64_t key)
+{
+    if (!enabled())
+        return;
+    Slot* slot = find(key);
+    slot->tokens -= 1.0;
+}
+
+uint64_t& TokenBuckets::mark(uint64_t key)
+{
+    return find(key)->mark;
+}
+
+// ----------------------------------------------------------------------------
+// AlertRateLimiter
+
+AlertRateLimiter::AlertRateLimiter(size_t size)
+    : _global(1)
+    , _contact(size)
+    , _alert(size)
+    , _suppressed(0)
+{
+}
+
+// mark of the alert bucket
+enum
+{
+    UNKNOWN = 0,
+    SENT_ACTIVE,
+    SENT_RESOLVED
+};
+
+AlertRateLimiter::Level AlertRateLimiter::allow(const std::string& contact, const std::string& rule,
+    const std::string& asset, const std::string& state, int64_t now_ms)
+{
+    static const std::string global;
+    uint64_t                 global_key  = s_hash({&global});
+    uint64_t                 contact_key = s_hash({&contact});
+    uint64_t                 alert_key   = s_hash({&contact, &rule, &asset});
+    bool                     resolved    = state == "RESOLVED";
+
+    // resolution of the sent alert always goes through, it is limited by the rate of activations
+    uint64_t& sent = _alert.mark(alert_key);
+    if (resolved && sent == SENT_ACTIVE) {
+        sent = SENT_RESOLVED;
+        return ALLOWED;
+    }
+
+    Level level = ALLOWED;
+    if (!_global.check(global_key, now_ms))
+        level = GLOBAL;
+    else if (!_contact.check(contact_key, now_ms))
+        level = CONTACT;
+    else if (!_alert.check(alert_key, now_ms))
+        level = ALERT;
+
+    if (level != ALLOWED) {
+        _suppressed++;
+        return level;
+    }
+
+    _global.take(global_key);
+    _contact.take(contact_key);
+    _alert.take(alert_key);
+    sent = resolved ? SENT_RESOLVED : SENT_ACTIVE;
+    return ALLOWED;
+}
+
+const char* AlertRateLimiter::name(Level level)
+{
+    switch (level) {
+        case GLOBAL:
+            return "global";
+        case CONTACT:
+            return "contact";
+        case ALERT:
+            return "alert";
+        default:
+            return "none";
+    }
+}
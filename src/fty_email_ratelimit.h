@@ -0,0 +1,138 @@
+/*  =========================================================================
+    fty_email_ratelimit - Rate limiting of alert notifications
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+///  @class TokenBuckets
+///
+///  Token buckets stored in fixed size open addressing table
+///
+///  Bucket is identified by 64 bit hash of its key only. Lookup probes at most PROBES slots, when none of them is
+///  free the least recently used one is reused, so memory stays bounded no matter how many keys are seen. Reused
+///  bucket starts full, which errs on the side of sending the email.
+class TokenBuckets
+{
+public:
+    /// @param size  number of slots, rounded up to power of two
+    explicit TokenBuckets(size_t size = 4096);
+
+    /// @param rate   tokens per minute, 0 disables the limit
+    /// @param burst  size of the bucket
+    void configure(double rate, double burst);
+
+    /// @return true if the limit is enabled
+    bool enabled() const
+    {
+        return _rate > 0;
+    }
+
+    /// @return true if bucket of the key has a token at now_ms (the token is not taken)
+    bool check(uint64_t key, int64_t now_ms);
+
+    /// take the token from the bucket of the key, check must be called before
+    void take(uint64_t key);
+
+    /// @return value kept with the bucket of the key, 0 for new (or reused) bucket; kept even if limit is disabled
+    uint64_t& mark(uint64_t key);
+
+    /// @return number of slots
+    size_t size() const
+    {
+        return _slots.size();
+    }
+
+protected:
+    static const size_t PROBES = 8;
+
+    struct Slot
+    {
+        uint64_t key;
+        int64_t  last;
+        double   tokens;
+        uint64_t mark;
+    };
+
+    Slot* find(uint64_t key);
+
+    std::vector<Slot> _slots;
+    double            _rate;
+    double            _burst;
+};
+
+///  @class AlertRateLimiter
+///
+///  Limits alert notifications per contact, per (contact, rule, asset) and globally
+///
+///  RESOLVED of alert whose active state was sent is never suppressed (nor takes tokens), so the contact is not left
+///  with an alert that looks active. Repeated states and re-activations of flapping alert are limited.
+class AlertRateLimiter
+{
+public:
+    enum Level
+    {
+        ALLOWED,
+        GLOBAL,
+        CONTACT,
+        ALERT
+    };
+
+    explicit AlertRateLimiter(size_t size = 4096);
+
+    void global(double rate, double burst)
+    {
+        _global.configure(rate, burst);
+    }
+
+    void contact(double rate, double burst)
+    {
+        _contact.configure(rate, burst);
+    }
+
+    void alert(double rate, double burst)
+    {
+        _alert.configure(rate, burst);
+    }
+
+    /// take a token from all the buckets of the alert
+    /// @param state  state of the alert (ACTIVE, ACK-*, RESOLVED)
+    /// @return ALLOWED if the email can be sent, otherwise the level whose limit was exceeded (no token is taken)
+    Level allow(const std::string& contact, const std::string& rule, const std::string& asset,
+        const std::string& state, int64_t now_ms);
+
+    /// @return number of suppressed alerts since start
+    uint64_t suppressed() const
+    {
+        return _suppressed;
+    }
+
+    /// @return human readable name of the level
+    static const char* name(Level level);
+
+protected:
+    TokenBuckets _global;
+    TokenBuckets _contact;
+    TokenBuckets _alert;
+    uint64_t     _suppressed;
+};
@@ -0,0 +1,176 @@
+/*  =========================================================================
+    fty_email_retry - Retry of failed deliveries
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_retry - Retry of failed deliveries
+@discuss
+    Short outage of SMTP server must not lose the alerts raised during it, transient failures are delivered again.
+@end
+*/
+
+#include "fty_email_retry.h"
+#include "fty_email_worker.h"
+#include <algorithm>
+
+// ----------------------------------------------------------------------------
+// RetryPolicy
+
+RetryPolicy::RetryPolicy()
+    : _max_age(3600 * 1000)
+    , _random(std::random_device{}())
+{
+    transient(2 * 1000, 300 * 1000);
+}
+
+void RetryPolicy::backoff(SmtpError error, int64_t initial_ms, int64_t max_ms)
+{
+    if (initial_ms <= 0) {
+        _backoff.erase(error);
+        return;
+    }
+    _backoff[error] = {initial_ms, std::max(initial_ms, max_ms)};
+}
+
+void RetryPolicy::transient(int64_t initial_ms, int64_t max_ms)
+{
+    backoff(SmtpError::ServerUnreachable, initial_ms, max_ms);
+    backoff(SmtpError::DNSFailed, 2 * initial_ms, max_ms);
+    backoff(SmtpError::Unknown, initial_ms, max_ms);
+}
+
+int64_t RetryPolicy::delay(SmtpError error, unsigned attempts, int64_t age_ms, bool permanent)
+{
+    auto it = _backoff.find(error);
+    if (permanent || it == _backoff.end() || attempts == 0)
+        return -1;
+
+    int64_t delay = it->second.initial;
+    for (unsigned i = 1; i < attempts && delay < it->second.max; i++)
+        delay *= 2;
+    delay = std::min(delay, it->second.max);
+
+    // equal jitter, requests failed at the same time do not come back at the same time
+    delay = delay / 2 + std::uniform_int_distribution<int64_t>(0, delay / 2)(_random);
+
+    if (age_ms + delay > _max_age)
+        return -1;
+    return delay;
+}
+
+// ----------------------------------------------------------------------------
+// RetryWheel
+
+RetryWheel::RetryWheel(int64_t tick_ms, size_t slots)
+    : _slots(slots)
+    , _tick_ms(tick_ms)
+    , _current(0)
+    , _size(0)
+{
+}
+
+void RetryWheel::schedule(std::unique_ptr<EmailJob>& job, int64_t due_ms, int64_t now_ms)
+{
+    if (_size == 0)
+        _current = now_ms / _tick_ms;
+
+    // job is never put to the slot being processed, it would wait for the whole revolution
+    int64_t tick = std::max(due_ms / _tick_ms, _current + 1);
+    _slots[size_t(tick) % _slots.size()].push_back({due_ms, std::move(job)});
+    _size++;
+}
+
+void RetryWheel::advance(int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& expired)
+{
+    int64_t now = now_ms / _tick_ms;
+    if (_size == 0) {
+        _current = now;
+        return;
+    }
+
+    // every slot is visited at most once, even if the wheel was not advanced for more than one revolution; jobs
+    // are due with resolution of the tick, the ones due in later revolutions stay in the slot
+    int64_t ticks = std::min(now - _current, int64_t(_slots.size()));
+    for (int64_t i = 1; i <= ticks; i++) {
+        auto& slot = _slots[size_t(_current + i) % _slots.size()];
+        auto  it   = std::partition(slot.begin(), slot.end(), [this, now](const Entry& entry) {
+            return entry.due / _tick_ms > now;
+        });
+        for (auto e = it; e != slot.end(); ++e)
+            expired.push_back(std::move(e->job));
+        _size -= size_t(slot.end() - it);
+        slot.erase(it, slot.end());
+    }
+    _current = std::max(_current, now);
+}
+
+void RetryWheel::take(std::vector<std::unique_ptr<EmailJob>>& jobs)
+{
+    for (auto& slot : _slots) {
+        for (auto& entry : slot)
+            jobs.push_back(std::move(entry.job));
+        slot.clear();
+    }
+    _size = 0;
+}
+
+bool RetryWheel::replace(const EmailJob* scheduled, std::unique_ptr<EmailJob>& job)
+{
+    for (auto& slot : _slots) {
+        for (auto& entry : slot) {
+            if (entry.job.get() == scheduled) {
+                std::swap(entry.job, job);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::unique_ptr<EmailJob> RetryWheel::remove(const EmailJob* scheduled)
+{
+    for (auto& slot : _slots) {
+        for (auto it = slot.begin(); it != slot.end(); ++it) {
+            if (it->job.get() == scheduled) {
+                std::unique_ptr<EmailJob> ret = std::move(it->job);
+                slot.erase(it);
+                _size--;
+                return ret;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void RetryWheel::each(const std::function<void(EmailJob&)>& fn)
+{
+    for (auto& slot : _slots) {
+        for (auto& entry : slot)
+            fn(*entry.job);
+    }
+}
+
+void RetryWheel::clear()
+{
+    for (auto& slot : _slots)
+        slot.clear();
+    _size = 0;
+}
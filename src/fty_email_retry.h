@@ -0,0 +1,143 @@
+/*  =========================================================================
+    fty_email_retry - Retry of failed deliveries
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "email.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+struct EmailJob;
+
+///  @class RetryPolicy
+///
+///  Decides if and when failed delivery is attempted again
+///
+///  Transient errors (ServerUnreachable, DNSFailed, Unknown) are retried with exponential backoff with jitter, the
+///  delay before attempt n+1 is random in <d/2, d> where d = min(initial * 2^(n-1), max). Permanent errors (AuthFailed,
+///  UnknownCA, ...) and requests refused by 5xx reply of the server are not retried. Request is not retried once it
+///  is older than max_age.
+class RetryPolicy
+{
+public:
+    RetryPolicy();
+
+    /// set backoff of the error, initial_ms == 0 makes the error permanent
+    void backoff(SmtpError error, int64_t initial_ms, int64_t max_ms);
+
+    /// set backoff of all transient errors, DNS failures start with doubled delay as resolvers cache them
+    void transient(int64_t initial_ms, int64_t max_ms);
+
+    /// maximum age of request which is still retried, 0 disables retries
+    void max_age(int64_t ms)
+    {
+        _max_age = ms;
+    }
+
+    /// @param error     error of the last attempt
+    /// @param attempts  number of attempts made so far
+    /// @param age_ms    time since the request was accepted
+    /// @param permanent the server refused the request by 5xx reply
+    /// @return delay before the next attempt in ms, -1 if request must not be retried
+    int64_t delay(SmtpError error, unsigned attempts, int64_t age_ms, bool permanent = false);
+
+protected:
+    struct Backoff
+    {
+        int64_t initial;
+        int64_t max;
+    };
+
+    std::map<SmtpError, Backoff> _backoff;
+    int64_t                      _max_age;
+    std::mt19937                 _random;
+};
+
+///  @class RetryWheel
+///
+///  Hashed timing wheel of jobs waiting for the next attempt
+///
+///  Jobs are hashed to slots by tick of their due time, so scheduling is O(1) and advancing the wheel touches only
+///  slots of elapsed ticks. Jobs due more than one revolution ahead stay in their slot until their tick comes.
+class RetryWheel
+{
+public:
+    /// @param tick_ms  resolution of the wheel
+    /// @param slots    number of slots (one revolution is tick_ms * slots)
+    explicit RetryWheel(int64_t tick_ms = 100, size_t slots = 512);
+
+    /// schedule the job at due_ms (monotonic time), job is moved
+    void schedule(std::unique_ptr<EmailJob>& job, int64_t due_ms, int64_t now_ms);
+
+    /// move jobs which are due at now_ms to expired
+    void advance(int64_t now_ms, std::vector<std::unique_ptr<EmailJob>>& expired);
+
+    /// move all the scheduled jobs to jobs, due or not
+    void take(std::vector<std::unique_ptr<EmailJob>>& jobs);
+
+    /// put job in place of the scheduled one, it keeps the due time; the scheduled job is moved to job
+    /// @return false if scheduled is not in the wheel, job is left untouched
+    bool replace(const EmailJob* scheduled, std::unique_ptr<EmailJob>& job);
+
+    /// remove the scheduled job
+    /// @return the job, nullptr if it is not in the wheel
+    std::unique_ptr<EmailJob> remove(const EmailJob* scheduled);
+
+    /// call fn for each scheduled job, in no particular order; the job stays scheduled
+    void each(const std::function<void(EmailJob&)>& fn);
+
+    /// drop all jobs
+    void clear();
+
+    /// @return resolution of the wheel
+    int64_t tick() const
+    {
+        return _tick_ms;
+    }
+
+    /// @return number of scheduled jobs
+    size_t size() const
+    {
+        return _size;
+    }
+
+    /// @return true if no job is scheduled
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+protected:
+    struct Entry
+    {
+        int64_t                   due;
+        std::unique_ptr<EmailJob> job;
+    };
+
+    std::vector<std::vector<Entry>> _slots;
+    int64_t                         _tick_ms;
+    /// last processed tick
+    int64_t _current;
+    size_t  _size;
+};
@@ -26,7 +26,18 @@
 #include "emailconfiguration.h"
 #include "fty_email.h"
 #include "fty_email_audit_log.h"
+#include "fty_email_digest.h"
+#include "fty_email_metrics.h"
+#include "fty_email_ratelimit.h"
+#include "fty_email_shard.h"
+#include "fty_email_spool.h"
+#include "fty_email_trace.h"
+#include "fty_email_worker.h"
+#include "smtp_client.h"
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include <fty/convert.h>
 #include <fty_common_macros.h>
 #include <fty_common_mlm.h>
@@ -34,8 +45,25 @@
 #include <set>
 #include <tuple>
 
-static void s_notify(
-    Smtp& smtp, const std::string& priority, const std::string& extname, const std::string& contact, fty_proto_t* alert)
+// how often are idle SMTP sessions checked for expiration
+#define SMTP_POOL_EXPIRE_MS 1000
+
+/// run the delivery, error of SMTP transport is stored to the job, so that transient errors are retried
+template <typename Send>
+static void s_transport(EmailJob& job, Send send)
+{
+    MetricsTimer timer(email_metrics().transport_us);
+    try {
+        send();
+    } catch (const std::runtime_error& e) {
+        job.error     = smtp_exception2code(e);
+        job.permanent = smtp_exception_permanent(e);
+        throw;
+    }
+}
+
+static void s_notify(Smtp& smtp, EmailJob& job, const std::string& priority, const std::string& extname,
+    const std::string& contact, fty_proto_t* alert)
 {
     if (priority.empty())
         throw std::runtime_error("Empty priority");
@@ -43,8 +71,332 @@ static void s_notify(
         throw std::runtime_error("Empty asset name");
     else if (contact.empty())
         throw std::runtime_error("Empty contact");
-    else
-        smtp.sendmail(contact, generate_subject(alert, priority, extname), generate_body(alert, priority, extname));
+    else {
+        std::string subject, body;
+        {
+            MetricsTimer timer(email_metrics().render_us);
+            generate_alert(alert, priority, extname, subject, body);
+        }
+        s_transport(job, [&]() {
+            smtp.sendmail(contact, subject, body);
+        });
+    }
+}
+
+/// deliver SENDMAIL request (called by delivery worker)
+static std::string s_sendmail(Smtp& smtp, EmailJob& job, zmsg_t* reply)
+{
+    const char* name    = job.agent.c_str();
+    bool        sent_ok = false;
+    try {
+        if (zmsg_size(job.msg) == 1) {
+            std::string body = getIpAddr();
+            ZstrGuard   bodyTemp(zmsg_popstr(job.msg));
+            body += bodyTemp.get();
+            log_debug("%s:\tsmtp.sendmail (%s)", name, body.c_str());
+            log_debug_email_audit("%s: Send email: %s", name, body.c_str());
+            s_transport(job, [&]() {
+                smtp.sendmail(body);
+            });
+        } else {
+            zmsg_print(job.msg);
+            // attachments are streamed to the transport, only headers and text are logged
+            EmailMetrics& metrics = email_metrics();
+            MimeWriter    mail    = [&]() {
+                MetricsTimer timer(metrics.render_us);
+                return smtp.msg2mime(&job.msg);
+            }();
+            if (job.attempts == 1) {
+                metrics.attachments.fetch_add(mail.attachments(), std::memory_order_relaxed);
+                metrics.attachment_bytes.fetch_add(mail.attachmentBytes(), std::memory_order_relaxed);
+            }
+            log_debug("%s\n%s", mail.headers().c_str(), mail.text().c_str());
+            log_debug_email_audit("%s: Send email with %zu attachment(s): %s%s", name, mail.attachments(),
+                mail.headers().c_str(), mail.text().c_str());
+            s_transport(job, [&]() {
+                smtp.sendmail(mail);
+            });
+        }
+        zmsg_addstr(reply, "0");
+        zmsg_addstr(reply, "OK");
+        sent_ok = true;
+    } catch (const std::runtime_error& re) {
+        log_debug("%s:\tgot std::runtime_error, e.what ()=%s", name, re.what());
+        log_error_email_audit("%s: Send email error: %s", name, re.what ());
+        sent_ok       = false;
+        uint32_t code = static_cast<uint32_t>(smtp_exception2code(re));
+        zmsg_addstrf(reply, "%" PRIu32, code);
+        zmsg_addstr(reply, UTF8::escape(re.what()).c_str());
+    }
+    if (sent_ok) {
+        log_info_email_audit("%s: Send email ok", name);
+    }
+    return sent_ok ? "SENDMAIL-OK" : "SENDMAIL-ERR";
+}
+
+/// deliver SENDMAIL_ALERT or SENDSMS_ALERT request (called by delivery worker)
+static std::string s_sendmail_alert(Smtp& smtp, EmailJob& job, zmsg_t* reply)
+{
+    const char*  name              = job.agent.c_str();
+    const std::string& topic       = job.subject;
+    char*        priority          = zmsg_popstr(job.msg);
+    char*        extname           = zmsg_popstr(job.msg);
+    char*        contact           = zmsg_popstr(job.msg);
+    fty_proto_t* alert             = fty_proto_decode(&job.msg);
+    std::string  gateway           = job.gw_template;
+    std::string  converted_contact = contact == NULL ? "" : contact;
+    std::string audit_contact = converted_contact;
+    bool sent_ok = false;
+    try {
+        if (topic == "SENDSMS_ALERT") {
+            log_debug("gw_template = %s", gateway.c_str());
+            log_debug("contact = %s", contact);
+            std::string _contact = sms_email_address(gateway, converted_contact);
+            audit_contact = _contact;
+            s_notify(smtp, job, priority ? priority : "", extname ? extname : "", _contact, alert);
+        } else {
+            s_notify(smtp, job, priority ? priority : "", extname ? extname : "", converted_contact, alert);
+        }
+        zmsg_addstr(reply, "OK");
+        sent_ok = true;
+    } catch (const std::exception& re) {
+        log_error("Sending of e-mail/SMS alert failed : %s", re.what());
+        if (!audit_contact.empty()) {
+            // Workaround for unwanted logs: log audit only if contact is not empty
+            log_error_email_audit("%s: Send email/SMS alert error (gateway=%s contact=%s extname=%s): %s",
+                name, gateway.c_str(), audit_contact.c_str(), extname ? extname : "", re.what ());
+        }
+        zmsg_addstr(reply, "ERROR");
+        zmsg_addstr(reply, re.what());
+    }
+    if (sent_ok) {
+        log_info_email_audit("%s: Send email/SMS alert OK: (gateway=%s contact=%s extname=%s)",
+            name, gateway.c_str(), audit_contact.c_str(), extname ? extname : "");
+    }
+    fty_proto_destroy(&alert);
+    zstr_free(&contact);
+    zstr_free(&extname);
+    zstr_free(&priority);
+    return topic;
+}
+
+/// deliver digest of SENDMAIL_ALERT requests for one contact (called by delivery worker)
+static std::string s_sendmail_digest(Smtp& smtp, EmailJob& job, zmsg_t* reply)
+{
+    const char*              name = job.agent.c_str();
+    std::string              contact;
+    std::vector<DigestAlert> alerts;
+    // parts are kept intact, digest can be retried
+    for (const auto& part : job.parts) {
+        zmsg_t*     msg      = zmsg_dup(part->msg);
+        ZstrGuard   priority(zmsg_popstr(msg));
+        ZstrGuard   extname(zmsg_popstr(msg));
+        ZstrGuard   part_contact(zmsg_popstr(msg));
+        fty_proto_t* alert   = fty_proto_decode(&msg);
+        zmsg_destroy(&msg);
+        if (!alert) {
+            log_error("%s:\tinvalid alert in digest request %s", name, part->uuid.c_str());
+            continue;
+        }
+        contact = part_contact.get();
+        alerts.push_back({alert, priority.get(), extname.get()});
+    }
+
+    try {
+        if (alerts.empty())
+            throw std::runtime_error("No valid alert in digest");
+        std::string subject, body;
+        {
+            MetricsTimer timer(email_metrics().render_us);
+            generate_digest(alerts, subject, body);
+        }
+        s_transport(job, [&]() {
+            smtp.sendmail(contact, subject, body);
+        });
+        zmsg_addstr(reply, "OK");
+        log_info_email_audit("%s: Send email digest of %zu alerts OK: (contact=%s)", name, alerts.size(),
+            contact.c_str());
+    } catch (const std::exception& re) {
+        log_error("Sending of e-mail digest failed : %s", re.what());
+        log_error_email_audit("%s: Send email digest of %zu alerts error (contact=%s): %s", name, alerts.size(),
+            contact.c_str(), re.what());
+        zmsg_addstr(reply, "ERROR");
+        zmsg_addstr(reply, re.what());
+    }
+
+    for (auto& it : alerts)
+        fty_proto_destroy(&it.alert);
+    return "SENDMAIL_ALERT";
+}
+
+/// deliver the request (called by delivery worker)
+static std::string s_deliver(Smtp& smtp, EmailJob& job, zmsg_t* reply)
+{
+    if (job.subject == "SENDMAIL")
+        return s_sendmail(smtp, job, reply);
+    if (job.subject == DIGEST_SUBJECT)
+        return s_sendmail_digest(smtp, job, reply);
+    return s_sendmail_alert(smtp, job, reply);
+}
+
+/// fill alert_key and alert_state of SENDMAIL_ALERT or SENDSMS_ALERT request [priority|extname|contact|alert],
+/// msg is not modified
+/// @return false if the request is invalid (it is refused by the worker)
+static bool s_identify(EmailJob& job, std::string& contact, std::string& rule, std::string& extname)
+{
+    zmsg_t*      dup = zmsg_dup(job.msg);
+    ZstrGuard    priority(zmsg_popstr(dup));
+    ZstrGuard    extname_frame(zmsg_popstr(dup));
+    ZstrGuard    contact_frame(zmsg_popstr(dup));
+    fty_proto_t* alert = fty_proto_decode(&dup);
+    zmsg_destroy(&dup);
+
+    if (!alert || !extname_frame.get() || !contact_frame.get()) {
+        fty_proto_destroy(&alert);
+        return false;
+    }
+
+    contact         = contact_frame.get();
+    rule            = fty_proto_rule(alert) ? fty_proto_rule(alert) : "";
+    extname         = extname_frame.get();
+    job.alert_key   = job.subject + "|" + rule + "|" + extname + "|" + contact;
+    job.alert_state = fty_proto_state(alert) ? fty_proto_state(alert) : "";
+    fty_proto_destroy(&alert);
+    return true;
+}
+
+/// fill shard_key of the job by its (first) recipient, contact of alert request is known already
+static void s_shard(EmailJob& job, const std::string& contact, ShardBy by)
+{
+    std::string recipient = contact;
+    if (job.subject == "SENDMAIL") {
+        zframe_t*   frame = zmsg_first(job.msg);
+        std::string first = frame ? std::string(reinterpret_cast<char*>(zframe_data(frame)), zframe_size(frame)) : "";
+        // [$to|$subject|$body|...] or whole email with headers
+        std::vector<std::string> recipients = zmsg_size(job.msg) == 1 ? smtp_prepare_envelope(first, "").recipients
+                                                                       : smtp_parse_addresses(first);
+        recipient = recipients.empty() ? "" : recipients.front();
+    }
+    job.shard_key = shard_key(recipient, by);
+}
+
+/// send reply [uuid|status|reason] to the sender of alert request, request is done
+static void s_reply_alert(mlm_client_t* client, EmailSpool& spool, const EmailJob& job, const char* status,
+    const std::string& reason)
+{
+    zmsg_t* reply = zmsg_new();
+    zmsg_addstr(reply, job.uuid.c_str());
+    zmsg_addstr(reply, status);
+    zmsg_addstr(reply, reason.c_str());
+    FTY_EMAIL_PROBE(reply_send, job.uuid.c_str(), job.subject.c_str(), zmsg_content_size(reply));
+    int r = mlm_client_sendto(client, job.sender.c_str(), job.subject.c_str(), NULL, 1000, &reply);
+    if (r == -1)
+        log_error("Can't send a reply for %s to %s", job.subject.c_str(), job.sender.c_str());
+    zmsg_destroy(&reply);
+    spool.done(job.spool_id);
+}
+
+/// send reply [spool_id|sender|subject|reply frames...] made by delivery worker
+static void s_send_result(mlm_client_t* client, EmailSpool& spool, zsock_t* results)
+{
+    zmsg_t* reply    = zmsg_recv(results);
+    char*   spool_id = zmsg_popstr(reply);
+    char*   sender   = zmsg_popstr(reply);
+    char*   subject  = zmsg_popstr(reply);
+    if (FTY_EMAIL_PROBE_ENABLED(reply_send)) {
+        ZstrGuard uuid(zmsg_popstr(reply));
+        zmsg_pushstr(reply, uuid.get());
+        FTY_EMAIL_PROBE(reply_send, uuid.get(), subject, zmsg_content_size(reply));
+    }
+    int r = mlm_client_sendto(client, sender, subject, NULL, 1000, &reply);
+    if (r == -1)
+        log_error("Can't send a reply %s to %s", subject, sender);
+    zmsg_destroy(&reply);
+    // reply is not journaled, request is done once delivery finished
+    spool.done(fty::convert<uint64_t>(spool_id));
+    zstr_free(&subject);
+    zstr_free(&sender);
+    zstr_free(&spool_id);
+}
+
+/// send error reply to the sender of the request which was not delivered, request is done; SENDMAIL is replied by
+/// SENDMAIL-ERR [uuid|code|reason], alert requests by [uuid|ERROR|reason]
+static void s_reply_error(mlm_client_t* client, EmailSpool& spool, const EmailJob& job, const std::string& reason)
+{
+    if (job.subject != "SENDMAIL") {
+        s_reply_alert(client, spool, job, "ERROR", reason);
+        return;
+    }
+    zmsg_t* reply = zmsg_new();
+    zmsg_addstr(reply, job.uuid.c_str());
+    zmsg_addstrf(reply, "%" PRIu32, static_cast<uint32_t>(SmtpError::Unknown));
+    zmsg_addstr(reply, reason.c_str());
+    FTY_EMAIL_PROBE(reply_send, job.uuid.c_str(), job.subject.c_str(), zmsg_content_size(reply));
+    int r = mlm_client_sendto(client, job.sender.c_str(), "SENDMAIL-ERR", NULL, 1000, &reply);
+    if (r == -1)
+        log_error("Can't send a reply for %s to %s", job.subject.c_str(), job.sender.c_str());
+    zmsg_destroy(&reply);
+    spool.done(job.spool_id);
+}
+
+/// queue the job for delivery, alert requests superseded by it are replied by SUPERSEDED
+static bool s_submit(EmailWorkerPool& workers, mlm_client_t* client, EmailSpool& spool,
+    std::unique_ptr<EmailJob>& job, bool force = false)
+{
+    EmailMetrics&                          metrics = email_metrics();
+    std::vector<std::unique_ptr<EmailJob>> superseded;
+    std::string                            uuid = job->uuid;
+    if (!workers.submit(job, force, &superseded)) {
+        metrics.rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    metrics.queue_depth.record(workers.queued());
+    metrics.superseded.fetch_add(superseded.size(), std::memory_order_relaxed);
+    for (auto& it : superseded) {
+        // in cancel mode the job itself is among the superseded ones
+        std::string reason = it->uuid == uuid ? "cancelled together with queued active alert" : "superseded by " + uuid;
+        log_info("%s:\t%s %s (%s) %s", it->agent.c_str(), it->subject.c_str(), it->uuid.c_str(),
+            it->alert_key.c_str(), reason.c_str());
+        s_reply_alert(client, spool, *it, "SUPERSEDED", reason);
+    }
+    return true;
+}
+
+/// publish the metrics on the stream of the producer as fty_proto metrics type@name (e.g.
+/// email.requests.sendmail@fty-email), valid for ttl seconds
+static void s_publish_metrics(
+    mlm_client_t* client, const char* name, const std::vector<MetricValue>& values, uint32_t ttl)
+{
+    uint64_t now = uint64_t(time(NULL));
+    for (const auto& it : values) {
+        std::string value   = std::to_string(it.value);
+        zmsg_t*     msg     = fty_proto_encode_metric(NULL, now, ttl, it.name.c_str(), name, value.c_str(),
+            it.unit.c_str());
+        std::string subject = it.name + "@" + name;
+        int         r       = mlm_client_send(client, subject.c_str(), &msg);
+        if (r == -1) {
+            log_warning("%s:\tcannot publish metric %s", name, subject.c_str());
+            zmsg_destroy(&msg);
+            break;
+        }
+    }
+}
+
+/// replace the stats file by the JSON of the metrics
+static void s_write_stats(const std::string& path, const std::string& json)
+{
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << json << std::endl;
+        if (!out) {
+            log_warning("cannot write stats file %s", tmp.c_str());
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+        log_warning("cannot rename %s to %s: %s", tmp.c_str(), path.c_str(), strerror(errno));
 }
 
 /// return dfl is item is NULL or empty string!!
@@ -100,6 +452,8 @@ zmsg_t* fty_email_encode(const char* uuid, const char* to, const char* subject,
 
     va_end(args);
 
+    FTY_EMAIL_PROBE(request_encode, uuid, zmsg_content_size(msg), zmsg_size(msg) - 5);
+
     return msg;
 }
 
@@ -117,17 +471,69 @@ void fty_email_server(zsock_t* pipe, void* args)
     mlm_client_t* client           = mlm_client_new();
     bool          client_connected = false;
 
-    zpoller_t* poller = zpoller_new(pipe, mlm_client_msgpipe(client), NULL);
-
-    Smtp smtp;
+    // smtp holds the settings, emails are delivered by the workers
+    Smtp            smtp;
+    EmailWorkerPool workers{s_deliver};
+    workers.start(1, 1024);
+    // accepted requests are journaled until delivered
+    EmailSpool spool;
+    // spool_dir is set, requests which cannot be journaled are counted
+    bool spooled = false;
+    // alerts for the same contact are coalesced
+    AlertDigest                            digest;
+    std::vector<std::unique_ptr<EmailJob>> digests;
+    // alerts over the rate limits are suppressed
+    AlertRateLimiter ratelimit;
+    // requests are routed to shards by recipient domain (or contact), if server/shards is set
+    size_t  shards     = 0;
+    ShardBy shard_mode = ShardBy::DOMAIN;
+
+    zpoller_t* poller = zpoller_new(pipe, mlm_client_msgpipe(client), workers.results(), NULL);
 
     std::set<std::tuple<std::string, std::string>> streams;
     bool                                           producer = false;
 
+    // metrics are published and written to the stats file every metrics_interval ms
+    EmailMetrics& metrics          = email_metrics();
+    int64_t       metrics_interval = 60 * 1000;
+    int64_t       metrics_due      = zclock_mono() + metrics_interval;
+    std::string   stats_file;
+
     zsock_signal(pipe, 0);
     while (!zsys_interrupted) {
 
-        void* which = zpoller_wait(poller, -1);
+        int     timeout    = SMTP_POOL_EXPIRE_MS;
+        int64_t digest_due = digest.next_due();
+        if (digest_due != -1)
+            timeout = int(std::max<int64_t>(0, std::min<int64_t>(timeout, digest_due - zclock_mono())));
+        if (metrics_interval > 0)
+            timeout = int(std::max<int64_t>(0, std::min<int64_t>(timeout, metrics_due - zclock_mono())));
+
+        void* which = zpoller_wait(poller, timeout);
+
+        if (metrics_interval > 0 && zclock_mono() >= metrics_due) {
+            metrics_due = zclock_mono() + metrics_interval;
+            if (producer)
+                s_publish_metrics(client, name ? name : "fty-email",
+                    metrics.values(workers.queued(), workers.retrying()), uint32_t(2 * metrics_interval / 1000));
+            if (!stats_file.empty())
+                s_write_stats(stats_file, metrics.json(workers.queued(), workers.retrying()));
+        }
+
+        // digests are released even if the mailbox is busy
+        if (digest_due != -1) {
+            digest.expired(zclock_mono(), digests);
+            for (auto& job : digests)
+                s_submit(workers, client, spool, job, true);
+            digests.clear();
+        }
+
+        if (which == NULL) {
+            if (zpoller_terminated(poller))
+                break;
+            smtp.expire_sessions();
+            continue;
+        }
 
         if (which == pipe) {
             zmsg_t* msg = zmsg_recv(pipe);
@@ -153,7 +559,7 @@ void fty_email_server(zsock_t* pipe, void* args)
 
                 if (s_get(config, "server/language", DEFAULT_LANGUAGE)) {
                     language = strdup(s_get(config, "server/language", DEFAULT_LANGUAGE));
-                    int rv   = translation_change_language(language);
+                    int rv   = emailconfiguration_change_language(language);
                     if (rv != TE_OK)
                         log_warning("Language not changed to %s, continuing in %s", language, DEFAULT_LANGUAGE);
                 }
@@ -169,6 +575,16 @@ void fty_email_server(zsock_t* pipe, void* args)
                 if (s_get(config, "smtp/msmtppath", NULL)) {
                     smtp.msmtp_path(s_get(config, "smtp/msmtppath", NULL));
                 }
+                smtp.recipients_header(s_get(config, "smtp/recipients_header", "bcc"));
+                // transport (native|msmtp)
+                smtp.transport(s_get(config, "smtp/transport", "native"));
+                smtp.timeout(fty::convert<int>(s_get(config, "smtp/timeout", "30")));
+                smtp.pipelining(streq(s_get(config, "smtp/pipelining", "true"), "true"));
+                smtp.chunking(streq(s_get(config, "smtp/chunking", "true"), "true"),
+                    fty::convert<size_t>(s_get(config, "smtp/chunk_size", "1048576")));
+                smtp.pool_limits(fty::convert<size_t>(s_get(config, "smtp/pool_max", "2")),
+                    fty::convert<int>(s_get(config, "smtp/pool_idle_timeout", "60")),
+                    fty::convert<int>(s_get(config, "smtp/pool_health_check", "5")));
 
                 // smtp
                 if (s_get(config, "smtp/server", NULL)) {
@@ -202,6 +618,72 @@ void fty_email_server(zsock_t* pipe, void* args)
                 // turn on verify_ca only if smtp/verify_ca is true
                 smtp.verify_ca(streq(zconfig_get(config, "smtp/verify_ca", "false"), "true"));
 
+                // delivery workers, optionally one per shard of recipient domains
+                shards = fty::convert<size_t>(s_get(config, "server/shards", "0"));
+                try {
+                    shard_mode = shard_by(s_get(config, "server/shard_by", "domain"));
+                } catch (const std::invalid_argument& e) {
+                    log_warning("%s:\t%s, using domain", name, e.what());
+                    shard_mode = ShardBy::DOMAIN;
+                }
+                workers.start(fty::convert<size_t>(s_get(config, "server/workers", "4")),
+                    fty::convert<size_t>(s_get(config, "server/queue_size", "1024")), shards);
+                workers.configure(smtp);
+
+                // interfaces whose address is put to the emails
+                emailconfiguration_ip_interfaces(s_get(config, "server/ip_interfaces", "eth0,LAN1"));
+                emailconfiguration_render_cache_size(
+                    fty::convert<size_t>(s_get(config, "server/render_cache_size", "256")));
+                mime_type_cache_size(fty::convert<size_t>(s_get(config, "server/mime_cache_size", "256")));
+                mime_type_fallback(s_get(config, "server/mime_fallback", "magic"));
+
+                // rate limits of alerts (per minute)
+                ratelimit.global(fty::convert<double>(s_get(config, "smtp/ratelimit_global_rate", "0")),
+                    fty::convert<double>(s_get(config, "smtp/ratelimit_global_burst", "100")));
+                ratelimit.contact(fty::convert<double>(s_get(config, "smtp/ratelimit_contact_rate", "0")),
+                    fty::convert<double>(s_get(config, "smtp/ratelimit_contact_burst", "20")));
+                ratelimit.alert(fty::convert<double>(s_get(config, "smtp/ratelimit_alert_rate", "0")),
+                    fty::convert<double>(s_get(config, "smtp/ratelimit_alert_burst", "5")));
+
+                // digest of alerts
+                digest.configure(fty::convert<int64_t>(s_get(config, "smtp/digest_window_ms", "0")),
+                    fty::convert<size_t>(s_get(config, "smtp/digest_max_alerts", "50")));
+                if (!digest.enabled()) {
+                    digest.flush(digests);
+                    for (auto& job : digests)
+                        s_submit(workers, client, spool, job, true);
+                    digests.clear();
+                }
+
+                // metrics (0 disables publishing and the stats file)
+                metrics_interval = fty::convert<int64_t>(s_get(config, "server/metrics_interval", "60")) * 1000;
+                metrics_due      = zclock_mono() + metrics_interval;
+                stats_file       = s_get(config, "server/stats_file", "");
+
+                // retry of transient failures
+                {
+                    RetryPolicy retry;
+                    retry.transient(fty::convert<int64_t>(s_get(config, "server/retry_initial_delay", "2")) * 1000,
+                        fty::convert<int64_t>(s_get(config, "server/retry_max_delay", "300")) * 1000);
+                    retry.max_age(fty::convert<int64_t>(s_get(config, "server/retry_max_age", "3600")) * 1000);
+                    workers.retry(retry);
+                }
+
+                // newer state of queued alert
+                {
+                    const char* supersede = s_get(config, "server/supersede", "replace");
+                    if (streq(supersede, "none"))
+                        workers.supersede(EmailWorkerPool::Supersede::NONE);
+                    else if (streq(supersede, "cancel"))
+                        workers.supersede(EmailWorkerPool::Supersede::CANCEL);
+                    else {
+                        if (!streq(supersede, "replace"))
+                            log_warning("(agent-smtp): server/supersede has unknown value, got %s, expected "
+                                        "(replace|cancel|none)", supersede);
+                        workers.supersede(EmailWorkerPool::Supersede::REPLACE);
+                    }
+                }
+
                 // malamute
                 if (zconfig_get(config, "malamute/verbose", NULL)) {
                     const char* foo         = zconfig_get(config, "malamute/verbose", "false");
@@ -277,6 +759,28 @@ void fty_email_server(zsock_t* pipe, void* args)
                     }
                 }
 
+                // spool is opened once, after name of the actor is known
+                if (!spool.is_open() && s_get(config, "server/spool_dir", NULL)) {
+                    spooled         = true;
+                    std::string dir = std::string(s_get(config, "server/spool_dir", NULL)) + "/" +
+                                      (name ? name : "fty-email");
+                    try {
+                        auto jobs = spool.open(dir);
+                        for (auto& job : jobs) {
+                            log_info("%s:\tdelivering again %s %s from %s", name, job->subject.c_str(),
+                                job->uuid.c_str(), job->sender.c_str());
+                            std::string contact, rule, extname;
+                            if (job->subject != "SENDMAIL")
+                                s_identify(*job, contact, rule, extname);
+                            if (shards != 0)
+                                s_shard(*job, contact, shard_mode);
+                            s_submit(workers, client, spool, job, true);
+                        }
+                    } catch (const std::exception& e) {
+                        log_error("%s:\tspool is disabled: %s", name, e.what());
+                    }
+                }
+
                 zconfig_destroy(&config);
                 zstr_free(&config_file);
             } else if (streq(cmd, "_MSMTP_TEST")) {
@@ -288,10 +792,15 @@ void fty_email_server(zsock_t* pipe, void* args)
                 if (rv == -1) {
                     log_error("%s\t:can't connect on test_client, endpoint=%s", name, endpoint);
                 }
-                std::function<void(const std::string&)> cb = [test_client, test_reader_name](const std::string& data) {
+                // called from delivery workers, mlm_client is not thread safe
+                auto test_mutex = std::make_shared<std::mutex>();
+                std::function<void(const std::string&)> cb = [test_client, test_reader_name, test_mutex](
+                                                                 const std::string& data) {
+                    std::lock_guard<std::mutex> lock(*test_mutex);
                     mlm_client_sendtox(test_client, test_reader_name, "btest", data.c_str(), NULL);
                 };
                 smtp.sendmail_set_test_fn(cb);
+                workers.configure(smtp);
             } else {
                 log_error("unhandled command %s", cmd);
             }
@@ -300,6 +809,12 @@ void fty_email_server(zsock_t* pipe, void* args)
             continue;
         }
 
+        if (which == workers.results()) {
+            // delivery finished, send the reply
+            s_send_result(client, spool, workers.results());
+            continue;
+        }
+
         zmsg_t* zmessage = mlm_client_recv(client);
         if (zmessage == NULL) {
             log_debug("%s:\tzmessage is NULL", name);
@@ -318,98 +833,90 @@ void fty_email_server(zsock_t* pipe, void* args)
                 zmsg_destroy(&zmessage);
                 continue;
             }
-
-            zmsg_t* reply = zmsg_new();
-            zmsg_addstr(reply, uuid);
-            zstr_free(&uuid);
-
-            if (topic == "SENDMAIL") {
-                bool sent_ok = false;
-                try {
-                    if (zmsg_size(zmessage) == 1) {
-                        std::string body = getIpAddr();
-                        ZstrGuard   bodyTemp(zmsg_popstr(zmessage));
-                        body += bodyTemp.get();
-                        log_debug("%s:\tsmtp.sendmail (%s)", name, body.c_str());
-                        log_debug_email_audit("%s: Send email: %s", name, body.c_str());
-                        smtp.sendmail(body);
-                    } else {
-                        zmsg_print(zmessage);
-                        auto mail = smtp.msg2email(&zmessage);
-                        log_debug(mail.c_str());
-                        log_debug_email_audit("%s: Send email: %s", name, mail.c_str());
-                        smtp.sendmail(mail);
-                    }
-                    zmsg_addstr(reply, "0");
-                    zmsg_addstr(reply, "OK");
-                    sent_ok = true;
-                } catch (const std::runtime_error& re) {
-                    log_debug("%s:\tgot std::runtime_error, e.what ()=%s", name, re.what());
-                    log_error_email_audit("%s: Send email error: %s", name, re.what ());
-                    sent_ok       = false;
-                    uint32_t code = static_cast<uint32_t>(msmtp_stderr2code(re.what()));
-                    zmsg_addstrf(reply, "%" PRIu32, code);
-                    zmsg_addstr(reply, UTF8::escape(re.what()).c_str());
-                }
-                if (sent_ok) {
-                    log_info_email_audit("%s: Send email ok", name);
-                }
-                int r = mlm_client_sendto(
-                    client, mlm_client_sender(client), sent_ok ? "SENDMAIL-OK" : "SENDMAIL-ERR", NULL, 1000, &reply);
+            FTY_EMAIL_PROBE(request_receive, uuid, topic.c_str(), zmsg_content_size(zmessage));
+
+            metrics.count(topic);
+            if (topic == "STATS") {
+                zmsg_t* reply = zmsg_new();
+                zmsg_addstr(reply, uuid);
+                zmsg_addstr(reply, "OK");
+                zmsg_addstr(reply, metrics.json(workers.queued(), workers.retrying()).c_str());
+                int r = mlm_client_sendto(client, mlm_client_sender(client), "STATS", NULL, 1000, &reply);
                 if (r == -1)
-                    log_error("Can't send a reply for SENDMAIL to %s", mlm_client_sender(client));
-            } else if (topic == "SENDMAIL_ALERT" || topic == "SENDSMS_ALERT") {
-                char*        priority          = zmsg_popstr(zmessage);
-                char*        extname           = zmsg_popstr(zmessage);
-                char*        contact           = zmsg_popstr(zmessage);
-                fty_proto_t* alert             = fty_proto_decode(&zmessage);
-                std::string  gateway           = gw_template == NULL ? "" : gw_template;
-                std::string  converted_contact = contact == NULL ? "" : contact;
-                std::string audit_contact = converted_contact;
-                bool sent_ok = false;
-                try {
-                    if (topic == "SENDSMS_ALERT") {
-                        log_debug("gw_template = %s", gw_template);
-                        log_debug("contact = %s", contact);
-                        std::string _contact = sms_email_address(gateway, converted_contact);
-                        audit_contact = _contact;
-                        s_notify(smtp, priority, extname, _contact, alert);
-                    } else {
-                        s_notify(smtp, priority, extname, converted_contact, alert);
+                    log_error("Can't send a reply for STATS to %s", mlm_client_sender(client));
+                zmsg_destroy(&reply);
+            } else if (topic == "SENDMAIL" || topic == "SENDMAIL_ALERT" || topic == "SENDSMS_ALERT") {
+                std::unique_ptr<EmailJob> job{new EmailJob};
+                job->sender      = mlm_client_sender(client);
+                job->subject     = topic;
+                job->uuid        = uuid;
+                job->agent       = name ? name : "";
+                job->gw_template = gw_template == NULL ? "" : gw_template;
+                job->msg         = zmessage;
+                zmessage         = NULL;
+
+                // flapping rule must not flood the contact (and get us throttled by the relay)
+                AlertRateLimiter::Level level = AlertRateLimiter::ALLOWED;
+                std::string             contact, rule, extname;
+                if (topic != "SENDMAIL" && s_identify(*job, contact, rule, extname))
+                    level = ratelimit.allow(contact, rule, extname, job->alert_state, zclock_mono());
+                if (shards != 0)
+                    s_shard(*job, contact, shard_mode);
+
+                if (level != AlertRateLimiter::ALLOWED) {
+                    log_warning("%s:\t%s %s from %s suppressed by %s rate limit (%" PRIu64 " suppressed)", name,
+                        topic.c_str(), uuid, mlm_client_sender(client), AlertRateLimiter::name(level),
+                        ratelimit.suppressed());
+                    char* reason = zsys_sprintf("%s rate limit exceeded, %" PRIu64 " alerts suppressed",
+                        AlertRateLimiter::name(level), ratelimit.suppressed());
+                    s_reply_alert(client, spool, *job, "SUPPRESSED", reason);
+                    metrics.suppressed.fetch_add(1, std::memory_order_relaxed);
+                    zstr_free(&reason);
+                } else {
+                    // delivered anyway, but it is not durable
+                    if (!spool.append(*job) && spooled) {
+                        log_warning("%s:\t%s %s from %s cannot be journaled, it is lost on restart", name,
+                            topic.c_str(), uuid, mlm_client_sender(client));
+                        metrics.unjournaled.fetch_add(1, std::memory_order_relaxed);
                     }
-                    zmsg_addstr(reply, "OK");
-                    sent_ok = true;
-                } catch (const std::exception& re) {
-                    log_error("Sending of e-mail/SMS alert failed : %s", re.what());
-                    if (!audit_contact.empty()) {
-                        // Workaround for unwanted logs: log audit only if contact is not empty
-                        log_error_email_audit("%s: Send email/SMS alert error (gateway=%s contact=%s extname=%s): %s",
-                            name, gateway.c_str(), audit_contact.c_str(), extname ? extname : "", re.what ());
+                    if (digest.add(job, zclock_mono(), digests)) {
+                        // held in the digest, or the digest is complete
+                        for (auto& it : digests)
+                            s_submit(workers, client, spool, it, true);
+                        digests.clear();
+                    } else if (!s_submit(workers, client, spool, job)) {
+                        log_error("%s:\tdelivery queue is full, %s from %s rejected", name, topic.c_str(),
+                            mlm_client_sender(client));
+                        s_reply_error(client, spool, *job, "delivery queue is full");
                     }
-                    zmsg_addstr(reply, "ERROR");
-                    zmsg_addstr(reply, re.what());
-                }
-                if (sent_ok) {
-                    log_info_email_audit("%s: Send email/SMS alert OK: (gateway=%s contact=%s extname=%s)",
-                        name, gateway.c_str(), audit_contact.c_str(), extname ? extname : "");
                 }
-                int r = mlm_client_sendto(client, mlm_client_sender(client),
-                    (topic == "SENDMAIL_ALERT") ? "SENDMAIL_ALERT" : "SENDSMS_ALERT", NULL, 1000, &reply);
-                if (r == -1)
-                    log_error("Can't send a reply for SENDMAIL_ALERT to %s", mlm_client_sender(client));
-                fty_proto_destroy(&alert);
-                zstr_free(&contact);
-                zstr_free(&extname);
-                zstr_free(&priority);
             } else
                 log_warning("%s:\tUnknown subject %s", name, topic.c_str());
 
-            zmsg_destroy(&reply);
+            zstr_free(&uuid);
             zmsg_destroy(&zmessage);
             continue;
         }
     }
 
+    workers.stop();
+    // replies of deliveries finished before the workers stopped
+    while (zsock_events(workers.results()) & ZMQ_POLLIN)
+        s_send_result(client, spool, workers.results());
+    // requests accepted and not delivered are replied, unless they are journaled and delivered after restart
+    std::vector<std::unique_ptr<EmailJob>> undelivered;
+    digest.flush(undelivered);
+    workers.drain(undelivered);
+    for (auto& job : undelivered) {
+        for (auto& part : job->parts) {
+            if (part->spool_id == 0)
+                s_reply_error(client, spool, *part, "agent stopped before delivery");
+        }
+        if (job->parts.empty() && job->spool_id == 0)
+            s_reply_error(client, spool, *job, "agent stopped before delivery");
+    }
+    if (!undelivered.empty())
+        log_info("%s:\t%zu request(s) were not delivered before stop", name, undelivered.size());
     zstr_free(&name);
     zstr_free(&endpoint);
     zstr_free(&test_reader_name);
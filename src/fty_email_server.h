@@ -28,6 +28,24 @@
 ///
 ///  server
 ///      verbose             1 turns verbose mode on, 0 off
+///      workers             number of delivery threads (default 4)
+///      queue_size          maximum of requests waiting for delivery (default 1024)
+///      shards              number of delivery shards, each delivers requests of its recipient domains in order by
+///                          its own worker, replaces workers (default 0, disabled)
+///      shard_by            shard key, domain or contact of the recipient (default domain)
+///      spool_dir           journal of accepted requests, undelivered ones are delivered again after restart
+///      retry_initial_delay delay (s) before retry of transient failure, doubled each attempt (default 2, 0 disables)
+///      retry_max_delay     maximum delay (s) between retries (default 300)
+///      retry_max_age       age (s) of request after which it is not retried (default 3600)
+///      ip_interfaces       comma separated interfaces whose address is put to emails (default eth0,LAN1)
+///      render_cache_size   number of rendered alert notifications kept for other contacts (default 256)
+///      mime_cache_size     number of attachment MIME types detected by libmagic kept (default 256)
+///      mime_fallback       MIME type of attachments with unknown extension, magic to detect it (default magic)
+///      supersede           newer state of queued alert replaces it (replace), RESOLVED cancels queued ACTIVE and
+///                          neither is sent (cancel), or both are sent (none), default replace
+///      metrics_interval    period (s) of publishing metrics on producer stream and writing stats_file (default
+///                          60, 0 disables)
+///      stats_file          file replaced by JSON of metrics each metrics_interval
 ///      assets              path to state file for assets
 ///      alerts              path to state file for alerts
 ///  smtp
@@ -37,13 +55,31 @@
 ///      password            password of user
 ///      from                From: header of email
 ///      encryption          encryption, can be (none|tls|starttls)
-///      msmtppath           path to msmtp command
+///      recipients_header   To: header of multi-recipient email (list|individual|bcc), default bcc
+///      transport           transport used to deliver emails (native|msmtp), default native
+///      timeout             timeout of SMTP connection and each read/write in seconds (native transport)
+///      pipelining          true to pipeline SMTP envelope if server supports PIPELINING (native transport)
+///      chunking            true to send email by BDAT if server supports CHUNKING (native transport)
+///      chunk_size          size of one BDAT chunk in bytes
+///      pool_max            maximum of SMTP sessions kept open to the server, 0 disables reuse (native transport)
+///      pool_idle_timeout   idle SMTP session is closed after this number of seconds
+///      pool_health_check   SMTP session idle for longer than this number of seconds is checked by NOOP
+///      digest_window_ms    alerts for one contact are coalesced to one email for this time, 0 disables digest
+///      digest_max_alerts   digest is sent once it has this number of alerts (default 50)
+///      ratelimit_global_rate, ratelimit_global_burst
+///                          token bucket of all alert emails, rate per minute (0 disables) and bucket size
+///      ratelimit_contact_rate, ratelimit_contact_burst
+///                          token bucket of alert emails per contact
+///      ratelimit_alert_rate, ratelimit_alert_burst
+///                          token bucket of alert emails per contact, rule and asset
+///      msmtppath           path to msmtp command (msmtp transport)
 ///      smsgateway          email to sms gateway
 ///      verify_ca           1 turns on CA verification, 0 off
 ///  malamute
 ///      verbose             1 setup verbose mode of mlm_client, 0 turn it off
 ///      endpoint            malamute endpoint address
 ///      address             mailbox address of agent-smtp
+///      producer            stream the metrics (fty_proto METRIC email.*@$address) are published on
 ///      consumers
 ///          ALERTS  .*      consume all messages on ALERTS stream
 ///          ASSETS  .*      consume all messages on ASSETS stream
@@ -70,8 +106,19 @@
 ///  REP: subject=SENDMAIL-OK [$uuid|0|OK]
 ///      if email was sent
 ///  REP: subject=SENDMAIL-ERR [$uuid|$error code|$error message]
-///      if email wasn't sent, or there was improper number of arguments
-///      error message comes from msmtp stderr and is NOT normalized!
+///      if email wasn't sent, or there was improper number of arguments, or delivery queue is full
+///      error message comes from msmtp stderr or native SMTP client and is NOT normalized!
+///
+///  Requests are queued and delivered by server/workers threads, the reply is sent when delivery finishes,
+///  so replies to different requests can come in different order. Transient SMTP failures are retried, the error
+///  is replied once retries are exhausted. Requests still in the spool when the agent was
+///  stopped are delivered again on startup (at least once delivery), their replies go to the original sender.
+///  SENDMAIL_ALERT and SENDSMS_ALERT requests still queued when newer state of the same alert (rule, asset and
+///  contact) comes are replied [$uuid|SUPERSEDED|$reason], see server/supersede.
+///
+///  REQ: subject=STATS [$uuid]
+///  REP: subject=STATS [$uuid|OK|$json]
+///      counters and histograms of the agent (see fty_email_metrics.h), cumulative since start of the process
 ///
 ///  args:
 ///      "sendmail-only"      : ignore consumer/ part, connect as $(malamute/address)-sendmail-only
@@ -0,0 +1,91 @@
+/*  =========================================================================
+    fty_email_shard - Routing of requests to delivery shards
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_shard - Routing of requests to delivery shards
+@discuss
+    With server/shards set, each delivery worker owns one shard with its own queue. Request goes to the shard of
+    its recipient domain, so that requests for one domain are delivered in the order they were accepted, while
+    different domains are delivered in parallel.
+@end
+*/
+
+#include "fty_email_shard.h"
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+ShardRing::ShardRing(size_t shards)
+    : _shards(std::max<size_t>(shards, 1))
+{
+    _ring.reserve(_shards * REPLICAS);
+    for (size_t shard = 0; shard != _shards; shard++) {
+        for (unsigned replica = 0; replica != REPLICAS; replica++)
+            _ring.emplace_back(hash(std::to_string(shard) + "#" + std::to_string(replica)), shard);
+    }
+    std::sort(_ring.begin(), _ring.end());
+}
+
+uint64_t ShardRing::hash(const std::string& key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char ch : key) {
+        h ^= ch;
+        h *= 1099511628211ULL;
+    }
+    // FNV-1a of similar short keys differs in low bits only, points would cluster on the ring
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t ShardRing::shard(const std::string& key) const
+{
+    if (_shards == 1)
+        return 0;
+    auto it = std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(hash(key), size_t(0)));
+    if (it == _ring.end())
+        it = _ring.begin();
+    return it->second;
+}
+
+ShardBy shard_by(const std::string& name)
+{
+    if (name == "domain")
+        return ShardBy::DOMAIN;
+    if (name == "contact")
+        return ShardBy::CONTACT;
+    throw std::invalid_argument("unknown shard_by " + name);
+}
+
+std::string shard_key(const std::string& address, ShardBy by)
+{
+    size_t      at  = address.rfind('@');
+    std::string ret = by == ShardBy::DOMAIN && at != std::string::npos ? address.substr(at + 1) : address;
+    std::transform(ret.begin(), ret.end(), ret.begin(), [](unsigned char ch) {
+        return char(std::tolower(ch));
+    });
+    return ret;
+}
@@ -0,0 +1,77 @@
+/*  =========================================================================
+    fty_email_shard - Routing of requests to delivery shards
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+///  @class ShardRing
+///
+///  Consistent hashing of keys to shards
+///
+///  Each shard has REPLICAS points on a ring of 64 bit hashes, key belongs to the shard of the first point at or
+///  after its hash. When the number of shards changes from n to n + 1, only about 1/(n + 1) of the keys move, all of
+///  them to the new shard.
+class ShardRing
+{
+public:
+    static const unsigned REPLICAS = 64;
+
+    /// @param shards  number of shards, at least 1
+    explicit ShardRing(size_t shards = 1);
+
+    /// @return number of shards
+    size_t shards() const
+    {
+        return _shards;
+    }
+
+    /// @return shard of the key, 0 .. shards() - 1
+    size_t shard(const std::string& key) const;
+
+    /// @return 64 bit hash of the key (FNV-1a with final mixing)
+    static uint64_t hash(const std::string& key);
+
+protected:
+    size_t                                   _shards;
+    std::vector<std::pair<uint64_t, size_t>> _ring;
+};
+
+/// how requests are assigned to shards
+enum class ShardBy
+{
+    /// domain of the recipient, all the emails for one relay domain are delivered in order by one worker
+    DOMAIN,
+    /// recipient address
+    CONTACT
+};
+
+/// @param name  domain or contact
+/// @throw std::invalid_argument for other names
+ShardBy shard_by(const std::string& name);
+
+/// @param address  recipient address (joe@Example.com), or contact without domain (phone number of SMS)
+/// @return shard key of the recipient in lower case: domain (DOMAIN) or address (CONTACT); address without domain
+///         is the key in both cases
+std::string shard_key(const std::string& address, ShardBy by);
@@ -0,0 +1,446 @@
+/*  =========================================================================
+    fty_email_spool - Persistent outbox of email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_spool - Persistent outbox of email actor
+@discuss
+    Requests survive restart of fty-email: they are journaled before being queued and replayed on startup.
+@end
+*/
+
+#include "fty_email_spool.h"
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fty_log.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+#define SPOOL_FILE_MAGIC   "FTYESPL1"
+#define SPOOL_HEADER_SIZE  16
+#define SPOOL_RECORD_MAGIC 0x46544552 // "FTER"
+#define SPOOL_PUT          1
+#define SPOOL_DONE         2
+// journal grows by this size
+#define SPOOL_GROW (1024 * 1024)
+// journal is compacted if it is bigger than this and more than half of it are finished requests
+#define SPOOL_COMPACT_SIZE (4 * 1024 * 1024)
+
+struct SpoolRecord
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t id;
+    uint32_t size;
+    uint32_t crc;
+};
+
+static_assert(sizeof(SpoolRecord) == 24, "unexpected size of spool record header");
+
+// ----------------------------------------------------------------------------
+// static helper functions
+
+static uint32_t s_crc32(const void* data, size_t size)
+{
+    static uint32_t table[256] = {0};
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    uint32_t             crc = 0xFFFFFFFFu;
+    const unsigned char* p   = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static size_t s_align(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+static std::string s_popstr(zmsg_t* msg)
+{
+    char*       str = zmsg_popstr(msg);
+    std::string ret = str ? str : "";
+    zstr_free(&str);
+    return ret;
+}
+
+// ----------------------------------------------------------------------------
+// EmailSpool
+
+EmailSpool::EmailSpool()
+    : _fd(-1)
+    , _map(nullptr)
+    , _map_size(0)
+    , _offset(0)
+    , _dead(0)
+    , _next_id(1)
+{
+}
+
+EmailSpool::~EmailSpool()
+{
+    close();
+}
+
+void EmailSpool::close()
+{
+    if (_map) {
+        munmap(_map, _map_size);
+        _map      = nullptr;
+        _map_size = 0;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _pending.clear();
+    _offset = 0;
+    _dead   = 0;
+}
+
+void EmailSpool::map(size_t size)
+{
+    if (ftruncate(_fd, off_t(size)) == -1)
+        throw std::runtime_error("cannot resize spool journal: " + std::string(strerror(errno)));
+
+    void* ptr = _map ? mremap(_map, _map_size, size, MREMAP_MAYMOVE)
+                     : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("cannot map spool journal: " + std::string(strerror(errno)));
+    _map      = static_cast<char*>(ptr);
+    _map_size = size;
+}
+
+void EmailSpool::reserve(size_t size)
+{
+    if (_offset + size <= _map_size)
+        return;
+    size_t new_size = ((_offset + size) / SPOOL_GROW + 1) * SPOOL_GROW;
+    map(new_size);
+}
+
+std::vector<std::unique_ptr<EmailJob>> EmailSpool::open(const std::string& dir)
+{
+    close();
+    _dir = dir;
+
+    std::error_code ec;
+    fs::create_directories(fs::path(dir) / "attachments", ec);
+    if (ec)
+        throw std::runtime_error("cannot create spool directory " + dir + ": " + ec.message());
+
+    std::string path = dir + "/journal";
+    _fd              = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (_fd == -1)
+        throw std::runtime_error("cannot open spool journal " + path + ": " + strerror(errno));
+
+    struct stat st;
+    fstat(_fd, &st);
+    size_t size = size_t(st.st_size);
+    if (size < SPOOL_HEADER_SIZE || size % SPOOL_GROW != 0)
+        size = ((size + SPOOL_HEADER_SIZE) / SPOOL_GROW + 1) * SPOOL_GROW;
+    map(size);
+
+    if (memcmp(_map, SPOOL_FILE_MAGIC, 8) != 0) {
+        if (st.st_size != 0)
+            log_warning("spool journal %s has unknown format, starting empty", path.c_str());
+        memset(_map, 0, _map_size);
+        reset();
+        return {};
+    }
+
+    // replay the journal
+    std::map<uint64_t, size_t> pending;
+    size_t                     offset = SPOOL_HEADER_SIZE;
+    while (offset + sizeof(SpoolRecord) <= _map_size) {
+        SpoolRecord rec;
+        memcpy(&rec, _map + offset, sizeof(rec));
+        if (rec.magic != SPOOL_RECORD_MAGIC || offset + sizeof(rec) + rec.size > _map_size)
+            break;
+        if (s_crc32(_map + offset + sizeof(rec), rec.size) != rec.crc) {
+            log_warning("spool journal %s: torn record at offset %zu ignored", path.c_str(), offset);
+            break;
+        }
+        if (rec.type == SPOOL_PUT)
+            pending[rec.id] = offset;
+        else if (rec.type == SPOOL_DONE)
+            pending.erase(rec.id);
+        _next_id = std::max(_next_id, rec.id + 1);
+        offset += s_align(sizeof(rec) + rec.size);
+    }
+    _offset  = offset;
+    _pending = pending;
+    _dead    = 0;
+    // anything after the last valid record is garbage of interrupted append
+    memset(_map + _offset, 0, _map_size - _offset);
+
+    std::vector<std::unique_ptr<EmailJob>> jobs;
+    for (auto it = _pending.begin(); it != _pending.end();) {
+        SpoolRecord rec;
+        memcpy(&rec, _map + it->second, sizeof(rec));
+        zframe_t* frame = zframe_new(_map + it->second + sizeof(rec), rec.size);
+        zmsg_t*   msg   = zmsg_decode(frame);
+        zframe_destroy(&frame);
+        if (!msg) {
+            log_error("spool journal %s: request %" PRIu64 " cannot be decoded", path.c_str(), it->first);
+            removeAttachments(it->first);
+            it = _pending.erase(it);
+            continue;
+        }
+
+        std::unique_ptr<EmailJob> job{new EmailJob};
+        job->spool_id    = it->first;
+        job->sender      = s_popstr(msg);
+        job->subject     = s_popstr(msg);
+        job->uuid        = s_popstr(msg);
+        job->agent       = s_popstr(msg);
+        job->gw_template = s_popstr(msg);
+        job->msg         = msg;
+        jobs.push_back(std::move(job));
+        ++it;
+    }
+    // attachments of requests whose PUT record did not make it to the journal
+    for (const auto& entry : fs::directory_iterator(fs::path(dir) / "attachments", ec)) {
+        uint64_t id = strtoull(entry.path().filename().c_str(), nullptr, 10);
+        if (_pending.count(id) == 0)
+            fs::remove_all(entry.path(), ec);
+    }
+    log_info("spool %s opened, %zu request(s) to be delivered again", dir.c_str(), jobs.size());
+
+    // pending records are rewritten to the beginning of the journal
+    compact();
+    return jobs;
+}
+
+void EmailSpool::reset()
+{
+    if (_map_size > SPOOL_GROW) {
+        munmap(_map, _map_size);
+        _map      = nullptr;
+        _map_size = 0;
+        map(SPOOL_GROW);
+    }
+    // only the used part is cleared, the rest is zero already
+    size_t used = std::min(std::max(_offset, size_t(SPOOL_HEADER_SIZE)), _map_size);
+    memset(_map, 0, used);
+    memcpy(_map, SPOOL_FILE_MAGIC, 8);
+    sync(0, used);
+    _offset = SPOOL_HEADER_SIZE;
+    _dead   = 0;
+}
+
+size_t EmailSpool::write(uint32_t type, uint64_t id, const void* payload, size_t size)
+{
+    size_t total = s_align(sizeof(SpoolRecord) + size);
+    // keep space for the end marker (zero magic)
+    reserve(total + sizeof(SpoolRecord));
+
+    SpoolRecord rec;
+    rec.magic = SPOOL_RECORD_MAGIC;
+    rec.type  = type;
+    rec.id    = id;
+    rec.size  = uint32_t(size);
+    rec.crc   = s_crc32(payload, size);
+
+    size_t offset = _offset;
+    if (size)
+        memcpy(_map + offset + sizeof(rec), payload, size);
+    memcpy(_map + offset, &rec, sizeof(rec));
+    _offset += total;
+    sync(offset, total);
+    return offset;
+}
+
+void EmailSpool::sync(size_t offset, size_t size)
+{
+    static const size_t page  = size_t(sysconf(_SC_PAGESIZE));
+    size_t              begin = offset - offset % page;
+    if (msync(_map + begin, offset + size - begin, MS_SYNC) == -1)
+        log_error("msync of spool journal failed: %s", strerror(errno));
+}
+
+bool EmailSpool::append(EmailJob& job)
+{
+    if (!is_open())
+        return false;
+
+    uint64_t id = _next_id++;
+    try {
+        snapshotAttachments(job, id);
+    } catch (const std::exception& e) {
+        log_error("cannot snapshot attachments of %s to spool: %s", job.uuid.c_str(), e.what());
+        removeAttachments(id);
+        return false;
+    }
+
+    zmsg_t* msg = job.msg ? zmsg_dup(job.msg) : zmsg_new();
+    zmsg_pushstr(msg, job.gw_template.c_str());
+    zmsg_pushstr(msg, job.agent.c_str());
+    zmsg_pushstr(msg, job.uuid.c_str());
+    zmsg_pushstr(msg, job.subject.c_str());
+    zmsg_pushstr(msg, job.sender.c_str());
+    zframe_t* frame = zmsg_encode(msg);
+    zmsg_destroy(&msg);
+
+    try {
+        size_t offset = write(SPOOL_PUT, id, zframe_data(frame), zframe_size(frame));
+        _pending[id]  = offset;
+        job.spool_id  = id;
+    } catch (const std::exception& e) {
+        log_error("cannot write %s to spool: %s", job.uuid.c_str(), e.what());
+        removeAttachments(id);
+        zframe_destroy(&frame);
+        return false;
+    }
+    zframe_destroy(&frame);
+    return true;
+}
+
+void EmailSpool::done(uint64_t id)
+{
+    if (!is_open() || id == 0)
+        return;
+
+    auto it = _pending.find(id);
+    if (it == _pending.end())
+        return;
+
+    SpoolRecord rec;
+    memcpy(&rec, _map + it->second, sizeof(rec));
+    _dead += s_align(sizeof(rec) + rec.size);
+    _pending.erase(it);
+    removeAttachments(id);
+
+    try {
+        if (_pending.empty()) {
+            reset();
+            return;
+        }
+        write(SPOOL_DONE, id, nullptr, 0);
+        _dead += s_align(sizeof(SpoolRecord));
+        if (_offset > SPOOL_COMPACT_SIZE && _dead > _offset / 2)
+            compact();
+    } catch (const std::exception& e) {
+        log_error("cannot mark %" PRIu64 " done in spool: %s", id, e.what());
+    }
+}
+
+void EmailSpool::compact()
+{
+    if (_pending.empty()) {
+        reset();
+        return;
+    }
+
+    // live records are copied to new journal, which atomically replaces the old one
+    std::string path = _dir + "/journal";
+    std::string tmp  = path + ".tmp";
+    int         fd   = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_error("cannot compact spool journal: %s", strerror(errno));
+        return;
+    }
+
+    std::string                buf(SPOOL_HEADER_SIZE, '\0');
+    std::map<uint64_t, size_t> pending;
+    memcpy(&buf[0], SPOOL_FILE_MAGIC, 8);
+    for (const auto& it : _pending) {
+        SpoolRecord rec;
+        memcpy(&rec, _map + it.second, sizeof(rec));
+        pending[it.first] = buf.size();
+        buf.append(_map + it.second, s_align(sizeof(rec) + rec.size));
+    }
+    size_t size = (buf.size() / SPOOL_GROW + 1) * SPOOL_GROW;
+
+    bool ok = ::write(fd, buf.data(), buf.size()) == ssize_t(buf.size()) && ftruncate(fd, off_t(size)) == 0 &&
+              fsync(fd) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        log_error("cannot compact spool journal: %s", strerror(errno));
+        ::close(fd);
+        unlink(tmp.c_str());
+        return;
+    }
+
+    munmap(_map, _map_size);
+    ::close(_fd);
+    _fd      = fd;
+    _map     = nullptr;
+    _map_size = 0;
+    map(size);
+    _offset  = buf.size();
+    _dead    = 0;
+    _pending = pending;
+}
+
+void EmailSpool::snapshotAttachments(EmailJob& job, uint64_t id)
+{
+    // only SENDMAIL [to|subject|body|headers|path1|path2|...] refers to files
+    if (job.subject != "SENDMAIL" || !job.msg || zmsg_size(job.msg) <= 4)
+        return;
+
+    fs::path dir = fs::path(_dir) / "attachments" / std::to_string(id);
+    fs::create_directories(dir);
+
+    zmsg_t*   msg   = zmsg_new();
+    size_t    index = 0;
+    for (zframe_t* frame = zmsg_first(job.msg); frame != nullptr; frame = zmsg_next(job.msg), index++) {
+        if (index < 4) {
+            zframe_t* dup = zframe_dup(frame);
+            zmsg_append(msg, &dup);
+            continue;
+        }
+
+        char*    path   = zframe_strdup(frame);
+        fs::path target = dir / std::to_string(index - 4);
+        fs::create_directories(target);
+        // keep the file name, it is used in the attachment
+        target /= fs::path(path).filename();
+
+        std::error_code ec;
+        // hard link is cheap and survives removal of the original, copy is the fallback across filesystems
+        fs::create_hard_link(path, target, ec);
+        if (ec)
+            fs::copy_file(path, target, fs::copy_options::overwrite_existing);
+        zstr_free(&path);
+        zmsg_addstr(msg, target.c_str());
+    }
+    zmsg_destroy(&job.msg);
+    job.msg = msg;
+}
+
+void EmailSpool::removeAttachments(uint64_t id)
+{
+    std::error_code ec;
+    fs::remove_all(fs::path(_dir) / "attachments" / std::to_string(id), ec);
+}
@@ -0,0 +1,105 @@
+/*  =========================================================================
+    fty_email_spool - Persistent outbox of email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "fty_email_worker.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+///  @class EmailSpool
+///
+///  Write-ahead journal of accepted requests
+///
+///  Each accepted request is appended to memory mapped journal $dir/journal and synced to disk before it is queued
+///  for delivery, its attachments are snapshotted to $dir/attachments/$id. When delivery finishes the request is
+///  marked done. Journal is truncated once nothing is pending and compacted when done records take most of it.
+///  Requests not marked done are returned by open after restart and are delivered again.
+///
+///  Journal format: 16 bytes file header followed by records
+///      [magic:4|type:4|id:8|size:4|crc32:4|payload:size|padding to 8 bytes]
+///  where payload of PUT record is zmsg_encode of [sender|subject|uuid|agent|gw_template|request frames...] and DONE
+///  record has no payload. Torn record at the end (crash during append) is detected by crc32 and ignored.
+class EmailSpool
+{
+public:
+    EmailSpool();
+    ~EmailSpool();
+
+    EmailSpool(const EmailSpool&) = delete;
+    EmailSpool& operator=(const EmailSpool&) = delete;
+
+    /// open (or create) the spool in directory and return requests which were not delivered
+    /// @throws std::runtime_error if spool cannot be opened
+    std::vector<std::unique_ptr<EmailJob>> open(const std::string& dir);
+
+    /// close the spool, pending requests stay in the journal
+    void close();
+
+    /// @return true if spool is open
+    bool is_open() const
+    {
+        return _fd != -1;
+    }
+
+    /// @return directory of the spool
+    const std::string& dir() const
+    {
+        return _dir;
+    }
+
+    /// snapshot the attachments, append the request to journal and sync it to disk, job->spool_id is set
+    /// @return false if the request cannot be stored (it is logged)
+    bool append(EmailJob& job);
+
+    /// mark request as delivered (or finally failed), remove its attachments
+    void done(uint64_t id);
+
+    /// @return number of requests not marked done
+    size_t pending() const
+    {
+        return _pending.size();
+    }
+
+protected:
+    void   map(size_t size);
+    void   reserve(size_t size);
+    size_t write(uint32_t type, uint64_t id, const void* payload, size_t size);
+    void   sync(size_t offset, size_t size);
+    void   compact();
+    void   reset();
+    void   snapshotAttachments(EmailJob& job, uint64_t id);
+    void   removeAttachments(uint64_t id);
+
+    std::string _dir;
+    int         _fd;
+    char*       _map;
+    size_t      _map_size;
+    /// end of the last valid record
+    size_t _offset;
+    /// bytes taken by records of finished requests
+    size_t   _dead;
+    uint64_t _next_id;
+    /// offset of PUT record of pending requests
+    std::map<uint64_t, size_t> _pending;
+};
@@ -0,0 +1,57 @@
+/*  =========================================================================
+    fty_email_trace - Static tracepoints of the message lifecycle
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_trace - Static tracepoints of the message lifecycle
+@discuss
+    Semaphores of the probes live in .probes section, where the tracer finds them by the address stored in the
+    stapsdt notes.
+@end
+*/
+
+#include "fty_email_trace.h"
+
+#ifdef FTY_EMAIL_SDT
+// C linkage is given by the declarations in the header
+#define FTY_EMAIL_SEMAPHORE_DEFINE(name)                                                                              \
+    __attribute__((section(".probes"))) volatile unsigned short fty_email_##name##_semaphore = 0;
+FTY_EMAIL_PROBES(FTY_EMAIL_SEMAPHORE_DEFINE)
+#undef FTY_EMAIL_SEMAPHORE_DEFINE
+#endif
+
+static thread_local const char* s_uuid = "";
+
+TraceRequest::TraceRequest(const std::string& uuid)
+    : _previous(s_uuid)
+{
+    s_uuid = uuid.c_str();
+}
+
+TraceRequest::~TraceRequest()
+{
+    s_uuid = _previous;
+}
+
+const char* TraceRequest::uuid()
+{
+    return s_uuid;
+}
@@ -0,0 +1,136 @@
+/*  =========================================================================
+    fty_email_trace - Static tracepoints of the message lifecycle
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   fty_email_trace.h
+/// @brief  USDT probes (provider fty_email) at each stage of a request, for bpftrace/systemtap on running units
+///
+/// Probes are built in when <sys/sdt.h> (systemtap-sdt-dev) is found, unless FTY_EMAIL_NO_SDT is defined. Each
+/// probe has a semaphore, arguments are evaluated only while a tracer is attached, otherwise the probe costs a
+/// load of the semaphore and a not taken branch.
+///
+///    bpftrace -e 'usdt:/usr/bin/fty-email:fty_email:deliver_start { @t[str(arg0)] = nsecs; }
+///                 usdt:/usr/bin/fty-email:fty_email:deliver_end { @us = hist((nsecs - @t[str(arg0)]) / 1000); }'
+///
+/// The first argument of all the probes is uuid of the request (const char*, "" if unknown), the others:
+///
+///    request_receive   (uuid, subject, bytes)             request taken from the mailbox by the actor
+///    request_encode    (uuid, bytes, attachments)         SENDMAIL request made by fty_email_encode
+///    deliver_start     (uuid, subject, attempt)           delivery worker starts the request
+///    mime_start        (uuid, bytes)                      SENDMAIL request is converted to MIME email
+///    mime_end          (uuid, text_bytes, attachments)
+///    magic_start       (uuid, path)                       MIME type of the attachment is detected by libmagic
+///    magic_end         (uuid, path, mime_type)
+///    attachment_start  (uuid, path, encoding)             attachment is read, encoded and written to transport
+///    attachment_end    (uuid, path, bytes)
+///    connect_start     (uuid, host, port)                 native transport opens SMTP session
+///    connect_end       (uuid, host, port)
+///    spawn_start       (uuid, path)                       msmtp transport starts msmtp
+///    spawn_end         (uuid, path, pid)
+///    data_start        (uuid)                             email data are written to SMTP server or msmtp
+///    data_end          (uuid, bytes, status)              SMTP reply code or msmtp exit code
+///    deliver_end       (uuid, subject, error)             delivery attempt finished, error is SmtpError
+///    reply_send        (uuid, subject, bytes)             reply is sent to the requester
+
+#pragma once
+
+#if !defined(FTY_EMAIL_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FTY_EMAIL_SDT 1
+#endif
+#endif
+
+#include <string>
+
+#define FTY_EMAIL_PROBES(X)                                                                                           \
+    X(request_receive)                                                                                                \
+    X(request_encode)                                                                                                 \
+    X(deliver_start)                                                                                                  \
+    X(mime_start)                                                                                                     \
+    X(mime_end)                                                                                                       \
+    X(magic_start)                                                                                                    \
+    X(magic_end)                                                                                                      \
+    X(attachment_start)                                                                                               \
+    X(attachment_end)                                                                                                 \
+    X(connect_start)                                                                                                  \
+    X(connect_end)                                                                                                    \
+    X(spawn_start)                                                                                                    \
+    X(spawn_end)                                                                                                      \
+    X(data_start)                                                                                                     \
+    X(data_end)                                                                                                       \
+    X(deliver_end)                                                                                                    \
+    X(reply_send)
+
+#ifdef FTY_EMAIL_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// semaphores are incremented by the tracer when it attaches the probe, the names are given by sys/sdt.h
+#define FTY_EMAIL_SEMAPHORE_DECLARE(name) extern "C" volatile unsigned short fty_email_##name##_semaphore;
+FTY_EMAIL_PROBES(FTY_EMAIL_SEMAPHORE_DECLARE)
+#undef FTY_EMAIL_SEMAPHORE_DECLARE
+
+/// @return true if a tracer is attached to the probe
+#define FTY_EMAIL_PROBE_ENABLED(name) __builtin_expect(fty_email_##name##_semaphore != 0, 0)
+
+/// fire probe fty_email:name, arguments are evaluated only if the probe is enabled
+#define FTY_EMAIL_PROBE(name, ...)                                                                                    \
+    do {                                                                                                              \
+        if (FTY_EMAIL_PROBE_ENABLED(name))                                                                            \
+            STAP_PROBEV(fty_email, name, __VA_ARGS__);                                                                \
+    } while (0)
+
+#else
+
+/// arguments are type checked, but never evaluated
+template <typename... Args>
+inline void fty_email_probe_unused(const Args&...)
+{
+}
+
+#define FTY_EMAIL_PROBE_ENABLED(name) false
+#define FTY_EMAIL_PROBE(name, ...)                                                                                    \
+    do {                                                                                                              \
+        if (false)                                                                                                    \
+            fty_email_probe_unused(__VA_ARGS__);                                                                      \
+    } while (0)
+
+#endif
+
+///  @class TraceRequest
+///
+///  Sets uuid of the request delivered by the thread, so that probes of the layers which don't know the request
+///  (MIME, transports) carry it
+class TraceRequest
+{
+public:
+    explicit TraceRequest(const std::string& uuid);
+    ~TraceRequest();
+
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+
+    /// @return uuid of the request delivered by the calling thread, "" if none
+    static const char* uuid();
+
+private:
+    const char* _previous;
+};
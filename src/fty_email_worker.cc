@@ -0,0 +1,440 @@
+/*  =========================================================================
+    fty_email_worker - Delivery workers of email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    fty_email_worker - Delivery workers of email actor
+@discuss
+    Actor accepts the requests from the mailbox and puts them to the bounded queue, workers deliver them and pass
+    the replies back to the actor. Slow or unreachable SMTP server does not block the mailbox.
+@end
+*/
+
+#include "fty_email_worker.h"
+#include "fty_email_metrics.h"
+#include "fty_email_trace.h"
+#include <algorithm>
+#include <fty_log.h>
+
+EmailWorkerPool::EmailWorkerPool(Handler handler)
+    : _handler(handler)
+    , _results(nullptr)
+    , _queues(1)
+    , _held(1, false)
+    , _sharded(false)
+    , _queue_size(0)
+    , _supersede(Supersede::REPLACE)
+    , _stop(false)
+    , _version(0)
+{
+    char* endpoint = zsys_sprintf("inproc://fty-email-results-%p", static_cast<void*>(this));
+    _endpoint      = endpoint;
+    zstr_free(&endpoint);
+    _results = zsock_new_pull(("@" + _endpoint).c_str());
+    assert(_results);
+}
+
+EmailWorkerPool::~EmailWorkerPool()
+{
+    stop();
+    zsock_destroy(&_results);
+}
+
+/// @return number of jobs in the queues
+static size_t s_size(const std::vector<std::deque<std::unique_ptr<EmailJob>>>& queues)
+{
+    size_t ret = 0;
+    for (const auto& it : queues)
+        ret += it.size();
+    return ret;
+}
+
+void EmailWorkerPool::start(size_t workers, size_t queue_size, size_t shards)
+{
+    if (shards != 0)
+        workers = shards;
+    if (workers == 0)
+        workers = 1;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue_size = queue_size;
+    }
+    if (workers == _threads.size() && _sharded == (shards != 0))
+        return;
+
+    stop();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // queued jobs move to their new shards, jobs of one shard key keep their order
+        std::vector<std::unique_ptr<EmailJob>> jobs;
+        for (auto& queue : _queues) {
+            for (auto& job : queue)
+                jobs.push_back(std::move(job));
+        }
+        _sharded = shards != 0;
+        _ring    = ShardRing(_sharded ? shards : 1);
+        _queues.clear();
+        _queues.resize(_sharded ? shards : 1);
+        _held.assign(_queues.size(), false);
+        for (auto& job : jobs) {
+            job->shard = shardOf(*job);
+            _queues[job->shard].push_back(std::move(job));
+        }
+        // jobs waiting for retry keep holding their (new) shards
+        _retries.each([this](EmailJob& job) {
+            job.shard = shardOf(job);
+            if (_sharded)
+                _held[job.shard] = true;
+        });
+    }
+    log_debug("starting %zu delivery worker(s)%s, queue size %zu", workers, _sharded ? " (sharded)" : "", queue_size);
+    _stop = false;
+    for (size_t i = 0; i != workers; i++)
+        _threads.emplace_back(&EmailWorkerPool::worker, this, _sharded ? i : 0);
+}
+
+void EmailWorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+    for (auto& thread : _threads)
+        thread.join();
+    _threads.clear();
+}
+
+void EmailWorkerPool::drain(std::vector<std::unique_ptr<EmailJob>>& jobs)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& queue : _queues) {
+        for (auto& job : queue)
+            jobs.push_back(std::move(job));
+        queue.clear();
+    }
+    _retries.take(jobs);
+    _pending.clear();
+    _held.assign(_queues.size(), false);
+}
+
+void EmailWorkerPool::configure(const Smtp& smtp)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _smtp.configure(smtp);
+    _version++;
+}
+
+void EmailWorkerPool::retry(const RetryPolicy& policy)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _policy = policy;
+}
+
+void EmailWorkerPool::supersede(Supersede mode)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _supersede = mode;
+}
+
+bool EmailWorkerPool::submit(
+    std::unique_ptr<EmailJob>& job, bool force, std::vector<std::unique_ptr<EmailJob>>* superseded)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (job->accepted == 0)
+            job->accepted = zclock_mono();
+        job->shard = shardOf(*job);
+        // superseding job does not take more space in the queue
+        if (superseded && replace(job, *superseded))
+            return true;
+        if (!force && s_size(_queues) >= _queue_size)
+            return false;
+        if (!job->alert_key.empty()) {
+            auto pending = _pending.emplace(job->alert_key, job.get());
+            if (!pending.second && _supersede != Supersede::NONE) {
+                // older state is being delivered, it is not retried after this one
+                pending.first->second->superseded = true;
+                pending.first->second             = job.get();
+            }
+        }
+        _queues[job->shard].push_back(std::move(job));
+    }
+    // worker of the shard is woken up
+    if (_sharded)
+        _cond.notify_all();
+    else
+        _cond.notify_one();
+    return true;
+}
+
+size_t EmailWorkerPool::shardOf(const EmailJob& job) const
+{
+    return _sharded ? _ring.shard(job.shard_key) : 0;
+}
+
+bool EmailWorkerPool::replace(std::unique_ptr<EmailJob>& job, std::vector<std::unique_ptr<EmailJob>>& superseded)
+{
+    if (_supersede == Supersede::NONE || job->alert_key.empty())
+        return false;
+    auto pending = _pending.find(job->alert_key);
+    if (pending == _pending.end())
+        return false;
+
+    // the same alert has the same contact, so it is in the same shard
+    EmailJob* older  = pending->second;
+    auto&     queue  = _queues[older->shard];
+    auto      queued = std::find_if(queue.begin(), queue.end(), [&](const std::unique_ptr<EmailJob>& it) {
+        return it.get() == older;
+    });
+    bool cancel =
+        _supersede == Supersede::CANCEL && job->alert_state == "RESOLVED" && older->alert_state != "RESOLVED";
+
+    if (queued == queue.end()) {
+        EmailJob* newer = job.get();
+        if (cancel) {
+            std::unique_ptr<EmailJob> retried = _retries.remove(older);
+            if (retried) {
+                log_debug("%s:\t%s %s waiting for retry cancelled by %s", job->agent.c_str(), job->subject.c_str(),
+                    older->uuid.c_str(), job->uuid.c_str());
+                _pending.erase(pending);
+                // the shard was held behind the cancelled job
+                if (_sharded) {
+                    _held[older->shard] = false;
+                    _cond.notify_all();
+                }
+                superseded.push_back(std::move(retried));
+                superseded.push_back(std::move(job));
+                return true;
+            }
+        } else if (_retries.replace(older, job)) {
+            // newer state waits for the next attempt in place of the older one
+            log_debug("%s:\t%s %s waiting for retry superseded by %s", newer->agent.c_str(), newer->subject.c_str(),
+                older->uuid.c_str(), newer->uuid.c_str());
+            pending->second = newer;
+            superseded.push_back(std::move(job));
+            return true;
+        }
+        // being delivered, the newer job is queued behind it (see submit)
+        return false;
+    }
+
+    if (cancel) {
+        log_debug("%s:\t%s %s cancelled by %s", job->agent.c_str(), job->subject.c_str(), older->uuid.c_str(),
+            job->uuid.c_str());
+        _pending.erase(pending);
+        superseded.push_back(std::move(*queued));
+        queue.erase(queued);
+        superseded.push_back(std::move(job));
+        return true;
+    }
+
+    // newer state takes the place of the older one, so it is not delayed by the supersession
+    log_debug("%s:\t%s %s superseded by %s", job->agent.c_str(), job->subject.c_str(), older->uuid.c_str(),
+        job->uuid.c_str());
+    pending->second = job.get();
+    std::swap(*queued, job);
+    superseded.push_back(std::move(job));
+    return true;
+}
+
+size_t EmailWorkerPool::shards() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _sharded ? _queues.size() : 0;
+}
+
+size_t EmailWorkerPool::queued() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return s_size(_queues);
+}
+
+size_t EmailWorkerPool::queued(size_t shard) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return shard < _queues.size() ? _queues[shard].size() : 0;
+}
+
+size_t EmailWorkerPool::retrying() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _retries.size();
+}
+
+void EmailWorkerPool::promote()
+{
+    std::vector<std::unique_ptr<EmailJob>> due;
+    _retries.advance(zclock_mono(), due);
+    // retried jobs are not subject of queue_size, they were accepted already
+    for (auto& job : due) {
+        job->shard = shardOf(*job);
+        if (_sharded) {
+            // retried job goes before the jobs held behind it
+            _held[job->shard] = false;
+            _queues[job->shard].push_front(std::move(job));
+        } else
+            _queues[0].push_back(std::move(job));
+    }
+    // workers of the released shards may be waiting without timeout
+    if (_sharded && !due.empty())
+        _cond.notify_all();
+}
+
+/// make result [spool_id|sender|subject|uuid|reply frames...] for the job, or for each part of digest; reply is
+/// consumed. Interim result has spool_id 0, so the spooled request is not finished by it.
+static void s_results(
+    const EmailJob& job, const std::string& subject, zmsg_t** reply_p, bool interim, std::vector<zmsg_t*>& results)
+{
+    auto result = [&](const EmailJob& request, zmsg_t* reply) {
+        zmsg_pushstr(reply, request.uuid.c_str());
+        zmsg_pushstr(reply, subject.c_str());
+        zmsg_pushstr(reply, request.sender.c_str());
+        zmsg_pushstrf(reply, "%" PRIu64, interim ? 0 : request.spool_id);
+        results.push_back(reply);
+    };
+    for (auto& part : job.parts)
+        result(*part, zmsg_dup(*reply_p));
+    if (job.parts.empty()) {
+        result(job, *reply_p);
+        *reply_p = nullptr;
+    } else
+        zmsg_destroy(reply_p);
+}
+
+/// @return true if the reply made by the handler reports delivered request
+static bool s_succeeded(const std::string& subject, zmsg_t* reply)
+{
+    if (subject == "SENDMAIL-OK")
+        return true;
+    zframe_t* status = zmsg_first(reply);
+    return subject != "SENDMAIL-ERR" && status && zframe_streq(status, "OK");
+}
+
+void EmailWorkerPool::worker(size_t queue)
+{
+    EmailMetrics& metrics = email_metrics();
+
+    Smtp     smtp;
+    uint64_t version = 0;
+
+    zsock_t* push = zsock_new_push((">" + _endpoint).c_str());
+    assert(push);
+
+    for (;;) {
+        std::unique_ptr<EmailJob> job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                promote();
+                if (_stop || (!_held[queue] && !_queues[queue].empty()))
+                    break;
+                if (_retries.empty())
+                    _cond.wait(lock);
+                else
+                    _cond.wait_for(lock, std::chrono::milliseconds(_retries.tick()));
+            }
+            if (_stop)
+                break;
+            job = std::move(_queues[queue].front());
+            _queues[queue].pop_front();
+            if (version != _version) {
+                smtp.configure(_smtp);
+                version = _version;
+            }
+        }
+
+        // handler consumes the request, copy is kept for the next attempt
+        zmsg_t* request = zmsg_dup(job->msg);
+        job->error     = SmtpError::Succeeded;
+        job->permanent = false;
+        job->attempts++;
+
+        TraceRequest trace(job->uuid);
+        FTY_EMAIL_PROBE(deliver_start, job->uuid.c_str(), job->subject.c_str(), job->attempts);
+        zmsg_t*     reply   = zmsg_new();
+        std::string subject = _handler(smtp, *job, reply);
+        FTY_EMAIL_PROBE(deliver_end, job->uuid.c_str(), job->subject.c_str(), static_cast<int>(job->error));
+
+        // results are sent after unlocking, actor may be blocked in submit while results are not read
+        std::vector<zmsg_t*> results;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            int64_t now   = zclock_mono();
+            int64_t delay = job->error == SmtpError::Succeeded
+                                ? -1
+                                : _policy.delay(job->error, job->attempts, now - job->accepted, job->permanent);
+            if (delay >= 0 && job->superseded) {
+                // the next attempt would come after the newer state of the alert
+                log_debug("%s:\t%s %s failed and is superseded", job->agent.c_str(), job->subject.c_str(),
+                    job->uuid.c_str());
+                zmsg_destroy(&reply);
+                reply = zmsg_new();
+                zmsg_addstr(reply, "SUPERSEDED");
+                zmsg_addstr(reply, "superseded by newer state of the alert");
+                metrics.superseded.fetch_add(1, std::memory_order_relaxed);
+            } else if (delay >= 0) {
+                log_warning("%s:\t%s %s failed (error %d, attempt %u), next attempt in %" PRIi64 " ms",
+                    job->agent.c_str(), job->subject.c_str(), job->uuid.c_str(), static_cast<int>(job->error),
+                    job->attempts, delay);
+                zmsg_destroy(&job->msg);
+                job->msg = request;
+                // the first error is replied right away, the final status follows after the last attempt
+                if (job->attempts == 1)
+                    s_results(*job, subject, &reply, true, results);
+                else
+                    zmsg_destroy(&reply);
+                if (_sharded)
+                    _held[job->shard] = true;
+                _retries.schedule(job, now + delay, now);
+                metrics.retries.fetch_add(1, std::memory_order_relaxed);
+                // idle workers must start ticking the wheel
+                _cond.notify_all();
+            } else if (job->error != SmtpError::Succeeded) {
+                if (job->attempts > 1)
+                    log_error("%s:\t%s %s failed after %u attempts", job->agent.c_str(), job->subject.c_str(),
+                        job->uuid.c_str(), job->attempts);
+                metrics.failure(job->error);
+            }
+            // replied, newer state of the alert is not superseding it any more
+            if (job && !job->alert_key.empty()) {
+                auto pending = _pending.find(job->alert_key);
+                if (pending != _pending.end() && pending->second == job.get())
+                    _pending.erase(pending);
+            }
+        }
+
+        if (job) {
+            zmsg_destroy(&request);
+            // each part of digest is a request replied on its own
+            uint64_t replies = job->parts.empty() ? 1 : job->parts.size();
+            (s_succeeded(subject, reply) ? metrics.replies_ok : metrics.replies_failed)
+                .fetch_add(replies, std::memory_order_relaxed);
+            metrics.delivery_ms.record(uint64_t(std::max<int64_t>(0, zclock_mono() - job->accepted)));
+            s_results(*job, subject, &reply, false, results);
+        }
+        for (zmsg_t* result : results)
+            zmsg_send(&result, push);
+    }
+
+    zsock_destroy(&push);
+}
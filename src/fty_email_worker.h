@@ -0,0 +1,214 @@
+/*  =========================================================================
+    fty_email_worker - Delivery workers of email actor
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#pragma once
+
+#include "email.h"
+#include "fty_email_retry.h"
+#include "fty_email_shard.h"
+#include <condition_variable>
+#include <czmq.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// One request accepted from the mailbox
+struct EmailJob
+{
+    /// mailbox address of the requester, reply is sent there
+    std::string sender;
+    /// subject of the request (SENDMAIL, SENDMAIL_ALERT, SENDSMS_ALERT)
+    std::string subject;
+    /// correlation id of the request
+    std::string uuid;
+    /// name of the actor, used in the logs
+    std::string agent;
+    /// template of SMS gateway valid when the request was accepted
+    std::string gw_template;
+    /// request frames without uuid
+    zmsg_t* msg{nullptr};
+    /// id of the request in the spool, 0 if not spooled
+    uint64_t spool_id{0};
+    /// error of SMTP transport in the last attempt, set by Handler, Succeeded if SMTP was not reached
+    SmtpError error{SmtpError::Succeeded};
+    /// the last attempt was refused by 5xx reply of the server, set by Handler; such job is not retried
+    bool permanent{false};
+    /// number of delivery attempts
+    unsigned attempts{0};
+    /// monotonic time (ms) when the request was accepted
+    int64_t accepted{0};
+    /// requests delivered together by this job (digest), each one gets the reply
+    std::vector<std::unique_ptr<EmailJob>> parts;
+    /// (subject, rule, asset, contact) of alert request, newer request of the same key supersedes the queued one;
+    /// empty if the job is not subject of supersession
+    std::string alert_key;
+    /// state of the alert (ACTIVE, RESOLVED, ...)
+    std::string alert_state;
+    /// newer state of the alert was accepted while the job was being delivered, failed job is not retried then
+    bool superseded{false};
+    /// recipient domain or contact, jobs of the same key are delivered by the same shard (see fty_email_shard.h)
+    std::string shard_key;
+    /// shard the job is queued in, set by submit
+    size_t shard{0};
+
+    EmailJob() = default;
+    EmailJob(const EmailJob&) = delete;
+    EmailJob& operator=(const EmailJob&) = delete;
+    ~EmailJob()
+    {
+        zmsg_destroy(&msg);
+    }
+};
+
+///  @class EmailWorkerPool
+///
+///  Bounded queue of EmailJob and N threads delivering them
+///
+///  Each worker owns its Smtp instance (and libmagic cookie), the settings are copied from the Smtp passed to
+///  configure before the next job. Replies are not sent by workers, as mlm_client is not thread safe. Worker pushes
+///  [spool_id|sender|subject|reply frames...] to results() socket, which is polled by the actor.
+///
+///  Job with parts is replied to each part instead of itself.
+///
+///  When Handler reports transient SMTP error, the job is put to the retry wheel instead and queued again when
+///  RetryPolicy says so. Reply of the first attempt is pushed right away with spool_id 0 (the request is not done),
+///  the reply of the last attempt follows as the final status.
+///
+///  Jobs with alert_key are indexed by it until they are replied. When newer state of the alert comes while the older
+///  one still waits in the queue or for retry, the newer job takes place of the older one (Supersede::REPLACE), or
+///  RESOLVED cancels waiting ACTIVE and neither is sent (Supersede::CANCEL). Superseded jobs are returned by submit,
+///  caller replies them. Job being delivered is not superseded, but when it fails, it is replied by SUPERSEDED
+///  instead of being retried after the newer state.
+///
+///  Sharded pool has one queue and one worker per shard, job goes to the shard of its shard_key by consistent
+///  hashing. Jobs of one shard are delivered in the order they were submitted: while a job waits for retry, the
+///  rest of its shard waits too, and the job is delivered again before them.
+class EmailWorkerPool
+{
+public:
+    /// deliver the job, fill the reply frames (without uuid) and return subject of the reply
+    using Handler = std::function<std::string(Smtp& smtp, EmailJob& job, zmsg_t* reply)>;
+
+    enum class Supersede
+    {
+        NONE,
+        REPLACE,
+        CANCEL
+    };
+
+    explicit EmailWorkerPool(Handler handler);
+    ~EmailWorkerPool();
+
+    EmailWorkerPool(const EmailWorkerPool&) = delete;
+    EmailWorkerPool& operator=(const EmailWorkerPool&) = delete;
+
+    /// (re)start the workers, queued jobs are kept (moved to their new shards)
+    /// @param workers     number of delivery threads
+    /// @param queue_size  maximum of queued jobs
+    /// @param shards      number of shards, each delivered in order by its own worker instead of workers sharing
+    ///                    one queue, 0 disables sharding
+    void start(size_t workers, size_t queue_size, size_t shards = 0);
+
+    /// stop the workers, job being delivered is finished first
+    void stop();
+
+    /// take the jobs which were not delivered (queued and waiting for retry), to be replied after stop
+    void drain(std::vector<std::unique_ptr<EmailJob>>& jobs);
+
+    /// copy Smtp settings to the workers
+    void configure(const Smtp& smtp);
+
+    /// set the retry policy
+    void retry(const RetryPolicy& policy);
+
+    /// set how queued alerts are superseded
+    void supersede(Supersede mode);
+
+    /// queue the job
+    /// @param force       queue the job even if queue is full (replay of the spool)
+    /// @param superseded  jobs superseded by this one are moved there, they are not delivered
+    /// @return false if queue is full, job is left untouched
+    bool submit(std::unique_ptr<EmailJob>& job, bool force = false,
+        std::vector<std::unique_ptr<EmailJob>>* superseded = nullptr);
+
+    /// socket to be polled for results
+    zsock_t* results()
+    {
+        return _results;
+    }
+
+    /// @return number of workers
+    size_t workers() const
+    {
+        return _threads.size();
+    }
+
+    /// @return number of shards, 0 if not sharded
+    size_t shards() const;
+
+    /// @return number of queued jobs
+    size_t queued() const;
+
+    /// @return number of queued jobs of the shard
+    size_t queued(size_t shard) const;
+
+    /// @return number of jobs waiting for the next attempt
+    size_t retrying() const;
+
+protected:
+    /// deliver jobs of the queue (shard)
+    void worker(size_t queue);
+    /// queue the jobs due for the next attempt, called with _mutex locked
+    void promote();
+    /// @return shard of the job, called with _mutex locked
+    size_t shardOf(const EmailJob& job) const;
+    /// supersede waiting job of the same alert, called with _mutex locked
+    /// @return true if the job took place of the older one or was cancelled with it
+    bool replace(std::unique_ptr<EmailJob>& job, std::vector<std::unique_ptr<EmailJob>>& superseded);
+
+    Handler                                _handler;
+    zsock_t*                               _results;
+    std::string                            _endpoint;
+    std::vector<std::thread>               _threads;
+    mutable std::mutex                     _mutex;
+    std::condition_variable                _cond;
+    /// one queue shared by all the workers, or queue of each shard
+    std::vector<std::deque<std::unique_ptr<EmailJob>>> _queues;
+    /// shard whose job waits for retry, the rest of the shard is held behind it
+    std::vector<bool>                      _held;
+    bool                                   _sharded;
+    ShardRing                              _ring;
+    size_t                                 _queue_size;
+    Supersede                              _supersede;
+    /// queued, retried and delivered jobs by alert_key
+    std::unordered_map<std::string, EmailJob*> _pending;
+    bool                                   _stop;
+    RetryPolicy                            _policy;
+    RetryWheel                             _retries;
+    /// settings for the workers and their version
+    Smtp     _smtp;
+    uint64_t _version;
+};
@@ -0,0 +1,300 @@
+/*  =========================================================================
+    mime_writer - Streaming MIME multipart writer
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    mime_writer - Streaming MIME multipart writer
+@discuss
+    Replaces cxxtools::MimeMultipart, which keeps the attachments and the whole rendered email in memory.
+@end
+*/
+
+#include "mime_writer.h"
+#include "base64.h"
+#include "content_scan.h"
+#include "fty_email_trace.h"
+#include <cstring>
+#include <fstream>
+#include <fty_log.h>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+
+/// input bytes of one base64 line of 76 characters
+static const size_t BASE64_LINE = 57;
+
+static bool s_is_text(const std::string& mime_type)
+{
+    return mime_type.compare(0, 4, "text") == 0;
+}
+
+static std::string s_basename(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// ----------------------------------------------------------------------------
+// QuotedPrintableEncoder
+
+void QuotedPrintableEncoder::put(const char* token, size_t size, std::string& out)
+{
+    // soft line break, encoded line has at most 76 characters including the '='
+    if (_column + size > 75) {
+        out += "=\n";
+        _column = 0;
+    }
+    out.append(token, size);
+    _column += size;
+}
+
+void QuotedPrintableEncoder::literal(char ch, std::string& out)
+{
+    put(&ch, 1, out);
+}
+
+void QuotedPrintableEncoder::escape(char ch, std::string& out)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char     c     = static_cast<unsigned char>(ch);
+    char              token[3] = {'=', hex[c >> 4], hex[c & 15]};
+    put(token, 3, out);
+}
+
+void QuotedPrintableEncoder::flushHeld(std::string& out)
+{
+    for (char ch : _held) {
+        if (ch == '\r')
+            escape(ch, out);
+        else
+            literal(ch, out);
+    }
+    _held.clear();
+}
+
+void QuotedPrintableEncoder::encode(const char* data, size_t size, std::string& out)
+{
+    for (size_t i = 0; i != size; i++) {
+        char          ch = data[i];
+        unsigned char c  = static_cast<unsigned char>(ch);
+
+        if (ch == '\n') {
+            // CR of CRLF is dropped, whitespace at the end of line must be encoded
+            if (!_held.empty() && _held.back() == '\r')
+                _held.pop_back();
+            for (char held : _held)
+                escape(held, out);
+            _held.clear();
+            out.push_back('\n');
+            _column = 0;
+        } else if (ch == ' ' || ch == '\t') {
+            flushHeld(out);
+            _held.push_back(ch);
+        } else if (ch == '\r') {
+            // keep "<whitespace>\r" until it is known whether line break follows
+            if (_held.size() != 1 || _held[0] == '\r')
+                flushHeld(out);
+            _held.push_back(ch);
+        } else {
+            flushHeld(out);
+            if (c >= 33 && c <= 126 && c != '=')
+                literal(ch, out);
+            else
+                escape(ch, out);
+        }
+    }
+}
+
+void QuotedPrintableEncoder::finish(std::string& out)
+{
+    for (char held : _held)
+        escape(held, out);
+    _held.clear();
+    _column = 0;
+}
+
+// ----------------------------------------------------------------------------
+// MimeWriter
+
+MimeWriter::MimeWriter()
+{
+    // "=_" can't appear in quoted-printable nor base64 encoded part, 96 random bits are not guessed by 7bit text
+    std::random_device rd;
+    char               buf[64];
+    snprintf(buf, sizeof(buf), "=_fty-email_%08x%08x%08x", rd(), rd(), rd());
+    _boundary = buf;
+}
+
+void MimeWriter::header(const std::string& name, const std::string& value)
+{
+    _headers.emplace_back(name, value);
+}
+
+void MimeWriter::body(const std::string& text)
+{
+    _body = text;
+}
+
+void MimeWriter::attach(const std::string& path, const std::string& mime_type)
+{
+    _attachments.push_back({path, mime_type});
+}
+
+uint64_t MimeWriter::attachmentBytes() const
+{
+    uint64_t ret = 0;
+    for (const auto& it : _attachments) {
+        struct stat st;
+        if (::stat(it.path.c_str(), &st) == 0)
+            ret += uint64_t(st.st_size);
+    }
+    return ret;
+}
+
+std::string MimeWriter::headers() const
+{
+    std::string ret;
+    for (const auto& it : _headers)
+        ret += it.first + ": " + it.second + "\n";
+    return ret;
+}
+
+void MimeWriter::writeBody(MimeSink& sink) const
+{
+    sink.write("MIME-Version: 1.0\nContent-Type: multipart/mixed; boundary=\"" + _boundary + "\"\n\n");
+
+    ContentScanner scanner;
+    scanner.scan(_body.data(), _body.size());
+    TransferEncoding   encoding = scanner.stats().encoding(true, sink.eightBit());
+    std::istringstream body(_body);
+    sink.write("--" + _boundary + "\n");
+    sink.write("Content-Type: text/plain; charset=UTF-8\nContent-Transfer-Encoding: " +
+               std::string(transfer_encoding_name(encoding)) + "\n\n");
+    writePart(sink, body, encoding);
+
+    for (const auto& it : _attachments)
+        writeFile(sink, it);
+
+    sink.write("--" + _boundary + "--\n");
+}
+
+void MimeWriter::writeFile(MimeSink& sink, const Attachment& attachment) const
+{
+    std::ifstream file(attachment.path, std::ios::binary);
+    if (!file)
+        log_warning("Can't read %s, it is attached empty", attachment.path.c_str());
+
+    // text is read twice, first to find out the encoding it needs
+    TransferEncoding encoding = TransferEncoding::BASE64;
+    if (s_is_text(attachment.mime_type)) {
+        ContentScanner    scanner;
+        std::vector<char> in(BUFFER_SIZE);
+        while (file) {
+            file.read(in.data(), std::streamsize(in.size()));
+            scanner.scan(in.data(), size_t(file.gcount()));
+        }
+        file.clear();
+        file.seekg(0);
+        encoding = scanner.stats().encoding(true, sink.eightBit());
+    }
+
+    std::string name = s_basename(attachment.path);
+    sink.write("--" + _boundary + "\nContent-Type: " + attachment.mime_type + "; name=\"" + name +
+               "\"\nContent-Transfer-Encoding: " + transfer_encoding_name(encoding) +
+               "\nContent-Disposition: attachment; filename=\"" + name + "\"\n\n");
+    FTY_EMAIL_PROBE(
+        attachment_start, TraceRequest::uuid(), attachment.path.c_str(), transfer_encoding_name(encoding));
+    writePart(sink, file, encoding);
+    if (FTY_EMAIL_PROBE_ENABLED(attachment_end)) {
+        file.clear();
+        int64_t bytes = file.seekg(0, std::ios::end) ? int64_t(file.tellg()) : 0;
+        FTY_EMAIL_PROBE(attachment_end, TraceRequest::uuid(), attachment.path.c_str(), bytes);
+    }
+}
+
+void MimeWriter::writePart(MimeSink& sink, std::istream& in, TransferEncoding encoding) const
+{
+    std::vector<char> buf(BUFFER_SIZE);
+
+    if (encoding == TransferEncoding::SEVEN_BIT || encoding == TransferEncoding::EIGHT_BIT) {
+        bool bol = true;
+        while (in) {
+            in.read(buf.data(), std::streamsize(buf.size()));
+            size_t len = size_t(in.gcount());
+            if (len != 0) {
+                bol = buf[len - 1] == '\n';
+                sink.write(buf.data(), len);
+            }
+        }
+        if (!bol)
+            sink.write("\n", 1);
+        return;
+    }
+
+    if (encoding == TransferEncoding::QUOTED_PRINTABLE) {
+        QuotedPrintableEncoder qp;
+        std::string            out;
+        bool                   bol = true;
+        while (in) {
+            in.read(buf.data(), std::streamsize(buf.size()));
+            qp.encode(buf.data(), size_t(in.gcount()), out);
+            if (!in)
+                qp.finish(out);
+            if (!out.empty()) {
+                bol = out.back() == '\n';
+                sink.write(out);
+                out.clear();
+            }
+        }
+        if (!bol)
+            sink.write("\n", 1);
+        return;
+    }
+
+    // 76 characters and LF for each 57 bytes of input
+    std::vector<char>    out(base64_lines_size(BUFFER_SIZE, 1));
+    const unsigned char* data   = reinterpret_cast<const unsigned char*>(buf.data());
+    size_t               filled = 0;
+    while (in) {
+        in.read(buf.data() + filled, std::streamsize(buf.size() - filled));
+        filled += size_t(in.gcount());
+
+        // incomplete line waits for more data, unless it is the end of file
+        size_t encode = in ? filled - filled % BASE64_LINE : filled;
+        size_t len    = base64_encode_lines(data, encode, out.data(), "\n");
+        filled -= encode;
+        memmove(buf.data(), buf.data() + encode, filled);
+        sink.write(out.data(), len);
+    }
+}
+
+void MimeWriter::write(MimeSink& sink) const
+{
+    sink.write(headers());
+    writeBody(sink);
+}
+
+std::string MimeWriter::str() const
+{
+    StringSink sink;
+    write(sink);
+    return sink.str();
+}
@@ -0,0 +1,187 @@
+/*  =========================================================================
+    mime_writer - Streaming MIME multipart writer
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   mime_writer.h
+/// @brief  Multipart email encoded on the fly into the transport
+///
+/// Example:
+///
+///    MimeWriter mail;
+///    mail.header("To", "joe@example.com");
+///    mail.header("Subject", "logs");
+///    mail.body("see the attachment");
+///    mail.attach("/var/log/messages", "text/plain; charset=us-ascii");
+///
+///    StringSink sink;
+///    mail.write(sink);
+
+#pragma once
+
+#include "content_scan.h"
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+///  @class MimeSink
+///
+///  Consumer of streamed email (msmtp stdin, SMTP connection, string)
+class MimeSink
+{
+public:
+    virtual ~MimeSink() = default;
+
+    /// consume next piece of the email
+    virtual void write(const char* data, size_t size) = 0;
+
+    /// @return true if the transport accepts 8bit MIME parts (RFC 6152)
+    virtual bool eightBit() const
+    {
+        return false;
+    }
+
+    void write(const std::string& data)
+    {
+        write(data.data(), data.size());
+    }
+};
+
+/// email written piece by piece to the sink it gets
+using MimeSource = std::function<void(MimeSink& sink)>;
+
+///  @class StringSink
+///
+///  Collects streamed email to a string (small emails and tests)
+class StringSink : public MimeSink
+{
+public:
+    using MimeSink::write;
+
+    void write(const char* data, size_t size) override
+    {
+        _str.append(data, size);
+    }
+
+    const std::string& str() const
+    {
+        return _str;
+    }
+
+private:
+    std::string _str;
+};
+
+///  @class MimeWriter
+///
+///  multipart/mixed email with text body and file attachments
+///
+///  Attachments are not loaded to memory, they are read and encoded chunk by chunk when the email is written, so
+///  memory used by write is bounded by BUFFER_SIZE no matter how big the attachments are. Text parts are scanned
+///  first and sent as they are (7bit, or 8bit if the sink accepts it) when possible, otherwise they are encoded
+///  quoted-printable or base64, whichever is shorter. Other parts are encoded base64. Lines are terminated by LF,
+///  transports normalize them to CRLF.
+class MimeWriter
+{
+public:
+    /// size of read buffer of attachments (multiple of 57 bytes, one base64 line)
+    static const size_t BUFFER_SIZE = 57 * 1024;
+
+    MimeWriter();
+
+    /// add header of the email
+    void header(const std::string& name, const std::string& value);
+
+    /// set text body of the email (text/plain; charset=UTF-8)
+    void body(const std::string& text);
+
+    /// attach file, it is read when the email is written
+    /// @param path       path to the file
+    /// @param mime_type  content type of the file, only text types may be sent unencoded or quoted-printable
+    void attach(const std::string& path, const std::string& mime_type);
+
+    /// @return headers of the email added by header ("Name: value" lines), without MIME headers
+    std::string headers() const;
+
+    /// @return text body of the email
+    const std::string& text() const
+    {
+        return _body;
+    }
+
+    /// @return number of attachments
+    size_t attachments() const
+    {
+        return _attachments.size();
+    }
+
+    /// @return total size of the attached files (unreadable files are not counted)
+    uint64_t attachmentBytes() const;
+
+    /// write MIME headers and all the parts, to be written after headers()
+    /// Unreadable attachment is logged and sent empty, so that the email already half sent is not broken.
+    void writeBody(MimeSink& sink) const;
+
+    /// write the whole email (headers and body)
+    void write(MimeSink& sink) const;
+
+    /// @return the whole email as a string
+    std::string str() const;
+
+protected:
+    struct Attachment
+    {
+        std::string path;
+        std::string mime_type;
+    };
+
+    void writeFile(MimeSink& sink, const Attachment& attachment) const;
+    void writePart(MimeSink& sink, std::istream& in, TransferEncoding encoding) const;
+
+    std::string                                      _boundary;
+    std::vector<std::pair<std::string, std::string>> _headers;
+    std::string                                      _body;
+    std::vector<Attachment>                          _attachments;
+};
+
+///  @class QuotedPrintableEncoder
+///
+///  Incremental quoted-printable encoder (RFC 2045), input can be split at any byte
+class QuotedPrintableEncoder
+{
+public:
+    /// encode the data and append them to out
+    void encode(const char* data, size_t size, std::string& out);
+
+    /// finish the encoding (pending trailing whitespace) and append it to out
+    void finish(std::string& out);
+
+protected:
+    void put(const char* token, size_t size, std::string& out);
+    void literal(char ch, std::string& out);
+    void escape(char ch, std::string& out);
+    void flushHeld(std::string& out);
+
+    size_t _column{0};
+    /// trailing whitespace and/or CR, encoding depends on whether line break follows
+    std::string _held;
+};
@@ -0,0 +1,83 @@
+/*  =========================================================================
+    simd - Instruction sets of vectorized code
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    simd - Instruction sets of vectorized code
+@discuss
+@end
+*/
+
+#include "simd.h"
+
+bool simd_supported(SimdIsa isa)
+{
+    switch (isa) {
+        case SimdIsa::SCALAR:
+            return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case SimdIsa::SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case SimdIsa::SSSE3:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("ssse3");
+        case SimdIsa::AVX2:
+            // AVX2 kernels count bits by popcnt as well
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#elif defined(__aarch64__)
+        case SimdIsa::NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+SimdIsa simd_isa()
+{
+    static const SimdIsa isa = []() {
+        SimdIsa ret = SimdIsa::SCALAR;
+        for (SimdIsa it : SIMD_ISAS) {
+            if (simd_supported(it))
+                ret = it;
+        }
+        return ret;
+    }();
+    return isa;
+}
+
+const char* simd_isa_name(SimdIsa isa)
+{
+    switch (isa) {
+        case SimdIsa::SSE2:
+            return "sse2";
+        case SimdIsa::SSSE3:
+            return "ssse3";
+        case SimdIsa::AVX2:
+            return "avx2";
+        case SimdIsa::NEON:
+            return "neon";
+        default:
+            return "scalar";
+    }
+}
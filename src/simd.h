@@ -0,0 +1,50 @@
+/*  =========================================================================
+    simd - Instruction sets of vectorized code
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   simd.h
+/// @brief  Runtime selection of instruction set of vectorized code (base64, content scan)
+///
+/// Kernels are compiled with target attributes, so the binary runs on any CPU of the architecture and the best
+/// supported kernel is selected once at runtime.
+
+#pragma once
+
+/// instruction set of vectorized kernels
+enum class SimdIsa
+{
+    SCALAR,
+    SSE2,
+    SSSE3,
+    AVX2,
+    NEON
+};
+
+/// all instruction sets, in order of preference from the worst
+static const SimdIsa SIMD_ISAS[] = {SimdIsa::SCALAR, SimdIsa::SSE2, SimdIsa::SSSE3, SimdIsa::AVX2, SimdIsa::NEON};
+
+/// @return the best instruction set supported by this CPU
+SimdIsa simd_isa();
+
+/// @return true if the instruction set is supported by this CPU (and by the build)
+bool simd_supported(SimdIsa isa);
+
+/// @return name of the instruction set (scalar, sse2, ssse3, avx2, neon)
+const char* simd_isa_name(SimdIsa isa);
@@ -0,0 +1,1099 @@
+/*  =========================================================================
+    smtp_client - Native SMTP/ESMTP client
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    smtp_client - Native SMTP/ESMTP client
+@discuss
+    Implements the subset of RFC 5321 needed by fty-email: EHLO/HELO, STARTTLS (RFC 3207), implicit TLS,
+    AUTH PLAIN/LOGIN/CRAM-MD5 (RFC 4954), MAIL, RCPT, DATA and QUIT.
+@end
+*/
+
+#include "smtp_client.h"
+#include "fty_email_trace.h"
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fty_log.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+// static helper functions
+
+static std::string s_base64_encode(const std::string& inp)
+{
+    std::string ret(4 * ((inp.size() + 2) / 3) + 1, '\0');
+    int         len = EVP_EncodeBlock(
+        reinterpret_cast<unsigned char*>(&ret[0]), reinterpret_cast<const unsigned char*>(inp.data()), int(inp.size()));
+    ret.resize(size_t(len));
+    return ret;
+}
+
+static std::string s_base64_decode(const std::string& inp)
+{
+    std::string ret(3 * (inp.size() / 4) + 3, '\0');
+    int         len = EVP_DecodeBlock(
+        reinterpret_cast<unsigned char*>(&ret[0]), reinterpret_cast<const unsigned char*>(inp.data()), int(inp.size()));
+    if (len < 0)
+        return {};
+    // EVP_DecodeBlock does not strip padding
+    size_t pad = 0;
+    for (auto it = inp.rbegin(); it != inp.rend() && *it == '='; ++it)
+        pad++;
+    ret.resize(size_t(len) - std::min(pad, size_t(len)));
+    return ret;
+}
+
+static std::string s_openssl_error()
+{
+    unsigned long err = ERR_get_error();
+    if (err == 0)
+        return "unknown error";
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+static std::string s_trim(const std::string& str)
+{
+    auto begin = str.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return {};
+    auto end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+static std::string s_upper(std::string str)
+{
+    for (auto& ch : str)
+        ch = char(::toupper(static_cast<unsigned char>(ch)));
+    return str;
+}
+
+/// split address list (To:, Cc:, Bcc: headers) and return bare addresses
+static void s_parse_addresses(const std::string& value, std::vector<std::string>& out)
+{
+    std::string current;
+    std::string angle;
+    bool        in_quote = false;
+    bool        in_angle = false;
+    int         comment  = 0;
+
+    auto flush = [&]() {
+        std::string addr = s_trim(angle.empty() ? current : angle);
+        if (!addr.empty())
+            out.push_back(addr);
+        current.clear();
+        angle.clear();
+    };
+
+    for (size_t i = 0; i < value.size(); i++) {
+        char ch = value[i];
+        if (in_quote) {
+            if (ch == '\\' && i + 1 < value.size())
+                i++;
+            else if (ch == '"')
+                in_quote = false;
+            continue;
+        }
+        if (comment > 0) {
+            if (ch == '(')
+                comment++;
+            else if (ch == ')')
+                comment--;
+            continue;
+        }
+        if (in_angle) {
+            if (ch == '>')
+                in_angle = false;
+            else
+                angle.push_back(ch);
+            continue;
+        }
+        switch (ch) {
+            case '"':
+                in_quote = true;
+                break;
+            case '(':
+                comment++;
+                break;
+            case '<':
+                in_angle = true;
+                angle.clear();
+                break;
+            case ',':
+            case ';':
+                flush();
+                break;
+            case ':':
+                // group syntax "undisclosed-recipients: a@b, c@d;"
+                current.clear();
+                break;
+            default:
+                current.push_back(ch);
+        }
+    }
+    flush();
+}
+
+static bool s_header_is(const std::string& field, const char* name)
+{
+    size_t len = strlen(name);
+    return field.size() > len && field[len] == ':' && strncasecmp(field.c_str(), name, len) == 0;
+}
+
+static std::string s_rfc2822_date()
+{
+    time_t    t = ::time(nullptr);
+    struct tm tmp;
+    ::localtime_r(&t, &tmp);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", &tmp);
+    return buf;
+}
+
+std::vector<std::string> smtp_parse_addresses(const std::string& value)
+{
+    std::vector<std::string> ret;
+    s_parse_addresses(value, ret);
+    return ret;
+}
+
+SmtpEnvelope smtp_prepare_envelope(const std::string& data, const std::string& from)
+{
+    SmtpEnvelope ret;
+
+    // find end of header block
+    size_t body = 0;
+    while (body < data.size()) {
+        size_t eol = data.find('\n', body);
+        if (eol == std::string::npos) {
+            body = data.size();
+            break;
+        }
+        bool empty = (eol == body) || (eol == body + 1 && data[body] == '\r');
+        if (empty)
+            break;
+        body = eol + 1;
+    }
+
+    // unfold header fields, keep track of original text to be able to drop Bcc:
+    std::string headers;
+    bool        has_from = false;
+    bool        has_date = false;
+    size_t      pos      = 0;
+    while (pos < body) {
+        size_t end = pos;
+        do {
+            end = data.find('\n', end);
+            end = (end == std::string::npos || end >= body) ? body : end + 1;
+        } while (end < body && (data[end] == ' ' || data[end] == '\t'));
+
+        std::string raw = data.substr(pos, end - pos);
+        std::string field;
+        for (char ch : raw) {
+            if (ch != '\r' && ch != '\n')
+                field.push_back(ch);
+        }
+
+        bool keep = true;
+        if (s_header_is(field, "To") || s_header_is(field, "Cc")) {
+            s_parse_addresses(field.substr(3), ret.recipients);
+        } else if (s_header_is(field, "Bcc")) {
+            s_parse_addresses(field.substr(4), ret.recipients);
+            keep = false;
+        } else if (s_header_is(field, "From")) {
+            has_from = true;
+        } else if (s_header_is(field, "Date")) {
+            has_date = true;
+        }
+        if (keep)
+            headers += raw;
+        pos = end;
+    }
+
+    ret.data.reserve(data.size() + from.size() + 64);
+    if (!has_from && !from.empty())
+        ret.data += "From: " + from + "\r\n";
+    if (!has_date)
+        ret.data += "Date: " + s_rfc2822_date() + "\r\n";
+    ret.data += headers;
+    ret.data.append(data, body, std::string::npos);
+    return ret;
+}
+
+// ----------------------------------------------------------------------------
+// SmtpClient::DataSink
+
+class SmtpClient::DataSink : public MimeSink
+{
+public:
+    using MimeSink::write;
+
+    DataSink(SmtpClient& client, bool chunking, bool pipelining, bool eight_bit)
+        : _client(client)
+        , _chunking(chunking)
+        , _pipelining(pipelining)
+        , _eight_bit(eight_bit)
+        , _limit(chunking ? std::max<size_t>(client._settings.chunk_size, 1) : 64 * 1024)
+    {
+        _buf.reserve(_limit);
+    }
+
+    /// normalize line endings to CRLF, dot-stuff the lines (DATA), line may span more writes
+    void write(const char* data, size_t size) override
+    {
+        const char* end = data + size;
+        _size += size;
+        while (data != end) {
+            if (_bol && !_chunking && *data == '.')
+                append(".", 1);
+            const char* eol  = static_cast<const char*>(memchr(data, '\n', size_t(end - data)));
+            const char* stop = eol ? eol : end;
+            if (stop != data) {
+                append(data, size_t(stop - data));
+                _cr  = stop[-1] == '\r';
+                _bol = false;
+            }
+            if (!eol)
+                break;
+            append(_cr ? "\n" : "\r\n", _cr ? 1 : 2);
+            _cr  = false;
+            _bol = true;
+            data = eol + 1;
+        }
+    }
+
+    bool eightBit() const override
+    {
+        return _eight_bit;
+    }
+
+    /// @return number of bytes of the message written (before dot-stuffing)
+    size_t size() const
+    {
+        return _size;
+    }
+
+    /// terminate the message and return reply of the server
+    Reply finish()
+    {
+        if (!_bol)
+            append("\r\n", 2);
+        log_debug("sent %zu bytes of mail", _size);
+
+        if (!_chunking) {
+            append(".\r\n", 3);
+            flush(false);
+            return _client.reply();
+        }
+
+        // RFC 3030: last chunk may be empty
+        flush(true);
+        if (_pipelining) {
+            for (size_t i = 0; i < _chunks; i++) {
+                Reply r = _client.reply();
+                if (_rep.code == 0 || _rep.code == 250)
+                    _rep = r;
+            }
+        }
+        return _rep;
+    }
+
+private:
+    void append(const char* data, size_t size)
+    {
+        while (size != 0) {
+            size_t len = std::min(size, _limit - _buf.size());
+            _buf.append(data, len);
+            data += len;
+            size -= len;
+            if (_buf.size() == _limit)
+                flush(false);
+        }
+    }
+
+    void flush(bool last)
+    {
+        if (!_chunking) {
+            _client.writeAll(_buf.data(), _buf.size());
+            _buf.clear();
+            return;
+        }
+
+        // RFC 3030: message is sent as is in BDAT chunks, no dot-stuffing; rest of refused message is dropped
+        if (_rep.code == 0 || _rep.code == 250) {
+            std::string cmd = "BDAT " + std::to_string(_buf.size()) + (last ? " LAST" : "") + "\r\n";
+            _client.writeAll(cmd.data(), cmd.size());
+            _client.writeAll(_buf.data(), _buf.size());
+            _chunks++;
+            if (!_pipelining)
+                _rep = _client.reply();
+        }
+        _buf.clear();
+    }
+
+    SmtpClient& _client;
+    bool        _chunking;
+    bool        _pipelining;
+    bool        _eight_bit;
+    size_t      _limit;
+    std::string _buf;
+    bool        _bol{true};
+    bool        _cr{false};
+    size_t      _size{0};
+    size_t      _chunks{0};
+    Reply       _rep;
+};
+
+// ----------------------------------------------------------------------------
+// SmtpSettings
+
+bool SmtpSettings::operator==(const SmtpSettings& other) const
+{
+    return host == other.host && port == other.port && from == other.from && encryption == other.encryption &&
+           username == other.username && password == other.password && verify_ca == other.verify_ca &&
+           timeout_ms == other.timeout_ms && pipelining == other.pipelining && chunking == other.chunking &&
+           chunk_size == other.chunk_size;
+}
+
+// ----------------------------------------------------------------------------
+// SmtpClient
+
+std::string SmtpClient::Reply::text() const
+{
+    std::string ret;
+    for (const auto& line : lines) {
+        if (!ret.empty())
+            ret += " ";
+        ret += line;
+    }
+    return ret;
+}
+
+SmtpClient::SmtpClient(const SmtpSettings& settings)
+    : _settings(settings)
+    , _fd(-1)
+    , _ctx(nullptr)
+    , _ssl(nullptr)
+    , _in_transaction(false)
+{
+}
+
+SmtpClient::~SmtpClient()
+{
+    close();
+}
+
+void SmtpClient::fail(SmtpError code, const std::string& message, int reply)
+{
+    close();
+    throw SmtpException(code, message, reply / 100 == 5);
+}
+
+void SmtpClient::reject(SmtpError code, const std::string& message, int reply)
+{
+    // server refused the command, but the session itself is still usable
+    throw SmtpException(code, message, reply / 100 == 5);
+}
+
+void SmtpClient::close()
+{
+    if (_ssl) {
+        SSL_free(_ssl);
+        _ssl = nullptr;
+    }
+    if (_ctx) {
+        SSL_CTX_free(_ctx);
+        _ctx = nullptr;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _rbuf.clear();
+    _extensions.clear();
+    _auth_methods.clear();
+    _in_transaction = false;
+}
+
+void SmtpClient::connect()
+{
+    close();
+
+    if (_settings.host.empty())
+        fail(SmtpError::ServerUnreachable, "no host given");
+
+    FTY_EMAIL_PROBE(connect_start, TraceRequest::uuid(), _settings.host.c_str(), _settings.port.c_str());
+    tcpConnect();
+    if (_settings.encryption == Encryption::TLS)
+        tlsHandshake();
+
+    Reply greeting = reply();
+    if (greeting.code != 220)
+        fail(SmtpError::ServerUnreachable, "cannot get initial OK message from server: " + greeting.text());
+
+    ehlo();
+    if (_settings.encryption == Encryption::STARTTLS)
+        starttls();
+    authenticate();
+    FTY_EMAIL_PROBE(connect_end, TraceRequest::uuid(), _settings.host.c_str(), _settings.port.c_str());
+}
+
+void SmtpClient::tcpConnect()
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = nullptr;
+    int              r   = getaddrinfo(_settings.host.c_str(), _settings.port.c_str(), &hints, &res);
+    if (r != 0) {
+        fail(SmtpError::DNSFailed, "cannot locate host " + _settings.host + ": " + gai_strerror(r));
+    }
+
+    std::string last_error = "no address";
+    for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        _fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (_fd == -1) {
+            last_error = strerror(errno);
+            continue;
+        }
+
+        r = ::connect(_fd, ai->ai_addr, ai->ai_addrlen);
+        if (r == -1 && errno == EINPROGRESS) {
+            struct pollfd pfd = {_fd, POLLOUT, 0};
+            r                 = ::poll(&pfd, 1, _settings.timeout_ms);
+            if (r == 0) {
+                errno = ETIMEDOUT;
+                r     = -1;
+            } else if (r > 0) {
+                int       err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                errno = err;
+                r     = err == 0 ? 0 : -1;
+            }
+        }
+        if (r == 0)
+            break;
+
+        last_error = strerror(errno);
+        ::close(_fd);
+        _fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (_fd == -1)
+        fail(SmtpError::ServerUnreachable, "cannot connect to " + _settings.host + ", port " + _settings.port + ": " +
+                                               last_error);
+}
+
+void SmtpClient::tlsHandshake()
+{
+    _ctx = SSL_CTX_new(TLS_client_method());
+    if (!_ctx)
+        fail(SmtpError::Unknown, "cannot create TLS context: " + s_openssl_error());
+
+    if (_settings.verify_ca) {
+        SSL_CTX_set_default_verify_paths(_ctx);
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, nullptr);
+    } else {
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_NONE, nullptr);
+    }
+
+    _ssl = SSL_new(_ctx);
+    if (!_ssl)
+        fail(SmtpError::Unknown, "cannot create TLS session: " + s_openssl_error());
+    SSL_set_fd(_ssl, _fd);
+    SSL_set_tlsext_host_name(_ssl, _settings.host.c_str());
+    if (_settings.verify_ca)
+        SSL_set1_host(_ssl, _settings.host.c_str());
+
+    for (;;) {
+        int r = SSL_connect(_ssl);
+        if (r == 1)
+            break;
+        int err = SSL_get_error(_ssl, r);
+        if (err == SSL_ERROR_WANT_READ) {
+            waitFor(POLLIN);
+            continue;
+        }
+        if (err == SSL_ERROR_WANT_WRITE) {
+            waitFor(POLLOUT);
+            continue;
+        }
+
+        long verify = SSL_get_verify_result(_ssl);
+        if (_settings.verify_ca && verify != X509_V_OK)
+            fail(SmtpError::UnknownCA,
+                std::string("TLS certificate verification failed: ") + X509_verify_cert_error_string(verify));
+        fail(SmtpError::SSLNotSupported, "TLS handshake failed: " + s_openssl_error());
+    }
+    // buffered plain text must not survive the switch to TLS
+    _rbuf.clear();
+}
+
+void SmtpClient::ehlo()
+{
+    char hostname[256] = "localhost";
+    if (gethostname(hostname, sizeof(hostname) - 1) != 0 || hostname[0] == '\0')
+        strcpy(hostname, "localhost");
+
+    command(std::string("EHLO ") + hostname);
+    Reply rep = reply();
+    if (rep.code != 250) {
+        command(std::string("HELO ") + hostname);
+        rep = reply();
+        if (rep.code != 250)
+            fail(SmtpError::Unknown, "command HELO failed: " + rep.text());
+        return;
+    }
+
+    _extensions.clear();
+    _auth_methods.clear();
+    for (size_t i = 1; i < rep.lines.size(); i++) {
+        std::string line = s_upper(rep.lines[i]);
+        auto        sep  = line.find_first_of(" =");
+        std::string ext  = line.substr(0, sep);
+        _extensions.insert(ext);
+        if (ext == "AUTH" && sep != std::string::npos) {
+            std::string methods = line.substr(sep + 1);
+            size_t      p       = 0;
+            while (p < methods.size()) {
+                size_t e = methods.find(' ', p);
+                if (e == std::string::npos)
+                    e = methods.size();
+                if (e > p)
+                    _auth_methods.insert(methods.substr(p, e - p));
+                p = e + 1;
+            }
+        }
+    }
+}
+
+void SmtpClient::starttls()
+{
+    if (!has_extension("STARTTLS"))
+        fail(SmtpError::SSLNotSupported, "the server does not support TLS via the STARTTLS command");
+
+    command("STARTTLS");
+    Reply rep = reply();
+    if (rep.code != 220)
+        fail(SmtpError::SSLNotSupported, "command STARTTLS failed: " + rep.text());
+
+    tlsHandshake();
+    ehlo();
+}
+
+void SmtpClient::authenticate()
+{
+    if (_settings.username.empty())
+        return;
+
+    if (!has_extension("AUTH") || _auth_methods.empty())
+        fail(SmtpError::AuthMethodNotSupported, "the server does not support authentication");
+
+    // methods sending password in clear text are used only over TLS (the same policy as msmtp auth on)
+    std::string method;
+    if (_ssl && _auth_methods.count("PLAIN"))
+        method = "PLAIN";
+    else if (_auth_methods.count("CRAM-MD5"))
+        method = "CRAM-MD5";
+    else if (_ssl && _auth_methods.count("LOGIN"))
+        method = "LOGIN";
+    else if (!_ssl && (_auth_methods.count("PLAIN") || _auth_methods.count("LOGIN")))
+        fail(SmtpError::SSLNotSupported, "cannot use a secure authentication method");
+    else
+        fail(SmtpError::AuthMethodNotSupported, "cannot find a usable authentication method");
+
+    Reply rep;
+    if (method == "PLAIN") {
+        std::string token;
+        token.push_back('\0');
+        token += _settings.username;
+        token.push_back('\0');
+        token += _settings.password;
+        command("AUTH PLAIN " + s_base64_encode(token));
+        rep = reply();
+    } else if (method == "LOGIN") {
+        command("AUTH LOGIN");
+        rep = reply();
+        if (rep.code == 334) {
+            command(s_base64_encode(_settings.username));
+            rep = reply();
+        }
+        if (rep.code == 334) {
+            command(s_base64_encode(_settings.password));
+            rep = reply();
+        }
+    } else {
+        command("AUTH CRAM-MD5");
+        rep = reply();
+        if (rep.code == 334) {
+            std::string   challenge = s_base64_decode(rep.lines.empty() ? "" : rep.lines.front());
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int  digest_len = 0;
+            HMAC(EVP_md5(), _settings.password.data(), int(_settings.password.size()),
+                reinterpret_cast<const unsigned char*>(challenge.data()), challenge.size(), digest, &digest_len);
+            std::string response = _settings.username + " ";
+            char        hex[3];
+            for (unsigned int i = 0; i < digest_len; i++) {
+                snprintf(hex, sizeof(hex), "%02x", digest[i]);
+                response += hex;
+            }
+            command(s_base64_encode(response));
+            rep = reply();
+        }
+    }
+
+    if (rep.code == 235)
+        return;
+    if (rep.code == 504)
+        fail(SmtpError::AuthMethodNotSupported, "authentication method " + method + " not supported");
+    if (rep.code == 530 || rep.code == 538)
+        fail(SmtpError::SSLRequired, "AUTH " + method + " failed: " + rep.text());
+    fail(SmtpError::AuthFailed, "authentication failed (method " + method + "): " + rep.text());
+}
+
+void SmtpClient::sendmail(const std::string& from, const std::vector<std::string>& recipients, const std::string& data)
+{
+    sendmail(from, recipients, [&data](MimeSink& sink) {
+        sink.write(data);
+    });
+}
+
+void SmtpClient::sendmail(const std::string& from, const std::vector<std::string>& recipients, const MimeSource& data)
+{
+    if (from.empty())
+        throw SmtpException(SmtpError::NoSenderAddress, "no envelope-from address");
+    if (recipients.empty())
+        throw SmtpException(SmtpError::NoRecipient, "no recipients found");
+    if (!connected())
+        connect();
+
+    if (_in_transaction) {
+        command("RSET");
+        Reply rep = reply();
+        if (rep.code != 250)
+            fail(SmtpError::Unknown, "command RSET failed: " + rep.text());
+        _in_transaction = false;
+    }
+
+    bool pipelining = _settings.pipelining && has_extension("PIPELINING");
+    bool chunking   = _settings.chunking && (has_extension("CHUNKING") || has_extension("BINARYMIME"));
+    // RFC 6152: declaring 8bit body is allowed even if the message turns out to be 7bit
+    bool eight_bit = has_extension("8BITMIME");
+    log_debug("sending mail to %zu recipient(s), pipelining=%s, chunking=%s, 8bitmime=%s", recipients.size(),
+        pipelining ? "on" : "off", chunking ? "on" : "off", eight_bit ? "on" : "off");
+
+    // envelope
+    std::vector<std::string> commands;
+    commands.reserve(recipients.size() + 2);
+    commands.push_back("MAIL FROM:<" + from + ">" + (eight_bit ? " BODY=8BITMIME" : ""));
+    for (const auto& rcpt : recipients)
+        commands.push_back("RCPT TO:<" + rcpt + ">");
+    if (!chunking)
+        commands.push_back("DATA");
+
+    _in_transaction = true;
+    if (pipelining) {
+        // RFC 2920: whole envelope in one write, replies are checked in order afterwards
+        std::string batch;
+        for (const auto& cmd : commands)
+            batch += cmd + "\r\n";
+        writeAll(batch.data(), batch.size());
+    }
+
+    std::string error;
+    SmtpError   error_code  = SmtpError::Unknown;
+    int         error_reply = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        if (!pipelining)
+            command(commands[i]);
+        Reply rep = reply();
+
+        if (i == 0 && rep.code != 250) {
+            error       = "envelope from address " + from + " not accepted by the server: " + rep.text();
+            error_code  = (rep.code == 530 && !_ssl) ? SmtpError::SSLRequired : SmtpError::Unknown;
+            error_reply = rep.code;
+        } else if (i > 0 && i <= recipients.size() && rep.code != 250 && rep.code != 251) {
+            if (error.empty()) {
+                error = "recipient address " + recipients[i - 1] + " not accepted by the server: " + rep.text();
+                error_reply = rep.code;
+            }
+        } else if (i == recipients.size() + 1) {
+            // DATA
+            if (rep.code == 354 && !error.empty()) {
+                // DATA was accepted despite refused envelope, the only way to not deliver the mail is to hang up
+                fail(error_code, error, error_reply);
+            }
+            if (rep.code != 354 && error.empty()) {
+                error       = "command DATA failed: " + rep.text();
+                error_reply = rep.code;
+            }
+        }
+        if (!pipelining && !error.empty())
+            break;
+    }
+    if (!error.empty())
+        reject(error_code, error, error_reply);
+
+    Reply rep;
+    try {
+        FTY_EMAIL_PROBE(data_start, TraceRequest::uuid());
+        DataSink sink{*this, chunking, pipelining, eight_bit};
+        data(sink);
+        rep = sink.finish();
+        FTY_EMAIL_PROBE(data_end, TraceRequest::uuid(), sink.size(), rep.code);
+    } catch (const SmtpException&) {
+        throw;
+    } catch (const std::exception& e) {
+        // message is sent partially, the only way to not deliver it is to hang up
+        fail(SmtpError::Unknown, std::string("cannot write the mail: ") + e.what());
+    }
+
+    _in_transaction = false;
+    if (rep.code != 250)
+        reject(SmtpError::Unknown, "the server did not accept the mail: " + rep.text(), rep.code);
+}
+
+void SmtpClient::quit()
+{
+    if (!connected())
+        return;
+    try {
+        command("QUIT");
+        reply();
+    } catch (const std::exception& e) {
+        log_debug("QUIT failed: %s", e.what());
+    }
+    close();
+}
+
+bool SmtpClient::alive(bool noop)
+{
+    if (!connected())
+        return false;
+
+    // idle server must not send anything, readable socket means 421 timeout or closed connection
+    struct pollfd pfd = {_fd, POLLIN, 0};
+    if (::poll(&pfd, 1, 0) != 0 || (_ssl && SSL_pending(_ssl) > 0)) {
+        close();
+        return false;
+    }
+
+    if (!noop)
+        return true;
+    try {
+        command("NOOP");
+        if (reply().code == 250)
+            return true;
+    } catch (const std::exception& e) {
+        log_debug("NOOP failed: %s", e.what());
+    }
+    close();
+    return false;
+}
+
+void SmtpClient::command(const std::string& line)
+{
+    std::string buf = line + "\r\n";
+    writeAll(buf.data(), buf.size());
+}
+
+SmtpClient::Reply SmtpClient::reply()
+{
+    Reply rep;
+    for (;;) {
+        std::string line = readLine();
+        if (line.size() < 3 || !isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2]))
+            fail(SmtpError::Unknown, "the server sent an invalid reply: " + line);
+        rep.code = std::stoi(line.substr(0, 3));
+        rep.lines.push_back(line.size() > 4 ? line.substr(4) : "");
+        if (line.size() == 3 || line[3] != '-')
+            break;
+    }
+    return rep;
+}
+
+std::string SmtpClient::readLine()
+{
+    for (;;) {
+        auto eol = _rbuf.find('\n');
+        if (eol != std::string::npos) {
+            std::string line = _rbuf.substr(0, eol);
+            _rbuf.erase(0, eol + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            return line;
+        }
+        char   buf[4096];
+        size_t n = readSome(buf, sizeof(buf));
+        _rbuf.append(buf, n);
+    }
+}
+
+void SmtpClient::waitFor(short events)
+{
+    struct pollfd pfd = {_fd, events, 0};
+    int           r;
+    do {
+        r = ::poll(&pfd, 1, _settings.timeout_ms);
+    } while (r == -1 && errno == EINTR);
+
+    if (r == 0)
+        fail(SmtpError::ServerUnreachable, "network read/write timeout");
+    if (r == -1)
+        fail(SmtpError::ServerUnreachable, std::string("network error: ") + strerror(errno));
+}
+
+size_t SmtpClient::readSome(char* data, size_t size)
+{
+    if (_fd == -1)
+        fail(SmtpError::ServerUnreachable, "not connected");
+
+    for (;;) {
+        if (_ssl) {
+            int r = SSL_read(_ssl, data, int(size));
+            if (r > 0)
+                return size_t(r);
+            int err = SSL_get_error(_ssl, r);
+            if (err == SSL_ERROR_WANT_READ)
+                waitFor(POLLIN);
+            else if (err == SSL_ERROR_WANT_WRITE)
+                waitFor(POLLOUT);
+            else if (err == SSL_ERROR_ZERO_RETURN)
+                fail(SmtpError::ServerUnreachable, "the server closed the connection");
+            else
+                fail(SmtpError::Unknown, "cannot read from TLS connection: " + s_openssl_error());
+        } else {
+            ssize_t r = ::recv(_fd, data, size, 0);
+            if (r > 0)
+                return size_t(r);
+            if (r == 0)
+                fail(SmtpError::ServerUnreachable, "the server closed the connection");
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                waitFor(POLLIN);
+            else if (errno != EINTR)
+                fail(SmtpError::ServerUnreachable, std::string("network read error: ") + strerror(errno));
+        }
+    }
+}
+
+void SmtpClient::writeAll(const char* data, size_t size)
+{
+    if (_fd == -1)
+        fail(SmtpError::ServerUnreachable, "not connected");
+
+    while (size > 0) {
+        if (_ssl) {
+            int r = SSL_write(_ssl, data, int(std::min<size_t>(size, INT32_MAX)));
+            if (r > 0) {
+                data += r;
+                size -= size_t(r);
+                continue;
+            }
+            int err = SSL_get_error(_ssl, r);
+            if (err == SSL_ERROR_WANT_READ)
+                waitFor(POLLIN);
+            else if (err == SSL_ERROR_WANT_WRITE)
+                waitFor(POLLOUT);
+            else
+                fail(SmtpError::Unknown, "cannot write to TLS connection: " + s_openssl_error());
+        } else {
+            ssize_t r = ::send(_fd, data, size, MSG_NOSIGNAL);
+            if (r >= 0) {
+                data += r;
+                size -= size_t(r);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                waitFor(POLLOUT);
+            else if (errno != EINTR)
+                fail(SmtpError::ServerUnreachable, std::string("network write error: ") + strerror(errno));
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// SmtpSessionPool
+
+SmtpSessionPool::SmtpSessionPool()
+    : _busy(0)
+    , _max_sessions(2)
+    , _idle_timeout(std::chrono::seconds(60))
+    , _health_check(std::chrono::seconds(5))
+{
+}
+
+SmtpSessionPool::~SmtpSessionPool()
+{
+    clear();
+}
+
+void SmtpSessionPool::configure(const SmtpSettings& settings)
+{
+    std::deque<Idle> old;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (settings == _settings)
+            return;
+        _settings = settings;
+        old.swap(_idle);
+    }
+    log_debug("smtp settings changed, closing %zu pooled session(s)", old.size());
+    for (auto& it : old)
+        it.client->quit();
+}
+
+void SmtpSessionPool::limits(size_t max_sessions, int idle_timeout_ms, int health_check_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_sessions = max_sessions;
+    _idle_timeout = std::chrono::milliseconds(idle_timeout_ms);
+    _health_check = std::chrono::milliseconds(health_check_ms);
+    _cond.notify_all();
+}
+
+void SmtpSessionPool::sendmail(
+    const std::string& from, const std::vector<std::string>& recipients, const std::string& data)
+{
+    sendmail(from, recipients, [&data](MimeSink& sink) {
+        sink.write(data);
+    });
+}
+
+void SmtpSessionPool::sendmail(
+    const std::string& from, const std::vector<std::string>& recipients, const MimeSource& data)
+{
+    std::unique_ptr<SmtpClient> client = acquire();
+    try {
+        client->sendmail(from, recipients, data);
+    } catch (...) {
+        release(std::move(client));
+        throw;
+    }
+    release(std::move(client));
+}
+
+std::unique_ptr<SmtpClient> SmtpSessionPool::acquire()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::deque<Idle>             expired;
+    for (;;) {
+        auto now = Clock::now();
+        expireLocked(now, expired);
+        if (!expired.empty()) {
+            // QUIT waits for reply of the server, other threads must not wait for it
+            lock.unlock();
+            for (auto& it : expired)
+                it.client->quit();
+            expired.clear();
+            lock.lock();
+            continue;
+        }
+
+        if (!_idle.empty()) {
+            // most recently used session is the most likely to be alive
+            Idle idle = std::move(_idle.back());
+            _idle.pop_back();
+            _busy++;
+            bool noop = now - idle.since >= _health_check;
+            lock.unlock();
+            if (idle.client->alive(noop))
+                return std::move(idle.client);
+            lock.lock();
+            _busy--;
+            continue;
+        }
+
+        if (_max_sessions == 0 || _busy < _max_sessions) {
+            _busy++;
+            return std::unique_ptr<SmtpClient>(new SmtpClient(_settings));
+        }
+        _cond.wait(lock);
+    }
+}
+
+void SmtpSessionPool::release(std::unique_ptr<SmtpClient> client)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _busy--;
+    bool keep = _max_sessions != 0 && client->connected() && _idle.size() + _busy < _max_sessions;
+    // session opened with old settings must not be reused
+    keep = keep && client->settings() == _settings;
+    if (keep)
+        _idle.push_back({std::move(client), Clock::now()});
+    _cond.notify_one();
+    lock.unlock();
+
+    if (client)
+        client->quit();
+}
+
+void SmtpSessionPool::expire()
+{
+    std::deque<Idle> expired;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        expireLocked(Clock::now(), expired);
+    }
+    for (auto& it : expired)
+        it.client->quit();
+}
+
+void SmtpSessionPool::expireLocked(Clock::time_point now, std::deque<Idle>& expired)
+{
+    // sessions are pushed back in order of use, oldest are in the front
+    while (!_idle.empty() && now - _idle.front().since >= _idle_timeout) {
+        expired.push_back(std::move(_idle.front()));
+        _idle.pop_front();
+    }
+}
+
+void SmtpSessionPool::clear()
+{
+    std::deque<Idle> old;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        old.swap(_idle);
+    }
+    for (auto& it : old)
+        it.client->quit();
+}
+
+size_t SmtpSessionPool::idle() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _idle.size();
+}
@@ -0,0 +1,261 @@
+/*  =========================================================================
+    smtp_client - Native SMTP/ESMTP client
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   smtp_client.h
+/// @brief  In-process SMTP/ESMTP client used by Smtp instead of forking msmtp
+///
+/// Example:
+///
+///    SmtpSettings settings;
+///    settings.host = "mail.example.com";
+///    settings.from = "joe.doe@example.com";
+///
+///    SmtpClient client{settings};
+///    client.connect();
+///    client.sendmail(settings.from, {"agent.smith@matrix.gov"}, data);
+///    client.quit();
+
+#pragma once
+
+#include "email.h"
+#include "mime_writer.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+typedef struct ssl_st     SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/// Connection parameters of SMTP session
+struct SmtpSettings
+{
+    std::string host;
+    std::string port{"25"};
+    std::string from;
+    Encryption  encryption{Encryption::NONE};
+    std::string username;
+    std::string password;
+    bool        verify_ca{false};
+    /// timeout of connect and each read/write in milliseconds
+    int timeout_ms{30000};
+    /// send envelope without waiting for each reply if server advertises PIPELINING (RFC 2920)
+    bool pipelining{true};
+    /// send message by BDAT if server advertises CHUNKING or BINARYMIME (RFC 3030)
+    bool chunking{true};
+    /// size of one BDAT chunk in bytes
+    size_t chunk_size{1024 * 1024};
+
+    bool operator==(const SmtpSettings& other) const;
+    bool operator!=(const SmtpSettings& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/// Message prepared for SMTP transaction, derived from the message headers the same way as msmtp -t does
+struct SmtpEnvelope
+{
+    /// recipients found in To:, Cc: and Bcc: headers
+    std::vector<std::string> recipients;
+    /// message with Bcc: header removed and missing From:/Date: headers added
+    std::string data;
+};
+
+/// Parse the message headers and prepare the envelope (msmtp -t semantics)
+///  \param [in] data    full email message (headers + body)
+///  \param [in] from    address used for missing From: header
+SmtpEnvelope smtp_prepare_envelope(const std::string& data, const std::string& from);
+
+/// Parse address list of To:, Cc: or Bcc: header ("Joe <joe@example.com>, jane@example.com")
+///  \return the addresses without display names and comments
+std::vector<std::string> smtp_parse_addresses(const std::string& value);
+
+///  @class SmtpClient
+///
+///  One SMTP session (connect, EHLO, STARTTLS, AUTH, MAIL, RCPT, DATA/BDAT, QUIT)
+///
+///  All errors are reported as SmtpException with SmtpError code mapped the same way as msmtp_stderr2code does for
+///  msmtp, the message text follows the msmtp wording.
+class SmtpClient
+{
+public:
+    explicit SmtpClient(const SmtpSettings& settings);
+    ~SmtpClient();
+
+    SmtpClient(const SmtpClient&) = delete;
+    SmtpClient& operator=(const SmtpClient&) = delete;
+
+    /// connect to the server, read greeting, negotiate TLS and authenticate
+    /// @throws SmtpException
+    void connect();
+
+    /// send one message (MAIL FROM, RCPT TO..., DATA or BDAT)
+    ///
+    /// Envelope is pipelined if server supports PIPELINING, message is sent in BDAT chunks if server supports
+    /// CHUNKING, both can be turned off in SmtpSettings.
+    ///
+    /// @param from        envelope sender
+    /// @param recipients  envelope recipients
+    /// @param data        email message, line endings are normalized to CRLF and lines are dot-stuffed for DATA
+    /// @throws SmtpException
+    void sendmail(const std::string& from, const std::vector<std::string>& recipients, const std::string& data);
+
+    /// send one message produced by data, it is normalized and written to the server as it comes, in pieces of
+    /// chunk_size (BDAT) or 64 KiB (DATA), so the message is never held in memory
+    /// @throws SmtpException
+    void sendmail(const std::string& from, const std::vector<std::string>& recipients, const MimeSource& data);
+
+    /// send QUIT and close the connection, never throws
+    void quit();
+
+    /// check the session is still usable, never throws
+    /// @param noop  send NOOP and wait for the reply, otherwise only check the socket was not closed by the server
+    bool alive(bool noop);
+
+    /// @return settings of the session
+    const SmtpSettings& settings() const
+    {
+        return _settings;
+    }
+
+    /// @return true if session is established
+    bool connected() const
+    {
+        return _fd != -1;
+    }
+
+    /// @return true if EHLO response advertised given extension (upper case, e.g. "PIPELINING")
+    bool has_extension(const std::string& ext) const
+    {
+        return _extensions.count(ext) == 1;
+    }
+
+protected:
+    struct Reply
+    {
+        int                      code{0};
+        std::vector<std::string> lines;
+
+        std::string text() const;
+    };
+
+    /// message normalized to CRLF (and dot-stuffed for DATA) and sent in chunks
+    class DataSink;
+
+    void  tcpConnect();
+    void  tlsHandshake();
+    void  ehlo();
+    void  starttls();
+    void  authenticate();
+    void  close();
+    void  command(const std::string& line);
+    Reply reply();
+
+    void        writeAll(const char* data, size_t size);
+    size_t      readSome(char* data, size_t size);
+    std::string readLine();
+    void        waitFor(short events);
+
+    /// @param reply  code of the reply which refused the command, 5xx makes the error permanent
+    [[noreturn]] void fail(SmtpError code, const std::string& message, int reply = 0);
+    [[noreturn]] void reject(SmtpError code, const std::string& message, int reply = 0);
+
+    SmtpSettings          _settings;
+    int                   _fd;
+    SSL_CTX*              _ctx;
+    SSL*                  _ssl;
+    std::string           _rbuf;
+    std::set<std::string> _extensions;
+    std::set<std::string> _auth_methods;
+    /// MAIL FROM was sent and transaction did not finish, RSET is needed before next one
+    bool _in_transaction;
+};
+
+///  @class SmtpSessionPool
+///
+///  Authenticated SMTP sessions kept open between messages
+///
+///  Session is returned to the pool after each message and the next message is sent on it right away. A session
+///  which failed in the middle of transaction is reset by RSET, idle sessions are closed after idle timeout and
+///  sessions idle for longer than health check interval are checked by NOOP before reuse. All sessions are
+///  dropped when settings change (see configure).
+///
+///  The pool is thread safe, at most max_sessions sessions are open to the server.
+class SmtpSessionPool
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    SmtpSessionPool();
+    ~SmtpSessionPool();
+
+    /// apply connection settings, all sessions are closed if they differ from the current ones
+    void configure(const SmtpSettings& settings);
+
+    /// set limits of the pool
+    /// @param max_sessions     maximum of sessions open to the server, 0 disables pooling
+    /// @param idle_timeout_ms  idle session is closed after this time
+    /// @param health_check_ms  idle session is checked by NOOP before reuse after this time
+    void limits(size_t max_sessions, int idle_timeout_ms, int health_check_ms);
+
+    /// send one message on pooled session
+    /// @throws SmtpException
+    void sendmail(const std::string& from, const std::vector<std::string>& recipients, const std::string& data);
+
+    /// send one message streamed by data on pooled session
+    /// @throws SmtpException
+    void sendmail(const std::string& from, const std::vector<std::string>& recipients, const MimeSource& data);
+
+    /// close idle sessions which exceeded idle timeout
+    void expire();
+
+    /// close all sessions
+    void clear();
+
+    /// @return number of idle sessions
+    size_t idle() const;
+
+protected:
+    struct Idle
+    {
+        std::unique_ptr<SmtpClient> client;
+        Clock::time_point           since;
+    };
+
+    std::unique_ptr<SmtpClient> acquire();
+    void                        release(std::unique_ptr<SmtpClient> client);
+    /// move sessions which exceeded idle timeout to expired, caller closes them after unlocking
+    void                        expireLocked(Clock::time_point now, std::deque<Idle>& expired);
+
+    mutable std::mutex      _mutex;
+    std::condition_variable _cond;
+    SmtpSettings            _settings;
+    std::deque<Idle>        _idle;
+    size_t                  _busy;
+    size_t                  _max_sessions;
+    Clock::duration         _idle_timeout;
+    Clock::duration         _health_check;
+};
@@ -0,0 +1,116 @@
+#include "src/base64.h"
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+static std::vector<unsigned char> s_random(size_t size)
+{
+    std::mt19937               rng(static_cast<uint32_t>(size));
+    std::vector<unsigned char> ret(size);
+    for (auto& it : ret)
+        it = static_cast<unsigned char>(rng());
+    return ret;
+}
+
+static std::string s_blocks(const std::vector<unsigned char>& data, size_t offset, size_t size, SimdIsa isa)
+{
+    std::string out(size / 3 * 4, '\0');
+    CHECK(base64_encode_blocks(data.data() + offset, size, &out[0], isa) == out.size());
+    return out;
+}
+
+static std::string s_lines(const std::string& s, const char* eol)
+{
+    std::vector<char> out(base64_lines_size(s.size(), strlen(eol)));
+    size_t len = base64_encode_lines(reinterpret_cast<const unsigned char*>(s.data()), s.size(), out.data(), eol);
+    CHECK(len == out.size());
+    return std::string(out.data(), len);
+}
+
+TEST_CASE("base64")
+{
+    auto b64 = [](const std::string& s) {
+        return base64_encode(reinterpret_cast<const unsigned char*>(s.data()), s.size());
+    };
+    // RFC 4648 test vectors
+    CHECK(b64("") == "");
+    CHECK(b64("f") == "Zg==");
+    CHECK(b64("fo") == "Zm8=");
+    CHECK(b64("foo") == "Zm9v");
+    CHECK(b64("foob") == "Zm9vYg==");
+    CHECK(b64("fooba") == "Zm9vYmE=");
+    CHECK(b64("foobar") == "Zm9vYmFy");
+    CHECK(b64("\xfb\xff\xbf") == "+/+/");
+
+    CHECK(simd_supported(SimdIsa::SCALAR));
+    CHECK(simd_supported(simd_isa()));
+}
+
+TEST_CASE("base64_isa")
+{
+    // every offset, every tail length of each kernel, whole alphabet in every position
+    std::vector<unsigned char> data = s_random(4096 + 64);
+    for (SimdIsa isa : SIMD_ISAS) {
+        if (!simd_supported(isa))
+            continue;
+        INFO(simd_isa_name(isa));
+        for (size_t size = 0; size <= 300; size += 3) {
+            for (size_t offset = 0; offset != 4; offset++)
+                CHECK(s_blocks(data, offset, size, isa) == s_blocks(data, offset, size, SimdIsa::SCALAR));
+        }
+        CHECK(s_blocks(data, 1, 4095, isa) == s_blocks(data, 1, 4095, SimdIsa::SCALAR));
+
+        std::vector<unsigned char> all;
+        for (int i = 0; i != 3 * 256; i++)
+            all.push_back(static_cast<unsigned char>((i * 3 % 256) ^ (i / 256)));
+        CHECK(s_blocks(all, 0, all.size(), isa) == s_blocks(all, 0, all.size(), SimdIsa::SCALAR));
+    }
+}
+
+TEST_CASE("base64_lines")
+{
+    CHECK(base64_lines_size(0, 2) == 0);
+    CHECK(s_lines("", "\r\n") == "");
+    CHECK(s_lines("f", "\r\n") == "Zg==\r\n");
+    CHECK(s_lines("foobar", "\n") == "Zm9vYmFy\n");
+
+    std::string full(57, 'a');
+    std::string line = base64_encode(reinterpret_cast<const unsigned char*>(full.data()), full.size());
+    REQUIRE(line.size() == 76);
+    CHECK(s_lines(full, "\r\n") == line + "\r\n");
+    CHECK(s_lines(full + full, "\r\n") == line + "\r\n" + line + "\r\n");
+    CHECK(s_lines(full + "f", "\r\n") == line + "\r\nZg==\r\n");
+
+    // lines equal to the unwrapped encoding cut to 76 characters
+    for (size_t size : {56, 58, 113, 114, 1000, 57 * 100, 57 * 100 + 1}) {
+        std::vector<unsigned char> data = s_random(size);
+        std::string                flat = base64_encode(data.data(), size);
+        std::string                wrapped;
+        for (size_t i = 0; i < flat.size(); i += 76)
+            wrapped += flat.substr(i, 76) + "\r\n";
+        CHECK(s_lines(std::string(data.begin(), data.end()), "\r\n") == wrapped);
+    }
+}
+
+TEST_CASE("base64_benchmark", "[.benchmark]")
+{
+    // fty-email-test "[.benchmark]" -s
+    std::vector<unsigned char> data = s_random(9 * 1024 * 1024);
+    std::vector<char>          out(data.size() / 3 * 4);
+    for (SimdIsa isa : SIMD_ISAS) {
+        // there is no SSE2 kernel, pshufb is SSSE3
+        if (!simd_supported(isa) || isa == SimdIsa::SSE2)
+            continue;
+        auto   start = std::chrono::steady_clock::now();
+        size_t len   = 0;
+        for (int i = 0; i != 16; i++)
+            len += base64_encode_blocks(data.data(), data.size(), out.data(), isa);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "base64 " << simd_isa_name(isa) << ": " << 16.0 * double(data.size()) / elapsed.count() / 1e6
+                  << " MB/s" << std::endl;
+        CHECK(len == 16 * out.size());
+    }
+}
@@ -0,0 +1,138 @@
+#include "src/content_scan.h"
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+static ContentStats s_scan(const std::vector<std::string>& chunks, SimdIsa isa = SimdIsa::SCALAR)
+{
+    ContentScanner scanner{isa};
+    for (const auto& it : chunks)
+        scanner.scan(it.data(), it.size());
+    return scanner.stats();
+}
+
+static TransferEncoding s_encoding(const std::string& s, bool text = true, bool eight_bit = false)
+{
+    return s_scan({s}).encoding(text, eight_bit);
+}
+
+static bool operator==(const ContentStats& a, const ContentStats& b)
+{
+    return a.size == b.size && a.non_ascii == b.non_ascii && a.nul == b.nul && a.bare_cr == b.bare_cr &&
+           a.controls == b.controls && a.equals == b.equals && a.max_line == b.max_line;
+}
+
+/// log-like text with some non-ASCII, control and long lines
+static std::string s_random_text(std::mt19937& rng, size_t size)
+{
+    static const char chars[] = "abc= \t\r\n\n\n\x00\x01\x7f\xc5\xbe";
+    std::string       ret;
+    while (ret.size() < size) {
+        uint32_t r = rng();
+        if (r % 50 == 0)
+            ret.append(r % 3000, 'x');
+        else
+            ret.push_back(chars[r % (sizeof(chars) - 1)]);
+    }
+    return ret;
+}
+
+TEST_CASE("content_scan")
+{
+    ContentStats st = s_scan({"hello\nworld =\x01\xc5\xbe\n\t"});
+    CHECK(st.size == 18);
+    CHECK(st.non_ascii == 2);
+    CHECK(st.nul == 0);
+    CHECK(st.controls == 1);
+    CHECK(st.equals == 1);
+    CHECK(st.max_line == 10);
+
+    SECTION("bare CR")
+    {
+        CHECK(s_scan({"a\r\nb"}).bare_cr == 0);
+        CHECK(s_scan({"a\r", "\nb"}).bare_cr == 0);
+        CHECK(s_scan({"a\rb"}).bare_cr == 1);
+        CHECK(s_scan({"a\r", "b"}).bare_cr == 1);
+        CHECK(s_scan({"a\r"}).bare_cr == 1);
+        CHECK(s_scan({std::string(63, 'a') + "\r\n"}).bare_cr == 0);
+        CHECK(s_scan({std::string(63, 'a') + "\r", "\n"}).bare_cr == 0);
+    }
+
+    SECTION("lines span chunks")
+    {
+        CHECK(s_scan({std::string(100, 'a'), std::string(100, 'b') + "\nc"}).max_line == 200);
+        CHECK(s_scan({"a\n", std::string(1000, 'b')}).max_line == 1000);
+        CHECK(s_scan({std::string(64, 'a') + "\n" + std::string(70, 'b') + "\n"}).max_line == 70);
+    }
+}
+
+TEST_CASE("content_scan_isa")
+{
+    std::mt19937 rng(42);
+    for (SimdIsa isa : SIMD_ISAS) {
+        if (!simd_supported(isa))
+            continue;
+        INFO(simd_isa_name(isa));
+        for (size_t size : {0, 1, 63, 64, 65, 127, 128, 1000, 100000}) {
+            std::string text = s_random_text(rng, size);
+            // chunks split at random positions
+            std::vector<std::string> chunks;
+            for (size_t pos = 0; pos < text.size();) {
+                size_t len = rng() % 200;
+                chunks.push_back(text.substr(pos, len));
+                pos += len;
+            }
+            CHECK(s_scan({text}, isa) == s_scan({text}));
+            CHECK(s_scan(chunks, isa) == s_scan({text}));
+        }
+    }
+}
+
+TEST_CASE("content_scan_encoding")
+{
+    CHECK(s_encoding("") == TransferEncoding::SEVEN_BIT);
+    CHECK(s_encoding("line 1\r\nline 2\n") == TransferEncoding::SEVEN_BIT);
+    CHECK(s_encoding("line 1\n", false) == TransferEncoding::BASE64);
+
+    // 8bit only if the transport accepts it
+    CHECK(s_encoding("Alert na za\xc5\x99\xc3\xadzen\xc3\xad ups-01\n") ==
+          TransferEncoding::QUOTED_PRINTABLE);
+    CHECK(s_encoding("Alert na za\xc5\x99\xc3\xadzen\xc3\xad ups-01\n", true, true) ==
+          TransferEncoding::EIGHT_BIT);
+
+    // lines longer than 998, NUL and bare CR are not allowed in 7bit and 8bit
+    CHECK(s_encoding(std::string(998, 'a')) == TransferEncoding::SEVEN_BIT);
+    CHECK(s_encoding(std::string(999, 'a')) == TransferEncoding::QUOTED_PRINTABLE);
+    CHECK(s_encoding("a\rb", true, true) == TransferEncoding::QUOTED_PRINTABLE);
+    CHECK(s_encoding(std::string("a\0b", 3), true, true) == TransferEncoding::QUOTED_PRINTABLE);
+
+    // mostly not ASCII
+    std::string binary;
+    for (int i = 0; i != 1000; i++)
+        binary.push_back(char(i * 7));
+    CHECK(s_encoding(binary, true, true) == TransferEncoding::BASE64);
+
+    CHECK(std::string(transfer_encoding_name(TransferEncoding::EIGHT_BIT)) == "8bit");
+}
+
+TEST_CASE("content_scan_benchmark", "[.benchmark]")
+{
+    // fty-email-test "[.benchmark]" -s
+    std::mt19937 rng(42);
+    std::string  text = s_random_text(rng, 8 * 1024 * 1024);
+    for (SimdIsa isa : SIMD_ISAS) {
+        if (!simd_supported(isa) || isa == SimdIsa::SSSE3)
+            continue;
+        auto     start = std::chrono::steady_clock::now();
+        uint64_t size  = 0;
+        for (int i = 0; i != 16; i++)
+            size += s_scan({text}, isa).size;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "content scan " << simd_isa_name(isa) << ": " << double(size) / elapsed.count() / 1e6
+                  << " MB/s" << std::endl;
+        CHECK(size == 16 * text.size());
+    }
+}
@@ -1,9 +1,16 @@
 #include "src/email.h"
 #include "src/emailconfiguration.h"
 #include "src/fty_email_server.h"
+#include "fake_smtp_server.h"
 #include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <fty_log.h>
+#include <iostream>
+#include <regex>
+#include <sstream>
+#include <sysexits.h>
 
 TEST_CASE("email_test")
 {
@@ -62,3 +69,399 @@ TEST_CASE("email_test")
     std::string email = smtp.msg2email(&email_msg);
     log_debug("E M A I L:=\n%s\n", email.c_str());
 }
+
+TEST_CASE("email_multiple_recipients")
+{
+    Smtp                     smtp{};
+    std::vector<std::string> mails;
+    smtp.sendmail_set_test_fn([&mails](const std::string& data) {
+        mails.push_back(data);
+    });
+
+    std::vector<std::string> to = {"joe@example.com", "jane@example.com"};
+
+    SECTION("default is bcc, single recipient is stated in To:")
+    {
+        smtp.sendmail(to, "subject", "body");
+        REQUIRE(mails.size() == 1);
+        CHECK(mails[0].find("To: undisclosed-recipients:;") != std::string::npos);
+
+        smtp.sendmail("joe@example.com", "subject", "body");
+        smtp.sendmail(std::vector<std::string>{"joe@example.com"}, "subject", "body");
+        REQUIRE(mails.size() == 3);
+        for (size_t i = 1; i != mails.size(); i++) {
+            CHECK(mails[i].find("To: joe@example.com\n") != std::string::npos);
+            CHECK(mails[i].find("undisclosed-recipients") == std::string::npos);
+            CHECK(mails[i].find("Bcc:") == std::string::npos);
+        }
+    }
+
+    SECTION("list")
+    {
+        smtp.recipients_header("list");
+        smtp.sendmail(to, "subject", "body");
+        REQUIRE(mails.size() == 1);
+        CHECK(mails[0].find("joe@example.com, jane@example.com") != std::string::npos);
+    }
+
+    SECTION("bcc")
+    {
+        smtp.recipients_header("bcc");
+        smtp.sendmail(to, "subject", "body");
+        REQUIRE(mails.size() == 1);
+        CHECK(mails[0].find("undisclosed-recipients:;") != std::string::npos);
+        CHECK(mails[0].find("joe@example.com, jane@example.com") != std::string::npos);
+    }
+
+    SECTION("individual")
+    {
+        smtp.recipients_header("individual");
+        smtp.sendmail(to, "subject", "body");
+        REQUIRE(mails.size() == 2);
+        CHECK(mails[0].find("joe@example.com") != std::string::npos);
+        CHECK(mails[0].find("jane@example.com") == std::string::npos);
+        CHECK(mails[1].find("jane@example.com") != std::string::npos);
+        CHECK(mails[1].find("joe@example.com") == std::string::npos);
+    }
+}
+
+/// Smtp exposing its msmtp configuration
+class MsmtpSmtp : public Smtp
+{
+public:
+    using Smtp::msmtpConfigFile;
+};
+
+static std::string s_read(const std::string& path)
+{
+    std::ifstream      file{path};
+    std::ostringstream ret;
+    ret << file.rdbuf();
+    return ret.str();
+}
+
+TEST_CASE("email_msmtp_config")
+{
+    SECTION("memfd is reused until settings change")
+    {
+        MsmtpSmtp smtp;
+        smtp.transport(Transport::MSMTP);
+        smtp.host("mail.example.com");
+        smtp.from("joe.doe@example.com");
+
+        std::shared_ptr<MsmtpConfig> cfg = smtp.msmtpConfigFile();
+        CHECK(cfg->file().empty());
+        CHECK(cfg->path().find("/proc/") == 0);
+        CHECK(s_read(cfg->path()).find("host mail.example.com\n") != std::string::npos);
+        CHECK(smtp.msmtpConfigFile() == cfg);
+        CHECK(smtp.msmtpConfigFile()->path() == cfg->path());
+
+        // copies made by configure share it
+        Smtp copy;
+        copy.configure(smtp);
+        CHECK(cfg.use_count() == 3);
+
+        smtp.host("smtp.example.com");
+        std::shared_ptr<MsmtpConfig> host = smtp.msmtpConfigFile();
+        CHECK(host != cfg);
+        CHECK(s_read(host->path()).find("host smtp.example.com\n") != std::string::npos);
+
+        smtp.port("587");
+        std::shared_ptr<MsmtpConfig> port = smtp.msmtpConfigFile();
+        CHECK(port != host);
+        CHECK(s_read(port->path()).find("port 587\n") != std::string::npos);
+
+        smtp.username("joe");
+        smtp.password("secret");
+        std::shared_ptr<MsmtpConfig> auth = smtp.msmtpConfigFile();
+        CHECK(auth != port);
+        CHECK(s_read(auth->path()).find("password secret\n") != std::string::npos);
+        CHECK(smtp.msmtpConfigFile() == auth);
+    }
+
+    SECTION("temporary file is removed")
+    {
+        std::string file;
+        {
+            MsmtpConfig cfg{"host mail.example.com\n", false};
+            file = cfg.file();
+            REQUIRE(!file.empty());
+            CHECK(cfg.path() == file);
+            CHECK(s_read(file) == "host mail.example.com\n");
+        }
+        CHECK(!std::ifstream{file}.good());
+    }
+}
+
+TEST_CASE("email_native_transport")
+{
+    FakeSmtpServer server;
+    server.start();
+
+    Smtp smtp{};
+    smtp.transport("native");
+    smtp.host("127.0.0.1");
+    smtp.port(server.port());
+    smtp.from("from@example.com");
+    smtp.timeout(1);
+
+    auto code = [&smtp]() {
+        try {
+            smtp.sendmail("To: joe@example.com\r\nSubject: subject\r\n\r\nbody\r\n");
+            return SmtpError::Succeeded;
+        } catch (const std::runtime_error& e) {
+            return smtp_exception2code(e);
+        }
+    };
+
+    CHECK(code() == SmtpError::Succeeded);
+    REQUIRE(server.count() == 1);
+    CHECK(server.messages()[0].recipients == std::vector<std::string>{"joe@example.com"});
+    CHECK(server.messages()[0].data.find("Subject: subject") != std::string::npos);
+
+    server.fail("RCPT", "452 4.2.2 Mailbox full", 1);
+    CHECK(code() == SmtpError::Unknown);
+    server.drop("MAIL", 1);
+    CHECK(code() == SmtpError::ServerUnreachable);
+    server.latency("MESSAGE", 1500);
+    CHECK(code() == SmtpError::ServerUnreachable);
+    server.reset();
+    CHECK(code() == SmtpError::Succeeded);
+
+    SECTION("individual copy refused for one recipient")
+    {
+        smtp.recipients_header("individual");
+        std::vector<std::string> to = {"joe@example.com", "jane@example.com", "jim@example.com"};
+        server.fail("RCPT", "550 5.1.1 User unknown", 1);
+        try {
+            smtp.sendmail(to, "subject", "body");
+            CHECK(false);
+        } catch (const SmtpRecipientsException& e) {
+            CHECK(e.code() == SmtpError::Unknown);
+            CHECK(e.recipients() == std::vector<std::string>{"joe@example.com"});
+        }
+        size_t count = server.count();
+        CHECK(server.messages()[count - 2].recipients == std::vector<std::string>{"jane@example.com"});
+        CHECK(server.messages()[count - 1].recipients == std::vector<std::string>{"jim@example.com"});
+
+        // repeated for the failed recipient only, nobody gets the email twice
+        smtp.sendmail(std::vector<std::string>{"joe@example.com"}, "subject", "body");
+        REQUIRE(server.count() == count + 1);
+        CHECK(server.messages()[count].recipients == std::vector<std::string>{"joe@example.com"});
+    }
+
+    server.stop();
+    CHECK(code() == SmtpError::ServerUnreachable);
+
+    SECTION("individual copies to unreachable server are not attempted again")
+    {
+        smtp.recipients_header("individual");
+        try {
+            smtp.sendmail(std::vector<std::string>{"joe@example.com", "jane@example.com"}, "subject", "body");
+            CHECK(false);
+        } catch (const SmtpRecipientsException& e) {
+            CHECK(e.code() == SmtpError::ServerUnreachable);
+            CHECK(e.recipients().size() == 2);
+        }
+    }
+}
+
+TEST_CASE("email_mime_type")
+{
+    Smtp smtp{};
+
+    // known extensions are not examined
+    CHECK(smtp.mimeType("report.CSV") == "text/csv; charset=utf-8");
+    CHECK(smtp.mimeType("/var/log/messages.log") == "text/plain; charset=utf-8");
+    CHECK(smtp.mimeType("support.tar.gz") == "application/gzip; charset=binary");
+
+    {
+        std::ofstream file{"mime_type.bin", std::ios::binary};
+        file.write("MZ\0\0\0\0\0\0", 8);
+    }
+    MimeTypeCacheStats before = mime_type_cache_stats();
+    std::string        type   = smtp.mimeType("mime_type.bin");
+    CHECK(smtp.mimeType("mime_type.bin") == type);
+    MimeTypeCacheStats after = mime_type_cache_stats();
+    CHECK(after.misses - before.misses == 1);
+    CHECK(after.hits - before.hits == 1);
+
+    // changed file is examined again
+    {
+        std::ofstream file{"mime_type.bin", std::ios::binary | std::ios::app};
+        file << "text";
+    }
+    smtp.mimeType("mime_type.bin");
+    CHECK(mime_type_cache_stats().misses - after.misses == 1);
+
+    mime_type_fallback("application/octet-stream");
+    CHECK(smtp.mimeType("mime_type.bin") == "application/octet-stream");
+    CHECK(smtp.mimeType("mime_type.txt") == "text/plain; charset=utf-8");
+    mime_type_fallback("magic");
+
+    std::remove("mime_type.bin");
+}
+
+/// msmtp_stderr2code as it was implemented by regular expressions
+static SmtpError s_regex_stderr2code(const std::string& inp)
+{
+    if (inp.size() == 0)
+        return SmtpError::Succeeded;
+
+    static std::regex ServerUnreachable{"cannot connect to .*, port .*"};
+    static std::regex DNSFailed{
+        ".*(cannot locate host.*: Name or service not known|the server does not support DNS).*", std::regex::extended};
+    static std::regex SSLNotSupported{
+        ".*(the server does not support TLS via the STARTTLS command|command STARTTLS failed|cannot use a secure "
+        "authentication method).*"};
+    static std::regex AuthMethodNotSupported{
+        ".*(the server does not support authentication|authentication method .* not supported|cannot find a usable "
+        "authentication method).*"};
+    static std::regex AuthFailed{"(authentication failed|(AUTH LOGIN|AUTH CRAM-MD5|AUTH EXTERNAL) failed)"};
+    static std::regex UnknownCA{
+        ".*(no certificate was founderror gettint .* fingerprint|the certificate fingerprint does not match|the "
+        "certificate has been revoked|the certificate hasn't got a known issuer|the certificate is not trusted).*"};
+
+    if (std::regex_match(inp, ServerUnreachable))
+        return SmtpError::ServerUnreachable;
+    if (std::regex_match(inp, DNSFailed))
+        return SmtpError::DNSFailed;
+    if (std::regex_match(inp, AuthMethodNotSupported))
+        return SmtpError::AuthMethodNotSupported;
+    if (std::regex_match(inp, AuthFailed))
+        return SmtpError::AuthFailed;
+    if (std::regex_match(inp, SSLNotSupported))
+        return SmtpError::SSLNotSupported;
+    if (std::regex_match(inp, UnknownCA))
+        return SmtpError::UnknownCA;
+    return SmtpError::Unknown;
+}
+
+static const std::string s_msmtp_failed = "/usr/bin/msmtp failed with exit code '69'\nstderr: ";
+
+// clang-format off
+static const std::vector<std::pair<std::string, SmtpError>> s_stderr_corpus = {
+    {"", SmtpError::Succeeded},
+    {"msmtp: envelope from address a@b not accepted by the server", SmtpError::Unknown},
+    {"cannot connect to mail.example.com, port 25", SmtpError::ServerUnreachable},
+    {"cannot connect to , port ", SmtpError::ServerUnreachable},
+    {"cannot connect to mail.example.com, port 25\n", SmtpError::Unknown},
+    {"msmtp: cannot connect to mail.example.com, port 25", SmtpError::Unknown},
+    {"cannot connect to, port 25", SmtpError::Unknown},
+    {"msmtp: cannot locate host mail.example.com: Name or service not known", SmtpError::DNSFailed},
+    {"msmtp: cannot locate host NOTmail.etn.com: Name or service not known\nmsmtp: could not send mail (account default "
+     "from config)", SmtpError::DNSFailed},
+    {s_msmtp_failed + "msmtp: cannot locate host x: Name or service not known\n", SmtpError::DNSFailed},
+    {"cannot locate host: Name or service not known", SmtpError::DNSFailed},
+    {": Name or service not known cannot locate host", SmtpError::Unknown},
+    {std::string("cannot locate host x") + '\0' + ": Name or service not known", SmtpError::Unknown},
+    {"\r\nthe server does not support DNS\r\n", SmtpError::DNSFailed},
+    {"msmtp: the server does not support authentication", SmtpError::AuthMethodNotSupported},
+    {"msmtp: authentication method CRAM-MD5 not supported", SmtpError::AuthMethodNotSupported},
+    {"authentication method  not supported", SmtpError::AuthMethodNotSupported},
+    {"authentication method not supported", SmtpError::Unknown},
+    {"msmtp: cannot find a usable authentication method", SmtpError::AuthMethodNotSupported},
+    {s_msmtp_failed + "msmtp: cannot find a usable authentication method\n", SmtpError::Unknown},
+    {"authentication failed", SmtpError::AuthFailed},
+    {"AUTH LOGIN failed", SmtpError::AuthFailed},
+    {"AUTH CRAM-MD5 failed", SmtpError::AuthFailed},
+    {"AUTH EXTERNAL failed", SmtpError::AuthFailed},
+    {"AUTH PLAIN failed", SmtpError::Unknown},
+    {"msmtp: authentication failed", SmtpError::Unknown},
+    {"authentication failed\n", SmtpError::Unknown},
+    {"msmtp: the server does not support TLS via the STARTTLS command", SmtpError::SSLNotSupported},
+    {"msmtp: command STARTTLS failed", SmtpError::SSLNotSupported},
+    {"msmtp: cannot use a secure authentication method", SmtpError::SSLNotSupported},
+    {"command STARTTLS failed\r", SmtpError::Unknown},
+    {"msmtp: no certificate was founderror gettint SHA1 fingerprint", SmtpError::UnknownCA},
+    {"no certificate was founderror gettint  fingerprint", SmtpError::UnknownCA},
+    {"no certificate was founderror gettint fingerprint", SmtpError::Unknown},
+    {"msmtp: the certificate fingerprint does not match", SmtpError::UnknownCA},
+    {"msmtp: TLS certificate verification failed: the certificate has been revoked", SmtpError::UnknownCA},
+    {"msmtp: TLS certificate verification failed: the certificate hasn't got a known issuer", SmtpError::UnknownCA},
+    {"msmtp: TLS certificate verification failed: the certificate is not trusted", SmtpError::UnknownCA},
+    {"the certificate is not trusted\nmsmtp: could not send mail", SmtpError::Unknown},
+    // the first matching class wins
+    {"cannot connect to the server does not support authentication, port 25", SmtpError::ServerUnreachable},
+    {"the server does not support DNS nor authentication method x not supported", SmtpError::DNSFailed},
+    {"command STARTTLS failed: the certificate is not trusted", SmtpError::SSLNotSupported},
+    {"the server does not support authentication: command STARTTLS failed", SmtpError::AuthMethodNotSupported},
+};
+// clang-format on
+
+TEST_CASE("msmtp_stderr2code")
+{
+    for (const auto& it : s_stderr_corpus) {
+        INFO(it.first);
+        CHECK(msmtp_stderr2code(it.first) == it.second);
+        CHECK(s_regex_stderr2code(it.first) == it.second);
+    }
+
+    SECTION("same as regular expressions")
+    {
+        // corpus cut, glued and wrapped into msmtp output
+        std::vector<std::string> inputs;
+        for (const auto& it : s_stderr_corpus) {
+            const std::string& s = it.first;
+            inputs.push_back("msmtp: " + s);
+            inputs.push_back(s_msmtp_failed + s + "\n");
+            inputs.push_back(std::string(1, '\0') + s);
+            for (size_t i = 0; i < s.size(); i += 7) {
+                inputs.push_back(s.substr(0, i));
+                inputs.push_back(s.substr(i));
+                inputs.push_back(s.substr(i) + s.substr(0, i));
+            }
+            for (const auto& other : s_stderr_corpus)
+                inputs.push_back(s + " " + other.first);
+        }
+        for (const auto& it : inputs) {
+            INFO(it);
+            CHECK(msmtp_stderr2code(it) == s_regex_stderr2code(it));
+        }
+    }
+
+    SECTION("exit code")
+    {
+        CHECK(msmtp_stderr2code("msmtp: cannot locate host x: Name or service not known", EX_OK) ==
+              SmtpError::Succeeded);
+        CHECK(msmtp_stderr2code(s_msmtp_failed + "msmtp: authentication failed\n", EX_NOPERM) == SmtpError::AuthFailed);
+        CHECK(msmtp_stderr2code(s_msmtp_failed + "msmtp: cannot locate host\n", EX_NOHOST) == SmtpError::DNSFailed);
+        CHECK(msmtp_stderr2code("", EX_TEMPFAIL) == SmtpError::Unknown);
+        // stderr decides first
+        CHECK(msmtp_stderr2code("msmtp: command STARTTLS failed", EX_NOPERM) == SmtpError::SSLNotSupported);
+
+        MsmtpException e{EX_NOHOST, s_msmtp_failed + "msmtp: cannot locate host mail.example.com\n"};
+        CHECK(smtp_exception2code(e) == SmtpError::DNSFailed);
+        CHECK(!smtp_exception_permanent(e));
+    }
+
+    SECTION("permanent refusal")
+    {
+        MsmtpException refused{EX_UNAVAILABLE,
+            s_msmtp_failed + "msmtp: recipient address x@example.com not accepted by the server\n"
+                             "msmtp: server message: 550 5.1.1 User unknown\n"};
+        CHECK(smtp_exception_permanent(refused));
+        MsmtpException busy{EX_TEMPFAIL,
+            s_msmtp_failed + "msmtp: envelope from address a@example.com not accepted by the server\n"
+                             "msmtp: server message: 451 4.3.0 Try again later\n"};
+        CHECK(!smtp_exception_permanent(busy));
+        CHECK(smtp_exception_permanent(SmtpException{SmtpError::Unknown, "refused", true}));
+        CHECK(!smtp_exception_permanent(std::runtime_error{"server message: 550"}));
+    }
+}
+
+TEST_CASE("msmtp_stderr2code_benchmark", "[.benchmark]")
+{
+    // fty-email-test "[.benchmark]" -s
+    std::string inp = s_msmtp_failed + "msmtp: TLS certificate verification failed: the certificate is not trusted\n";
+    for (auto fn : {&s_regex_stderr2code, static_cast<SmtpError (*)(const std::string&)>(&msmtp_stderr2code)}) {
+        auto   start = std::chrono::steady_clock::now();
+        size_t n     = 0;
+        for (int i = 0; i != 10000; i++)
+            n += fn(inp) == SmtpError::Unknown;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (fn == &s_regex_stderr2code ? "regex" : "matcher") << ": " << elapsed.count() * 1e5
+                  << " ns/call" << std::endl;
+        CHECK(n == 10000);
+    }
+}
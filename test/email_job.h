@@ -0,0 +1,56 @@
+/*  =========================================================================
+    email_job - Requests of the tests
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   email_job.h
+/// @brief  EmailJob as accepted from the mailbox, shared by the tests of queue, retry, digest and spool
+
+#pragma once
+
+#include "src/fty_email_worker.h"
+#include <initializer_list>
+#include <memory>
+#include <string>
+
+/// request accepted from the mailbox
+/// @param frames  request frames without uuid
+inline std::unique_ptr<EmailJob> email_job(const std::string& sender, const std::string& subject,
+    const std::string& uuid, std::initializer_list<const char*> frames = {})
+{
+    std::unique_ptr<EmailJob> job{new EmailJob};
+    job->sender  = sender;
+    job->subject = subject;
+    job->uuid    = uuid;
+    job->agent   = "fty-email";
+    job->msg     = zmsg_new();
+    for (const char* frame : frames)
+        zmsg_addstr(job->msg, frame);
+    return job;
+}
+
+/// SENDMAIL_ALERT request of alert-mailer, superseded by newer state of the same alert_key
+inline std::unique_ptr<EmailJob> email_alert_job(const std::string& uuid, const std::string& alert_key,
+    const std::string& alert_state, std::initializer_list<const char*> frames = {})
+{
+    std::unique_ptr<EmailJob> job = email_job("alert-mailer", "SENDMAIL_ALERT", uuid, frames);
+    job->alert_key                = alert_key;
+    job->alert_state              = alert_state;
+    return job;
+}
@@ -1,6 +1,78 @@
+#include "src/emailconfiguration.h"
+#include "src/fty_email.h"
 #include <catch2/catch.hpp>
+#include <chrono>
+#include <fty_common_translation.h>
+#include <thread>
 
 TEST_CASE("emailconfiguration_test")
 {
     REQUIRE(true);
 }
+
+TEST_CASE("emailconfiguration_render_cache")
+{
+    translation_initialize(FTY_EMAIL_ADDRESS, "test/conf", "test_");
+
+    zlist_t* actions = zlist_new();
+    zlist_append(actions, const_cast<char*>("EMAIL"));
+    zmsg_t* msg = fty_proto_encode_alert(
+        NULL, uint64_t(time(NULL)), 600, "RULE", "ASSET", "ACTIVE", "CRITICAL", "description", actions);
+    fty_proto_t* alert = fty_proto_decode(&msg);
+    REQUIRE(alert);
+
+    emailconfiguration_render_cache_size(2);
+    RenderCacheStats before = emailconfiguration_render_cache_stats();
+
+    // the same alert for two contacts is rendered once
+    std::string subject1, body1, subject2, body2;
+    generate_alert(alert, "1", "Asset 1", subject1, body1);
+    generate_alert(alert, "1", "Asset 1", subject2, body2);
+    CHECK(subject1 == subject2);
+    CHECK(body1 == body2);
+    CHECK(subject1 == generate_subject(alert, "1", "Asset 1"));
+    CHECK(body1 == generate_body(alert, "1", "Asset 1"));
+
+    RenderCacheStats after = emailconfiguration_render_cache_stats();
+    CHECK(after.misses - before.misses == 1);
+    CHECK(after.hits - before.hits == 1);
+
+    // different priority is a different key, the least recently used entry is evicted
+    generate_alert(alert, "2", "Asset 1", subject2, body2);
+    CHECK(body1 != body2);
+    generate_alert(alert, "3", "Asset 1", subject2, body2);
+    CHECK(emailconfiguration_render_cache_stats().size == 2);
+    generate_alert(alert, "1", "Asset 1", subject2, body2);
+    CHECK(emailconfiguration_render_cache_stats().misses - before.misses == 4);
+
+    emailconfiguration_render_cache_size(256);
+    fty_proto_destroy(&alert);
+    zlist_destroy(&actions);
+}
+
+TEST_CASE("emailconfiguration_ip_addr")
+{
+    // loopback is the only interface sure to exist
+    emailconfiguration_ip_interfaces(" nosuchif0 ,, lo ");
+    uint64_t lookups = emailconfiguration_ip_addr_stats().lookups;
+    CHECK(getIpAddr() == "From: 127.0.0.1\r\n");
+    CHECK(emailconfiguration_ip_addr_stats().lookups == lookups + 1);
+
+    // the address is cached, the same list does not invalidate it
+    CHECK(getIpAddr() == "From: 127.0.0.1\r\n");
+    emailconfiguration_ip_interfaces("nosuchif0,lo");
+    CHECK(getIpAddr() == "From: 127.0.0.1\r\n");
+    CHECK(emailconfiguration_ip_addr_stats().lookups == lookups + 1);
+
+    // without rtnetlink the address is refreshed by timer, with it only when a change is reported
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    CHECK(getIpAddr() == "From: 127.0.0.1\r\n");
+    IpAddrStats stats = emailconfiguration_ip_addr_stats();
+    CHECK(stats.lookups == lookups + (stats.netlink ? 1 : 2));
+
+    emailconfiguration_ip_interfaces(" , nosuchif0 ");
+    CHECK(getIpAddr() == "From: \r\n");
+    CHECK(emailconfiguration_ip_addr_stats().lookups == stats.lookups + 1);
+
+    emailconfiguration_ip_interfaces("eth0,LAN1");
+}
@@ -0,0 +1,582 @@
+/*  =========================================================================
+    fake_smtp_server - SMTP sink with injectable latency and failures
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fake_smtp_server.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstring>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static std::string s_upper(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) {
+        return char(toupper(c));
+    });
+    return str;
+}
+
+static std::string s_base64_decode(const std::string& in)
+{
+    std::string ret;
+    uint32_t    acc  = 0;
+    int         bits = 0;
+    for (unsigned char c : in) {
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '+')
+            v = 62;
+        else if (c == '/')
+            v = 63;
+        else
+            continue;
+        acc = (acc << 6) | uint32_t(v);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            ret.push_back(char((acc >> bits) & 0xff));
+        }
+    }
+    return ret;
+}
+
+/// @return address between < and >
+static std::string s_address(const std::string& arg)
+{
+    size_t open  = arg.find('<');
+    size_t close = arg.find('>', open);
+    if (open == std::string::npos || close == std::string::npos)
+        return arg;
+    return arg.substr(open + 1, close - open - 1);
+}
+
+/// TLS context with self-signed certificate of localhost valid for one day
+static SSL_CTX* s_tls_context()
+{
+    EVP_PKEY*     key  = nullptr;
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 || EVP_PKEY_keygen(pctx, &key) <= 0) {
+        EVP_PKEY_CTX_free(pctx);
+        throw std::runtime_error("cannot generate key of the certificate");
+    }
+    EVP_PKEY_CTX_free(pctx);
+
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_sign(cert, key, EVP_sha256());
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    bool     ok  = ctx && SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if (!ok) {
+        SSL_CTX_free(ctx);
+        throw std::runtime_error("cannot create TLS context");
+    }
+    return ctx;
+}
+
+// ----------------------------------------------------------------------------
+// Session
+
+///  @class FakeSmtpServer::Session
+///
+///  Buffered blocking I/O of one connection, plain or TLS. Errors and end of the connection are thrown.
+class FakeSmtpServer::Session
+{
+public:
+    explicit Session(int fd)
+        : _fd(fd)
+        , _ssl(nullptr)
+    {
+    }
+
+    ~Session()
+    {
+        SSL_free(_ssl);
+    }
+
+    void tls(SSL_CTX* ctx)
+    {
+        _ssl = SSL_new(ctx);
+        SSL_set_fd(_ssl, _fd);
+        if (SSL_accept(_ssl) != 1)
+            throw std::runtime_error("TLS handshake failed");
+        // commands sent before the handshake must be ignored (RFC 3207)
+        _rbuf.clear();
+    }
+
+    bool secure() const
+    {
+        return _ssl != nullptr;
+    }
+
+    std::string line()
+    {
+        for (;;) {
+            auto eol = _rbuf.find('\n');
+            if (eol != std::string::npos) {
+                std::string ret = _rbuf.substr(0, eol);
+                _rbuf.erase(0, eol + 1);
+                if (!ret.empty() && ret.back() == '\r')
+                    ret.pop_back();
+                return ret;
+            }
+            fill();
+        }
+    }
+
+    std::string read(size_t size)
+    {
+        while (_rbuf.size() < size)
+            fill();
+        std::string ret = _rbuf.substr(0, size);
+        _rbuf.erase(0, size);
+        return ret;
+    }
+
+    void write(const std::string& reply)
+    {
+        std::string buf  = reply + "\r\n";
+        const char* data = buf.data();
+        size_t      size = buf.size();
+        while (size > 0) {
+            ssize_t r = _ssl ? SSL_write(_ssl, data, int(size)) : ::send(_fd, data, size, MSG_NOSIGNAL);
+            if (r <= 0) {
+                if (!_ssl && r == -1 && errno == EINTR)
+                    continue;
+                throw std::runtime_error("write failed");
+            }
+            data += r;
+            size -= size_t(r);
+        }
+    }
+
+protected:
+    void fill()
+    {
+        char    buf[16384];
+        ssize_t r = _ssl ? SSL_read(_ssl, buf, sizeof(buf)) : ::recv(_fd, buf, sizeof(buf), 0);
+        if (r <= 0) {
+            if (!_ssl && r == -1 && errno == EINTR)
+                return;
+            throw std::runtime_error("connection closed");
+        }
+        _rbuf.append(buf, size_t(r));
+    }
+
+    int         _fd;
+    SSL*        _ssl;
+    std::string _rbuf;
+};
+
+// ----------------------------------------------------------------------------
+// FakeSmtpServer
+
+FakeSmtpServer::FakeSmtpServer()
+    : FakeSmtpServer(Options())
+{
+}
+
+FakeSmtpServer::FakeSmtpServer(const Options& options)
+    : _options(options)
+    , _ctx(nullptr)
+    , _listen(-1)
+    , _port(0)
+    , _stopped(false)
+    , _connections(0)
+{
+}
+
+FakeSmtpServer::~FakeSmtpServer()
+{
+    stop();
+    SSL_CTX_free(_ctx);
+}
+
+void FakeSmtpServer::start()
+{
+    // peer closing the connection in the middle of TLS write must not kill the test
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!_ctx)
+        _ctx = s_tls_context();
+
+    _listen = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listen == -1)
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    int one = 1;
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+    socklen_t len        = sizeof(addr);
+    if (::bind(_listen, reinterpret_cast<struct sockaddr*>(&addr), len) == -1 || ::listen(_listen, 128) == -1 ||
+        ::getsockname(_listen, reinterpret_cast<struct sockaddr*>(&addr), &len) == -1) {
+        std::string error = strerror(errno);
+        ::close(_listen);
+        _listen = -1;
+        throw std::runtime_error("cannot listen on loopback: " + error);
+    }
+    _port     = ntohs(addr.sin_port);
+    _stopped  = false;
+    _acceptor = std::thread(&FakeSmtpServer::accept, this);
+}
+
+void FakeSmtpServer::stop()
+{
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_listen == -1)
+            return;
+        _stopped = true;
+        // wake up accept and blocking reads of the sessions
+        ::shutdown(_listen, SHUT_RDWR);
+        for (int fd : _fds)
+            ::shutdown(fd, SHUT_RDWR);
+    }
+    _cond.notify_all();
+    _acceptor.join();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        threads.swap(_threads);
+    }
+    for (auto& it : threads)
+        it.join();
+    ::close(_listen);
+    _listen = -1;
+}
+
+void FakeSmtpServer::accept()
+{
+    for (;;) {
+        int fd = ::accept4(_listen, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1 && errno == EINTR)
+            continue;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (fd == -1 || _stopped) {
+            if (fd != -1)
+                ::close(fd);
+            return;
+        }
+        _fds.insert(fd);
+        _connections++;
+        _threads.emplace_back(&FakeSmtpServer::serve, this, fd);
+    }
+}
+
+void FakeSmtpServer::latency(const std::string& command, int ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults[command].latency = ms;
+}
+
+void FakeSmtpServer::fail(const std::string& command, const std::string& reply, int count)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults[command].reply       = reply;
+    _faults[command].reply_count = count;
+}
+
+void FakeSmtpServer::drop(const std::string& command, int count)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults[command].drop_count = count;
+}
+
+void FakeSmtpServer::reset()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults.clear();
+}
+
+std::vector<FakeSmtpServer::Message> FakeSmtpServer::messages() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _messages;
+}
+
+size_t FakeSmtpServer::count() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _messages.size();
+}
+
+bool FakeSmtpServer::wait(size_t count, int timeout_ms) const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]() {
+        return _messages.size() >= count;
+    });
+}
+
+size_t FakeSmtpServer::connections() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _connections;
+}
+
+bool FakeSmtpServer::fault(const std::string& command, std::string& reply)
+{
+    int latency = 0;
+    reply.clear();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto                        it = _faults.find(command);
+        if (it == _faults.end())
+            return true;
+        Fault& f = it->second;
+        latency  = f.latency;
+        if (f.drop_count != 0) {
+            if (f.drop_count > 0)
+                f.drop_count--;
+            return false;
+        }
+        if (f.reply_count != 0) {
+            if (f.reply_count > 0)
+                f.reply_count--;
+            reply = f.reply;
+        }
+    }
+    sleep(latency);
+    return true;
+}
+
+void FakeSmtpServer::sleep(int ms)
+{
+    if (ms <= 0)
+        return;
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait_for(lock, std::chrono::milliseconds(ms), [this]() {
+        return _stopped;
+    });
+}
+
+void FakeSmtpServer::accepted(Message&& message)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _messages.push_back(std::move(message));
+    }
+    _cond.notify_all();
+}
+
+void FakeSmtpServer::serve(int fd)
+{
+    try {
+        Session session(fd);
+        if (_options.implicit_tls)
+            session.tls(_ctx);
+
+        std::string reply;
+        if (!fault("CONNECT", reply))
+            throw std::runtime_error("dropped");
+        session.write(reply.empty() ? "220 localhost ESMTP fake" : reply);
+
+        bool        authenticated = false;
+        std::string username;
+        bool        in_mail = false;
+        Message     mail;
+
+        for (;;) {
+            std::string line  = session.line();
+            size_t      space = line.find(' ');
+            std::string verb  = s_upper(line.substr(0, space));
+            std::string arg   = space == std::string::npos ? "" : line.substr(space + 1);
+
+            if (!fault(verb, reply))
+                throw std::runtime_error("dropped");
+            if (!reply.empty()) {
+                // chunk of refused BDAT is sent anyway
+                if (verb == "BDAT")
+                    session.read(std::stoul(arg));
+                session.write(reply);
+                continue;
+            }
+
+            if (verb == "EHLO") {
+                in_mail = false;
+                std::vector<std::string> ext{"localhost"};
+                if (_options.pipelining)
+                    ext.push_back("PIPELINING");
+                if (_options.chunking)
+                    ext.push_back("CHUNKING");
+                if (_options.eight_bit)
+                    ext.push_back("8BITMIME");
+                if (_options.starttls && !session.secure())
+                    ext.push_back("STARTTLS");
+                if (!_options.auth.empty()) {
+                    std::string auth = "AUTH";
+                    for (const auto& it : _options.auth)
+                        auth += " " + it;
+                    ext.push_back(auth);
+                }
+                for (size_t i = 0; i != ext.size(); i++)
+                    session.write((i + 1 == ext.size() ? "250 " : "250-") + ext[i]);
+            } else if (verb == "HELO") {
+                in_mail = false;
+                session.write("250 localhost");
+            } else if (verb == "STARTTLS") {
+                if (!_options.starttls || session.secure()) {
+                    session.write("454 4.7.0 TLS not available");
+                    continue;
+                }
+                session.write("220 2.0.0 Ready to start TLS");
+                session.tls(_ctx);
+                in_mail       = false;
+                authenticated = false;
+            } else if (verb == "AUTH") {
+                space              = arg.find(' ');
+                std::string method = s_upper(arg.substr(0, space));
+                std::string token  = space == std::string::npos ? "" : arg.substr(space + 1);
+                if (authenticated) {
+                    session.write("503 5.5.1 Already authenticated");
+                    continue;
+                }
+                if (!_options.auth.count(method)) {
+                    session.write("504 5.5.4 Unrecognized authentication type");
+                    continue;
+                }
+                std::string user, password;
+                if (method == "PLAIN") {
+                    if (token.empty()) {
+                        session.write("334 ");
+                        token = session.line();
+                    }
+                    // authzid \0 authcid \0 password
+                    std::string plain = s_base64_decode(token);
+                    size_t      first = plain.find('\0');
+                    size_t      second =
+                        first == std::string::npos ? std::string::npos : plain.find('\0', first + 1);
+                    if (second != std::string::npos) {
+                        user     = plain.substr(first + 1, second - first - 1);
+                        password = plain.substr(second + 1);
+                    }
+                } else {
+                    session.write("334 VXNlcm5hbWU6");
+                    user = s_base64_decode(session.line());
+                    session.write("334 UGFzc3dvcmQ6");
+                    password = s_base64_decode(session.line());
+                }
+                if (_options.username.empty() || (user == _options.username && password == _options.password)) {
+                    authenticated = true;
+                    username      = user;
+                    session.write("235 2.7.0 Authentication successful");
+                } else
+                    session.write("535 5.7.8 Authentication credentials invalid");
+            } else if (verb == "MAIL") {
+                if (!_options.username.empty() && !authenticated) {
+                    session.write("530 5.7.0 Authentication required");
+                    continue;
+                }
+                mail          = Message();
+                mail.from     = s_address(arg);
+                mail.tls      = session.secure();
+                mail.username = username;
+                in_mail       = true;
+                session.write("250 2.1.0 Ok");
+            } else if (verb == "RCPT") {
+                if (!in_mail) {
+                    session.write("503 5.5.1 Error: need MAIL command");
+                    continue;
+                }
+                mail.recipients.push_back(s_address(arg));
+                session.write("250 2.1.5 Ok");
+            } else if (verb == "DATA" || verb == "BDAT") {
+                bool last = true;
+                if (verb == "BDAT") {
+                    space         = arg.find(' ');
+                    std::string n = arg.substr(0, space);
+                    last          = space != std::string::npos && s_upper(arg.substr(space + 1)) == "LAST";
+                    std::string chunk = session.read(std::stoul(n));
+                    if (in_mail && !mail.recipients.empty())
+                        mail.data += chunk;
+                }
+                if (!in_mail || mail.recipients.empty()) {
+                    session.write("503 5.5.1 Error: need RCPT command");
+                    continue;
+                }
+                if (verb == "DATA") {
+                    session.write("354 End data with <CR><LF>.<CR><LF>");
+                    for (;;) {
+                        std::string data = session.line();
+                        if (data == ".")
+                            break;
+                        mail.data += (data.compare(0, 2, "..") == 0 ? data.substr(1) : data) + "\r\n";
+                    }
+                }
+                if (!last) {
+                    session.write("250 2.0.0 Ok: chunk received");
+                    continue;
+                }
+                in_mail = false;
+                if (!fault("MESSAGE", reply))
+                    throw std::runtime_error("dropped");
+                if (!reply.empty()) {
+                    session.write(reply);
+                    continue;
+                }
+                accepted(std::move(mail));
+                session.write("250 2.0.0 Ok: queued");
+            } else if (verb == "RSET") {
+                in_mail = false;
+                session.write("250 2.0.0 Ok");
+            } else if (verb == "NOOP") {
+                session.write("250 2.0.0 Ok");
+            } else if (verb == "QUIT") {
+                session.write("221 2.0.0 Bye");
+                break;
+            } else {
+                session.write("502 5.5.2 Error: command not recognized");
+            }
+        }
+    } catch (const std::exception&) {
+        // connection closed by the client, dropped by fault or stop
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _fds.erase(fd);
+    ::close(fd);
+}
@@ -0,0 +1,163 @@
+/*  =========================================================================
+    fake_smtp_server - SMTP sink with injectable latency and failures
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// @file   fake_smtp_server.h
+/// @brief  ESMTP server on loopback accepting all the mail, for tests and benchmarks of the native transport
+///
+/// Speaks EHLO, STARTTLS (self-signed certificate generated at start), AUTH PLAIN/LOGIN, PIPELINING, CHUNKING
+/// (BDAT) and 8BITMIME. Each connection is served by its own thread. Faults are set per command and apply to the
+/// following commands of all connections:
+///
+///    FakeSmtpServer server;
+///    server.start();
+///    server.latency("RCPT", 50);                        // each RCPT is replied after 50 ms
+///    server.fail("MAIL", "451 4.3.0 Try again later", 1); // the next MAIL is refused, the following accepted
+///    server.drop("DATA");                               // connection is closed instead of DATA reply
+///
+///    SmtpSettings settings;
+///    settings.host = "127.0.0.1";
+///    settings.port = server.port();
+///
+/// Command is the first word of the line (EHLO, MAIL, RCPT, ...), CONNECT is the greeting and MESSAGE is the reply to
+/// the end of data (final dot or BDAT LAST).
+
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+class FakeSmtpServer
+{
+public:
+    /// mail accepted by the server
+    struct Message
+    {
+        std::string              from;
+        std::vector<std::string> recipients;
+        std::string              data;     ///< without dot stuffing and the final dot
+        bool                     tls;      ///< delivered over TLS
+        std::string              username; ///< authenticated user, empty without AUTH
+    };
+
+    struct Options
+    {
+        bool starttls     = true; ///< offer STARTTLS
+        bool implicit_tls = false; ///< TLS from the start (smtps, Encryption::TLS)
+        bool pipelining   = true;
+        bool chunking     = true;
+        bool eight_bit    = true;
+
+        /// offered AUTH methods (PLAIN, LOGIN), no AUTH if empty
+        std::set<std::string> auth{"PLAIN", "LOGIN"};
+        /// credentials accepted by AUTH (any if username is empty), MAIL requires AUTH if username is not empty
+        std::string username;
+        std::string password;
+    };
+
+    FakeSmtpServer();
+    explicit FakeSmtpServer(const Options& options);
+    ~FakeSmtpServer();
+
+    FakeSmtpServer(const FakeSmtpServer&) = delete;
+    FakeSmtpServer& operator=(const FakeSmtpServer&) = delete;
+
+    /// listen on 127.0.0.1 on a free port
+    /// @throw std::runtime_error
+    void start();
+
+    /// close the listening socket and all the connections, wait for their threads
+    void stop();
+
+    /// @return port the server listens on
+    std::string port() const
+    {
+        return std::to_string(_port);
+    }
+
+    /// delay reply to command by ms milliseconds
+    void latency(const std::string& command, int ms);
+
+    /// reply to the next count commands (-1 all) by reply instead of the normal one, e.g. "452 4.2.2 Mailbox full"
+    void fail(const std::string& command, const std::string& reply, int count = -1);
+
+    /// close the connection instead of reply to the next count commands (-1 all)
+    void drop(const std::string& command, int count = -1);
+
+    /// remove all the faults
+    void reset();
+
+    /// @return copy of accepted mails
+    std::vector<Message> messages() const;
+
+    /// @return number of accepted mails
+    size_t count() const;
+
+    /// wait until count mails are accepted
+    /// @return false on timeout
+    bool wait(size_t count, int timeout_ms) const;
+
+    /// @return number of accepted connections
+    size_t connections() const;
+
+protected:
+    struct Fault
+    {
+        int         latency = 0;
+        std::string reply;
+        int         reply_count = 0;
+        int         drop_count  = 0;
+    };
+
+    class Session;
+
+    void accept();
+    void serve(int fd);
+
+    /// apply faults of the command: sleep the latency, set reply replacing the normal one ("" if none)
+    /// @return false if the connection is to be closed
+    bool fault(const std::string& command, std::string& reply);
+
+    /// sleep unless stopped
+    void sleep(int ms);
+
+    void accepted(Message&& message);
+
+    Options                         _options;
+    SSL_CTX*                        _ctx;
+    int                             _listen;
+    int                             _port;
+    bool                            _stopped;
+    std::thread                     _acceptor;
+    std::vector<std::thread>        _threads;
+    std::set<int>                   _fds;
+    std::map<std::string, Fault>    _faults;
+    std::vector<Message>            _messages;
+    size_t                          _connections;
+    mutable std::mutex              _mutex;
+    mutable std::condition_variable _cond;
+};
@@ -0,0 +1,71 @@
+#include "src/fty_email_digest.h"
+#include "email_job.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("fty_email_digest")
+{
+    AlertDigest                            digest;
+    std::vector<std::unique_ptr<EmailJob>> ready;
+
+    SECTION("disabled")
+    {
+        auto job = email_alert_job("1", "", "", {"2", "UPS1", "joe@example.com", "alert"});
+        CHECK(!digest.add(job, 0, ready));
+        CHECK(job);
+    }
+
+    digest.configure(1000, 3);
+
+    SECTION("P1 and SENDMAIL bypass the digest")
+    {
+        auto job = email_alert_job("1", "", "", {"1", "UPS1", "joe@example.com", "alert"});
+        CHECK(!digest.add(job, 0, ready));
+        CHECK(job);
+
+        job->subject = "SENDMAIL";
+        CHECK(!digest.add(job, 0, ready));
+        CHECK(digest.held() == 0);
+    }
+
+    SECTION("window")
+    {
+        auto a = email_alert_job("a", "", "", {"2", "UPS1", "joe@example.com", "alert"});
+        auto b = email_alert_job("b", "", "", {"3", "UPS1", "joe@example.com", "alert"});
+        auto c = email_alert_job("c", "", "", {"2", "UPS1", "jane@example.com", "alert"});
+        CHECK(digest.add(a, 0, ready));
+        CHECK(digest.add(b, 500, ready));
+        CHECK(digest.add(c, 600, ready));
+        CHECK(ready.empty());
+        CHECK(digest.held() == 3);
+        CHECK(digest.next_due() == 1000);
+
+        digest.expired(999, ready);
+        CHECK(ready.empty());
+
+        digest.expired(1000, ready);
+        REQUIRE(ready.size() == 1);
+        CHECK(ready[0]->subject == DIGEST_SUBJECT);
+        REQUIRE(ready[0]->parts.size() == 2);
+        CHECK(ready[0]->parts[0]->uuid == "a");
+        CHECK(ready[0]->parts[1]->uuid == "b");
+
+        // single request is released as is
+        ready.clear();
+        digest.expired(1600, ready);
+        REQUIRE(ready.size() == 1);
+        CHECK(ready[0]->subject == "SENDMAIL_ALERT");
+        CHECK(ready[0]->uuid == "c");
+        CHECK(digest.next_due() == -1);
+    }
+
+    SECTION("count threshold")
+    {
+        for (const char* uuid : {"a", "b", "c"}) {
+            auto job = email_alert_job(uuid, "", "", {"2", "UPS1", "joe@example.com", "alert"});
+            CHECK(digest.add(job, 0, ready));
+        }
+        REQUIRE(ready.size() == 1);
+        CHECK(ready[0]->parts.size() == 3);
+        CHECK(digest.held() == 0);
+    }
+}
@@ -0,0 +1,92 @@
+#include "src/fty_email_load.h"
+#include "fake_smtp_server.h"
+#include <catch2/catch.hpp>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+TEST_CASE("fty_email_load")
+{
+    LoadOptions opts;
+    opts.clients          = 3;
+    opts.requests         = 60;
+    opts.rate             = 0;
+    opts.window           = 4;
+    opts.timeout          = 10;
+    opts.mix[0]           = 4;
+    opts.mix[1]           = 1;
+    opts.mix[2]           = 1;
+    opts.body_sizes       = {0, 100, 5000};
+    opts.attachment_sizes = {0, 3000};
+    opts.translations     = "test/conf/test_";
+    opts.config["server/workers"] = "2";
+
+    LoadReport report;
+    {
+        EmailLoadGenerator gen(opts);
+        CHECK(gen.attachment(3000).find("attachment-3000") != std::string::npos);
+        report = gen.run();
+    }
+
+    LoadStats all = report.total();
+    CHECK(all.sent == 60);
+    CHECK(all.ok == 60);
+    CHECK(all.failed == 0);
+    CHECK(all.lost == 0);
+    CHECK(all.latency.count() == 60);
+    CHECK(report.kinds[int(LoadKind::SENDMAIL)].sent > 0);
+    CHECK(report.kinds[int(LoadKind::SENDMAIL_ALERT)].sent > 0);
+    CHECK(report.kinds[int(LoadKind::SENDSMS_ALERT)].sent > 0);
+    CHECK(report.delivered == 60);
+    CHECK(report.elapsed > 0);
+    CHECK(report.throughput() > 0);
+
+    std::stringstream json;
+    report.print(json, true);
+    CHECK(json.str().find("\"SENDSMS_ALERT\": {\"sent\": ") != std::string::npos);
+
+    // the table is printed by the benchmarks only
+    std::stringstream table;
+    report.print(table);
+    CHECK(table.str().find("SENDSMS_ALERT") != std::string::npos);
+}
+
+TEST_CASE("fty_email_load_benchmark", "[.benchmark]")
+{
+    // fty-email-test "[.benchmark]" -s
+    LoadOptions opts;
+    opts.clients      = 8;
+    opts.requests     = 5000;
+    opts.rate         = 1000;
+    opts.mix[1]       = 1;
+    opts.translations = "test/conf/test_";
+
+    EmailLoadGenerator gen(opts);
+    LoadReport         report = gen.run();
+    report.print(std::cout);
+    CHECK(report.total().lost == 0);
+}
+
+TEST_CASE("fty_email_load_smtp_benchmark", "[.benchmark]")
+{
+    // native transport against local SMTP server answering each mail in 5 ms
+    FakeSmtpServer server;
+    server.start();
+    server.latency("MESSAGE", 5);
+
+    LoadOptions opts;
+    opts.clients      = 8;
+    opts.requests     = 2000;
+    opts.rate         = 500;
+    opts.smtp         = "127.0.0.1:" + server.port();
+    opts.translations = "test/conf/test_";
+    opts.config["server/workers"] = "4";
+    opts.config["smtp/pool_max"]  = "4";
+
+    EmailLoadGenerator gen(opts);
+    LoadReport         report = gen.run();
+    report.print(std::cout);
+    CHECK(report.total().ok == 2000);
+    // the probe request of the generator is delivered as well
+    CHECK(server.count() == 2001);
+}
@@ -0,0 +1,133 @@
+#include "src/fty_email_metrics.h"
+#include <catch2/catch.hpp>
+#include <thread>
+
+TEST_CASE("histogram")
+{
+    Histogram hist;
+    CHECK(hist.count() == 0);
+    CHECK(hist.percentile(50) == 0);
+    CHECK(hist.min() == 0);
+
+    // buckets are ordered, each value is within its bucket, error below 1/16
+    size_t last = 0;
+    for (uint64_t value : {uint64_t(0), uint64_t(1), uint64_t(15), uint64_t(16), uint64_t(17), uint64_t(31),
+             uint64_t(32), uint64_t(33), uint64_t(1000), uint64_t(123456789), uint64_t(1) << 40, UINT64_MAX}) {
+        size_t bucket = Histogram::bucket(value);
+        CHECK(bucket >= last);
+        last = bucket;
+        CHECK(Histogram::upper(bucket) >= value);
+        CHECK(Histogram::upper(bucket) - value <= value / 16);
+        if (bucket > 0)
+            CHECK(Histogram::upper(bucket - 1) < value);
+    }
+    CHECK(Histogram::bucket(15) == 15);
+    CHECK(Histogram::bucket(16) == 16);
+    CHECK(Histogram::upper(Histogram::bucket(UINT64_MAX)) == UINT64_MAX);
+
+    for (uint64_t i = 1; i <= 1000; i++)
+        hist.record(i);
+    CHECK(hist.count() == 1000);
+    CHECK(hist.min() == 1);
+    CHECK(hist.max() == 1000);
+    CHECK(hist.mean() == Approx(500.5));
+    CHECK(hist.percentile(50) >= 500);
+    CHECK(hist.percentile(50) <= 500 + 500 / 16);
+    CHECK(hist.percentile(99) >= 990);
+    CHECK(hist.percentile(100) == 1000);
+    CHECK(hist.percentile(0.01) == 1);
+
+    Histogram other;
+    other.record(1000000);
+    hist.merge(other);
+    CHECK(hist.count() == 1001);
+    CHECK(hist.max() == 1000000);
+    CHECK(hist.percentile(100) == 1000000);
+    CHECK(hist.percentile(50) <= 500 + 500 / 16);
+}
+
+TEST_CASE("atomic_histogram")
+{
+    AtomicHistogram hist;
+    CHECK(hist.snapshot().count() == 0);
+    CHECK(hist.snapshot().min() == 0);
+
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t != 4; t++) {
+        threads.emplace_back([&hist, t]() {
+            for (uint64_t i = 1; i <= 10000; i++)
+                hist.record(i + t * 10000);
+        });
+    }
+    for (auto& it : threads)
+        it.join();
+
+    Histogram snapshot = hist.snapshot();
+    CHECK(snapshot.count() == 40000);
+    CHECK(snapshot.min() == 1);
+    CHECK(snapshot.max() == 40000);
+    CHECK(snapshot.mean() == Approx(20000.5));
+    CHECK(snapshot.percentile(50) >= 20000);
+    CHECK(snapshot.percentile(50) <= 20000 + 20000 / 16);
+
+    {
+        MetricsTimer timer(hist);
+    }
+    CHECK(hist.snapshot().count() == 40001);
+
+    hist.reset();
+    CHECK(hist.snapshot().count() == 0);
+    CHECK(hist.snapshot().max() == 0);
+}
+
+TEST_CASE("email_metrics")
+{
+    EmailMetrics metrics;
+    metrics.count("SENDMAIL");
+    metrics.count("SENDMAIL");
+    metrics.count("SENDSMS_ALERT");
+    metrics.count("STATS");
+    metrics.count("FOO");
+    metrics.failure(SmtpError::ServerUnreachable);
+    metrics.failure(SmtpError(42));
+    metrics.attachment_bytes += 1000;
+    metrics.unjournaled++;
+    metrics.delivery_ms.record(20);
+    metrics.delivery_ms.record(30);
+
+    auto value = [&metrics](const std::string& name) -> int64_t {
+        for (const auto& it : metrics.values(3, 1)) {
+            if (it.name == name)
+                return int64_t(it.value);
+        }
+        return -1;
+    };
+    CHECK(value("email.requests.sendmail") == 2);
+    CHECK(value("email.requests.sendmail_alert") == 0);
+    CHECK(value("email.requests.sendsms_alert") == 1);
+    CHECK(value("email.requests.stats") == 1);
+    CHECK(value("email.requests.other") == 1);
+    CHECK(value("email.failures.server_unreachable") == 1);
+    CHECK(value("email.failures.unknown") == 1);
+    CHECK(value("email.failures.succeeded") == -1);
+    CHECK(value("email.attachment_bytes") == 1000);
+    CHECK(value("email.unjournaled") == 1);
+    CHECK(value("email.queued") == 3);
+    CHECK(value("email.retrying") == 1);
+    CHECK(value("email.delivery_ms.count") == 2);
+    CHECK(value("email.delivery_ms.max") == 30);
+    CHECK(value("email.transport_us.count") == 0);
+
+    std::string json = metrics.json(3, 1);
+    CHECK(json.front() == '{');
+    CHECK(json.back() == '}');
+    CHECK(json.find("\"requests\": {\"sendmail\": 2, \"sendmail_alert\": 0") != std::string::npos);
+    CHECK(json.find("\"server_unreachable\": 1") != std::string::npos);
+    CHECK(json.find("\"unjournaled\": 1, \"failures\"") != std::string::npos);
+    CHECK(json.find("\"queued\": 3, \"retrying\": 1") != std::string::npos);
+    CHECK(json.find("\"delivery_ms\": {\"count\": 2, \"min\": 20, \"mean\": 25.0") != std::string::npos);
+
+    metrics.reset();
+    CHECK(value("email.requests.sendmail") == 0);
+    CHECK(value("email.delivery_ms.count") == 0);
+}
@@ -0,0 +1,98 @@
+#include "src/fty_email_ratelimit.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("fty_email_ratelimit")
+{
+    AlertRateLimiter limiter{64};
+    int64_t          now = 1000;
+
+    SECTION("disabled")
+    {
+        for (int i = 0; i != 100; i++)
+            CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.suppressed() == 0);
+    }
+
+    SECTION("per alert bucket")
+    {
+        // 6 per minute, bucket of 2
+        limiter.alert(6, 2);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALERT);
+        // other asset and other contact have their own buckets
+        CHECK(limiter.allow("joe@example.com", "rule", "pdu", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("jane@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.suppressed() == 1);
+
+        // one token per 10 seconds
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 9000) == AlertRateLimiter::ALERT);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 10000) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 10000) == AlertRateLimiter::ALERT);
+    }
+
+    SECTION("suppressed alert does not take tokens of other levels")
+    {
+        limiter.contact(60, 3);
+        limiter.alert(60, 1);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALERT);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALERT);
+        CHECK(limiter.allow("joe@example.com", "rule2", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule3", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule4", "ups", "ACTIVE", now) == AlertRateLimiter::CONTACT);
+    }
+
+    SECTION("resolution of sent alert is not suppressed")
+    {
+        // 1 per minute, bucket of 1, contact bucket is exhausted by the first email
+        limiter.alert(1, 1);
+        limiter.contact(1, 1);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "RESOLVED", now) == AlertRateLimiter::ALLOWED);
+        // flapping: re-activation is limited, so is its resolution, the contact knows it is resolved already
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::CONTACT);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "RESOLVED", now) == AlertRateLimiter::CONTACT);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 30000) == AlertRateLimiter::CONTACT);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "RESOLVED", now + 30000) == AlertRateLimiter::CONTACT);
+        CHECK(limiter.suppressed() == 4);
+        // once there is a token, next flap is sent whole
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 60000) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "RESOLVED", now + 60000) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "ACTIVE", now + 60000) == AlertRateLimiter::CONTACT);
+        // repeated resolution is limited
+        limiter.contact(0, 0);
+        CHECK(limiter.allow("joe@example.com", "rule", "ups", "RESOLVED", now + 60000) == AlertRateLimiter::ALERT);
+        CHECK(limiter.suppressed() == 6);
+    }
+
+    SECTION("global bucket")
+    {
+        limiter.global(60, 2);
+        CHECK(limiter.allow("a@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("b@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::ALLOWED);
+        CHECK(limiter.allow("c@example.com", "rule", "ups", "ACTIVE", now) == AlertRateLimiter::GLOBAL);
+    }
+
+    SECTION("memory is bounded")
+    {
+        limiter.alert(1, 1);
+        for (int i = 0; i != 10000; i++)
+            limiter.allow("joe@example.com", "rule", "asset" + std::to_string(i), "ACTIVE", now + i);
+        CHECK(limiter.suppressed() == 0);
+    }
+}
+
+TEST_CASE("fty_email_ratelimit_table")
+{
+    TokenBuckets buckets{16};
+    CHECK(buckets.size() == 16);
+    buckets.configure(60, 1);
+
+    // all keys probe the same slots, the least recently used is reused
+    for (uint64_t key = 1; key != 100; key++) {
+        CHECK(buckets.check(key * 16, int64_t(key)));
+        buckets.take(key * 16);
+    }
+    CHECK(!buckets.check(99 * 16, 100));
+}
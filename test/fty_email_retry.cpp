@@ -0,0 +1,128 @@
+#include "src/fty_email_retry.h"
+#include "src/fty_email_worker.h"
+#include "email_job.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("fty_email_retry_policy")
+{
+    RetryPolicy policy;
+    policy.transient(1000, 8000);
+    policy.max_age(60 * 1000);
+
+    SECTION("permanent errors are not retried")
+    {
+        CHECK(policy.delay(SmtpError::AuthFailed, 1, 0) == -1);
+        CHECK(policy.delay(SmtpError::UnknownCA, 1, 0) == -1);
+        CHECK(policy.delay(SmtpError::NoRecipient, 1, 0) == -1);
+    }
+
+    SECTION("requests refused by 5xx reply are not retried")
+    {
+        CHECK(policy.delay(SmtpError::Unknown, 1, 0, true) == -1);
+        CHECK(policy.delay(SmtpError::ServerUnreachable, 1, 0, true) == -1);
+        CHECK(policy.delay(SmtpError::Unknown, 1, 0) > 0);
+    }
+
+    SECTION("transient errors back off exponentially with jitter")
+    {
+        for (int i = 0; i != 100; i++) {
+            int64_t delay = policy.delay(SmtpError::ServerUnreachable, 1, 0);
+            CHECK(delay >= 500);
+            CHECK(delay <= 1000);
+            delay = policy.delay(SmtpError::ServerUnreachable, 3, 0);
+            CHECK(delay >= 2000);
+            CHECK(delay <= 4000);
+            delay = policy.delay(SmtpError::Unknown, 30, 0);
+            CHECK(delay >= 4000);
+            CHECK(delay <= 8000);
+            delay = policy.delay(SmtpError::DNSFailed, 1, 0);
+            CHECK(delay >= 1000);
+            CHECK(delay <= 2000);
+        }
+    }
+
+    SECTION("old requests are not retried")
+    {
+        CHECK(policy.delay(SmtpError::ServerUnreachable, 1, 59 * 1000 + 600) == -1);
+        policy.max_age(0);
+        CHECK(policy.delay(SmtpError::ServerUnreachable, 1, 0) == -1);
+    }
+
+    SECTION("zero initial delay disables retries")
+    {
+        policy.transient(0, 0);
+        CHECK(policy.delay(SmtpError::ServerUnreachable, 1, 0) == -1);
+    }
+}
+
+TEST_CASE("fty_email_retry_wheel")
+{
+    RetryWheel                             wheel{100, 8};
+    std::vector<std::unique_ptr<EmailJob>> expired;
+
+    auto soon = email_job("mailer", "SENDMAIL", "soon");
+    auto late = email_job("mailer", "SENDMAIL", "late");
+    auto past = email_job("mailer", "SENDMAIL", "past");
+    // more than one revolution ahead
+    wheel.schedule(late, 10000 + 2500, 10000);
+    wheel.schedule(soon, 10000 + 300, 10000);
+    wheel.schedule(past, 9000, 10000);
+    CHECK(wheel.size() == 3);
+
+    wheel.advance(10100, expired);
+    REQUIRE(expired.size() == 1);
+    CHECK(expired[0]->uuid == "past");
+
+    expired.clear();
+    wheel.advance(10250, expired);
+    CHECK(expired.empty());
+
+    wheel.advance(10300, expired);
+    REQUIRE(expired.size() == 1);
+    CHECK(expired[0]->uuid == "soon");
+
+    // the slot of late job was passed, but it is due in later revolution
+    expired.clear();
+    wheel.advance(11000, expired);
+    CHECK(expired.empty());
+    CHECK(wheel.size() == 1);
+
+    // wheel not advanced for several revolutions
+    wheel.advance(20000, expired);
+    REQUIRE(expired.size() == 1);
+    CHECK(expired[0]->uuid == "late");
+    CHECK(wheel.empty());
+
+    // scheduled job replaced by another one keeps its due time, removed one is not expired
+    auto      older     = email_job("mailer", "SENDMAIL", "older");
+    auto      newer     = email_job("mailer", "SENDMAIL", "newer");
+    auto      other     = email_job("mailer", "SENDMAIL", "other");
+    auto      removed   = email_job("mailer", "SENDMAIL", "removed");
+    EmailJob* scheduled = older.get();
+    EmailJob* dropped   = removed.get();
+    wheel.schedule(older, 20500, 20000);
+    wheel.schedule(other, 20500, 20000);
+    wheel.schedule(removed, 20500, 20000);
+    CHECK(wheel.replace(scheduled, newer));
+    CHECK(newer->uuid == "older");
+    CHECK(!wheel.replace(scheduled, newer));
+    CHECK(wheel.remove(dropped)->uuid == "removed");
+    CHECK(!wheel.remove(dropped));
+    CHECK(wheel.size() == 2);
+
+    // visited jobs stay scheduled
+    size_t visited = 0;
+    wheel.each([&](EmailJob& job) {
+        CHECK((job.uuid == "other" || job.uuid == "newer"));
+        visited++;
+    });
+    CHECK(visited == 2);
+    CHECK(wheel.size() == 2);
+
+    expired.clear();
+    wheel.advance(20500, expired);
+    REQUIRE(expired.size() == 2);
+    CHECK(expired[0]->uuid != expired[1]->uuid);
+    for (const auto& it : expired)
+        CHECK((it->uuid == "other" || it->uuid == "newer"));
+}
@@ -1,6 +1,7 @@
 #include "src/fty_email_server.h"
 #include "src/emailconfiguration.h"
 #include "src/fty_email.h"
+#include "src/fty_email_metrics.h"
 #include <catch2/catch.hpp>
 #include <fty/convert.h>
 #include <fty_common_mlm.h>
@@ -208,7 +209,7 @@ TEST_CASE("fty_email_server_test")
         log_debug("\n");
         log_debug("newBody =\n%s", newBody.c_str());
 
-        // FIXME: email body is created by cxxtools::MimeMultipart class - do we need to test it?
+        // FIXME: email body is created by MimeWriter class - do we need to test it?
         // REQUIRE ( expectedBody.compare(newBody) == 0 );
 
         log_debug("Test #2 OK");
@@ -442,6 +443,34 @@ TEST_CASE("fty_email_server_test")
         zmsg_destroy(&msg);
         log_debug("Test #7 OK");
     }
+    // test STATS
+    {
+        log_debug("Test #8 - test STATS");
+        rv = mlm_client_sendtox(alert_producer, "agent-smtp", "STATS", "UUID8", NULL);
+        REQUIRE(rv != -1);
+        zmsg_t* msg = mlm_client_recv(alert_producer);
+        REQUIRE(streq(mlm_client_subject(alert_producer), "STATS"));
+        REQUIRE(zmsg_size(msg) == 3);
+
+        char* uuid = zmsg_popstr(msg);
+        CHECK(streq(uuid, "UUID8"));
+        zstr_free(&uuid);
+
+        char* status = zmsg_popstr(msg);
+        CHECK(streq(status, "OK"));
+        zstr_free(&status);
+
+        // metrics are shared by all the actors of the process, the requests above are counted at least
+        char* json = zmsg_popstr(msg);
+        CHECK(std::string(json).find("\"requests\": {\"sendmail\": ") != std::string::npos);
+        CHECK(email_metrics().requests[EmailMetrics::SENDMAIL] >= 1);
+        CHECK(email_metrics().replies_ok >= 1);
+        CHECK(email_metrics().transport_us.snapshot().count() >= 1);
+        zstr_free(&json);
+
+        zmsg_destroy(&msg);
+        log_debug("Test #8 OK");
+    }
 
     // clean up after the test
 
@@ -0,0 +1,54 @@
+#include "src/fty_email_shard.h"
+#include <catch2/catch.hpp>
+#include <map>
+
+TEST_CASE("fty_email_shard ring")
+{
+    ShardRing one;
+    CHECK(one.shards() == 1);
+    CHECK(one.shard("example.com") == 0);
+    CHECK(ShardRing(0).shards() == 1);
+
+    // keys spread over the shards, the same key always goes to the same shard
+    ShardRing              ring(4);
+    std::map<size_t, int>  count;
+    std::vector<size_t>    before;
+    for (int i = 0; i != 4000; i++) {
+        std::string key   = "domain" + std::to_string(i) + ".example.com";
+        size_t      shard = ring.shard(key);
+        REQUIRE(shard < 4);
+        CHECK(ring.shard(key) == shard);
+        count[shard]++;
+        before.push_back(shard);
+    }
+    for (const auto& it : count) {
+        CHECK(it.second > 600);
+        CHECK(it.second < 1400);
+    }
+
+    // adding a shard moves about 1/5 of the keys, all of them to the new shard
+    ShardRing more(5);
+    int       moved = 0;
+    for (int i = 0; i != 4000; i++) {
+        size_t shard = more.shard("domain" + std::to_string(i) + ".example.com");
+        if (shard != before[size_t(i)]) {
+            CHECK(shard == 4);
+            moved++;
+        }
+    }
+    CHECK(moved > 400);
+    CHECK(moved < 1400);
+}
+
+TEST_CASE("fty_email_shard key")
+{
+    CHECK(shard_key("joe@Example.COM", ShardBy::DOMAIN) == "example.com");
+    CHECK(shard_key("joe@Example.COM", ShardBy::CONTACT) == "joe@example.com");
+    // phone number of SMS has no domain
+    CHECK(shard_key("+1 555 0100", ShardBy::DOMAIN) == "+1 555 0100");
+    CHECK(shard_key("", ShardBy::DOMAIN) == "");
+
+    CHECK(shard_by("domain") == ShardBy::DOMAIN);
+    CHECK(shard_by("contact") == ShardBy::CONTACT);
+    CHECK_THROWS_AS(shard_by("rcpt"), std::invalid_argument);
+}
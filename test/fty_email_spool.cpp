@@ -0,0 +1,98 @@
+#include "src/fty_email_spool.h"
+#include "email_job.h"
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+TEST_CASE("fty_email_spool")
+{
+    const std::string dir        = "./spool-test";
+    const std::string attachment = "./spool-test-attachment.txt";
+    std::filesystem::remove_all(dir);
+    {
+        std::ofstream out(attachment);
+        out << "hello";
+    }
+
+    uint64_t sendmail_id = 0;
+    {
+        EmailSpool spool;
+        CHECK(spool.open(dir).empty());
+
+        auto sendmail =
+            email_job("sender", "SENDMAIL", "uuid-1", {"to@example.com", "subject", "body", "", attachment.c_str()});
+        REQUIRE(spool.append(*sendmail));
+        sendmail_id = sendmail->spool_id;
+        CHECK(sendmail_id != 0);
+
+        auto alert = email_job("sender", "SENDMAIL_ALERT", "uuid-2", {"alert"});
+        REQUIRE(spool.append(*alert));
+        CHECK(alert->spool_id != sendmail_id);
+        CHECK(spool.pending() == 2);
+
+        spool.done(alert->spool_id);
+        CHECK(spool.pending() == 1);
+    }
+
+    // attachment is snapshotted, requester may remove it after the request is accepted
+    std::filesystem::remove(attachment);
+
+    SECTION("undelivered request is replayed")
+    {
+        EmailSpool spool;
+        auto       jobs = spool.open(dir);
+        REQUIRE(jobs.size() == 1);
+        CHECK(jobs[0]->spool_id == sendmail_id);
+        CHECK(jobs[0]->subject == "SENDMAIL");
+        CHECK(jobs[0]->uuid == "uuid-1");
+        CHECK(jobs[0]->sender == "sender");
+        REQUIRE(zmsg_size(jobs[0]->msg) == 5);
+
+        zmsg_t* msg = jobs[0]->msg;
+        zframe_t* frame = zmsg_first(msg);
+        for (int i = 0; i != 4; i++)
+            frame = zmsg_next(msg);
+        char* path = zframe_strdup(frame);
+        std::ifstream in(path);
+        std::string   content;
+        in >> content;
+        CHECK(content == "hello");
+        zstr_free(&path);
+
+        spool.done(sendmail_id);
+        CHECK(spool.pending() == 0);
+        CHECK(!std::filesystem::exists(dir + "/attachments/" + std::to_string(sendmail_id)));
+        CHECK(spool.open(dir).empty());
+    }
+
+    SECTION("torn record is ignored")
+    {
+        uint64_t torn_id = 0;
+        {
+            EmailSpool spool;
+            REQUIRE(spool.open(dir).size() == 1);
+            auto job = email_job("sender", "SENDMAIL_ALERT", "uuid-3", {"alert"});
+            REQUIRE(spool.append(*job));
+            torn_id = job->spool_id;
+        }
+
+        // damage payload of the last record as if the agent crashed in the middle of append
+        int fd = open((dir + "/journal").c_str(), O_RDWR);
+        REQUIRE(fd != -1);
+        uint32_t size = 0;
+        REQUIRE(pread(fd, &size, sizeof(size), 16 + 16) == sizeof(size));
+        char garbage = 'X';
+        REQUIRE(pwrite(fd, &garbage, 1, off_t(16 + ((24 + size + 7) & ~7u) + 24)) == 1);
+        close(fd);
+
+        EmailSpool spool;
+        auto       jobs = spool.open(dir);
+        REQUIRE(jobs.size() == 1);
+        CHECK(jobs[0]->spool_id == sendmail_id);
+        CHECK(jobs[0]->spool_id != torn_id);
+    }
+
+    std::filesystem::remove_all(dir);
+}
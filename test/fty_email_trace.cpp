@@ -0,0 +1,33 @@
+#include "src/fty_email_trace.h"
+#include <catch2/catch.hpp>
+#include <cstring>
+#include <thread>
+
+TEST_CASE("fty_email_trace")
+{
+    CHECK(strcmp(TraceRequest::uuid(), "") == 0);
+    {
+        std::string  uuid = "uuid-1";
+        TraceRequest outer(uuid);
+        CHECK(strcmp(TraceRequest::uuid(), "uuid-1") == 0);
+        {
+            std::string  other = "uuid-2";
+            TraceRequest inner(other);
+            CHECK(strcmp(TraceRequest::uuid(), "uuid-2") == 0);
+        }
+        CHECK(strcmp(TraceRequest::uuid(), "uuid-1") == 0);
+
+        // uuid is per thread
+        std::string seen = "x";
+        std::thread([&seen]() {
+            seen = TraceRequest::uuid();
+        }).join();
+        CHECK(seen == "");
+
+        // probes compile with and without sys/sdt.h and are no-op without a tracer
+        FTY_EMAIL_PROBE(deliver_start, TraceRequest::uuid(), "SENDMAIL", 1u);
+        FTY_EMAIL_PROBE(data_end, TraceRequest::uuid(), size_t(100), 250);
+        CHECK(!FTY_EMAIL_PROBE_ENABLED(reply_send));
+    }
+    CHECK(strcmp(TraceRequest::uuid(), "") == 0);
+}
@@ -0,0 +1,455 @@
+#include "src/fty_email_worker.h"
+#include "email_job.h"
+#include <catch2/catch.hpp>
+#include <condition_variable>
+#include <map>
+#include <set>
+
+/// @return frames of the next result [spool_id|sender|subject|uuid|reply frames...], empty on timeout
+static std::vector<std::string> s_result(EmailWorkerPool& pool)
+{
+    std::vector<std::string> ret;
+    zmsg_t*                  msg = zmsg_recv(pool.results());
+    if (!msg)
+        return ret;
+    while (zmsg_size(msg) != 0) {
+        char* frame = zmsg_popstr(msg);
+        ret.push_back(frame);
+        zstr_free(&frame);
+    }
+    zmsg_destroy(&msg);
+    return ret;
+}
+
+TEST_CASE("fty_email_worker queue")
+{
+    std::mutex               mutex;
+    std::condition_variable  cond;
+    bool                     blocked = false;
+    std::vector<std::string> delivered;
+
+    // handler sends the uuid through Smtp of the worker, test function of the Smtp records it
+    EmailWorkerPool pool{[&](Smtp& smtp, EmailJob& job, zmsg_t* reply) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]() {
+                return !blocked;
+            });
+        }
+        if (job.uuid == "retry") {
+            job.error = SmtpError::ServerUnreachable;
+            return std::string("SENDMAIL-ERR");
+        }
+        if (job.uuid == "refused") {
+            job.error     = SmtpError::Unknown;
+            job.permanent = true;
+            return std::string("SENDMAIL-ERR");
+        }
+        smtp.sendmail(job.uuid);
+        zmsg_addstr(reply, "0");
+        zmsg_addstr(reply, "OK");
+        return std::string("SENDMAIL-OK");
+    }};
+    zsock_set_rcvtimeo(pool.results(), 5000);
+
+    // settings of the workers are told apart by tag of the test function
+    auto configure = [&](const std::string& tag) {
+        Smtp smtp;
+        smtp.sendmail_set_test_fn([&delivered, &mutex, tag](const std::string& data) {
+            std::lock_guard<std::mutex> lock(mutex);
+            delivered.push_back(tag + ":" + data);
+        });
+        pool.configure(smtp);
+    };
+
+    SECTION("full queue rejects the job, results are pushed in order")
+    {
+        configure("smtp");
+        blocked = true;
+        pool.start(1, 2);
+        auto a = email_job("mailer", "SENDMAIL", "a");
+        CHECK(pool.submit(a));
+        // wait for the worker to take the first job
+        for (int i = 0; i != 500 && pool.queued() != 0; i++)
+            zclock_sleep(10);
+        REQUIRE(pool.queued() == 0);
+
+        auto b = email_job("mailer", "SENDMAIL", "b");
+        auto c = email_job("mailer", "SENDMAIL", "c");
+        auto d = email_job("mailer", "SENDMAIL", "d");
+        CHECK(pool.submit(b));
+        CHECK(pool.submit(c));
+        CHECK(!pool.submit(d));
+        CHECK(d);
+        CHECK(pool.queued() == 2);
+        // replay of the spool is not subject of the queue size
+        CHECK(pool.submit(d, true));
+        CHECK(pool.queued() == 3);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocked = false;
+        }
+        cond.notify_all();
+        for (const char* uuid : {"a", "b", "c", "d"}) {
+            std::vector<std::string> result = s_result(pool);
+            CHECK(result == std::vector<std::string>{"0", "mailer", "SENDMAIL-OK", uuid, "0", "OK"});
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        CHECK(delivered == std::vector<std::string>{"smtp:a", "smtp:b", "smtp:c", "smtp:d"});
+    }
+
+    SECTION("workers use settings of the last configure")
+    {
+        configure("first");
+        pool.start(2, 16);
+        auto a = email_job("mailer", "SENDMAIL", "a");
+        CHECK(pool.submit(a));
+        CHECK(s_result(pool).size() == 6);
+
+        configure("second");
+        for (const char* uuid : {"b", "c", "d"}) {
+            auto job = email_job("mailer", "SENDMAIL", uuid);
+            CHECK(pool.submit(job));
+            CHECK(s_result(pool).size() == 6);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        CHECK(delivered == std::vector<std::string>{"first:a", "second:b", "second:c", "second:d"});
+    }
+
+    SECTION("job refused by 5xx reply is not retried")
+    {
+        RetryPolicy retry;
+        retry.transient(60000, 60000);
+        pool.retry(retry);
+        pool.start(1, 16);
+        auto r = email_job("mailer", "SENDMAIL", "refused");
+        CHECK(pool.submit(r));
+        std::vector<std::string> result = s_result(pool);
+        REQUIRE(result.size() == 4);
+        CHECK(result[2] == "SENDMAIL-ERR");
+        CHECK(pool.retrying() == 0);
+    }
+
+    SECTION("undelivered jobs are drained after stop")
+    {
+        RetryPolicy retry;
+        retry.transient(60000, 60000);
+        pool.retry(retry);
+        pool.start(1, 16);
+        auto r = email_job("mailer", "SENDMAIL", "retry");
+        CHECK(pool.submit(r));
+        for (int i = 0; i != 500 && pool.retrying() == 0; i++)
+            zclock_sleep(10);
+        REQUIRE(pool.retrying() == 1);
+        // the first error is replied, the request is not done
+        CHECK(s_result(pool) == std::vector<std::string>{"0", "mailer", "SENDMAIL-ERR", "retry"});
+        pool.stop();
+
+        auto q = email_job("mailer", "SENDMAIL", "queued");
+        CHECK(pool.submit(q));
+        std::vector<std::unique_ptr<EmailJob>> jobs;
+        pool.drain(jobs);
+        REQUIRE(jobs.size() == 2);
+        CHECK(jobs[0]->uuid == "queued");
+        CHECK(jobs[1]->uuid == "retry");
+        CHECK(pool.queued() == 0);
+        CHECK(pool.retrying() == 0);
+        CHECK(zsock_events(pool.results()) == 0);
+    }
+}
+
+TEST_CASE("fty_email_worker supersede")
+{
+    // workers are not started, jobs stay in the queue
+    EmailWorkerPool                        pool{[](Smtp&, EmailJob&, zmsg_t*) {
+        return std::string();
+    }};
+    std::vector<std::unique_ptr<EmailJob>> superseded;
+
+    SECTION("replace")
+    {
+        auto a = email_alert_job("a", "rule|ups|joe", "ACTIVE");
+        auto b = email_alert_job("b", "rule|pdu|joe", "ACTIVE");
+        auto c = email_alert_job("c", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(a, true, &superseded));
+        CHECK(pool.submit(b, true, &superseded));
+        CHECK(superseded.empty());
+        CHECK(pool.submit(c, true, &superseded));
+        CHECK(!c);
+        CHECK(pool.queued() == 2);
+        REQUIRE(superseded.size() == 1);
+        CHECK(superseded[0]->uuid == "a");
+
+        // the newer one is indexed now
+        auto d = email_alert_job("d", "rule|ups|joe", "ACTIVE");
+        CHECK(pool.submit(d, true, &superseded));
+        REQUIRE(superseded.size() == 2);
+        CHECK(superseded[1]->uuid == "c");
+        CHECK(pool.queued() == 2);
+    }
+
+    SECTION("cancel")
+    {
+        pool.supersede(EmailWorkerPool::Supersede::CANCEL);
+        auto a = email_alert_job("a", "rule|ups|joe", "ACTIVE");
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(a, true, &superseded));
+        CHECK(pool.submit(b, true, &superseded));
+        CHECK(pool.queued() == 0);
+        REQUIRE(superseded.size() == 2);
+        CHECK(superseded[0]->uuid == "a");
+        CHECK(superseded[1]->uuid == "b");
+
+        // RESOLVED after RESOLVED is replaced
+        auto c = email_alert_job("c", "rule|ups|joe", "RESOLVED");
+        auto d = email_alert_job("d", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(c, true, &superseded));
+        CHECK(pool.submit(d, true, &superseded));
+        CHECK(pool.queued() == 1);
+        CHECK(superseded.back()->uuid == "c");
+    }
+
+    SECTION("none")
+    {
+        pool.supersede(EmailWorkerPool::Supersede::NONE);
+        auto a = email_alert_job("a", "rule|ups|joe", "ACTIVE");
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(a, true, &superseded));
+        CHECK(pool.submit(b, true, &superseded));
+        CHECK(pool.queued() == 2);
+        CHECK(superseded.empty());
+    }
+
+    SECTION("superseding job is accepted even if the queue is full")
+    {
+        pool.start(1, 0);
+        pool.stop();
+        auto a = email_alert_job("a", "rule|ups|joe", "ACTIVE");
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        auto c = email_alert_job("c", "rule|pdu|joe", "ACTIVE");
+        CHECK(pool.submit(a, true, &superseded));
+        CHECK(!pool.submit(c, false, &superseded));
+        CHECK(c);
+        CHECK(pool.submit(b, false, &superseded));
+        CHECK(pool.queued() == 1);
+    }
+}
+
+TEST_CASE("fty_email_worker supersede retried")
+{
+    std::mutex               mutex;
+    std::condition_variable  cond;
+    bool                     blocked = false;
+    std::vector<std::string> delivered;
+
+    // jobs "fail..." fail on transient error
+    EmailWorkerPool pool{[&](Smtp&, EmailJob& job, zmsg_t* reply) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() {
+            return !blocked;
+        });
+        if (job.uuid.find("fail") == 0 || (job.uuid == "flaky" && job.attempts == 1)) {
+            job.error = SmtpError::ServerUnreachable;
+            zmsg_addstr(reply, "ERROR");
+            return job.subject;
+        }
+        delivered.push_back(job.uuid);
+        zmsg_addstr(reply, "OK");
+        return job.subject;
+    }};
+    zsock_set_rcvtimeo(pool.results(), 5000);
+    RetryPolicy retry;
+    retry.transient(60000, 60000);
+    pool.retry(retry);
+    std::vector<std::unique_ptr<EmailJob>> superseded;
+
+    // the first error is replied before the retry
+    auto wait_retrying = [&]() {
+        CHECK(s_result(pool) == std::vector<std::string>{"0", "alert-mailer", "SENDMAIL_ALERT", "fail-a", "ERROR"});
+        for (int i = 0; i != 500 && pool.retrying() == 0; i++)
+            zclock_sleep(10);
+        REQUIRE(pool.retrying() == 1);
+    };
+
+    SECTION("first error is replied at once, the final status after the retry")
+    {
+        retry.transient(20, 20);
+        pool.retry(retry);
+        pool.start(1, 16);
+        auto a      = email_alert_job("flaky", "rule|ups|joe", "ACTIVE");
+        a->spool_id = 7;
+        CHECK(pool.submit(a, false, &superseded));
+        // spool_id 0 does not finish the spooled request
+        CHECK(s_result(pool) == std::vector<std::string>{"0", "alert-mailer", "SENDMAIL_ALERT", "flaky", "ERROR"});
+        CHECK(s_result(pool) == std::vector<std::string>{"7", "alert-mailer", "SENDMAIL_ALERT", "flaky", "OK"});
+        CHECK(pool.retrying() == 0);
+    }
+
+    SECTION("newer state takes place of the job waiting for retry")
+    {
+        pool.start(1, 16);
+        auto a = email_alert_job("fail-a", "rule|ups|joe", "ACTIVE");
+        CHECK(pool.submit(a, false, &superseded));
+        wait_retrying();
+
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(b, false, &superseded));
+        REQUIRE(superseded.size() == 1);
+        CHECK(superseded[0]->uuid == "fail-a");
+        CHECK(pool.retrying() == 1);
+        CHECK(pool.queued() == 0);
+
+        pool.stop();
+        std::vector<std::unique_ptr<EmailJob>> jobs;
+        pool.drain(jobs);
+        REQUIRE(jobs.size() == 1);
+        CHECK(jobs[0]->uuid == "b");
+    }
+
+    SECTION("RESOLVED cancels ACTIVE waiting for retry, the shard is released")
+    {
+        pool.supersede(EmailWorkerPool::Supersede::CANCEL);
+        pool.start(1, 16, 1);
+        auto a = email_alert_job("fail-a", "rule|ups|joe", "ACTIVE");
+        CHECK(pool.submit(a, false, &superseded));
+        wait_retrying();
+
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(b, false, &superseded));
+        REQUIRE(superseded.size() == 2);
+        CHECK(superseded[0]->uuid == "fail-a");
+        CHECK(superseded[1]->uuid == "b");
+        CHECK(pool.retrying() == 0);
+
+        auto c = email_alert_job("c", "rule|pdu|joe", "ACTIVE");
+        CHECK(pool.submit(c, false, &superseded));
+        CHECK(s_result(pool) == std::vector<std::string>{"0", "alert-mailer", "SENDMAIL_ALERT", "c", "OK"});
+    }
+
+    SECTION("job waiting for retry holds its shard after restart")
+    {
+        pool.supersede(EmailWorkerPool::Supersede::CANCEL);
+        pool.start(1, 16, 2);
+        auto a       = email_alert_job("fail-a", "rule|ups|joe", "ACTIVE");
+        a->shard_key = "joe";
+        CHECK(pool.submit(a, false, &superseded));
+        wait_retrying();
+
+        // resharded, the later job of the same contact does not overtake the retried one
+        pool.start(1, 16, 3);
+        auto c       = email_alert_job("c", "rule|pdu|joe", "ACTIVE");
+        c->shard_key = "joe";
+        CHECK(pool.submit(c, false, &superseded));
+        zclock_sleep(100);
+        CHECK(pool.queued() == 1);
+        CHECK(pool.retrying() == 1);
+
+        // the job is found in its new shard, which is released
+        auto b       = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        b->shard_key = "joe";
+        CHECK(pool.submit(b, false, &superseded));
+        REQUIRE(superseded.size() == 2);
+        CHECK(superseded[0]->uuid == "fail-a");
+        CHECK(pool.retrying() == 0);
+        CHECK(s_result(pool) == std::vector<std::string>{"0", "alert-mailer", "SENDMAIL_ALERT", "c", "OK"});
+    }
+
+    SECTION("failed job being delivered is not retried after the newer state")
+    {
+        blocked = true;
+        pool.start(2, 16);
+        auto a = email_alert_job("fail-a", "rule|ups|joe", "ACTIVE");
+        CHECK(pool.submit(a, false, &superseded));
+        for (int i = 0; i != 500 && pool.queued() != 0; i++)
+            zclock_sleep(10);
+        REQUIRE(pool.queued() == 0);
+
+        auto b = email_alert_job("b", "rule|ups|joe", "RESOLVED");
+        CHECK(pool.submit(b, false, &superseded));
+        CHECK(superseded.empty());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocked = false;
+        }
+        cond.notify_all();
+
+        std::set<std::vector<std::string>> results{s_result(pool), s_result(pool)};
+        CHECK(results.count({"0", "alert-mailer", "SENDMAIL_ALERT", "fail-a", "SUPERSEDED",
+                  "superseded by newer state of the alert"}) == 1);
+        CHECK(results.count({"0", "alert-mailer", "SENDMAIL_ALERT", "b", "OK"}) == 1);
+        CHECK(pool.retrying() == 0);
+        std::lock_guard<std::mutex> lock(mutex);
+        CHECK(delivered == std::vector<std::string>{"b"});
+    }
+}
+
+TEST_CASE("fty_email_worker shards")
+{
+    // delivered jobs as (shard key, sequence number, thread)
+    struct Delivery
+    {
+        std::string     key;
+        int             seq;
+        std::thread::id thread;
+    };
+    std::mutex            mutex;
+    std::vector<Delivery> delivered;
+    bool                  failed = false;
+
+    EmailWorkerPool pool{[&](Smtp&, EmailJob& job, zmsg_t* reply) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the first attempt of "retry" job fails on transient error
+        if (job.uuid == "retry" && !failed) {
+            failed    = true;
+            job.error = SmtpError::ServerUnreachable;
+            return std::string("SENDMAIL-ERR");
+        }
+        delivered.push_back({job.shard_key, std::stoi(job.sender), std::this_thread::get_id()});
+        zmsg_addstr(reply, "OK");
+        return std::string("SENDMAIL-OK");
+    }};
+    RetryPolicy retry;
+    retry.transient(20, 20);
+    pool.retry(retry);
+    pool.start(2, 1024, 3);
+    CHECK(pool.shards() == 3);
+    CHECK(pool.workers() == 3);
+
+    const char* domains[] = {"a.example.com", "b.example.com", "c.example.com", "d.example.com", "e.example.com"};
+    for (int i = 0; i != 200; i++) {
+        auto job       = email_job(std::to_string(i), "SENDMAIL", i == 10 ? "retry" : "uuid");
+        job->shard_key = domains[i % 5];
+        CHECK(pool.submit(job));
+    }
+
+    for (int i = 0; i != 500; i++) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (delivered.size() == 200)
+                break;
+        }
+        zclock_sleep(10);
+    }
+    pool.stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    REQUIRE(delivered.size() == 200);
+    // each domain is delivered by one thread in order of submission, also after the retry
+    std::map<std::string, int>             last;
+    std::map<std::string, std::thread::id> thread;
+    for (const auto& it : delivered) {
+        if (last.count(it.key)) {
+            CHECK(it.seq > last[it.key]);
+            CHECK(it.thread == thread[it.key]);
+        }
+        last[it.key]   = it.seq;
+        thread[it.key] = it.thread;
+    }
+    CHECK(failed);
+
+    // unsharded pool again, queued jobs are kept
+    pool.start(2, 1024);
+    CHECK(pool.shards() == 0);
+    CHECK(pool.workers() == 2);
+}
@@ -0,0 +1,164 @@
+#include "src/mime_writer.h"
+#include <catch2/catch.hpp>
+#include <cstdio>
+#include <fstream>
+
+static std::string s_qp(const std::vector<std::string>& chunks)
+{
+    QuotedPrintableEncoder qp;
+    std::string            out;
+    for (const auto& it : chunks)
+        qp.encode(it.data(), it.size(), out);
+    qp.finish(out);
+    return out;
+}
+
+static std::string s_base64_decode(const std::string& inp)
+{
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string              ret;
+    uint32_t                 v    = 0;
+    int                      bits = 0;
+    for (char ch : inp) {
+        size_t pos = alphabet.find(ch);
+        if (pos == std::string::npos)
+            continue;
+        v = v << 6 | uint32_t(pos);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            ret.push_back(char((v >> bits) & 0xff));
+        }
+    }
+    return ret;
+}
+
+/// remembers size of the biggest write
+class MaxSink : public MimeSink
+{
+public:
+    using MimeSink::write;
+
+    void write(const char* data, size_t size) override
+    {
+        max = std::max(max, size);
+        str.append(data, size);
+    }
+
+    bool eightBit() const override
+    {
+        return eight_bit;
+    }
+
+    size_t      max{0};
+    std::string str;
+    bool        eight_bit{false};
+};
+
+TEST_CASE("mime_writer_quoted_printable")
+{
+    CHECK(s_qp({"hello world"}) == "hello world");
+    CHECK(s_qp({"a=b\tc"}) == "a=3Db\tc");
+    CHECK(s_qp({"\xc5\xbelu\xc5\xa5"}) == "=C5=BElu=C5=A5");
+
+    SECTION("whitespace at the end of line is encoded")
+    {
+        CHECK(s_qp({"trailing \nspace"}) == "trailing=20\nspace");
+        CHECK(s_qp({"trailing\t"}) == "trailing=09");
+        CHECK(s_qp({"trailing ", "\r", "\n"}) == "trailing=20\n");
+        CHECK(s_qp({"in ", "side"}) == "in side");
+    }
+
+    SECTION("CRLF is line break, lone CR is encoded")
+    {
+        CHECK(s_qp({"a\r\nb"}) == "a\nb");
+        CHECK(s_qp({"a\r", "\nb"}) == "a\nb");
+        CHECK(s_qp({"a\rb"}) == "a=0Db");
+        CHECK(s_qp({"a \rb"}) == "a =0Db");
+    }
+
+    SECTION("soft line breaks")
+    {
+        std::string out = s_qp({std::string(200, 'x')});
+        size_t      pos = 0;
+        for (;;) {
+            size_t eol = out.find('\n', pos);
+            size_t len = (eol == std::string::npos ? out.size() : eol) - pos;
+            CHECK(len <= 76);
+            if (eol == std::string::npos)
+                break;
+            CHECK(out[eol - 1] == '=');
+            pos = eol + 1;
+        }
+        // escape is not split by soft line break
+        out = s_qp({std::string(74, 'x') + "="});
+        CHECK(out == std::string(74, 'x') + "=\n=3D");
+    }
+}
+
+TEST_CASE("mime_writer")
+{
+    std::string binary;
+    for (size_t i = 0; i != 3 * MimeWriter::BUFFER_SIZE + 17; i++)
+        binary.push_back(char(i * 7 + i / 251));
+    {
+        std::ofstream file{"mime_writer.bin", std::ios::binary};
+        file.write(binary.data(), std::streamsize(binary.size()));
+        std::ofstream text{"mime_writer.txt"};
+        text << "line 1\nline 2 \n";
+        std::ofstream utf8{"mime_writer.utf8"};
+        utf8 << "temperature 40 \xc2\xb0""C\n";
+    }
+
+    MimeWriter mime;
+    mime.header("To", "joe@example.com");
+    mime.header("Subject", "logs");
+    mime.body("see attachments");
+    mime.attach("mime_writer.bin", "application/octet-stream; charset=binary");
+    mime.attach("./mime_writer.txt", "text/plain; charset=us-ascii");
+    mime.attach("mime_writer.missing", "text/plain");
+    mime.attach("mime_writer.utf8", "text/plain; charset=utf-8");
+    CHECK(mime.headers() == "To: joe@example.com\nSubject: logs\n");
+    CHECK(mime.attachments() == 4);
+
+    MaxSink sink;
+    mime.write(sink);
+    const std::string& mail = sink.str;
+    CHECK(mime.str() == mail);
+    // attachment is never held in memory as a whole
+    CHECK(sink.max < 2 * MimeWriter::BUFFER_SIZE);
+
+    size_t b = mail.find("boundary=\"");
+    REQUIRE(b != std::string::npos);
+    std::string boundary = mail.substr(b + 10, mail.find('"', b + 10) - b - 10);
+    CHECK(mail.find("\n\n--" + boundary +
+                    "\nContent-Type: text/plain; charset=UTF-8\nContent-Transfer-Encoding: 7bit") != std::string::npos);
+    CHECK(mail.find("see attachments\n--" + boundary) != std::string::npos);
+    CHECK(mail.substr(mail.size() - boundary.size() - 5) == "--" + boundary + "--\n");
+
+    size_t bin = mail.find("filename=\"mime_writer.bin\"\n\n");
+    REQUIRE(bin != std::string::npos);
+    bin = mail.find("\n\n", bin) + 2;
+    std::string encoded = mail.substr(bin, mail.find("--" + boundary, bin) - bin);
+    CHECK(s_base64_decode(encoded) == binary);
+    CHECK(encoded.substr(76, 1) == "\n");
+
+    // text is sent as it is when possible
+    CHECK(mail.find("Content-Transfer-Encoding: 7bit\nContent-Disposition: attachment; "
+                    "filename=\"mime_writer.txt\"\n\nline 1\nline 2 \n--" +
+                    boundary) != std::string::npos);
+    CHECK(mail.find("filename=\"mime_writer.missing\"\n\n--" + boundary) != std::string::npos);
+    CHECK(mail.find("Content-Transfer-Encoding: quoted-printable\nContent-Disposition: attachment; "
+                    "filename=\"mime_writer.utf8\"\n\ntemperature 40 =C2=B0C\n--" +
+                    boundary) != std::string::npos);
+
+    MaxSink eight_bit;
+    eight_bit.eight_bit = true;
+    mime.write(eight_bit);
+    CHECK(eight_bit.str.find("Content-Transfer-Encoding: 8bit\nContent-Disposition: attachment; "
+                             "filename=\"mime_writer.utf8\"\n\ntemperature 40 \xc2\xb0""C\n--") != std::string::npos);
+
+    std::remove("mime_writer.bin");
+    std::remove("mime_writer.txt");
+    std::remove("mime_writer.utf8");
+}
@@ -0,0 +1,400 @@
+#include "src/smtp_client.h"
+#include "fake_smtp_server.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("smtp_client_envelope")
+{
+    SECTION("recipients from To/Cc/Bcc, Bcc is removed")
+    {
+        SmtpEnvelope env = smtp_prepare_envelope(
+            "To: Joe Doe <joe@example.com>, jane@example.com\r\n"
+            "Cc: \"Smith, Agent\" <smith@matrix.gov>\r\n"
+            "Bcc: hidden@example.com,\r\n"
+            " other@example.com\r\n"
+            "Subject: test\r\n"
+            "\r\n"
+            "To: not-a-header@example.com\r\n",
+            "from@example.com");
+
+        REQUIRE(env.recipients.size() == 5);
+        CHECK(env.recipients[0] == "joe@example.com");
+        CHECK(env.recipients[1] == "jane@example.com");
+        CHECK(env.recipients[2] == "smith@matrix.gov");
+        CHECK(env.recipients[3] == "hidden@example.com");
+        CHECK(env.recipients[4] == "other@example.com");
+
+        CHECK(env.data.find("Bcc:") == std::string::npos);
+        CHECK(env.data.find("other@example.com") == std::string::npos);
+        CHECK(env.data.find("From: from@example.com\r\n") == 0);
+        CHECK(env.data.find("Date: ") != std::string::npos);
+        CHECK(env.data.find("To: not-a-header@example.com") != std::string::npos);
+    }
+
+    SECTION("existing From and Date are kept, LF only line endings")
+    {
+        SmtpEnvelope env = smtp_prepare_envelope(
+            "From: me@example.com\nDate: Mon, 1 Jan 2020 00:00:00 +0000\nTo: you@example.com\n\nbody\n", "other@example.com");
+        REQUIRE(env.recipients.size() == 1);
+        CHECK(env.recipients[0] == "you@example.com");
+        CHECK(env.data.find("From: me@example.com\n") == 0);
+        CHECK(env.data.find("other@example.com") == std::string::npos);
+    }
+
+    SECTION("no recipients")
+    {
+        SmtpEnvelope env = smtp_prepare_envelope("Subject: test\r\n\r\nbody", "from@example.com");
+        CHECK(env.recipients.empty());
+    }
+}
+
+TEST_CASE("smtp_client_errors")
+{
+    SmtpSettings settings;
+    settings.host       = "127.0.0.1";
+    settings.port       = "1";
+    settings.from       = "from@example.com";
+    settings.timeout_ms = 1000;
+
+    SECTION("server unreachable")
+    {
+        SmtpClient client{settings};
+        try {
+            client.connect();
+            CHECK(false);
+        } catch (const SmtpException& e) {
+            CHECK(e.code() == SmtpError::ServerUnreachable);
+            CHECK(smtp_exception2code(e) == SmtpError::ServerUnreachable);
+        }
+        CHECK(!client.connected());
+    }
+
+    SECTION("dns failed")
+    {
+        settings.host = "host.invalid";
+        SmtpClient client{settings};
+        try {
+            client.connect();
+            CHECK(false);
+        } catch (const SmtpException& e) {
+            CHECK(e.code() == SmtpError::DNSFailed);
+        }
+    }
+
+    SECTION("no recipient")
+    {
+        SmtpClient client{settings};
+        try {
+            client.sendmail(settings.from, {}, "body");
+            CHECK(false);
+        } catch (const SmtpException& e) {
+            CHECK(e.code() == SmtpError::NoRecipient);
+        }
+    }
+
+    SECTION("no sender")
+    {
+        SmtpClient client{settings};
+        try {
+            client.sendmail("", {"to@example.com"}, "body");
+            CHECK(false);
+        } catch (const SmtpException& e) {
+            CHECK(e.code() == SmtpError::NoSenderAddress);
+        }
+    }
+}
+
+TEST_CASE("smtp_client_pool")
+{
+    SmtpSettings settings;
+    settings.host       = "127.0.0.1";
+    settings.port       = "1";
+    settings.from       = "from@example.com";
+    settings.timeout_ms = 1000;
+
+    SmtpSessionPool pool;
+    pool.limits(1, 1000, 1000);
+    pool.configure(settings);
+
+    // failed session must be released, otherwise the second attempt would wait forever
+    for (int i = 0; i != 2; i++) {
+        try {
+            pool.sendmail(settings.from, {"to@example.com"}, "body");
+            CHECK(false);
+        } catch (const SmtpException& e) {
+            CHECK(e.code() == SmtpError::ServerUnreachable);
+        }
+        CHECK(pool.idle() == 0);
+    }
+}
+
+static SmtpSettings s_fake_settings(const FakeSmtpServer& server)
+{
+    SmtpSettings settings;
+    settings.host       = "127.0.0.1";
+    settings.port       = server.port();
+    settings.from       = "from@example.com";
+    settings.timeout_ms = 2000;
+    return settings;
+}
+
+static SmtpError s_send(SmtpClient& client, const std::string& data = "Subject: test\r\n\r\nbody\r\n",
+    const std::vector<std::string>& recipients = {"to@example.com"})
+{
+    try {
+        if (!client.connected())
+            client.connect();
+        client.sendmail("from@example.com", recipients, data);
+        return SmtpError::Succeeded;
+    } catch (const SmtpException& e) {
+        return e.code();
+    }
+}
+
+/// @return true if the message was refused by 5xx reply
+static bool s_refused_permanently(SmtpClient& client)
+{
+    try {
+        client.sendmail("from@example.com", {"to@example.com"}, "Subject: test\r\n\r\nbody\r\n");
+    } catch (const SmtpException& e) {
+        return e.permanent();
+    }
+    return false;
+}
+
+TEST_CASE("smtp_client_fake_server")
+{
+    FakeSmtpServer server;
+    server.start();
+    SmtpSettings settings = s_fake_settings(server);
+
+    SECTION("BDAT")
+    {
+        SmtpClient client{settings};
+        client.connect();
+        CHECK(client.has_extension("CHUNKING"));
+        client.sendmail("from@example.com", {"to@example.com", "cc@example.com"}, "Subject: test\r\n\r\n.body\r\n");
+        client.quit();
+        REQUIRE(server.count() == 1);
+        FakeSmtpServer::Message msg = server.messages()[0];
+        CHECK(msg.from == "from@example.com");
+        CHECK(msg.recipients == std::vector<std::string>{"to@example.com", "cc@example.com"});
+        CHECK(msg.data == "Subject: test\r\n\r\n.body\r\n");
+        CHECK(!msg.tls);
+    }
+
+    SECTION("BDAT in chunks smaller than the message")
+    {
+        std::string data = "Subject: test\r\n\r\n";
+        for (int i = 0; i != 100; i++)
+            data += "line " + std::to_string(i) + "\r\n";
+        settings.chunk_size = 16;
+        for (bool pipelining : {true, false}) {
+            settings.pipelining = pipelining;
+            SmtpClient client{settings};
+            CHECK(s_send(client, data) == SmtpError::Succeeded);
+        }
+        REQUIRE(server.count() == 2);
+        CHECK(server.messages()[0].data == data);
+        CHECK(server.messages()[1].data == data);
+    }
+
+    SECTION("pipelined envelope with refused recipient")
+    {
+        // BDAT is not sent after refused envelope, DATA is refused by the server as no recipient was accepted
+        for (bool chunking : {true, false}) {
+            settings.chunking = chunking;
+            SmtpClient               client{settings};
+            std::vector<std::string> recipients{"bad@example.com"};
+            if (chunking)
+                recipients.push_back("to@example.com");
+            size_t count = server.count();
+            server.fail("RCPT", "550 5.1.1 User unknown", 1);
+            CHECK(s_send(client, "Subject: test\r\n\r\nbody\r\n", recipients) == SmtpError::Unknown);
+            // replies of the whole envelope were read, the session is in sync for the next message
+            CHECK(client.connected());
+            CHECK(server.count() == count);
+            CHECK(s_send(client) == SmtpError::Succeeded);
+            CHECK(server.count() == count + 1);
+        }
+        CHECK(server.connections() == 2);
+    }
+
+    SECTION("DATA accepted despite refused recipient, connection is closed")
+    {
+        settings.chunking = false;
+        SmtpClient client{settings};
+        server.fail("RCPT", "550 5.1.1 User unknown", 1);
+        CHECK(s_send(client, "Subject: test\r\n\r\nbody\r\n", {"bad@example.com", "to@example.com"}) ==
+              SmtpError::Unknown);
+        CHECK(!client.connected());
+        CHECK(server.count() == 0);
+        CHECK(s_send(client) == SmtpError::Succeeded);
+        CHECK(server.count() == 1);
+        CHECK(server.connections() == 2);
+    }
+
+    SECTION("DATA, dot stuffing")
+    {
+        settings.chunking   = false;
+        settings.pipelining = false;
+        SmtpClient client{settings};
+        CHECK(s_send(client, "Subject: test\r\n\r\n.\r\n..body\r\n") == SmtpError::Succeeded);
+        REQUIRE(server.count() == 1);
+        CHECK(server.messages()[0].data == "Subject: test\r\n\r\n.\r\n..body\r\n");
+    }
+
+    SECTION("transient and permanent replies")
+    {
+        SmtpClient client{settings};
+        server.fail("MAIL", "451 4.3.0 Try again later", 1);
+        CHECK(s_send(client) == SmtpError::Unknown);
+        // refused command leaves the session usable
+        CHECK(client.connected());
+        server.fail("RCPT", "550 5.1.1 User unknown", 1);
+        CHECK(s_send(client) == SmtpError::Unknown);
+        server.fail("MESSAGE", "554 5.7.1 Rejected", 1);
+        CHECK(s_send(client) == SmtpError::Unknown);
+        CHECK(server.count() == 0);
+        CHECK(s_send(client) == SmtpError::Succeeded);
+        CHECK(server.count() == 1);
+        CHECK(server.connections() == 1);
+
+        // only 5xx replies are permanent
+        server.fail("MAIL", "451 4.3.0 Try again later", 1);
+        CHECK(!s_refused_permanently(client));
+        server.fail("RCPT", "550 5.1.1 User unknown", 1);
+        CHECK(s_refused_permanently(client));
+        server.fail("MESSAGE", "554 5.7.1 Rejected", 1);
+        CHECK(s_refused_permanently(client));
+        server.fail("MESSAGE", "452 4.3.1 Insufficient system storage", 1);
+        CHECK(!s_refused_permanently(client));
+        CHECK(server.count() == 1);
+    }
+
+    SECTION("greeting refused, connection dropped")
+    {
+        server.fail("CONNECT", "421 4.3.2 Service not available", 1);
+        SmtpClient client{settings};
+        CHECK(s_send(client) == SmtpError::ServerUnreachable);
+
+        server.drop("DATA", 1);
+        settings.chunking = false;
+        SmtpClient client2{settings};
+        CHECK(s_send(client2) == SmtpError::ServerUnreachable);
+        CHECK(!client2.connected());
+        CHECK(s_send(client2) == SmtpError::Succeeded);
+    }
+
+    SECTION("latency above timeout")
+    {
+        settings.timeout_ms = 200;
+        server.latency("RCPT", 1000);
+        SmtpClient client{settings};
+        CHECK(s_send(client) == SmtpError::ServerUnreachable);
+        server.reset();
+        CHECK(s_send(client) == SmtpError::Succeeded);
+    }
+
+    SECTION("session pool")
+    {
+        SmtpSessionPool pool;
+        pool.limits(1, 60000, 5000);
+        pool.configure(settings);
+        for (int i = 0; i != 3; i++)
+            pool.sendmail(settings.from, {"to@example.com"}, "Subject: test\r\n\r\nbody\r\n");
+        CHECK(server.count() == 3);
+        CHECK(server.connections() == 1);
+        CHECK(pool.idle() == 1);
+    }
+
+    SECTION("expired session is closed without blocking the pool")
+    {
+        SmtpSessionPool pool;
+        pool.limits(2, 50, 5000);
+        pool.configure(settings);
+        pool.sendmail(settings.from, {"to@example.com"}, "Subject: test\r\n\r\nbody\r\n");
+        CHECK(pool.idle() == 1);
+        server.latency("QUIT", 1000);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        std::thread expire([&pool]() {
+            pool.expire();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // QUIT of the expired session is still waiting for the reply
+        auto start = std::chrono::steady_clock::now();
+        CHECK(pool.idle() == 0);
+        pool.sendmail(settings.from, {"to@example.com"}, "Subject: test\r\n\r\nbody\r\n");
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+        expire.join();
+        CHECK(server.count() == 2);
+    }
+}
+
+TEST_CASE("smtp_client_fake_server_tls")
+{
+    FakeSmtpServer::Options opts;
+    opts.username = "joe";
+    opts.password = "secret";
+
+    SECTION("STARTTLS, AUTH PLAIN")
+    {
+        FakeSmtpServer server{opts};
+        server.start();
+        SmtpSettings settings = s_fake_settings(server);
+        settings.encryption   = Encryption::STARTTLS;
+        settings.username     = "joe";
+        settings.password     = "secret";
+        SmtpClient client{settings};
+        CHECK(s_send(client) == SmtpError::Succeeded);
+        REQUIRE(server.count() == 1);
+        CHECK(server.messages()[0].tls);
+        CHECK(server.messages()[0].username == "joe");
+
+        settings.password = "wrong";
+        SmtpClient client2{settings};
+        CHECK(s_send(client2) == SmtpError::AuthFailed);
+
+        // no password in clear text
+        settings.encryption = Encryption::NONE;
+        SmtpClient client3{settings};
+        CHECK(s_send(client3) == SmtpError::SSLNotSupported);
+
+        // MAIL without AUTH is refused by 530, which msmtp reports as TLS required
+        settings.username.clear();
+        SmtpClient client4{settings};
+        CHECK(s_send(client4) == SmtpError::SSLRequired);
+    }
+
+    SECTION("TLS, AUTH LOGIN")
+    {
+        opts.implicit_tls = true;
+        opts.starttls     = false;
+        opts.auth         = {"LOGIN"};
+        FakeSmtpServer server{opts};
+        server.start();
+        SmtpSettings settings = s_fake_settings(server);
+        settings.encryption   = Encryption::TLS;
+        settings.username     = "joe";
+        settings.password     = "secret";
+        SmtpClient client{settings};
+        CHECK(s_send(client) == SmtpError::Succeeded);
+        REQUIRE(server.count() == 1);
+        CHECK(server.messages()[0].tls);
+
+        server.fail("AUTH", "535 5.7.8 Authentication credentials invalid");
+        SmtpClient client2{settings};
+        CHECK(s_send(client2) == SmtpError::AuthFailed);
+    }
+
+    SECTION("STARTTLS not offered")
+    {
+        opts.starttls = false;
+        FakeSmtpServer server{opts};
+        server.start();
+        SmtpSettings settings = s_fake_settings(server);
+        settings.encryption   = Encryption::STARTTLS;
+        SmtpClient client{settings};
+        CHECK(s_send(client) == SmtpError::SSLNotSupported);
+    }
+}